@@ -5,17 +5,21 @@
 # DESCRIPTION
 #
 #   Checks whether the pcreposix library and its headers are available.
-#   Prefers libpcre2 over libpcre.  The --enable-pcreposix option can
-#   be used to enable, disable, or force the use of libpcre verison 1
-#   (--enable-pcreposix=pcre1).  Upon return, the status_pcreposix shell
-#   variable is set to indicate the result:
+#   Prefers libpcre2 over libpcre.  If libpcre2 is found, its native
+#   API is used, unless --enable-pcreposix=pcre2 is given, in which case
+#   the POSIX wrapper library is used instead.  The --enable-pcreposix
+#   option can also be used to enable, disable, or force the use of
+#   libpcre verison 1 (--enable-pcreposix=pcre1).  Upon return, the
+#   status_pcreposix shell variable is set to indicate the result:
 #
-#   .  no - neither library has been found
-#   .  1  - libpcre is found
-#   .  2  - libpcre2 is found
+#   .  no     - neither library has been found
+#   .  1      - libpcre is found
+#   .  2      - libpcre2posix is found
+#   .  native - libpcre2 is found and its native API will be used
 #
 #   On success, the HAVE_LIBPCREPOSIX m4 macro is defined to the version
-#   of the library used (1 or 2).
+#   of the library used (1 or 2).  If the native libpcre2 API is used,
+#   HAVE_LIBPCRE2 is defined instead.
 #
 #   Substitution variables PCREPOSIX_CFLAGS and PCREPOSIX_LIBS are defined
 #   to compiler and loader flags needed in order to build with the version
@@ -50,7 +54,27 @@ AC_DEFUN([PND_PCREPOSIX],
  AC_SUBST([PCREPOSIX_LIBS])
  if test "$status_pcreposix" != no; then
    AC_PATH_PROG([PCRE2_CONFIG],[pcre2-config],[])
-   if test "$status_pcreposix" != pcre1 && test -n "$PCRE2_CONFIG"; then
+   if test "$status_pcreposix" != pcre1 && test "$status_pcreposix" != pcre2 \
+      && test -n "$PCRE2_CONFIG"; then
+     saved_CFLAGS=$CFLAGS
+     CFLAGS="$CFLAGS $($PCRE2_CONFIG --cflags)"
+     saved_LIBS=$LIBS
+     LIBS="$LIBS $($PCRE2_CONFIG --libs8)"
+     AC_LINK_IFELSE(
+         [AC_LANG_PROGRAM([#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>],
+			  [pcre2_jit_compile (NULL, PCRE2_JIT_COMPLETE);])],
+	 [PCREPOSIX_CFLAGS=$($PCRE2_CONFIG --cflags)
+	  PCREPOSIX_LIBS=$($PCRE2_CONFIG --libs8)
+	  status_pcreposix=native])
+     LIBS=$saved_LIBS
+     CFLAGS=$saved_CFLAGS
+   fi
+
+   if test "$status_pcreposix" = native; then
+     AC_DEFINE([HAVE_LIBPCRE2],[1],
+               [Define if the native libpcre2 API is used])
+   elif test "$status_pcreposix" != pcre1 && test -n "$PCRE2_CONFIG"; then
      PCREPOSIX_CFLAGS=$($PCRE2_CONFIG --cflags-posix)
      PCREPOSIX_LIBS=$($PCRE2_CONFIG --libs-posix)
      status_pcreposix=2
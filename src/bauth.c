@@ -17,9 +17,13 @@
  */
 
 #include "pound.h"
+#include "json.h"
+#include "shtab.h"
 #if HAVE_CRYPT_H
 # include <crypt.h>
 #endif
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 
 static pthread_mutex_t crypt_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -288,15 +292,258 @@ auth_match (const char *pass, const char *hash)
   return 1;
 }
 
+/*
+ * Password files are loaded into immutable, reference-counted hash
+ * tables.  A table is never modified once built: when the file changes,
+ * a new table is created and published by swapping the pass_file table
+ * pointer.  The pass_file mutex protects only the pointer and the
+ * reference count: request handlers take a reference to the current
+ * table under it and verify the password after releasing it, so that
+ * slow crypt(3) calls neither serialize requests nor delay reloads.
+ * The last one to drop its reference frees the table.
+ */
+struct user_pass
+{
+  struct user_pass *next;       /* Next entry in the bucket. */
+  unsigned long hash;           /* Hash value of user. */
+  char *pass;                   /* Password hash. */
+  char user[1];                 /* User name. */
+};
+
+struct pass_table
+{
+  unsigned refcount;            /* Reference count. */
+  size_t size;                  /* Number of buckets (power of 2). */
+  struct user_pass *bucket[1];
+};
+
+/* List of all password files in use. */
+static SLIST_HEAD (, pass_file) pass_file_head =
+  SLIST_HEAD_INITIALIZER (pass_file_head);
+
+unsigned basic_auth_check = DEFAULT_BASIC_AUTH_CHECK;
+unsigned basic_auth_cache_size = DEFAULT_BASIC_AUTH_CACHE_SIZE;
+unsigned basic_auth_cache_ttl = DEFAULT_BASIC_AUTH_CACHE_TTL;
+
+/*
+ * Cache of successfully verified credentials.
+ *
+ * Verifying crypt(3) and apr1 hashes takes a considerable amount of
+ * CPU time, whereas clients using basic authentication send the same
+ * credentials with each request.  Each password file keeps a bounded
+ * cache of credentials verified within the last basic_auth_cache_ttl
+ * seconds.  Entries are keyed by HMAC-SHA256 of user name, password
+ * and stored hash, computed with a random per-process key, so that
+ * no passwords or unsalted hashes of them are kept in memory.  Since
+ * the stored hash is part of the key, changing a user's password
+ * makes its cached entry unreachable.  In any case, the cache is
+ * flushed each time the password file is reloaded.
+ */
+#define CRED_DIGEST_LENGTH SHA256_DIGEST_LENGTH
+
+/* Credential cache counters. */
+enum
+  {
+    CRED_HITS,
+    CRED_MISSES
+  };
+
+struct cred_entry
+{
+  struct timespec expire;          /* Expiration time. */
+};
+
+static unsigned char cred_key[32];
+
+/*
+ * Compute the cache key for the given credentials.  Return -1 if
+ * they are too long to be cached.
+ */
+static int
+cred_digest (unsigned char *digest, char const *user, char const *pass,
+	     char const *hash)
+{
+  char buf[MAXBUF];
+  size_t ulen = strlen (user) + 1;
+  size_t plen = strlen (pass) + 1;
+  size_t hlen = strlen (hash);
+  unsigned len;
+  int rc = 0;
+
+  if (ulen + plen + hlen > sizeof (buf))
+    return -1;
+  memcpy (buf, user, ulen);
+  memcpy (buf + ulen, pass, plen);
+  memcpy (buf + ulen + plen, hash, hlen);
+  if (HMAC (EVP_sha256 (), cred_key, sizeof (cred_key),
+	    (unsigned char *) buf, ulen + plen + hlen, digest, &len) == NULL)
+    rc = -1;
+  memset (buf, 0, ulen + plen);
+  return rc;
+}
+
+/* Return 1 if credentials with the given DIGEST have been verified. */
+static int
+cred_cache_lookup (SHTAB *cache, unsigned char const *digest)
+{
+  struct shtab_cursor cur;
+  struct cred_entry *ent;
+  struct timespec now;
+  int found = 0;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  if ((ent = shtab_lookup (cache, digest, CRED_DIGEST_LENGTH, &cur)) != NULL)
+    {
+      if (timespec_cmp (&now, &ent->expire) < 0)
+	found = 1;
+      else
+	shtab_remove (cache, &cur);
+    }
+  shtab_count (&cur, found ? CRED_HITS : CRED_MISSES, 1);
+  shtab_unlock (&cur);
+  return found;
+}
+
+/* Remember that credentials with the given DIGEST are valid. */
+static void
+cred_cache_insert (SHTAB *cache, unsigned char const *digest)
+{
+  struct shtab_cursor cur;
+  struct cred_entry *ent;
+
+  if (shtab_lookup (cache, digest, CRED_DIGEST_LENGTH, &cur) == NULL
+      && (ent = shtab_insert (cache, &cur)) != NULL)
+    {
+      clock_gettime (CLOCK_MONOTONIC, &ent->expire);
+      ent->expire.tv_sec += basic_auth_cache_ttl;
+    }
+  shtab_unlock (&cur);
+}
+
+/* Drop a reference to TAB and free it if it was the last one. */
 static void
-user_pass_free (USER_PASS_HEAD *head)
+pass_table_unref (struct pass_table *tab)
 {
-  while (!SLIST_EMPTY (head))
+  size_t i;
+
+  if (!tab || __atomic_sub_fetch (&tab->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+  for (i = 0; i < tab->size; i++)
+    {
+      struct user_pass *up = tab->bucket[i];
+      while (up)
+	{
+	  struct user_pass *next = up->next;
+	  free (up);
+	  up = next;
+	}
+    }
+  free (tab);
+}
+
+static struct user_pass const *
+pass_table_lookup (struct pass_table const *tab, char const *user)
+{
+  unsigned long h;
+  struct user_pass const *up;
+
+  if (!tab)
+    return NULL;
+  h = fnv_hash (user, strlen (user));
+  for (up = tab->bucket[h & (tab->size - 1)]; up; up = up->next)
+    if (up->hash == h && strcmp (up->user, user) == 0)
+      return up;
+  return NULL;
+}
+
+/*
+ * Read user:password pairs from FP and build a hash table of them.
+ * If a user appears several times, its first entry takes precedence and
+ * the rest are ignored.  Returns NULL on memory shortage.
+ */
+static struct pass_table *
+pass_table_read (FILE *fp)
+{
+  char buf[MAXBUF];
+  struct user_pass *list = NULL, *up;
+  size_t count = 0, size;
+  struct pass_table *tab;
+
+  while (fgets (buf, sizeof (buf), fp))
+    {
+      char *p, *q;
+      int ulen;
+
+      for (p = buf; *p && (*p == ' ' || *p == '\t'); p++);
+      if (*p == '#')
+	continue;
+      q = p + strlen (p);
+      if (q == p)
+	continue;
+      if (q[-1] == '\n')
+	*--q = 0;
+      if (!*p)
+	continue;
+      if ((q = strchr (p, ':')) == NULL)
+	continue;
+      ulen = q - p;
+
+      if ((up = malloc (sizeof (up[0]) + strlen (p))) == NULL)
+	{
+	  lognomem ();
+	  break;
+	}
+
+      strcpy (up->user, p);
+      up->user[ulen] = 0;
+      up->pass = up->user + ulen + 1;
+      up->hash = fnv_hash (up->user, ulen);
+      up->next = list;
+      list = up;
+      count++;
+    }
+
+  for (size = 16; size < count; size <<= 1)
+    ;
+  tab = calloc (1, sizeof (*tab) + (size - 1) * sizeof (tab->bucket[0]));
+  if (tab == NULL)
     {
-      struct user_pass *up = SLIST_FIRST (head);
-      SLIST_SHIFT (head, link);
-      free (up);
+      lognomem ();
+      while (list)
+	{
+	  up = list->next;
+	  free (list);
+	  list = up;
+	}
+      return NULL;
+    }
+  tab->refcount = 1;
+  tab->size = size;
+
+  /*
+   * The list is in reverse order.  Inserting each entry in place of
+   * the previously inserted one for the same user ensures the first
+   * occurrence wins.
+   */
+  while (list)
+    {
+      struct user_pass **pp;
+
+      up = list;
+      list = up->next;
+      for (pp = &tab->bucket[up->hash & (size - 1)]; *pp; pp = &(*pp)->next)
+	if ((*pp)->hash == up->hash && strcmp ((*pp)->user, up->user) == 0)
+	  break;
+      if (*pp)
+	{
+	  up->next = (*pp)->next;
+	  free (*pp);
+	}
+      else
+	up->next = NULL;
+      *pp = up;
     }
+  return tab;
 }
 
 static int
@@ -318,20 +565,40 @@ pass_file_changed (struct pass_file *pwf, struct stat const *st)
   return 0;
 }
 
+/* Install new table TAB for PWF and free the old one. */
+static void
+pass_file_publish (struct pass_file *pwf, struct pass_table *tab)
+{
+  struct pass_table *old;
+
+  pthread_mutex_lock (&pwf->lock);
+  old = pwf->table;
+  pwf->table = tab;
+  pthread_mutex_unlock (&pwf->lock);
+  if (pwf->cache)
+    shtab_flush (pwf->cache);
+  pass_table_unref (old);
+}
+
+/*
+ * Reload the password file if its modification time has changed.
+ * Errors are reported only once, when they first occur.
+ */
 static void
-pass_file_fill (struct pass_file *pwf)
+pass_file_load (struct pass_file *pwf)
 {
   FILE *fp;
-  char buf[MAXBUF];
   struct stat st;
 
   if ((fp = fopen_wd (pwf->wd, pwf->filename)) == NULL)
     {
       int ec = errno;
-      fopen_error (LOG_WARNING, ec, pwf->wd, pwf->filename, &pwf->locus);
+      if (ec != pwf->err)
+	fopen_error (LOG_WARNING, ec, pwf->wd, pwf->filename, &pwf->locus);
+      pwf->err = ec;
       if (ec == ENOENT)
 	{
-	  user_pass_free (&pwf->head);
+	  pass_file_publish (pwf, NULL);
 	  memset (&pwf->mtim, 0, sizeof (pwf->mtim));
 	}
       return;
@@ -339,68 +606,159 @@ pass_file_fill (struct pass_file *pwf)
 
   if (fstat (fileno (fp), &st))
     {
-      logmsg (LOG_WARNING, "fstat(%s) failed: %s", pwf->filename,
-	      strerror (errno));
+      int ec = errno;
+      if (ec != pwf->err)
+	logmsg (LOG_WARNING, "fstat(%s) failed: %s", pwf->filename,
+		strerror (ec));
+      pwf->err = ec;
       fclose (fp);
       return;
     }
+  pwf->err = 0;
 
   if (pass_file_changed (pwf, &st))
     {
-      /* Free existing entries. */
-      user_pass_free (&pwf->head);
-
-      /* Rescan the file. */
-      while (fgets (buf, sizeof (buf), fp))
-	{
-	  struct user_pass *up;
-	  char *p, *q;
-	  int ulen;
-
-	  for (p = buf; *p && (*p == ' ' || *p == '\t'); p++);
-	  if (*p == '#')
-	    continue;
-	  q = p + strlen (p);
-	  if (q == p)
-	    continue;
-	  if (q[-1] == '\n')
-	    *--q = 0;
-	  if (!*p)
-	    continue;
-	  if ((q = strchr (p, ':')) == NULL)
-	    continue;
-	  ulen = q - p;
-
-	  if ((up = malloc (sizeof (up[0]) + strlen (p))) == NULL)
-	    {
-	      lognomem ();
-	      break;
-	    }
-
-	  strcpy (up->user, p);
-	  up->user[ulen] = 0;
-	  up->pass = up->user + ulen + 1;
-
-	  SLIST_PUSH (&pwf->head, up, link);
-	}
+      struct pass_table *tab = pass_table_read (fp);
+      if (tab)
+	pass_file_publish (pwf, tab);
+      else
+	/* Retry on the next check. */
+	memset (&pwf->mtim, 0, sizeof (pwf->mtim));
     }
   fclose (fp);
-  return;
+}
+
+/*
+ * Periodic job: reload the password file passed in DATA if it has
+ * changed.
+ */
+static void
+pass_file_watch (void *data)
+{
+  struct pass_file *pwf = data;
+
+  job_unlock ();
+  pass_file_load (pwf);
+  job_lock ();
+  job_enqueue_after_unlocked (basic_auth_check, pass_file_watch, pwf);
+}
+
+void
+pass_file_register (struct pass_file *pwf)
+{
+  pthread_mutex_init (&pwf->lock, NULL);
+  SLIST_PUSH (&pass_file_head, pwf, next);
+}
+
+/*
+ * Load all registered password files and schedule periodic checks
+ * for modifications, unless BasicAuthCheck is 0.
+ */
+void
+basic_auth_init (void)
+{
+  struct pass_file *pwf;
+  int use_cache = basic_auth_cache_size > 0 && basic_auth_cache_ttl > 0;
+
+  if (use_cache && !SLIST_EMPTY (&pass_file_head)
+      && RAND_bytes (cred_key, sizeof (cred_key)) != 1)
+    {
+      logmsg (LOG_WARNING,
+	      "can't generate credential cache key; caching disabled");
+      use_cache = 0;
+    }
+
+  SLIST_FOREACH (pwf, &pass_file_head, next)
+    {
+      if (use_cache)
+	pwf->cache = shtab_new (basic_auth_cache_size,
+			        sizeof (struct cred_entry));
+      pass_file_load (pwf);
+      if (basic_auth_check)
+	job_enqueue_after (basic_auth_check, pass_file_watch, pwf);
+    }
+}
+
+/* Return a reference to the current password table of PWF. */
+static struct pass_table *
+pass_file_table (struct pass_file *pwf)
+{
+  struct pass_table *tab;
+
+  pthread_mutex_lock (&pwf->lock);
+  if ((tab = pwf->table) != NULL)
+    __atomic_add_fetch (&tab->refcount, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock (&pwf->lock);
+  return tab;
 }
 
 static int
 basic_auth_internal (struct pass_file *pwf, char const *user, char const *pass)
 {
-  struct user_pass *up;
+  struct pass_table *tab = pass_file_table (pwf);
+  struct user_pass const *up;
+  int rc = 1;
 
-  pass_file_fill (pwf);
-  SLIST_FOREACH (up, &pwf->head, link)
+  if ((up = pass_table_lookup (tab, user)) != NULL)
     {
-      if (strcmp (user, up->user) == 0)
-	return auth_match (pass, up->pass);
+      unsigned char digest[CRED_DIGEST_LENGTH];
+
+      if (pwf->cache && cred_digest (digest, user, pass, up->pass) == 0)
+	{
+	  if (cred_cache_lookup (pwf->cache, digest))
+	    rc = 0;
+	  else if ((rc = auth_match (pass, up->pass)) == 0)
+	    cred_cache_insert (pwf->cache, digest);
+	  memset (digest, 0, sizeof (digest));
+	}
+      else
+	rc = auth_match (pass, up->pass);
     }
+  pass_table_unref (tab);
+  return rc;
+}
 
-  return 1;
+/*
+ * Return credential cache statistics, summed over all password files.
+ */
+struct json_value *
+basic_auth_cache_serialize (void)
+{
+  struct json_value *obj;
+  struct pass_file *pwf;
+  unsigned long hits = 0, misses = 0, entries = 0;
+  int err = 0;
+
+  SLIST_FOREACH (pwf, &pass_file_head, next)
+    {
+      if (pwf->cache)
+	{
+	  struct shtab_stats st;
+
+	  shtab_get_stats (pwf->cache, &st);
+	  hits += st.counter[CRED_HITS];
+	  misses += st.counter[CRED_MISSES];
+	  entries += st.entries;
+	}
+    }
+
+  obj = json_new_object ();
+  if (obj)
+    {
+      err = json_object_set (obj, "size",
+			     json_new_integer (basic_auth_cache_size))
+	|| json_object_set (obj, "ttl",
+			    json_new_integer (basic_auth_cache_ttl))
+	|| json_object_set (obj, "entries", json_new_number (entries))
+	|| json_object_set (obj, "hits", json_new_number (hits))
+	|| json_object_set (obj, "misses", json_new_number (misses));
+    }
+  if (err)
+    {
+      json_value_free (obj);
+      obj = NULL;
+    }
+  return obj;
 }
 
 int
@@ -0,0 +1,181 @@
+/*
+ * Pound - the reverse-proxy load-balancer
+ * Copyright (C) 2024 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * CIDR tries.
+ *
+ * CIDRs of an ACL are kept in a path-compressed binary radix trie, one
+ * per address family.  Each node holds a network prefix; its children
+ * hold longer prefixes that continue it with 0 and 1 bit, respectively.
+ * Chains of nodes with a single child are collapsed.
+ *
+ * ACLs only need to tell whether an address belongs to any of the CIDRs,
+ * so prefixes covered by shorter ones are not stored.  Consequently,
+ * a terminal node (one corresponding to a CIDR) never has children, and
+ * lookup stops at the first terminal node on the path.  A lookup visits
+ * at most 32 (IPv4) or 128 (IPv6) nodes, whatever the number of CIDRs.
+ */
+#include "pound.h"
+
+struct cidr_node
+{
+  unsigned char key[MAX_INADDR_BYTES]; /* Network prefix. */
+  unsigned bitlen;                     /* Prefix length in bits. */
+  int term;                            /* True if it is a CIDR. */
+  struct cidr_node *child[2];          /* Children. */
+};
+
+/* Return bit N of the address ADDR. */
+static inline int
+addr_bit (unsigned char const *addr, unsigned n)
+{
+  return (addr[n / 8] >> (7 - n % 8)) & 1;
+}
+
+/*
+ * Return the length of the common prefix of addresses A and B, not
+ * exceeding MAXBITS.
+ */
+static unsigned
+common_prefix (unsigned char const *a, unsigned char const *b,
+	       unsigned maxbits)
+{
+  unsigned n;
+
+  for (n = 0; n + 8 <= maxbits && a[n / 8] == b[n / 8]; n += 8)
+    ;
+  for (; n < maxbits && addr_bit (a, n) == addr_bit (b, n); n++)
+    ;
+  return n;
+}
+
+/* Return true if the first BITLEN bits of A and B are the same. */
+static inline int
+prefix_match (unsigned char const *a, unsigned char const *b,
+	      unsigned bitlen)
+{
+  unsigned n = bitlen / 8;
+
+  if (memcmp (a, b, n))
+    return 0;
+  if (bitlen % 8)
+    {
+      unsigned char mask = 0xff << (8 - bitlen % 8);
+      return ((a[n] ^ b[n]) & mask) == 0;
+    }
+  return 1;
+}
+
+static struct cidr_node *
+cidr_node_new (unsigned char const *key, unsigned bitlen, int term,
+	       size_t *mem)
+{
+  struct cidr_node *node;
+  unsigned n;
+
+  XZALLOC (node);
+  n = (bitlen + 7) / 8;
+  memcpy (node->key, key, n);
+  if (bitlen % 8)
+    node->key[n - 1] &= 0xff << (8 - bitlen % 8);
+  node->bitlen = bitlen;
+  node->term = term;
+  *mem += sizeof (*node);
+  return node;
+}
+
+static void
+cidr_node_free (struct cidr_node *node, size_t *mem)
+{
+  if (node)
+    {
+      cidr_node_free (node->child[0], mem);
+      cidr_node_free (node->child[1], mem);
+      free (node);
+      *mem -= sizeof (*node);
+    }
+}
+
+/*
+ * Insert the network ADDR/MASKLEN into the trie at *ROOT.  Update the
+ * memory counter *MEM.
+ */
+void
+cidr_trie_insert (struct cidr_node **root, unsigned char const *addr,
+		  unsigned masklen, size_t *mem)
+{
+  struct cidr_node **pp = root, *node, *mid;
+  unsigned n;
+
+  while ((node = *pp) != NULL)
+    {
+      n = common_prefix (addr, node->key,
+			 masklen < node->bitlen ? masklen : node->bitlen);
+      if (n == node->bitlen)
+	{
+	  if (node->term)
+	    /* Already covered. */
+	    return;
+	  if (n == masklen)
+	    {
+	      /* The node becomes terminal: its subtrees are redundant. */
+	      cidr_node_free (node->child[0], mem);
+	      cidr_node_free (node->child[1], mem);
+	      node->child[0] = node->child[1] = NULL;
+	      node->term = 1;
+	      return;
+	    }
+	  pp = &node->child[addr_bit (addr, n)];
+	}
+      else if (n == masklen)
+	{
+	  /* New CIDR covers the node. */
+	  cidr_node_free (node, mem);
+	  *pp = cidr_node_new (addr, masklen, 1, mem);
+	  return;
+	}
+      else
+	{
+	  /* Split the path at the first differing bit. */
+	  mid = cidr_node_new (addr, n, 0, mem);
+	  mid->child[addr_bit (node->key, n)] = node;
+	  mid->child[addr_bit (addr, n)] = cidr_node_new (addr, masklen, 1, mem);
+	  *pp = mid;
+	  return;
+	}
+    }
+  *pp = cidr_node_new (addr, masklen, 1, mem);
+}
+
+/*
+ * Return 1 if the address ADDR matches one of the CIDRs in the trie
+ * NODE, and 0 otherwise.
+ */
+int
+cidr_trie_lookup (struct cidr_node const *node, unsigned char const *addr)
+{
+  while (node)
+    {
+      if (!prefix_match (addr, node->key, node->bitlen))
+	break;
+      if (node->term)
+	return 1;
+      node = node->child[addr_bit (addr, node->bitlen)];
+    }
+  return 0;
+}
@@ -0,0 +1,233 @@
+/*
+ * Pound - the reverse-proxy load-balancer
+ * Copyright (C) 2024 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Adaptive concurrency limiting.
+ *
+ * The number of requests a service passes to its backends at the same
+ * time is limited.  The limit is adjusted continuously using the AIMD
+ * (additive increase, multiplicative decrease) rule, based on the
+ * observed response latency:
+ *
+ *  - Two exponentially weighted moving averages of the latency are
+ *    maintained: a short-term one, following the current state, and a
+ *    long-term one, approximating the latency of the unloaded service.
+ *
+ *  - If a request fails, or the short-term average exceeds the
+ *    long-term one by more than the configured tolerance, the backends
+ *    are assumed to be overloaded and the limit is multiplied by the
+ *    backoff factor.  This is done at most once per average latency
+ *    interval, so that a single burst of slow responses doesn't collapse
+ *    the limit.
+ *
+ *  - Otherwise, if the limit is actually being used (at least half of
+ *    it is in flight), it is increased by 1/limit per request, i.e.
+ *    roughly by one per round of requests.
+ *
+ * A request arriving when the limit is reached waits for a free slot
+ * for at most the configured queue time-out, and is rejected if none
+ * becomes available.
+ */
+#include "pound.h"
+#include "json.h"
+
+/* Weights (as 1/N) of a new sample in the latency averages. */
+#define SHORT_WINDOW 10
+#define LONG_WINDOW  500
+
+struct conc_state
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;             /* Signaled when a slot is released. */
+  double limit;                    /* Current limit. */
+  unsigned inflight;               /* Number of requests in flight. */
+  double short_rtt;                /* Short-term latency average (ns). */
+  double long_rtt;                 /* Long-term latency average (ns). */
+  struct timespec last_decrease;   /* Time of the last decrease. */
+  unsigned long passed;            /* Statistics. */
+  unsigned long queued;
+  unsigned long rejected;
+  unsigned long failed;
+};
+
+/* Set up the state of the concurrency limiter CL. */
+void
+conc_limit_init (CONC_LIMIT *cl)
+{
+  struct conc_state *st;
+  pthread_condattr_t attr;
+
+  XZALLOC (st);
+  pthread_mutex_init (&st->mutex, NULL);
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&st->cond, &attr);
+  pthread_condattr_destroy (&attr);
+  st->limit = cl->initial;
+  cl->state = st;
+}
+
+static inline int
+conc_slot_available (CONC_LIMIT *cl)
+{
+  return cl->state->inflight < (unsigned) cl->state->limit;
+}
+
+/*
+ * Take a slot for a new request.  If none is available, wait for at
+ * most the queue time-out.  Return 0 on success, and -1 if the request
+ * must be rejected.
+ */
+int
+conc_limit_acquire (CONC_LIMIT *cl)
+{
+  struct conc_state *st = cl->state;
+  int rc = 0;
+
+  pthread_mutex_lock (&st->mutex);
+  if (!conc_slot_available (cl) && cl->queue_timeout)
+    {
+      struct timespec ts;
+
+      clock_gettime (CLOCK_MONOTONIC, &ts);
+      ts.tv_sec += cl->queue_timeout / 1000;
+      ts.tv_nsec += (long) (cl->queue_timeout % 1000) * 1000000;
+      if (ts.tv_nsec >= 1000000000)
+	{
+	  ts.tv_sec++;
+	  ts.tv_nsec -= 1000000000;
+	}
+      st->queued++;
+      while (!conc_slot_available (cl))
+	if (pthread_cond_timedwait (&st->cond, &st->mutex, &ts) == ETIMEDOUT)
+	  break;
+    }
+  if (conc_slot_available (cl))
+    {
+      st->inflight++;
+      st->passed++;
+    }
+  else
+    {
+      st->rejected++;
+      rc = -1;
+    }
+  pthread_mutex_unlock (&st->mutex);
+  return rc;
+}
+
+/*
+ * Release the slot taken by a request.  LATENCY is the time it took to
+ * process it, or NULL if it can't be used as a sample (e.g. the client
+ * went away).  OK is 0 if the backend failed to process the request.
+ */
+void
+conc_limit_release (CONC_LIMIT *cl, struct timespec const *latency, int ok)
+{
+  struct conc_state *st = cl->state;
+  unsigned inflight;
+
+  pthread_mutex_lock (&st->mutex);
+  inflight = st->inflight--;
+  if (latency)
+    {
+      double t = (double) latency->tv_sec * 1e9 + latency->tv_nsec;
+
+      if (st->long_rtt == 0)
+	st->short_rtt = st->long_rtt = t;
+      else
+	{
+	  st->short_rtt += (t - st->short_rtt) / SHORT_WINDOW;
+	  st->long_rtt += (t - st->long_rtt) / LONG_WINDOW;
+	}
+
+      if (!ok || st->short_rtt * 100 > st->long_rtt * cl->tolerance)
+	{
+	  struct timespec now, diff;
+
+	  if (!ok)
+	    st->failed++;
+	  clock_gettime (CLOCK_MONOTONIC, &now);
+	  diff = timespec_sub (&now, &st->last_decrease);
+	  if ((double) diff.tv_sec * 1e9 + diff.tv_nsec >= st->short_rtt)
+	    {
+	      st->limit = st->limit * cl->backoff / 100;
+	      if (st->limit < cl->min)
+		st->limit = cl->min;
+	      st->last_decrease = now;
+	    }
+	}
+      else if (inflight * 2 >= st->limit)
+	{
+	  st->limit += 1 / st->limit;
+	  if (st->limit > cl->max)
+	    st->limit = cl->max;
+	}
+    }
+  if (conc_slot_available (cl))
+    pthread_cond_signal (&st->cond);
+  pthread_mutex_unlock (&st->mutex);
+}
+
+void
+conc_limit_get_stats (CONC_LIMIT *cl, struct conc_limit_stats *res)
+{
+  struct conc_state *st = cl->state;
+
+  pthread_mutex_lock (&st->mutex);
+  res->limit = (unsigned) st->limit;
+  res->inflight = st->inflight;
+  res->latency = st->short_rtt;
+  res->baseline_latency = st->long_rtt;
+  res->passed = st->passed;
+  res->queued = st->queued;
+  res->rejected = st->rejected;
+  res->failed = st->failed;
+  pthread_mutex_unlock (&st->mutex);
+}
+
+struct json_value *
+conc_limit_serialize (CONC_LIMIT *cl)
+{
+  struct conc_limit_stats st;
+  struct json_value *obj;
+  int err = 0;
+
+  conc_limit_get_stats (cl, &st);
+  obj = json_new_object ();
+  if (obj)
+    {
+      err = json_object_set (obj, "min", json_new_integer (cl->min))
+	|| json_object_set (obj, "max", json_new_integer (cl->max))
+	|| json_object_set (obj, "limit", json_new_number (st.limit))
+	|| json_object_set (obj, "inflight", json_new_number (st.inflight))
+	|| json_object_set (obj, "latency", json_new_number (st.latency))
+	|| json_object_set (obj, "baseline_latency",
+			    json_new_number (st.baseline_latency))
+	|| json_object_set (obj, "passed", json_new_number (st.passed))
+	|| json_object_set (obj, "queued", json_new_number (st.queued))
+	|| json_object_set (obj, "rejected", json_new_number (st.rejected))
+	|| json_object_set (obj, "failed", json_new_number (st.failed));
+    }
+  if (err)
+    {
+      json_value_free (obj);
+      obj = NULL;
+    }
+  return obj;
+}
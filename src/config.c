@@ -422,6 +422,29 @@ xgetcwd (void)
   return buf;
 }
 
+/*
+ * Return absolute pathname of NAME, relative to the current working
+ * directory.  Certificates are reloaded after pound has changed to
+ * the root directory, so relative names can't be kept.
+ */
+static char *
+absolute_pathname (char const *name)
+{
+  char *cwd, *ret;
+  size_t len;
+
+  if (name[0] == '/')
+    return xstrdup (name);
+  cwd = xgetcwd ();
+  len = strlen (cwd);
+  ret = xmalloc (len + strlen (name) + 2);
+  strcpy (ret, cwd);
+  ret[len] = '/';
+  strcpy (ret + len + 1, name);
+  free (cwd);
+  return ret;
+}
+
 static WORKDIR *
 workdir_get (char const *name)
 {
@@ -516,6 +539,29 @@ open_include_dir (char const *dir)
   return include_wd = workdir_get (dir);
 }
 
+/*
+ * Return absolute pathname of NAME, relative to the include directory.
+ * This is used for files that are reopened at run time, after pound
+ * may have changed to the root directory.
+ */
+static char *
+include_pathname (char const *name)
+{
+  char *dir, *ret;
+  size_t len;
+
+  if (name[0] == '/' || include_wd == NULL)
+    return absolute_pathname (name);
+  dir = absolute_pathname (include_wd->name);
+  len = strlen (dir);
+  ret = xmalloc (len + strlen (name) + 2);
+  strcpy (ret, dir);
+  ret[len] = '/';
+  strcpy (ret + len + 1, name);
+  free (dir);
+  return ret;
+}
+
 FILE *
 fopen_wd (WORKDIR *wd, const char *filename)
 {
@@ -1511,18 +1557,6 @@ assign_port (void *call_data, void *section_data)
  * ACL support
  */
 
-/* Max. number of bytes in an inet address (suitable for both v4 and v6) */
-#define MAX_INADDR_BYTES 16
-
-typedef struct cidr
-{
-  int family;                           /* Address family */
-  int len;                              /* Address length */
-  unsigned char addr[MAX_INADDR_BYTES]; /* Network address */
-  unsigned char mask[MAX_INADDR_BYTES]; /* Address mask */
-  SLIST_ENTRY (cidr) next;              /* Link to next CIDR */
-} CIDR;
-
 /* Create a new ACL. */
 static ACL *
 new_acl (char const *name)
@@ -1534,28 +1568,10 @@ new_acl (char const *name)
     acl->name = xstrdup (name);
   else
     acl->name = NULL;
-  SLIST_INIT (&acl->head);
 
   return acl;
 }
 
-/* Match cidr against inet address ap/len.  Return 0 on match, 1 otherwise. */
-static int
-cidr_match (CIDR *cidr, unsigned char *ap, size_t len)
-{
-  size_t i;
-
-  if (cidr->len == len)
-    {
-      for (i = 0; i < len; i++)
-	{
-	  if (cidr->addr[i] != (ap[i] & cidr->mask[i]))
-	    return 1;
-	}
-    }
-  return 0;
-}
-
 /*
  * Split the inet address of SA to address pointer and length, suitable
  * for use with the above functions.  Store pointer in RET_PTR.  Return
@@ -1587,36 +1603,13 @@ sockaddr_bytes (struct sockaddr *sa, unsigned char **ret_ptr)
 int
 acl_match (ACL *acl, struct sockaddr *sa)
 {
-  CIDR *cidr;
   unsigned char *ap;
-  size_t len;
 
-  if ((len = sockaddr_bytes (sa, &ap)) == -1)
+  if (sockaddr_bytes (sa, &ap) == -1)
     return -1;
 
-  SLIST_FOREACH (cidr, &acl->head, next)
-    {
-      if (cidr->family == sa->sa_family && cidr_match (cidr, ap, len) == 0)
-	return 0;
-    }
-
-  return 1;
-}
-
-static void
-masklen_to_netmask (unsigned char *buf, size_t len, size_t masklen)
-{
-  int i, cnt;
-
-  cnt = masklen / 8;
-  for (i = 0; i < cnt; i++)
-    buf[i] = 0xff;
-  if (i == MAX_INADDR_BYTES)
-    return;
-  cnt = 8 - masklen % 8;
-  buf[i++] = (0xff >> cnt) << cnt;
-  for (; i < MAX_INADDR_BYTES; i++)
-    buf[i] = 0;
+  return !cidr_trie_lookup (sa->sa_family == AF_INET ? acl->root4 : acl->root6,
+			    ap);
 }
 
 /* Parse CIDR at the current point of the input. */
@@ -1653,26 +1646,26 @@ parse_cidr (ACL *acl)
 
   if ((rc = getaddrinfo (tok->str, NULL, &hints, &res)) == 0)
     {
-      CIDR *cidr;
-      int len, i;
+      int len;
       unsigned char *p;
 
       if ((len = sockaddr_bytes (res->ai_addr, &p)) == -1)
 	{
 	  conf_error ("%s", "unsupported address family");
+	  freeaddrinfo (res);
 	  return PARSER_FAIL;
 	}
-      XZALLOC (cidr);
-      cidr->family = res->ai_family;
-      cidr->len = len;
-      memcpy (cidr->addr, p, len);
       if (!mask)
 	masklen = len * 8;
-      masklen_to_netmask (cidr->mask, cidr->len, masklen);
-      /* Fix-up network address, just in case */
-      for (i = 0; i < len; i++)
-	cidr->addr[i] &= cidr->mask[i];
-      SLIST_PUSH (&acl->head, cidr, next);
+      else if (masklen > len * 8)
+	{
+	  conf_error ("%s", "invalid netmask");
+	  freeaddrinfo (res);
+	  return PARSER_FAIL;
+	}
+      cidr_trie_insert (res->ai_family == AF_INET ? &acl->root4 : &acl->root6,
+			p, masklen, &acl->mem);
+      acl->count++;
       freeaddrinfo (res);
     }
   else
@@ -1714,9 +1707,12 @@ static int
 parse_acl (ACL *acl)
 {
   struct token *tok;
+  struct locus_range range;
+  struct stringbuf sb;
 
   if ((tok = gettkn_any ()) == NULL)
     return PARSER_FAIL;
+  range.beg = tok->locus.beg;
 
   if (tok->type != '\n')
     {
@@ -1749,6 +1745,14 @@ parse_acl (ACL *acl)
       if ((rc = parse_cidr (acl)) != PARSER_OK)
 	return rc;
     }
+  range.end = tok->locus.end;
+
+  xstringbuf_init (&sb);
+  stringbuf_format_locus_range (&sb, &range);
+  stringbuf_printf (&sb, ": %zu CIDRs compiled into radix trie (%zu bytes)",
+		    acl->count, acl->mem);
+  logmsg (LOG_DEBUG, "%s", stringbuf_finish (&sb));
+  stringbuf_free (&sb);
   return PARSER_OK;
 }
 
@@ -2438,6 +2442,7 @@ string_ref_alloc (char const *str)
   STRING_REF *ref = xmalloc (sizeof (*ref) + strlen (str));
   ref->refcount = 1;
   strcpy (ref->value, str);
+  ref->exp = expansion_compile (ref->value);
   return ref;
 }
 
@@ -2453,7 +2458,49 @@ void
 string_ref_free (STRING_REF *ref)
 {
   if (ref && --ref->refcount == 0)
-    free (ref);
+    {
+      expansion_free (ref->exp);
+      free (ref);
+    }
+}
+
+/*
+ * If condition COND built from string STR in MODE can be evaluated by
+ * literal comparison, save the literal in COND.
+ */
+static void
+cond_literal_set (SERVICE_COND *cond, int mode, int flags, char const *str)
+{
+  switch (cond->type)
+    {
+    case COND_HOST:
+    case COND_URL:
+    case COND_PATH:
+      break;
+
+    default:
+      return;
+    }
+
+  /* These are not escaped by stringbuf_escape_regex. */
+  if (str[strcspn (str, "^$|")])
+    return;
+
+  switch (mode)
+    {
+    case MATCH_EXACT:
+      cond->lit.mode = COND_LIT_EXACT;
+      break;
+
+    case MATCH_BEG:
+      cond->lit.mode = COND_LIT_PREFIX;
+      break;
+
+    default:
+      return;
+    }
+  cond->lit.icase = (flags & REG_ICASE) != 0;
+  cond->lit.str = xstrdup (str);
 }
 
 static int
@@ -2481,6 +2528,11 @@ parse_cond_matcher_0 (SERVICE_COND *top_cond, enum service_cond_type type,
       char *p;
       char buf[MAXBUF];
       STRING_REF *ref = NULL;
+      char **linev = NULL;
+      size_t i, linec = 0, linemax = 0;
+      int literal;
+      struct pattern_list *pl;
+      struct timespec ts_start, ts_end;
 
       if ((fp = fopen_include (tok->str)) == NULL)
 	{
@@ -2488,6 +2540,7 @@ parse_cond_matcher_0 (SERVICE_COND *top_cond, enum service_cond_type type,
 	  return PARSER_FAIL;
 	}
 
+      clock_gettime (CLOCK_MONOTONIC, &ts_start);
       cond = service_cond_append (top_cond, COND_BOOL);
       cond->bool.op = BOOL_OR;
 
@@ -2501,11 +2554,14 @@ parse_cond_matcher_0 (SERVICE_COND *top_cond, enum service_cond_type type,
 	  break;
 	}
 
+      /*
+       * Literal patterns can be matched all at once, unless they contain
+       * characters that stringbuf_escape_regex leaves intact.
+       */
+      literal = mode != MATCH_RE && !(type == COND_HOST && mode == MATCH_END);
       while ((p = fgets (buf, sizeof buf, fp)) != NULL)
 	{
-	  int rc;
 	  size_t len;
-	  SERVICE_COND *hc;
 
 	  p += strspn (p, " \t");
 	  for (len = strlen (p);
@@ -2514,30 +2570,123 @@ parse_cond_matcher_0 (SERVICE_COND *top_cond, enum service_cond_type type,
 	  if (len == 0 || *p == '#')
 	    continue;
 	  p[len] = 0;
+	  if (p[strcspn (p, "^$|")])
+	    literal = 0;
+	  if (linec == linemax)
+	    linev = x2nrealloc (linev, &linemax, sizeof (linev[0]));
+	  linev[linec++] = xstrdup (p);
+	}
+      fclose (fp);
+
+      /* An empty OR is true: leave it alone. */
+      if (linec == 0)
+	literal = 0;
+
+      if (literal)
+	{
+	  pl = pattern_list_new (type,
+				 mode == MATCH_EXACT ? PATLIST_EXACT
+				 : mode == MATCH_BEG ? PATLIST_PREFIX
+				 : PATLIST_SUFFIX,
+				 (flags & REG_ICASE) != 0);
+	  for (i = 0; i < linec; i++)
+	    pattern_list_add (pl, linev[i]);
+	}
+      else
+	{
+	  struct stringbuf alt;
+	  int combine = linec > 1 && (flags & REG_EXTENDED);
 
-	  stringbuf_reset (&sb);
-	  expr = build_regex (&sb, mode, p, type == COND_HOST ? host_pfx : NULL);
-	  hc = service_cond_append (cond, type);
-	  rc = regcomp (&hc->re, expr, flags);
-	  if (rc)
+	  pl = pattern_list_new (type, PATLIST_REGEX, (flags & REG_ICASE) != 0);
+	  xstringbuf_init (&alt);
+	  for (i = 0; i < linec; i++)
 	    {
-	      conf_regcomp_error (rc, &hc->re, NULL);
-	      return PARSER_FAIL;
+	      int rc;
+	      SERVICE_COND *hc;
+
+	      stringbuf_reset (&sb);
+	      expr = build_regex (&sb, mode, linev[i],
+				  type == COND_HOST ? host_pfx : NULL);
+	      hc = service_cond_append (cond, type);
+	      rc = regcomp (&hc->re, expr, flags);
+	      if (rc)
+		{
+		  conf_regcomp_error (rc, &hc->re, NULL);
+		  return PARSER_FAIL;
+		}
+	      switch (type)
+		{
+		case COND_QUERY_PARAM:
+		case COND_STRING_MATCH:
+		  memmove (&hc->sm.re, &hc->re, sizeof (hc->sm.re));
+		  hc->sm.string = string_ref_incr (ref);
+		  break;
+
+		default:
+		  break;
+		}
+
+	      /*
+	       * Back-references can't be used in alternation, because
+	       * group numbers change.
+	       */
+	      for (p = expr; (p = strchr (p, '\\')) != NULL && p[1]; p += 2)
+		if (isdigit (p[1]))
+		  combine = 0;
+	      if (combine)
+		{
+		  if (i > 0)
+		    stringbuf_add_char (&alt, '|');
+		  stringbuf_add_string (&alt, expr);
+		}
 	    }
-	  switch (type)
-	    {
-	    case COND_QUERY_PARAM:
-	    case COND_STRING_MATCH:
-	      memmove (&hc->sm.re, &hc->re, sizeof (hc->sm.re));
-	      hc->sm.string = string_ref_incr (ref);
-	      break;
 
-	    default:
-	      break;
+	  if (combine)
+	    {
+	      if ((p = stringbuf_finish (&alt)) == NULL
+		  || pattern_list_regcomp (pl, p, flags))
+		combine = 0;
 	    }
+	  stringbuf_free (&alt);
+	  if (!combine)
+	    {
+	      free (pl);
+	      pl = NULL;
+	    }
+	}
+
+      for (i = 0; i < linec; i++)
+	free (linev[i]);
+      free (linev);
+
+      if (pl)
+	{
+	  struct stringbuf msg;
+	  static char const *descr[] = {
+	    [PATLIST_EXACT]  = "exact match table",
+	    [PATLIST_PREFIX] = "prefix table",
+	    [PATLIST_SUFFIX] = "suffix table",
+	    [PATLIST_REGEX]  = "combined regular expression"
+	  };
+
+	  pl->string = string_ref_incr (ref);
+	  cond->bool.patlist = pl;
+
+	  clock_gettime (CLOCK_MONOTONIC, &ts_end);
+	  ts_end = timespec_sub (&ts_end, &ts_start);
+	  xstringbuf_init (&msg);
+	  stringbuf_format_locus_range (&msg, &tok->locus);
+	  stringbuf_printf (&msg,
+			    ": %zu patterns compiled into %s"
+			    " (%zu bytes) in %ld.%03ld ms",
+			    pl->count, descr[pl->mode], pl->mem,
+			    (long) (ts_end.tv_sec * 1000
+				    + ts_end.tv_nsec / 1000000),
+			    (long) (ts_end.tv_nsec / 1000 % 1000));
+	  logmsg (LOG_DEBUG, "%s", stringbuf_finish (&msg));
+	  stringbuf_free (&msg);
 	}
       string_ref_free (ref);
-      fclose (fp);
     }
   else
     {
@@ -2558,6 +2707,7 @@ parse_cond_matcher_0 (SERVICE_COND *top_cond, enum service_cond_type type,
 	  break;
 
 	default:
+	  cond_literal_set (cond, mode, flags, tok->str);
 	  break;
 	}
     }
@@ -2688,6 +2838,7 @@ parse_cond_basic_auth (void *call_data, void *section_data)
     return PARSER_FAIL;
   cond->pwfile.locus = tok->locus;
   cond->pwfile.filename = xstrdup (tok->str);
+  pass_file_register (&cond->pwfile);
   return PARSER_OK;
 }
 
@@ -2754,6 +2905,7 @@ parse_redirect_backend (void *call_data, void *section_data)
   if ((be->v.redirect.has_uri = matches[3].rm_eo - matches[3].rm_so) == 1)
     /* the path is a single '/', so remove it */
     be->v.redirect.url[matches[3].rm_so] = '\0';
+  be->v.redirect.exp = expansion_compile (be->v.redirect.url);
 
   SLIST_PUSH (head, be, next);
 
@@ -2909,143 +3061,456 @@ parse_session (void *call_data, void *section_data)
   return PARSER_OK;
 }
 
-static int
-assign_dfl_ignore_case (void *call_data, void *section_data)
+static struct kwtab rate_limit_type_tab[] = {
+  { "IP", RATE_LIMIT_IP },
+  { "HEADER", RATE_LIMIT_HEADER },
+  { "STRING", RATE_LIMIT_STRING },
+  { NULL }
+};
+
+char const *
+rate_limit_type_to_str (int type)
 {
-  POUND_DEFAULTS *dfl = section_data;
-  return assign_bool (&dfl->ignore_case, NULL);
+  return kw_to_str (rate_limit_type_tab, type);
 }
 
-static int parse_cond (int op, SERVICE_COND *cond, void *section_data);
-
 static int
-parse_match (void *call_data, void *section_data)
+rate_limit_type_parser (void *call_data, void *section_data)
 {
+  RATE_LIMIT *rl = call_data;
   struct token *tok;
-  int op = BOOL_AND;
+  int n;
 
-  if ((tok = gettkn_any ()) == NULL)
+  if ((tok = gettkn_expect (T_IDENT)) == NULL)
     return PARSER_FAIL;
-  if (tok->type == T_IDENT)
+
+  if (kw_to_tok (rate_limit_type_tab, tok->str, 1, &n))
     {
-      if (strcasecmp (tok->str, "and") == 0)
-	op = BOOL_AND;
-      else if (strcasecmp (tok->str, "or") == 0)
-	op = BOOL_OR;
-      else
-	{
-	  conf_error ("expected AND or OR, but found %s", tok->str);
-	  return PARSER_FAIL;
-	}
+      conf_error ("%s", "Unknown RateLimit type");
+      return PARSER_FAIL;
     }
-  else
-    putback_tkn (tok);
-
-  return parse_cond (op, call_data, section_data);
-}
-
-static int parse_not_cond (void *call_data, void *section_data);
-
-#define MATCH_CONDITIONS(data, off)				\
-  { "ACL", parse_cond_acl, data, off },				\
-  { "URL", parse_cond_url_matcher, data, off },			\
-  { "Path", parse_cond_path_matcher, data, off },		\
-  { "Query", parse_cond_query_matcher, data, off },		\
-  { "QueryParam", parse_cond_query_param_matcher, data, off },	\
-  { "Header", parse_cond_hdr_matcher, data, off },		\
-  { "Host", parse_cond_host, data, off },			\
-  { "BasicAuth", parse_cond_basic_auth, data, off },		\
-  { "StringMatch", parse_cond_string_matcher, data, off },	\
-  { "Match", parse_match, data, off },				\
-  { "NOT", parse_not_cond, data, off },				\
-    /* compatibility keywords */				\
-  { "HeadRequire", parse_cond_hdr_matcher, data, off },         \
-  { "HeadDeny", parse_cond_head_deny_matcher, data, off }
-
-static PARSER_TABLE negate_parsetab[] = {
-  MATCH_CONDITIONS (NULL, 0),
-  { NULL }
-};
+  rl->type = n;
 
-static int
-parse_not_cond (void *call_data, void *section_data)
-{
-  SERVICE_COND *cond = service_cond_append (call_data, COND_BOOL);
-  cond->bool.op = BOOL_NOT;
-  return parse_statement (negate_parsetab, cond, section_data, 1, NULL);
+  return PARSER_OK;
 }
 
-static PARSER_TABLE logcon_parsetab[] = {
+static PARSER_TABLE rate_limit_parsetab[] = {
   { "End", parse_end },
-  MATCH_CONDITIONS (NULL, 0),
+  { "Type", rate_limit_type_parser },
+  { "ID", assign_string, NULL, offsetof (RATE_LIMIT, id) },
+  { "Rate", assign_unsigned, NULL, offsetof (RATE_LIMIT, rate) },
+  { "Interval", assign_timeout, NULL, offsetof (RATE_LIMIT, interval) },
+  { "Burst", assign_unsigned, NULL, offsetof (RATE_LIMIT, burst) },
+  { "Size", assign_unsigned, NULL, offsetof (RATE_LIMIT, size) },
   { NULL }
 };
 
 static int
-parse_cond (int op, SERVICE_COND *cond, void *section_data)
+parse_rate_limit (void *call_data, void *section_data)
 {
-  SERVICE_COND *subcond = service_cond_append (cond, COND_BOOL);
+  RATE_LIMIT **prl = call_data, *rl;
   struct locus_range range;
 
-  subcond->bool.op = op;
-  return parser_loop (logcon_parsetab, subcond, section_data, &range);
-}
-
-static int parse_else (void *call_data, void *section_data);
-static int parse_rewrite (void *call_data, void *section_data);
-static int parse_set_header (void *call_data, void *section_data);
-static int parse_delete_header (void *call_data, void *section_data);
-static int parse_set_url (void *call_data, void *section_data);
-static int parse_set_path (void *call_data, void *section_data);
-static int parse_set_query (void *call_data, void *section_data);
-static int parse_set_query_param (void *call_data, void *section_data);
-static int parse_sub_rewrite (void *call_data, void *section_data);
+  if (*prl)
+    {
+      conf_error ("%s", "RateLimit already defined");
+      return PARSER_FAIL;
+    }
 
-#define REWRITE_OPS(data, off)						\
-  { "SetHeader", parse_set_header, data, off },				\
-  { "DeleteHeader", parse_delete_header, data, off },			\
-  { "SetURL", parse_set_url, data, off },				\
-  { "SetPath", parse_set_path, data, off },				\
-  { "SetQuery", parse_set_query, data, off },				\
-  { "SetQueryParam", parse_set_query_param, data, off }
+  XZALLOC (rl);
+  rl->type = RATE_LIMIT_IP;
+  rl->interval = 1;
+  rl->size = DEFAULT_RATE_LIMIT_SIZE;
+  if (parser_loop (rate_limit_parsetab, rl, section_data, &range))
+    return PARSER_FAIL;
 
-static PARSER_TABLE rewrite_rule_parsetab[] = {
-  { "End", parse_end },
-  { "Rewrite", parse_sub_rewrite, NULL, offsetof (REWRITE_RULE, ophead) },
-  { "Else", parse_else, NULL, offsetof (REWRITE_RULE, iffalse) },
-  MATCH_CONDITIONS (NULL, offsetof (REWRITE_RULE, cond)),
-  REWRITE_OPS (NULL, offsetof (REWRITE_RULE, ophead)),
+  if (rl->rate == 0)
+    {
+      conf_error_at_locus_range (&range, "RateLimit rate not defined");
+      return PARSER_FAIL;
+    }
+
+  if (rl->interval == 0)
+    {
+      conf_error_at_locus_range (&range, "RateLimit interval can't be 0");
+      return PARSER_FAIL;
+    }
+
+  if (rl->size == 0)
+    {
+      conf_error_at_locus_range (&range, "RateLimit size can't be 0");
+      return PARSER_FAIL;
+    }
+
+  if (rl->burst == 0)
+    rl->burst = rl->rate;
+
+  switch (rl->type)
+    {
+    case RATE_LIMIT_HEADER:
+    case RATE_LIMIT_STRING:
+      if (rl->id == NULL)
+	{
+	  conf_error_at_locus_range (&range, "RateLimit ID not defined");
+	  return PARSER_FAIL;
+	}
+      if (rl->type == RATE_LIMIT_STRING)
+	rl->exp = expansion_compile (rl->id);
+      break;
+
+    default:
+      break;
+    }
+
+  rate_limit_init (rl);
+  *prl = rl;
+  return PARSER_OK;
+}
+
+static struct kwtab prio_tab[] = {
+  { "high", PRIO_HIGH },
+  { "normal", PRIO_NORMAL },
+  { "low", PRIO_LOW },
   { NULL }
 };
 
-static int
-parse_end_else (void *call_data, void *section_data)
+char const *
+prio_to_str (int prio)
 {
-  struct token nl = { '\n' };
-  putback_tkn (NULL);
-  putback_tkn (&nl);
-  return PARSER_END;
+  return kw_to_str (prio_tab, prio);
 }
 
-static PARSER_TABLE else_rule_parsetab[] = {
-  { "End", parse_end_else },
-  { "Rewrite", parse_sub_rewrite, NULL, offsetof (REWRITE_RULE, ophead) },
-  { "Else", parse_else, NULL, offsetof (REWRITE_RULE, iffalse) },
-  MATCH_CONDITIONS (NULL, offsetof (REWRITE_RULE, cond)),
-  REWRITE_OPS (NULL, offsetof (REWRITE_RULE, ophead)),
+static struct kwtab log_queue_overflow_tab[] = {
+  { "drop", LOG_QUEUE_DROP },
+  { "block", LOG_QUEUE_BLOCK },
   { NULL }
 };
 
-static REWRITE_OP *
-rewrite_op_alloc (REWRITE_OP_HEAD *head, enum rewrite_type type)
+char const *
+log_queue_overflow_to_str (int n)
 {
-  REWRITE_OP *op;
-
-  XZALLOC (op);
-  op->type = type;
-  SLIST_PUSH (head, op, next);
-
-  return op;
+  return kw_to_str (log_queue_overflow_tab, n);
+}
+
+static int
+assign_log_queue_overflow (void *call_data, void *section_data)
+{
+  struct token *tok;
+
+  if ((tok = gettkn_expect (T_IDENT)) == NULL)
+    return PARSER_FAIL;
+
+  if (kw_to_tok (log_queue_overflow_tab, tok->str, 1, call_data))
+    {
+      conf_error ("%s", "unknown overflow policy");
+      return PARSER_FAIL;
+    }
+  return PARSER_OK;
+}
+
+/*
+ * Parse LogThrottle statement:
+ *   LogThrottle N [SEC]
+ */
+static int
+parse_log_throttle (void *call_data, void *section_data)
+{
+  struct token *tok;
+  int type;
+
+  if (assign_unsigned (&log_throttle_burst, NULL))
+    return PARSER_FAIL;
+  if ((tok = gettkn_any ()) == NULL)
+    return PARSER_FAIL;
+  type = tok->type;
+  putback_tkn (tok);
+  if (type == T_NUMBER)
+    {
+      if (assign_timeout (&log_throttle_interval, NULL))
+	return PARSER_FAIL;
+      if (log_throttle_interval == 0)
+	{
+	  conf_error ("%s", "throttling interval must be positive");
+	  return PARSER_FAIL;
+	}
+    }
+  return PARSER_OK;
+}
+
+static int
+parse_prio (int *prio)
+{
+  struct token *tok;
+
+  if ((tok = gettkn_expect (T_IDENT)) == NULL)
+    return PARSER_FAIL;
+
+  if (kw_to_tok (prio_tab, tok->str, 1, prio))
+    {
+      conf_error ("%s", "unknown priority class");
+      return PARSER_FAIL;
+    }
+  return PARSER_OK;
+}
+
+static int
+assign_prio (void *call_data, void *section_data)
+{
+  return parse_prio (call_data);
+}
+
+/*
+ * Parse PriorityClient statement:
+ *   PriorityClient CLASS "aclname"
+ *   PriorityClient CLASS
+ *     CIDR...
+ *   End
+ */
+static int
+parse_prio_client (void *call_data, void *section_data)
+{
+  PRIO_ACL_HEAD *head = call_data;
+  struct prio_acl *pa;
+  int prio;
+
+  if (parse_prio (&prio))
+    return PARSER_FAIL;
+  XZALLOC (pa);
+  pa->prio = prio;
+  if (parse_acl_ref (&pa->acl))
+    {
+      free (pa);
+      return PARSER_FAIL;
+    }
+  SLIST_PUSH (head, pa, next);
+  return PARSER_OK;
+}
+
+/*
+ * Parse PriorityWeight statement:
+ *   PriorityWeight CLASS N
+ */
+static int
+parse_prio_weight (void *call_data, void *section_data)
+{
+  int prio;
+  unsigned n;
+
+  if (parse_prio (&prio))
+    return PARSER_FAIL;
+  if (assign_unsigned (&n, NULL))
+    return PARSER_FAIL;
+  if (n == 0)
+    {
+      conf_error ("%s", "priority weight must be positive");
+      return PARSER_FAIL;
+    }
+  prio_weight[prio] = n;
+  return PARSER_OK;
+}
+
+static PARSER_TABLE conc_limit_parsetab[] = {
+  { "End", parse_end },
+  { "Min", assign_unsigned, NULL, offsetof (CONC_LIMIT, min) },
+  { "Max", assign_unsigned, NULL, offsetof (CONC_LIMIT, max) },
+  { "Initial", assign_unsigned, NULL, offsetof (CONC_LIMIT, initial) },
+  { "Backoff", assign_unsigned, NULL, offsetof (CONC_LIMIT, backoff) },
+  { "Tolerance", assign_unsigned, NULL, offsetof (CONC_LIMIT, tolerance) },
+  { "QueueTimeout", assign_unsigned, NULL, offsetof (CONC_LIMIT, queue_timeout) },
+  { NULL }
+};
+
+static int
+parse_conc_limit (void *call_data, void *section_data)
+{
+  CONC_LIMIT **pcl = call_data, *cl;
+  struct locus_range range;
+
+  if (*pcl)
+    {
+      conf_error ("%s", "ConcurrencyLimit already defined");
+      return PARSER_FAIL;
+    }
+
+  XZALLOC (cl);
+  cl->min = DEFAULT_CONC_LIMIT_MIN;
+  cl->max = DEFAULT_CONC_LIMIT_MAX;
+  cl->initial = 0;
+  cl->backoff = DEFAULT_CONC_LIMIT_BACKOFF;
+  cl->tolerance = DEFAULT_CONC_LIMIT_TOLERANCE;
+  if (parser_loop (conc_limit_parsetab, cl, section_data, &range))
+    return PARSER_FAIL;
+
+  if (cl->min == 0 || cl->max < cl->min)
+    {
+      conf_error_at_locus_range (&range,
+				 "ConcurrencyLimit: bad Min/Max values");
+      return PARSER_FAIL;
+    }
+
+  if (cl->initial == 0)
+    cl->initial = DEFAULT_CONC_LIMIT_INITIAL;
+  if (cl->initial < cl->min)
+    cl->initial = cl->min;
+  else if (cl->initial > cl->max)
+    cl->initial = cl->max;
+
+  if (cl->backoff == 0 || cl->backoff >= 100)
+    {
+      conf_error_at_locus_range (&range,
+				 "ConcurrencyLimit: Backoff must be between 1 and 99");
+      return PARSER_FAIL;
+    }
+
+  if (cl->tolerance <= 100)
+    {
+      conf_error_at_locus_range (&range,
+				 "ConcurrencyLimit: Tolerance must be greater than 100");
+      return PARSER_FAIL;
+    }
+
+  conc_limit_init (cl);
+  *pcl = cl;
+  return PARSER_OK;
+}
+
+static int
+assign_dfl_ignore_case (void *call_data, void *section_data)
+{
+  POUND_DEFAULTS *dfl = section_data;
+  return assign_bool (&dfl->ignore_case, NULL);
+}
+
+static int parse_cond (int op, SERVICE_COND *cond, void *section_data);
+
+static int
+parse_match (void *call_data, void *section_data)
+{
+  struct token *tok;
+  int op = BOOL_AND;
+
+  if ((tok = gettkn_any ()) == NULL)
+    return PARSER_FAIL;
+  if (tok->type == T_IDENT)
+    {
+      if (strcasecmp (tok->str, "and") == 0)
+	op = BOOL_AND;
+      else if (strcasecmp (tok->str, "or") == 0)
+	op = BOOL_OR;
+      else
+	{
+	  conf_error ("expected AND or OR, but found %s", tok->str);
+	  return PARSER_FAIL;
+	}
+    }
+  else
+    putback_tkn (tok);
+
+  return parse_cond (op, call_data, section_data);
+}
+
+static int parse_not_cond (void *call_data, void *section_data);
+
+#define MATCH_CONDITIONS(data, off)				\
+  { "ACL", parse_cond_acl, data, off },				\
+  { "URL", parse_cond_url_matcher, data, off },			\
+  { "Path", parse_cond_path_matcher, data, off },		\
+  { "Query", parse_cond_query_matcher, data, off },		\
+  { "QueryParam", parse_cond_query_param_matcher, data, off },	\
+  { "Header", parse_cond_hdr_matcher, data, off },		\
+  { "Host", parse_cond_host, data, off },			\
+  { "BasicAuth", parse_cond_basic_auth, data, off },		\
+  { "StringMatch", parse_cond_string_matcher, data, off },	\
+  { "Match", parse_match, data, off },				\
+  { "NOT", parse_not_cond, data, off },				\
+    /* compatibility keywords */				\
+  { "HeadRequire", parse_cond_hdr_matcher, data, off },         \
+  { "HeadDeny", parse_cond_head_deny_matcher, data, off }
+
+static PARSER_TABLE negate_parsetab[] = {
+  MATCH_CONDITIONS (NULL, 0),
+  { NULL }
+};
+
+static int
+parse_not_cond (void *call_data, void *section_data)
+{
+  SERVICE_COND *cond = service_cond_append (call_data, COND_BOOL);
+  cond->bool.op = BOOL_NOT;
+  return parse_statement (negate_parsetab, cond, section_data, 1, NULL);
+}
+
+static PARSER_TABLE logcon_parsetab[] = {
+  { "End", parse_end },
+  MATCH_CONDITIONS (NULL, 0),
+  { NULL }
+};
+
+static int
+parse_cond (int op, SERVICE_COND *cond, void *section_data)
+{
+  SERVICE_COND *subcond = service_cond_append (cond, COND_BOOL);
+  struct locus_range range;
+
+  subcond->bool.op = op;
+  return parser_loop (logcon_parsetab, subcond, section_data, &range);
+}
+
+static int parse_else (void *call_data, void *section_data);
+static int parse_rewrite (void *call_data, void *section_data);
+static int parse_set_header (void *call_data, void *section_data);
+static int parse_delete_header (void *call_data, void *section_data);
+static int parse_set_url (void *call_data, void *section_data);
+static int parse_set_path (void *call_data, void *section_data);
+static int parse_set_query (void *call_data, void *section_data);
+static int parse_set_query_param (void *call_data, void *section_data);
+static int parse_sub_rewrite (void *call_data, void *section_data);
+
+#define REWRITE_OPS(data, off)						\
+  { "SetHeader", parse_set_header, data, off },				\
+  { "DeleteHeader", parse_delete_header, data, off },			\
+  { "SetURL", parse_set_url, data, off },				\
+  { "SetPath", parse_set_path, data, off },				\
+  { "SetQuery", parse_set_query, data, off },				\
+  { "SetQueryParam", parse_set_query_param, data, off }
+
+static PARSER_TABLE rewrite_rule_parsetab[] = {
+  { "End", parse_end },
+  { "Rewrite", parse_sub_rewrite, NULL, offsetof (REWRITE_RULE, ophead) },
+  { "Else", parse_else, NULL, offsetof (REWRITE_RULE, iffalse) },
+  MATCH_CONDITIONS (NULL, offsetof (REWRITE_RULE, cond)),
+  REWRITE_OPS (NULL, offsetof (REWRITE_RULE, ophead)),
+  { NULL }
+};
+
+static int
+parse_end_else (void *call_data, void *section_data)
+{
+  struct token nl = { '\n' };
+  putback_tkn (NULL);
+  putback_tkn (&nl);
+  return PARSER_END;
+}
+
+static PARSER_TABLE else_rule_parsetab[] = {
+  { "End", parse_end_else },
+  { "Rewrite", parse_sub_rewrite, NULL, offsetof (REWRITE_RULE, ophead) },
+  { "Else", parse_else, NULL, offsetof (REWRITE_RULE, iffalse) },
+  MATCH_CONDITIONS (NULL, offsetof (REWRITE_RULE, cond)),
+  REWRITE_OPS (NULL, offsetof (REWRITE_RULE, ophead)),
+  { NULL }
+};
+
+static REWRITE_OP *
+rewrite_op_alloc (REWRITE_OP_HEAD *head, enum rewrite_type type)
+{
+  REWRITE_OP *op;
+
+  XZALLOC (op);
+  op->type = type;
+  SLIST_PUSH (head, op, next);
+
+  return op;
 }
 
 static int
@@ -3297,10 +3762,13 @@ parse_balancer (void *call_data, void *section_data)
   return PARSER_OK;
 }
 
+/*
+ * Parse a list of HTTP status classes.  Store in *RESULT the
+ * corresponding bitmask.
+ */
 static int
-parse_log_suppress (void *call_data, void *section_data)
+parse_status_classes (int *result_ptr)
 {
-  int *result_ptr = call_data;
   struct token *tok;
   int n;
   int result = 0;
@@ -3356,6 +3824,43 @@ parse_log_suppress (void *call_data, void *section_data)
   return PARSER_OK;
 }
 
+static int
+parse_log_suppress (void *call_data, void *section_data)
+{
+  return parse_status_classes (call_data);
+}
+
+/*
+ * Parse LogSample statement:
+ *   LogSample PERCENT CLASS...
+ */
+static int
+parse_log_sample (void *call_data, void *section_data)
+{
+  struct log_sample *ls = call_data;
+  struct token *tok;
+  double d;
+  char *p;
+  int mask, i;
+
+  if ((tok = gettkn_expect_mask (T_UNQ)) == NULL)
+    return PARSER_FAIL;
+  errno = 0;
+  d = strtod (tok->str, &p);
+  if (errno || *p || d < 0 || d > 100)
+    {
+      conf_error ("%s", "expected percentage (0 to 100)");
+      return PARSER_FAIL;
+    }
+  if (parse_status_classes (&mask))
+    return PARSER_FAIL;
+  for (i = 0; i < LOG_SAMPLE_CLASSES; i++)
+    if (mask & (1 << i))
+      ls->rate[i] = d * (LOG_SAMPLE_SCALE / 100);
+  ls->mask |= mask;
+  return PARSER_OK;
+}
+
 static PARSER_TABLE service_parsetab[] = {
   { "End", parse_end },
 
@@ -3378,10 +3883,13 @@ static PARSER_TABLE service_parsetab[] = {
   { "Emergency", parse_emergency, NULL, offsetof (SERVICE, emergency) },
   { "Metrics", parse_metrics, NULL, offsetof (SERVICE, backends) },
   { "Session", parse_session },
+  { "RateLimit", parse_rate_limit, NULL, offsetof (SERVICE, rate_limit) },
+  { "ConcurrencyLimit", parse_conc_limit, NULL, offsetof (SERVICE, conc_limit) },
   { "Balancer", parse_balancer, NULL, offsetof (SERVICE, balancer) },
   { "ForwardedHeader", assign_string, NULL, offsetof (SERVICE, forwarded_header) },
   { "TrustedIP", assign_acl, NULL, offsetof (SERVICE, trusted_ips) },
   { "LogSuppress", parse_log_suppress, NULL, offsetof (SERVICE, log_suppress_mask) },
+  { "LogSample", parse_log_sample, NULL, offsetof (SERVICE, log_sample) },
   { NULL }
 };
 
@@ -3844,6 +4352,88 @@ parse_log_level (void *call_data, void *section_data)
   return PARSER_OK;
 }
 
+static PARSER_TABLE log_file_parsetab[] = {
+  { "End", parse_end },
+  { "Path", assign_string, NULL, offsetof (LOG_FILE, name) },
+  { "MaxSize", assign_CONTENT_LENGTH, NULL, offsetof (LOG_FILE, max_size) },
+  { "RotateInterval", assign_timeout, NULL, offsetof (LOG_FILE, interval) },
+  { "Keep", assign_unsigned, NULL, offsetof (LOG_FILE, keep) },
+  { NULL }
+};
+
+/*
+ * Parse LogFile statement:
+ *   LogFile "path"
+ * or
+ *   LogFile
+ *     Path "path"
+ *     MaxSize N
+ *     RotateInterval SEC
+ *     Keep N
+ *   End
+ */
+static int
+parse_log_file (void *call_data, void *section_data)
+{
+  LOG_FILE **plf = call_data, *lf, tmp;
+  struct token *tok;
+  struct locus_range range;
+  char *name;
+
+  if (*plf)
+    {
+      conf_error ("%s", "LogFile already defined");
+      return PARSER_FAIL;
+    }
+
+  if ((tok = gettkn_any ()) == NULL)
+    return PARSER_FAIL;
+
+  if (tok->type == T_STRING)
+    {
+      name = include_pathname (tok->str);
+      if ((lf = log_file_lookup (name)) == NULL)
+	lf = log_file_new (name);
+      free (name);
+      *plf = lf;
+      return PARSER_OK;
+    }
+  else if (tok->type != '\n')
+    {
+      conf_error ("expected file name or section, but found %s",
+		  token_type_str (tok->type));
+      return PARSER_FAIL;
+    }
+
+  putback_tkn (tok);
+  memset (&tmp, 0, sizeof (tmp));
+  tmp.keep = DEFAULT_LOG_FILE_KEEP;
+  if (parser_loop (log_file_parsetab, &tmp, section_data, &range))
+    return PARSER_FAIL;
+  if (tmp.name == NULL)
+    {
+      conf_error_at_locus_range (&range, "%s", "LogFile: Path not specified");
+      return PARSER_FAIL;
+    }
+  name = include_pathname (tmp.name);
+  free (tmp.name);
+  tmp.name = name;
+  if (log_file_lookup (tmp.name))
+    {
+      conf_error_at_locus_range (&range, "LogFile %s already defined",
+				 tmp.name);
+      free (tmp.name);
+      return PARSER_FAIL;
+    }
+  lf = log_file_new (tmp.name);
+  lf->max_size = tmp.max_size;
+  lf->interval = tmp.interval;
+  lf->keep = tmp.keep;
+  free (tmp.name);
+  *plf = lf;
+  return PARSER_OK;
+}
+
 static int
 parse_log_format (void *call_data, void *section_data)
 {
@@ -3938,6 +4528,9 @@ static PARSER_TABLE http_parsetab[] = {
   { "SocketFrom", listener_parse_socket_from },
   { "xHTTP", listener_parse_xhttp, NULL, offsetof (LISTENER, verb) },
   { "Client", assign_timeout, NULL, offsetof (LISTENER, to) },
+  { "HeaderTimeout", assign_timeout, NULL, offsetof (LISTENER, header_to) },
+  { "BodyMinRate", assign_unsigned, NULL, offsetof (LISTENER, body_min_rate) },
+  { "KeepAliveTimeout", assign_timeout, NULL, offsetof (LISTENER, keepalive_to) },
   { "CheckURL", listener_parse_checkurl },
   { "Err400", assign_string_from_file, NULL, offsetof (LISTENER, http_err[HTTP_STATUS_BAD_REQUEST]) },
   { "Err401", assign_string_from_file, NULL, offsetof (LISTENER, http_err[HTTP_STATUS_UNAUTHORIZED]) },
@@ -3945,6 +4538,7 @@ static PARSER_TABLE http_parsetab[] = {
   { "Err404", assign_string_from_file, NULL, offsetof (LISTENER, http_err[HTTP_STATUS_NOT_FOUND]) },
   { "Err413", assign_string_from_file, NULL, offsetof (LISTENER, http_err[HTTP_STATUS_PAYLOAD_TOO_LARGE]) },
   { "Err414", assign_string_from_file, NULL, offsetof (LISTENER, http_err[HTTP_STATUS_URI_TOO_LONG]) },
+  { "Err429", assign_string_from_file, NULL, offsetof (LISTENER, http_err[HTTP_STATUS_TOO_MANY_REQUESTS]) },
   { "Err500", assign_string_from_file, NULL, offsetof (LISTENER, http_err[HTTP_STATUS_INTERNAL_SERVER_ERROR]) },
   { "Err501", assign_string_from_file, NULL, offsetof (LISTENER, http_err[HTTP_STATUS_NOT_IMPLEMENTED]) },
   { "Err503", assign_string_from_file, NULL, offsetof (LISTENER, http_err[HTTP_STATUS_SERVICE_UNAVAILABLE]) },
@@ -3969,7 +4563,15 @@ static PARSER_TABLE http_parsetab[] = {
   { "RewriteLocation", parse_rewritelocation, NULL, offsetof (LISTENER, rewr_loc) },
   { "RewriteDestination", assign_bool, NULL, offsetof (LISTENER, rewr_dest) },
   { "LogLevel", parse_log_level, NULL, offsetof (LISTENER, log_level) },
+  { "LogFile", parse_log_file, NULL, offsetof (LISTENER, log_file) },
+  { "LogSample", parse_log_sample, NULL, offsetof (LISTENER, log_sample) },
   { "Service", parse_service, NULL, offsetof (LISTENER, services) },
+  { "RouteCache", assign_unsigned, NULL, offsetof (LISTENER, route_cache_size) },
+  { "RateLimit", parse_rate_limit, NULL, offsetof (LISTENER, rate_limit) },
+  { "MaxConnectionsPerIP", assign_unsigned, NULL, offsetof (LISTENER, max_conn_per_ip) },
+  { "MaxConnectionsIPv6Prefix", assign_unsigned, NULL, offsetof (LISTENER, max_conn_ipv6_prefix) },
+  { "Priority", assign_prio, NULL, offsetof (LISTENER, prio) },
+  { "PriorityClient", parse_prio_client, NULL, offsetof (LISTENER, prio_acls) },
   { "ACME", parse_acme, NULL, offsetof (LISTENER, services) },
   { "ForwardedHeader", assign_string, NULL, offsetof (LISTENER, forwarded_header) },
   { "TrustedIP", assign_acl, NULL, offsetof (LISTENER, trusted_ips) },
@@ -3990,10 +4592,16 @@ listener_alloc (POUND_DEFAULTS *dfl)
   lst->log_level = dfl->log_level;
   lst->verb = 0;
   lst->header_options = dfl->header_options;
+  lst->max_conn_ipv6_prefix = DEFAULT_CONN_IPV6_PREFIX;
+  lst->prio = PRIO_NORMAL;
+  SLIST_INIT (&lst->prio_acls);
   SLIST_INIT (&lst->rewrite[REWRITE_REQUEST]);
   SLIST_INIT (&lst->rewrite[REWRITE_RESPONSE]);
   SLIST_INIT (&lst->services);
   SLIST_INIT (&lst->ctx_head);
+  pthread_rwlock_init (&lst->ctx_lock, NULL);
+  pthread_mutex_init (&lst->tmo_mutex, NULL);
+  SLIST_INIT (&lst->cert_sources);
   return lst;
 }
 
@@ -4009,6 +4617,24 @@ find_listener_ident (LISTENER_HEAD *list_head, char const *name)
   return 0;
 }
 
+/*
+ * Set up the per-client connection limit of listener LST, if requested.
+ */
+static int
+listener_conn_limit_init (LISTENER *lst, struct locus_range *range)
+{
+  if (lst->max_conn_ipv6_prefix > 128)
+    {
+      conf_error_at_locus_range (range, "%s",
+				 "MaxConnectionsIPv6Prefix out of range");
+      return PARSER_FAIL;
+    }
+  if (lst->max_conn_per_ip)
+    lst->conn_table = conn_table_new (lst->max_conn_per_ip,
+				      lst->max_conn_ipv6_prefix);
+  return PARSER_OK;
+}
+
 static int
 parse_listen_http (void *call_data, void *section_data)
 {
@@ -4041,6 +4667,9 @@ parse_listen_http (void *call_data, void *section_data)
   if (check_addrinfo (&lst->addr, &range, "ListenHTTP") != PARSER_OK)
     return PARSER_FAIL;
 
+  if (listener_conn_limit_init (lst, &range) != PARSER_OK)
+    return PARSER_FAIL;
+
   lst->locus = format_locus_str (&range);
 
   SLIST_PUSH (list_head, lst, next);
@@ -4094,8 +4723,33 @@ get_subjectaltnames (X509 *x509, POUND_CTX *pc, size_t san_max)
     pc->subjectAltNames = result;
 }
 
+static void
+pound_ctx_free (POUND_CTX *pc)
+{
+  size_t i;
+
+  SSL_CTX_free (pc->ctx);
+  free (pc->server_name);
+  for (i = 0; i < pc->subjectAltNameCount; i++)
+    free (pc->subjectAltNames[i]);
+  free (pc->subjectAltNames);
+  free (pc->ocsp_file);
+  free (pc);
+}
+
+static void
+pound_ctx_list_free (POUND_CTX_HEAD *head)
+{
+  while (!SLIST_EMPTY (head))
+    {
+      POUND_CTX *pc = SLIST_FIRST (head);
+      SLIST_SHIFT (head, next);
+      pound_ctx_free (pc);
+    }
+}
+
 static int
-load_cert (char const *filename, LISTENER *lst)
+load_cert (char const *filename, POUND_CTX_HEAD *head)
 {
   POUND_CTX *pc;
 
@@ -4104,24 +4758,24 @@ load_cert (char const *filename, LISTENER *lst)
   if ((pc->ctx = SSL_CTX_new (SSLv23_server_method ())) == NULL)
     {
       conf_openssl_error (NULL, "SSL_CTX_new");
-      return PARSER_FAIL;
+      goto err;
     }
 
   if (SSL_CTX_use_certificate_chain_file (pc->ctx, filename) != 1)
     {
       conf_openssl_error (filename, "SSL_CTX_use_certificate_chain_file");
-      return PARSER_FAIL;
+      goto err;
     }
   if (SSL_CTX_use_PrivateKey_file (pc->ctx, filename, SSL_FILETYPE_PEM) != 1)
     {
       conf_openssl_error (filename, "SSL_CTX_use_PrivateKey_file");
-      return PARSER_FAIL;
+      goto err;
     }
 
   if (SSL_CTX_check_private_key (pc->ctx) != 1)
     {
       conf_openssl_error (filename, "SSL_CTX_check_private_key");
-      return PARSER_FAIL;
+      goto err;
     }
 
 #ifdef SSL_CTRL_SET_TLSEXT_SERVERNAME_CB
@@ -4137,7 +4791,7 @@ load_cert (char const *filename, LISTENER *lst)
       {
 	conf_error ("%s: could not open certificate file: %s", filename,
 		    strerror (errno));
-	return PARSER_FAIL;
+	goto err;
       }
 
     x509 = PEM_read_X509 (fcert, NULL, NULL, NULL);
@@ -4146,7 +4800,7 @@ load_cert (char const *filename, LISTENER *lst)
     if (!x509)
       {
 	conf_error ("%s: could not get certificate subject", filename);
-	return PARSER_FAIL;
+	goto err;
       }
 
     pc->subjectAltNameCount = 0;
@@ -4160,10 +4814,12 @@ load_cert (char const *filename, LISTENER *lst)
       {
 	X509_NAME_ENTRY *entry = X509_NAME_get_entry (xname, i);
 	ASN1_STRING *value;
-	char *str = NULL;
+	unsigned char *utf8 = NULL;
 	value = X509_NAME_ENTRY_get_data (entry);
-	if (ASN1_STRING_to_UTF8 ((unsigned char **)&str, value) >= 0)
+	if (ASN1_STRING_to_UTF8 (&utf8, value) >= 0)
 	  {
+	    char *str = xstrdup ((char*) utf8);
+	    OPENSSL_free (utf8);
 	    if (pc->server_name == NULL)
 	      pc->server_name = str;
 	    else
@@ -4183,42 +4839,42 @@ load_cert (char const *filename, LISTENER *lst)
     if (pc->server_name == NULL)
       {
 	conf_error ("%s: no CN in certificate subject name", filename);
-	return PARSER_FAIL;
+	goto err;
       }
   }
 #else
   if (res->ctx)
     conf_error ("%s: multiple certificates not supported", filename);
 #endif
-  SLIST_PUSH (&lst->ctx_head, pc, next);
+  SLIST_PUSH (head, pc, next);
 
   return PARSER_OK;
+
+ err:
+  pound_ctx_free (pc);
+  return PARSER_FAIL;
 }
 
+/*
+ * Load certificates from PATH, which is either a certificate file or a
+ * directory containing such files.  Append them to HEAD.  Set *IS_DIR
+ * to 1 if PATH is a directory and to 0 otherwise.
+ */
 static int
-https_parse_cert (void *call_data, void *section_data)
+load_cert_source (char const *path, POUND_CTX_HEAD *head, int *is_dir)
 {
-  LISTENER *lst = call_data;
-  struct token *tok;
   struct stat st;
 
-  if (lst->has_other)
+  if (stat (path, &st))
     {
-      conf_error ("%s", "Cert directives MUST precede other SSL-specific directives");
+      conf_error ("%s: stat error: %s", path, strerror (errno));
       return PARSER_FAIL;
     }
 
-  if ((tok = gettkn_expect (T_STRING)) == NULL)
-    return PARSER_FAIL;
-
-  if (stat (tok->str, &st))
-    {
-      conf_error ("%s: stat error: %s", tok->str, strerror (errno));
-      return PARSER_FAIL;
-    }
+  *is_dir = S_ISDIR (st.st_mode);
 
   if (S_ISREG (st.st_mode))
-    return load_cert (tok->str, lst);
+    return load_cert (path, head);
 
   if (S_ISDIR (st.st_mode))
     {
@@ -4228,19 +4884,19 @@ https_parse_cert (void *call_data, void *section_data)
       size_t dirlen;
       int rc = PARSER_OK;
 
-      dirlen = strlen (tok->str);
-      while (dirlen > 0 && tok->str[dirlen-1] == '/')
+      dirlen = strlen (path);
+      while (dirlen > 0 && path[dirlen-1] == '/')
 	dirlen--;
 
       xstringbuf_init (&namebuf);
-      stringbuf_add (&namebuf, tok->str, dirlen);
+      stringbuf_add (&namebuf, path, dirlen);
       stringbuf_add_char (&namebuf, '/');
       dirlen++;
 
-      dp = opendir (tok->str);
+      dp = opendir (path);
       if (dp == NULL)
 	{
-	  conf_error ("%s: error opening directory: %s", tok->str,
+	  conf_error ("%s: error opening directory: %s", path,
 		      strerror (errno));
 	  stringbuf_free (&namebuf);
 	  return PARSER_FAIL;
@@ -4261,7 +4917,7 @@ https_parse_cert (void *call_data, void *section_data)
 	    }
 	  else if (S_ISREG (st.st_mode))
 	    {
-	      if ((rc = load_cert (filename, lst)) != PARSER_OK)
+	      if ((rc = load_cert (filename, head)) != PARSER_OK)
 		break;
 	    }
 	  else
@@ -4273,10 +4929,36 @@ https_parse_cert (void *call_data, void *section_data)
       return rc;
     }
 
-  conf_error ("%s: not a regular file or directory", tok->str);
+  conf_error ("%s: not a regular file or directory", path);
   return PARSER_FAIL;
 }
 
+static int
+https_parse_cert (void *call_data, void *section_data)
+{
+  LISTENER *lst = call_data;
+  struct token *tok;
+  CERT_SOURCE *src;
+
+  if (lst->has_other)
+    {
+      conf_error ("%s", "Cert directives MUST precede other SSL-specific directives");
+      return PARSER_FAIL;
+    }
+
+  if ((tok = gettkn_expect (T_STRING)) == NULL)
+    return PARSER_FAIL;
+
+  if (load_cert_source (tok->str, &lst->ctx_head, &lst->cert_dir) != PARSER_OK)
+    return PARSER_FAIL;
+
+  XZALLOC (src);
+  src->path = absolute_pathname (tok->str);
+  SLIST_PUSH (&lst->cert_sources, src, next);
+
+  return PARSER_OK;
+}
+
 static int
 verify_OK (int pre_ok, X509_STORE_CTX * ctx)
 {
@@ -4285,7 +4967,7 @@ verify_OK (int pre_ok, X509_STORE_CTX * ctx)
 
 #ifdef SSL_CTRL_SET_TLSEXT_SERVERNAME_CB
 static int
-SNI_server_name (SSL *ssl, int *dummy, POUND_CTX_HEAD *ctx_head)
+SNI_server_name (SSL *ssl, int *dummy, LISTENER *lst)
 {
   const char *server_name;
   POUND_CTX *pc;
@@ -4295,43 +4977,173 @@ SNI_server_name (SSL *ssl, int *dummy, POUND_CTX_HEAD *ctx_head)
 
   /* logmsg(LOG_DEBUG, "Received SSL SNI Header for servername %s", servername); */
 
-  SSL_set_SSL_CTX (ssl, NULL);
-  SLIST_FOREACH (pc, ctx_head, next)
+  pthread_rwlock_rdlock (&lst->ctx_lock);
+  SLIST_FOREACH (pc, &lst->ctx_head, next)
     {
       if (fnmatch (pc->server_name, server_name, 0) == 0)
+	break;
+      else if (pc->subjectAltNameCount > 0 && pc->subjectAltNames != NULL)
 	{
-	  /* logmsg(LOG_DEBUG, "Found cert for %s", servername); */
-	  SSL_set_SSL_CTX (ssl, pc->ctx);
-	  return SSL_TLSEXT_ERR_OK;
+	  int i;
+
+	  for (i = 0; i < pc->subjectAltNameCount; i++)
+	    {
+	      if (fnmatch ((char *) pc->subjectAltNames[i], server_name, 0) ==
+		  0)
+		break;
+	    }
+	  if (i < pc->subjectAltNameCount)
+	    break;
+	}
+    }
+
+  if (pc)
+    /* logmsg(LOG_DEBUG, "Found cert for %s", servername); */
+    SSL_set_SSL_CTX (ssl, pc->ctx);
+  else
+    /* logmsg(LOG_DEBUG, "No match for %s, default used", server_name); */
+    SSL_set_SSL_CTX (ssl, SLIST_FIRST (&lst->ctx_head)->ctx);
+  pthread_rwlock_unlock (&lst->ctx_lock);
+  return SSL_TLSEXT_ERR_OK;
+}
+#endif
+
+SSL *
+listener_ssl_new (LISTENER *lstn)
+{
+  SSL *ssl;
+
+  pthread_rwlock_rdlock (&lstn->ctx_lock);
+  ssl = SSL_new (SLIST_FIRST (&lstn->ctx_head)->ctx);
+  pthread_rwlock_unlock (&lstn->ctx_lock);
+  return ssl;
+}
+
+static void
+ctx_set_verify (POUND_CTX_HEAD *head, int clnt_check, int depth)
+{
+  POUND_CTX *pc;
+
+  switch (clnt_check)
+    {
+    case 0:
+      /* don't ask */
+      SLIST_FOREACH (pc, head, next)
+	SSL_CTX_set_verify (pc->ctx, SSL_VERIFY_NONE, NULL);
+      break;
+
+    case 1:
+      /* ask but OK if no client certificate */
+      SLIST_FOREACH (pc, head, next)
+	{
+	  SSL_CTX_set_verify (pc->ctx,
+			      SSL_VERIFY_PEER |
+			      SSL_VERIFY_CLIENT_ONCE, NULL);
+	  SSL_CTX_set_verify_depth (pc->ctx, depth);
+	}
+      break;
+
+    case 2:
+      /* ask and fail if no client certificate */
+      SLIST_FOREACH (pc, head, next)
+	{
+	  SSL_CTX_set_verify (pc->ctx,
+			      SSL_VERIFY_PEER |
+			      SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+	  SSL_CTX_set_verify_depth (pc->ctx, depth);
+	}
+      break;
+
+    case 3:
+      /* ask but do not verify client certificate */
+      SLIST_FOREACH (pc, head, next)
+	{
+	  SSL_CTX_set_verify (pc->ctx,
+			      SSL_VERIFY_PEER |
+			      SSL_VERIFY_CLIENT_ONCE, verify_OK);
+	  SSL_CTX_set_verify_depth (pc->ctx, depth);
+	}
+      break;
+    }
+}
+
+static void
+ctx_set_ciphers (POUND_CTX_HEAD *head, char const *ciphers)
+{
+  POUND_CTX *pc;
+
+  SLIST_FOREACH (pc, head, next)
+    SSL_CTX_set_cipher_list (pc->ctx, ciphers);
+}
+
+static int
+ctx_set_calist (POUND_CTX_HEAD *head, char const *file)
+{
+  STACK_OF (X509_NAME) *cert_names;
+  POUND_CTX *pc;
+
+  if ((cert_names = SSL_load_client_CA_file (file)) == NULL)
+    {
+      conf_openssl_error (NULL, "SSL_load_client_CA_file");
+      return PARSER_FAIL;
+    }
+
+  /* Each context takes ownership of its list. */
+  SLIST_FOREACH (pc, head, next)
+    SSL_CTX_set_client_CA_list (pc->ctx, SSL_dup_CA_list (cert_names));
+  sk_X509_NAME_pop_free (cert_names, X509_NAME_free);
+
+  return PARSER_OK;
+}
+
+static int
+ctx_set_verifylist (POUND_CTX_HEAD *head, char const *file)
+{
+  POUND_CTX *pc;
+
+  SLIST_FOREACH (pc, head, next)
+    if (SSL_CTX_load_verify_locations (pc->ctx, file, NULL) != 1)
+      {
+	conf_openssl_error (NULL, "SSL_CTX_load_verify_locations");
+	return PARSER_FAIL;
+      }
+
+  return PARSER_OK;
+}
+
+static int
+ctx_set_crlist (POUND_CTX_HEAD *head, char const *file)
+{
+  X509_STORE *store;
+  X509_LOOKUP *lookup;
+  POUND_CTX *pc;
+
+  SLIST_FOREACH (pc, head, next)
+    {
+      store = SSL_CTX_get_cert_store (pc->ctx);
+      if ((lookup = X509_STORE_add_lookup (store, X509_LOOKUP_file ())) == NULL)
+	{
+	  conf_openssl_error (NULL, "X509_STORE_add_lookup");
+	  return PARSER_FAIL;
 	}
-      else if (pc->subjectAltNameCount > 0 && pc->subjectAltNames != NULL)
-	{
-	  int i;
 
-	  for (i = 0; i < pc->subjectAltNameCount; i++)
-	    {
-	      if (fnmatch ((char *) pc->subjectAltNames[i], server_name, 0) ==
-		  0)
-		{
-		  SSL_set_SSL_CTX (ssl, pc->ctx);
-		  return SSL_TLSEXT_ERR_OK;
-		}
-	    }
+      if (X509_load_crl_file (lookup, file, X509_FILETYPE_PEM) != 1)
+	{
+	  conf_openssl_error (file, "X509_load_crl_file failed");
+	  return PARSER_FAIL;
 	}
+
+      X509_STORE_set_flags (store, X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
     }
 
-  /* logmsg(LOG_DEBUG, "No match for %s, default used", server_name); */
-  SSL_set_SSL_CTX (ssl, SLIST_FIRST (ctx_head)->ctx);
-  return SSL_TLSEXT_ERR_OK;
+  return PARSER_OK;
 }
-#endif
 
 static int
 https_parse_client_cert (void *call_data, void *section_data)
 {
   LISTENER *lst = call_data;
-  int depth;
-  POUND_CTX *pc;
+  int depth = 0;
 
   if (SLIST_EMPTY (&lst->ctx_head))
     {
@@ -4346,47 +5158,8 @@ https_parse_client_cert (void *call_data, void *section_data)
   if (lst->clnt_check > 0 && assign_int (&depth, NULL) != PARSER_OK)
     return PARSER_FAIL;
 
-  switch (lst->clnt_check)
-    {
-    case 0:
-      /* don't ask */
-      SLIST_FOREACH (pc, &lst->ctx_head, next)
-	SSL_CTX_set_verify (pc->ctx, SSL_VERIFY_NONE, NULL);
-      break;
-
-    case 1:
-      /* ask but OK if no client certificate */
-      SLIST_FOREACH (pc, &lst->ctx_head, next)
-	{
-	  SSL_CTX_set_verify (pc->ctx,
-			      SSL_VERIFY_PEER |
-			      SSL_VERIFY_CLIENT_ONCE, NULL);
-	  SSL_CTX_set_verify_depth (pc->ctx, depth);
-	}
-      break;
-
-    case 2:
-      /* ask and fail if no client certificate */
-      SLIST_FOREACH (pc, &lst->ctx_head, next)
-	{
-	  SSL_CTX_set_verify (pc->ctx,
-			      SSL_VERIFY_PEER |
-			      SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
-	  SSL_CTX_set_verify_depth (pc->ctx, depth);
-	}
-      break;
-
-    case 3:
-      /* ask but do not verify client certificate */
-      SLIST_FOREACH (pc, &lst->ctx_head, next)
-	{
-	  SSL_CTX_set_verify (pc->ctx,
-			      SSL_VERIFY_PEER |
-			      SSL_VERIFY_CLIENT_ONCE, verify_OK);
-	  SSL_CTX_set_verify_depth (pc->ctx, depth);
-	}
-      break;
-    }
+  lst->verify_depth = depth;
+  ctx_set_verify (&lst->ctx_head, lst->clnt_check, depth);
   return PARSER_OK;
 }
 
@@ -4402,7 +5175,6 @@ https_parse_ciphers (void *call_data, void *section_data)
 {
   LISTENER *lst = call_data;
   struct token *tok;
-  POUND_CTX *pc;
 
   if (SLIST_EMPTY (&lst->ctx_head))
     {
@@ -4414,8 +5186,9 @@ https_parse_ciphers (void *call_data, void *section_data)
   if ((tok = gettkn_expect (T_STRING)) == NULL)
     return PARSER_FAIL;
 
-  SLIST_FOREACH (pc, &lst->ctx_head, next)
-    SSL_CTX_set_cipher_list (pc->ctx, tok->str);
+  free (lst->ciphers);
+  lst->ciphers = xstrdup (tok->str);
+  ctx_set_ciphers (&lst->ctx_head, lst->ciphers);
 
   return PARSER_OK;
 }
@@ -4469,9 +5242,7 @@ static int
 https_parse_calist (void *call_data, void *section_data)
 {
   LISTENER *lst = call_data;
-  STACK_OF (X509_NAME) *cert_names;
   struct token *tok;
-  POUND_CTX *pc;
 
   if (SLIST_EMPTY (&lst->ctx_head))
     {
@@ -4483,15 +5254,11 @@ https_parse_calist (void *call_data, void *section_data)
   if ((tok = gettkn_expect (T_STRING)) == NULL)
     return PARSER_FAIL;
 
-  if ((cert_names = SSL_load_client_CA_file (tok->str)) == NULL)
-    {
-      conf_openssl_error (NULL, "SSL_load_client_CA_file");
-      return PARSER_FAIL;
-    }
-
-  SLIST_FOREACH (pc, &lst->ctx_head, next)
-    SSL_CTX_set_client_CA_list (pc->ctx, cert_names);
+  if (ctx_set_calist (&lst->ctx_head, tok->str) != PARSER_OK)
+    return PARSER_FAIL;
 
+  free (lst->calist);
+  lst->calist = absolute_pathname (tok->str);
   return PARSER_OK;
 }
 
@@ -4500,7 +5267,6 @@ https_parse_verifylist (void *call_data, void *section_data)
 {
   LISTENER *lst = call_data;
   struct token *tok;
-  POUND_CTX *pc;
 
   if (SLIST_EMPTY (&lst->ctx_head))
     {
@@ -4512,13 +5278,11 @@ https_parse_verifylist (void *call_data, void *section_data)
   if ((tok = gettkn_expect (T_STRING)) == NULL)
     return PARSER_FAIL;
 
-  SLIST_FOREACH (pc, &lst->ctx_head, next)
-    if (SSL_CTX_load_verify_locations (pc->ctx, tok->str, NULL) != 1)
-      {
-	conf_openssl_error (NULL, "SSL_CTX_load_verify_locations");
-	return PARSER_FAIL;
-      }
+  if (ctx_set_verifylist (&lst->ctx_head, tok->str) != PARSER_OK)
+    return PARSER_FAIL;
 
+  free (lst->verifylist);
+  lst->verifylist = absolute_pathname (tok->str);
   return PARSER_OK;
 }
 
@@ -4527,9 +5291,6 @@ https_parse_crlist (void *call_data, void *section_data)
 {
   LISTENER *lst = call_data;
   struct token *tok;
-  X509_STORE *store;
-  X509_LOOKUP *lookup;
-  POUND_CTX *pc;
 
   if (SLIST_EMPTY (&lst->ctx_head))
     {
@@ -4541,32 +5302,249 @@ https_parse_crlist (void *call_data, void *section_data)
   if ((tok = gettkn_expect (T_STRING)) == NULL)
     return PARSER_FAIL;
 
-  SLIST_FOREACH (pc, &lst->ctx_head, next)
+  if (ctx_set_crlist (&lst->ctx_head, tok->str) != PARSER_OK)
+    return PARSER_FAIL;
+
+  free (lst->crlist);
+  lst->crlist = absolute_pathname (tok->str);
+  return PARSER_OK;
+}
+
+static int
+https_parse_nohttps11 (void *call_data, void *section_data)
+{
+  LISTENER *lst = call_data;
+  return assign_int_range (&lst->noHTTPS11, 0, 2);
+}
+
+static int
+https_parse_ocsp_response (void *call_data, void *section_data)
+{
+  LISTENER *lst = call_data;
+  struct token *tok;
+  POUND_CTX *pc;
+
+  if (SLIST_EMPTY (&lst->ctx_head))
     {
-      store = SSL_CTX_get_cert_store (pc->ctx);
-      if ((lookup = X509_STORE_add_lookup (store, X509_LOOKUP_file ())) == NULL)
+      conf_error ("%s", "OCSPResponse may only be used after Cert");
+      return PARSER_FAIL;
+    }
+  if (lst->cert_dir)
+    {
+      conf_error ("%s", "OCSPResponse can't be used with a certificate directory");
+      return PARSER_FAIL;
+    }
+
+  if ((tok = gettkn_expect (T_STRING)) == NULL)
+    return PARSER_FAIL;
+
+  pc = SLIST_LAST (&lst->ctx_head);
+  if (pc->ocsp_file)
+    {
+      conf_error ("%s", "OCSP response file already set for this certificate");
+      return PARSER_FAIL;
+    }
+  pc->ocsp_file = absolute_pathname (tok->str);
+  SLIST_LAST (&lst->cert_sources)->ocsp_file = xstrdup (pc->ocsp_file);
+
+  return PARSER_OK;
+}
+
+static int
+https_parse_ocsp_responder (void *call_data, void *section_data)
+{
+  LISTENER *lst = call_data;
+  struct token *tok;
+
+  if ((tok = gettkn_expect (T_STRING)) == NULL)
+    return PARSER_FAIL;
+  free (lst->ocsp_url);
+  lst->ocsp_url = xstrdup (tok->str);
+  lst->ocsp_stapling = 1;
+
+  return PARSER_OK;
+}
+
+/*
+ * Finish setting up the SSL contexts in HEAD for use by the listener LST.
+ * RANGE is the location of the listener definition, for error reporting.
+ */
+static int
+listener_ctx_init (LISTENER *lst, POUND_CTX_HEAD *head,
+		   struct locus_range const *range)
+{
+  POUND_CTX *pc;
+
+#ifdef SSL_CTRL_SET_TLSEXT_SERVERNAME_CB
+  if (!SLIST_EMPTY (head))
+    {
+      SSL_CTX *ctx = SLIST_FIRST (head)->ctx;
+      if (!SSL_CTX_set_tlsext_servername_callback (ctx, SNI_server_name)
+	  || !SSL_CTX_set_tlsext_servername_arg (ctx, lst))
 	{
-	  conf_openssl_error (NULL, "X509_STORE_add_lookup");
+	  conf_openssl_error (NULL, "can't set SNI callback");
 	  return PARSER_FAIL;
 	}
+    }
+#endif
+
+  /*
+   * Use the same session id context for all contexts of the listener,
+   * so that sessions survive certificate reloads.
+   */
+  if (lst->sid_ctx == NULL)
+    {
+      struct stringbuf sb;
 
-      if (X509_load_crl_file (lookup, tok->str, X509_FILETYPE_PEM) != 1)
+      xstringbuf_init (&sb);
+      stringbuf_printf (&sb, "%d-Pound-%ld", getpid (), random ());
+      lst->sid_ctx = stringbuf_finish (&sb);
+    }
+
+  SLIST_FOREACH (pc, head, next)
+    {
+      SSL_CTX_set_app_data (pc->ctx, lst);
+      SSL_CTX_set_mode (pc->ctx, SSL_MODE_AUTO_RETRY);
+      SSL_CTX_set_options (pc->ctx, lst->ssl_op_enable);
+      SSL_CTX_clear_options (pc->ctx, lst->ssl_op_disable);
+      SSL_CTX_set_session_id_context (pc->ctx, (unsigned char *) lst->sid_ctx,
+				      strlen (lst->sid_ctx));
+      POUND_SSL_CTX_init (pc->ctx);
+      SSL_CTX_set_info_callback (pc->ctx, SSLINFO_callback);
+      if (lst->early_data)
+	early_data_ctx_init (pc->ctx, lst->early_data);
+      if ((pc->ocsp_file || lst->ocsp_stapling)
+	  && ocsp_stapling_init (pc, lst->ocsp_url, lst->ocsp_timeout))
 	{
-	  conf_openssl_error (tok->str, "X509_load_crl_file failed");
+	  conf_error_at_locus_range (range, "can't enable OCSP stapling");
 	  return PARSER_FAIL;
 	}
+    }
+  return PARSER_OK;
+}
 
-      X509_STORE_set_flags (store, X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
+/*
+ * Return the most recent modification time of the certificate files
+ * and directories of the listener LST.
+ */
+static time_t
+cert_sources_mtime (LISTENER *lst)
+{
+  CERT_SOURCE *src;
+  time_t t = 0;
+
+  SLIST_FOREACH (src, &lst->cert_sources, next)
+    {
+      struct stat st;
+      DIR *dp;
+      struct dirent *ent;
+
+      if (stat (src->path, &st))
+	continue;
+      if (st.st_mtime > t)
+	t = st.st_mtime;
+      if (!S_ISDIR (st.st_mode) || (dp = opendir (src->path)) == NULL)
+	continue;
+      while ((ent = readdir (dp)) != NULL)
+	{
+	  if (fstatat (dirfd (dp), ent->d_name, &st, 0) == 0
+	      && S_ISREG (st.st_mode) && st.st_mtime > t)
+	    t = st.st_mtime;
+	}
+      closedir (dp);
     }
+  return t;
+}
 
-  return PARSER_OK;
+/* Size of session ticket keys: key name, HMAC secret and AES key. */
+#define TICKET_KEYS_SIZE 80
+
+/*
+ * Reload certificates of the HTTPS listener LST.  New contexts are built
+ * from the listener settings and atomically replace the current ones.
+ * Connections in progress keep using the old contexts, which are freed
+ * when the last of them is closed.
+ *
+ * Return 0 on success and -1 on error, in which case the current
+ * contexts remain in use.
+ */
+int
+listener_reload_certs (LISTENER *lst)
+{
+  static pthread_mutex_t reload_mutex = PTHREAD_MUTEX_INITIALIZER;
+  POUND_CTX_HEAD head = SLIST_HEAD_INITIALIZER (head), tmp;
+  CERT_SOURCE *src;
+  time_t mtime;
+  int is_dir;
+  unsigned char keys[TICKET_KEYS_SIZE];
+  int rc = PARSER_FAIL;
+
+  if (SLIST_EMPTY (&lst->cert_sources))
+    return -1;
+
+  pthread_mutex_lock (&reload_mutex);
+  mtime = cert_sources_mtime (lst);
+  SLIST_FOREACH (src, &lst->cert_sources, next)
+    {
+      if (load_cert_source (src->path, &head, &is_dir) != PARSER_OK)
+	goto end;
+      if (src->ocsp_file)
+	SLIST_LAST (&head)->ocsp_file = xstrdup (src->ocsp_file);
+    }
+
+  ctx_set_verify (&head, lst->clnt_check, lst->verify_depth);
+  if (lst->ciphers)
+    ctx_set_ciphers (&head, lst->ciphers);
+  if ((lst->calist && ctx_set_calist (&head, lst->calist) != PARSER_OK)
+      || (lst->verifylist
+	  && ctx_set_verifylist (&head, lst->verifylist) != PARSER_OK)
+      || (lst->crlist && ctx_set_crlist (&head, lst->crlist) != PARSER_OK)
+      || listener_ctx_init (lst, &head, NULL) != PARSER_OK)
+    goto end;
+
+  pthread_rwlock_wrlock (&lst->ctx_lock);
+  /*
+   * Session tickets are protected by the keys of the first context.
+   * Carry them over, so that clients are able to resume their sessions.
+   */
+  if (SSL_CTX_get_tlsext_ticket_keys (SLIST_FIRST (&lst->ctx_head)->ctx,
+				      keys, sizeof (keys)) == 1)
+    SSL_CTX_set_tlsext_ticket_keys (SLIST_FIRST (&head)->ctx,
+				    keys, sizeof (keys));
+  tmp = lst->ctx_head;
+  lst->ctx_head = head;
+  head = tmp;
+  pthread_rwlock_unlock (&lst->ctx_lock);
+  rc = PARSER_OK;
+
+ end:
+  /* Don't retry until the files change again. */
+  lst->cert_mtime = mtime;
+  /* Free the old contexts or, if reload failed, the new ones. */
+  pound_ctx_list_free (&head);
+  pthread_mutex_unlock (&reload_mutex);
+
+  if (rc == PARSER_OK)
+    logmsg (LOG_NOTICE, "%s: certificates reloaded", lst->locus);
+  else
+    logmsg (LOG_ERR, "%s: can't reload certificates", lst->locus);
+  return rc == PARSER_OK ? 0 : -1;
 }
 
-static int
-https_parse_nohttps11 (void *call_data, void *section_data)
+/*
+ * Periodic job: reload certificates of the listener passed in DATA,
+ * if any of its certificate files has changed.
+ */
+static void
+listener_cert_watch (void *data)
 {
-  LISTENER *lst = call_data;
-  return assign_int_range (&lst->noHTTPS11, 0, 2);
+  LISTENER *lst = data;
+
+  job_unlock ();
+  if (cert_sources_mtime (lst) != lst->cert_mtime)
+    listener_reload_certs (lst);
+  job_lock ();
+  job_enqueue_after_unlocked (lst->cert_watch, listener_cert_watch, lst);
 }
 
 static PARSER_TABLE https_parsetab[] = {
@@ -4576,6 +5554,9 @@ static PARSER_TABLE https_parsetab[] = {
   { "SocketFrom", listener_parse_socket_from },
   { "xHTTP", listener_parse_xhttp, NULL, offsetof (LISTENER, verb) },
   { "Client", assign_timeout, NULL, offsetof (LISTENER, to) },
+  { "HeaderTimeout", assign_timeout, NULL, offsetof (LISTENER, header_to) },
+  { "BodyMinRate", assign_unsigned, NULL, offsetof (LISTENER, body_min_rate) },
+  { "KeepAliveTimeout", assign_timeout, NULL, offsetof (LISTENER, keepalive_to) },
   { "CheckURL", listener_parse_checkurl },
   { "Err400", assign_string_from_file, NULL, offsetof (LISTENER, http_err[HTTP_STATUS_BAD_REQUEST]) },
   { "Err401", assign_string_from_file, NULL, offsetof (LISTENER, http_err[HTTP_STATUS_UNAUTHORIZED]) },
@@ -4583,6 +5564,8 @@ static PARSER_TABLE https_parsetab[] = {
   { "Err404", assign_string_from_file, NULL, offsetof (LISTENER, http_err[HTTP_STATUS_NOT_FOUND]) },
   { "Err413", assign_string_from_file, NULL, offsetof (LISTENER, http_err[HTTP_STATUS_PAYLOAD_TOO_LARGE]) },
   { "Err414", assign_string_from_file, NULL, offsetof (LISTENER, http_err[HTTP_STATUS_URI_TOO_LONG]) },
+  { "Err425", assign_string_from_file, NULL, offsetof (LISTENER, http_err[HTTP_STATUS_TOO_EARLY]) },
+  { "Err429", assign_string_from_file, NULL, offsetof (LISTENER, http_err[HTTP_STATUS_TOO_MANY_REQUESTS]) },
   { "Err500", assign_string_from_file, NULL, offsetof (LISTENER, http_err[HTTP_STATUS_INTERNAL_SERVER_ERROR]) },
   { "Err501", assign_string_from_file, NULL, offsetof (LISTENER, http_err[HTTP_STATUS_NOT_IMPLEMENTED]) },
   { "Err503", assign_string_from_file, NULL, offsetof (LISTENER, http_err[HTTP_STATUS_SERVICE_UNAVAILABLE]) },
@@ -4607,9 +5590,17 @@ static PARSER_TABLE https_parsetab[] = {
   { "RewriteLocation", parse_rewritelocation, NULL, offsetof (LISTENER, rewr_loc) },
   { "RewriteDestination", assign_bool, NULL, offsetof (LISTENER, rewr_dest) },
   { "LogLevel", parse_log_level, NULL, offsetof (LISTENER, log_level) },
+  { "LogFile", parse_log_file, NULL, offsetof (LISTENER, log_file) },
+  { "LogSample", parse_log_sample, NULL, offsetof (LISTENER, log_sample) },
   { "ForwardedHeader", assign_string, NULL, offsetof (LISTENER, forwarded_header) },
   { "TrustedIP", assign_acl, NULL, offsetof (LISTENER, trusted_ips) },
   { "Service", parse_service, NULL, offsetof (LISTENER, services) },
+  { "RouteCache", assign_unsigned, NULL, offsetof (LISTENER, route_cache_size) },
+  { "RateLimit", parse_rate_limit, NULL, offsetof (LISTENER, rate_limit) },
+  { "MaxConnectionsPerIP", assign_unsigned, NULL, offsetof (LISTENER, max_conn_per_ip) },
+  { "MaxConnectionsIPv6Prefix", assign_unsigned, NULL, offsetof (LISTENER, max_conn_ipv6_prefix) },
+  { "Priority", assign_prio, NULL, offsetof (LISTENER, prio) },
+  { "PriorityClient", parse_prio_client, NULL, offsetof (LISTENER, prio_acls) },
   { "Cert", https_parse_cert },
   { "ClientCert", https_parse_client_cert },
   { "Disable", https_parse_disable },
@@ -4620,6 +5611,12 @@ static PARSER_TABLE https_parsetab[] = {
   { "VerifyList", https_parse_verifylist },
   { "CRLlist", https_parse_crlist },
   { "NoHTTPS11", https_parse_nohttps11 },
+  { "OCSPStapling", assign_bool, NULL, offsetof (LISTENER, ocsp_stapling) },
+  { "OCSPResponder", https_parse_ocsp_responder },
+  { "OCSPResponse", https_parse_ocsp_response },
+  { "OCSPTimeout", assign_timeout, NULL, offsetof (LISTENER, ocsp_timeout) },
+  { "CertWatch", assign_timeout, NULL, offsetof (LISTENER, cert_watch) },
+  { "EarlyData", assign_unsigned, NULL, offsetof (LISTENER, early_data) },
   { NULL }
 };
 
@@ -4630,8 +5627,6 @@ parse_listen_https (void *call_data, void *section_data)
   LISTENER_HEAD *list_head = call_data;
   POUND_DEFAULTS *dfl = section_data;
   struct locus_range range;
-  POUND_CTX *pc;
-  struct stringbuf sb;
   struct token *tok;
 
   if ((lst = listener_alloc (dfl)) == NULL)
@@ -4658,6 +5653,7 @@ parse_listen_https (void *call_data, void *section_data)
   lst->ssl_op_disable =
     SSL_OP_ALLOW_UNSAFE_LEGACY_RENEGOTIATION | SSL_OP_LEGACY_SERVER_CONNECT |
     SSL_OP_DONT_INSERT_EMPTY_FRAGMENTS;
+  lst->ocsp_timeout = OCSP_DEFAULT_TIMEOUT;
 
   if (parser_loop (https_parsetab, lst, section_data, &range))
     return PARSER_FAIL;
@@ -4665,6 +5661,9 @@ parse_listen_https (void *call_data, void *section_data)
   if (check_addrinfo (&lst->addr, &range, "ListenHTTPS") != PARSER_OK)
     return PARSER_FAIL;
 
+  if (listener_conn_limit_init (lst, &range) != PARSER_OK)
+    return PARSER_FAIL;
+
   lst->locus = format_locus_str (&range);
 
   if (SLIST_EMPTY (&lst->ctx_head))
@@ -4673,34 +5672,21 @@ parse_listen_https (void *call_data, void *section_data)
       return PARSER_FAIL;
     }
 
-#ifdef SSL_CTRL_SET_TLSEXT_SERVERNAME_CB
-  if (!SLIST_EMPTY (&lst->ctx_head))
+  if (lst->early_data && lst->clnt_check)
     {
-      SSL_CTX *ctx = SLIST_FIRST (&lst->ctx_head)->ctx;
-      if (!SSL_CTX_set_tlsext_servername_callback (ctx, SNI_server_name)
-	  || !SSL_CTX_set_tlsext_servername_arg (ctx, &lst->ctx_head))
-	{
-	  conf_openssl_error (NULL, "can't set SNI callback");
-	  return PARSER_FAIL;
-	}
+      conf_error_at_locus_range (&range,
+				 "EarlyData can't be used with ClientCert");
+      return PARSER_FAIL;
     }
-#endif
 
-  xstringbuf_init (&sb);
-  SLIST_FOREACH (pc, &lst->ctx_head, next)
+  if (listener_ctx_init (lst, &lst->ctx_head, &range) != PARSER_OK)
+    return PARSER_FAIL;
+
+  if (lst->cert_watch)
     {
-      SSL_CTX_set_app_data (pc->ctx, lst);
-      SSL_CTX_set_mode (pc->ctx, SSL_MODE_AUTO_RETRY);
-      SSL_CTX_set_options (pc->ctx, lst->ssl_op_enable);
-      SSL_CTX_clear_options (pc->ctx, lst->ssl_op_disable);
-      stringbuf_reset (&sb);
-      stringbuf_printf (&sb, "%d-Pound-%ld", getpid (), random ());
-      SSL_CTX_set_session_id_context (pc->ctx, (unsigned char *) sb.base,
-				      sb.len);
-      POUND_SSL_CTX_init (pc->ctx);
-      SSL_CTX_set_info_callback (pc->ctx, SSLINFO_callback);
+      lst->cert_mtime = cert_sources_mtime (lst);
+      job_enqueue_after (lst->cert_watch, listener_cert_watch, lst);
     }
-  stringbuf_free (&sb);
 
   SLIST_PUSH (list_head, lst, next);
   return PARSER_OK;
@@ -4807,6 +5793,7 @@ parse_control (void *call_data, void *section_data)
     return PARSER_FAIL;
 
   lst->verb = 1; /* Need PUT and DELETE methods */
+  lst->prio = PRIO_HIGH; /* Management requests must not wait */
   lst->locus = format_locus_str (&range);
   /* Register listener in the global listener list */
   SLIST_PUSH (&listeners, lst, next);
@@ -4924,6 +5911,92 @@ parse_combine_headers (void *call_data, void *section_data)
     }
   return PARSER_OK;
 }
+
+static PARSER_TABLE trace_parsetab[] = {
+  { "End", parse_end },
+  { "SampleRate", assign_unsigned, NULL, offsetof (TRACE_CONF, sample_rate) },
+  { "File", assign_string, NULL, offsetof (TRACE_CONF, file) },
+  { "Address", assign_address, NULL, offsetof (TRACE_CONF, addr) },
+  { "Port", assign_port, NULL, offsetof (TRACE_CONF, addr) },
+  { "ServiceName", assign_string, NULL, offsetof (TRACE_CONF, service_name) },
+  { "QueueSize", assign_unsigned, NULL, offsetof (TRACE_CONF, queue_size) },
+  { NULL }
+};
+
+/*
+ * Parse the Trace section:
+ *   Trace
+ *     SampleRate PERCENT
+ *     File "path"
+ *     Address "addr"
+ *     Port N
+ *     ServiceName "name"
+ *     QueueSize N
+ *   End
+ */
+static int
+parse_trace (void *call_data, void *section_data)
+{
+  TRACE_CONF *tc = call_data;
+  struct locus_range range;
+
+  if (tc->enabled)
+    {
+      conf_error ("%s", "Trace already defined");
+      return PARSER_FAIL;
+    }
+
+  tc->sample_rate = DEFAULT_TRACE_SAMPLE_RATE;
+  tc->queue_size = DEFAULT_TRACE_QUEUE_SIZE;
+  if (parser_loop (trace_parsetab, tc, section_data, &range))
+    return PARSER_FAIL;
+
+  if (tc->sample_rate > 100)
+    {
+      conf_error_at_locus_range (&range, "%s",
+				 "Trace: SampleRate must be between 0 and 100");
+      return PARSER_FAIL;
+    }
+
+  if (tc->file)
+    {
+      char *name;
+
+      if (ADDRINFO_HAS_ADDRESS (&tc->addr))
+	{
+	  conf_error_at_locus_range (&range, "%s",
+				     "Trace: File and Address are mutually exclusive");
+	  return PARSER_FAIL;
+	}
+      /* The file is reopened at run time: store its absolute name. */
+      name = include_pathname (tc->file);
+      free (tc->file);
+      tc->file = name;
+    }
+  else if (!ADDRINFO_HAS_ADDRESS (&tc->addr))
+    {
+      conf_error_at_locus_range (&range, "%s",
+				 "Trace: either File or Address must be given");
+      return PARSER_FAIL;
+    }
+  else if (tc->addr.ai_family != AF_UNIX && !ADDRINFO_HAS_PORT (&tc->addr))
+    {
+      conf_error_at_locus_range (&range, "%s", "Trace: Port is missing");
+      return PARSER_FAIL;
+    }
+
+  if (tc->queue_size == 0)
+    {
+      conf_error_at_locus_range (&range, "%s",
+				 "Trace: QueueSize must be positive");
+      return PARSER_FAIL;
+    }
+
+  if (!tc->service_name)
+    tc->service_name = xstrdup (DEFAULT_TRACE_SERVICE_NAME);
+  tc->enabled = 1;
+  return PARSER_OK;
+}
 
 static PARSER_TABLE top_level_parsetab[] = {
   { "IncludeDir", parse_includedir },
@@ -4936,10 +6009,18 @@ static PARSER_TABLE top_level_parsetab[] = {
   { "WorkerMaxCount", assign_unsigned, &worker_max_count },
   { "Threads", parse_threads_compat },
   { "WorkerIdleTimeout", assign_timeout, &worker_idle_timeout },
+  { "PriorityWeight", parse_prio_weight },
+  { "HandshakeThreads", assign_unsigned, &handshake_threads },
   { "Grace", assign_timeout, &grace },
+  { "BasicAuthCheck", assign_timeout, &basic_auth_check },
+  { "BasicAuthCacheSize", assign_unsigned, &basic_auth_cache_size },
+  { "BasicAuthCacheTTL", assign_timeout, &basic_auth_cache_ttl },
   { "LogFacility", assign_log_facility, NULL, offsetof (POUND_DEFAULTS, facility) },
   { "LogLevel", parse_log_level, NULL, offsetof (POUND_DEFAULTS, log_level) },
   { "LogFormat", parse_log_format },
+  { "LogQueueSize", assign_unsigned, &log_queue_size },
+  { "LogQueueOverflow", assign_log_queue_overflow, &log_queue_overflow },
+  { "LogThrottle", parse_log_throttle },
   { "Alive", assign_timeout, &alive_to },
   { "Client", assign_timeout, NULL, offsetof (POUND_DEFAULTS, clnt_to) },
   { "TimeOut", assign_timeout, NULL, offsetof (POUND_DEFAULTS, be_to) },
@@ -4960,6 +6041,8 @@ static PARSER_TABLE top_level_parsetab[] = {
   { "ACL", parse_named_acl, NULL },
   { "PidFile", assign_string, &pid_name },
   { "BackendStats", assign_bool, &enable_backend_stats },
+  { "MetricsCacheTTL", assign_unsigned, &metrics_cache_ttl },
+  { "Trace", parse_trace, &trace_conf },
   { "ForwardedHeader", assign_string, &forwarded_header },
   { "TrustedIP", assign_acl, &trusted_ips },
   { "CombineHeaders", parse_combine_headers },
@@ -5123,8 +6206,12 @@ parse_config_file (char const *file, int nosyslog)
 	  if (foreach_backend (resolve_backend_ref,
 			       &pound_defaults.named_backend_table))
 	    exit (1);
+	  service_index_init ();
+	  rewrite_init ();
 	  if (worker_min_count > worker_max_count)
 	    abend ("WorkerMinCount is greater than WorkerMaxCount");
+	  if (enable_backend_stats)
+	    stats_init ();
 	  if (!nosyslog)
 	    log_facility = pound_defaults.facility;
 
@@ -5147,6 +6234,7 @@ parse_config_file (char const *file, int nosyslog)
 		  include_wd->fd = fd;
 		}
 	    }
+	  basic_auth_init ();
 	  workdir_unref (include_wd);
 	}
     }
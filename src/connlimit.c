@@ -0,0 +1,204 @@
+/*
+ * Pound - the reverse-proxy load-balancer
+ * Copyright (C) 2024 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Per-client limit on the number of concurrent connections.
+ *
+ * The limit is enforced by the dispatcher thread right after accepting
+ * the connection: a connection from a client that has reached the limit
+ * is reset before any per-connection data are allocated.  The counter is
+ * decremented when the connection is destroyed.
+ *
+ * Counters are kept in a sharded table (see shtab.c) keyed by the client
+ * address.  IPv6 addresses are truncated to the configured prefix length,
+ * so that a client can't circumvent the limit by using many addresses
+ * from its subnet.  IPv4-mapped IPv6 addresses are treated as IPv4.
+ * Entries are removed when their counter drops to zero, so the table
+ * holds only clients with open connections.
+ */
+#include "pound.h"
+#include "json.h"
+#include "shtab.h"
+
+/* Connection limit counters. */
+enum
+  {
+    CONN_ACTIVE,                   /* Connections open */
+    CONN_REJECTED                  /* Connections rejected */
+  };
+
+/* Address key: family and (truncated) address. */
+struct conn_key
+{
+  unsigned char family;
+  unsigned char addr[16];
+};
+
+struct conn_table
+{
+  unsigned max;                    /* Max. connections per client. */
+  unsigned prefix;                 /* IPv6 prefix length. */
+  SHTAB *tab;                      /* Number of open connections per
+				      client. */
+};
+
+struct conn_table *
+conn_table_new (unsigned max, unsigned prefix)
+{
+  struct conn_table *ct;
+
+  XZALLOC (ct);
+  ct->max = max;
+  ct->prefix = prefix;
+  ct->tab = shtab_new (0, sizeof (unsigned));
+  return ct;
+}
+
+/*
+ * Fill KEY from the socket address SA.  Return -1 if the address
+ * family is not subject to limiting.
+ */
+static int
+conn_key_init (struct conn_table *ct, struct conn_key *key,
+	       struct sockaddr const *sa)
+{
+  memset (key, 0, sizeof (*key));
+  switch (sa->sa_family)
+    {
+    case AF_INET:
+      key->family = AF_INET;
+      memcpy (key->addr, &((struct sockaddr_in const *) sa)->sin_addr, 4);
+      break;
+
+    case AF_INET6:
+      {
+	struct in6_addr const *a = &((struct sockaddr_in6 const *) sa)->sin6_addr;
+	unsigned n = ct->prefix / 8, r = ct->prefix % 8;
+
+	if (IN6_IS_ADDR_V4MAPPED (a))
+	  {
+	    key->family = AF_INET;
+	    memcpy (key->addr, a->s6_addr + 12, 4);
+	    break;
+	  }
+	key->family = AF_INET6;
+	memcpy (key->addr, a->s6_addr, n);
+	if (r)
+	  key->addr[n] = a->s6_addr[n] & (0xff << (8 - r));
+      }
+      break;
+
+    default:
+      return -1;
+    }
+  return 0;
+}
+
+/*
+ * Account for a new connection from SA.  Return 0 if it is allowed,
+ * and -1 if the client has reached the limit.
+ */
+int
+conn_limit_acquire (struct conn_table *ct, struct sockaddr const *sa)
+{
+  struct conn_key key;
+  struct shtab_cursor cur;
+  unsigned *count;
+  int rc = 0;
+
+  if (conn_key_init (ct, &key, sa))
+    return 0;
+
+  if ((count = shtab_lookup (ct->tab, &key, sizeof (key), &cur)) != NULL)
+    {
+      if (*count >= ct->max)
+	{
+	  shtab_count (&cur, CONN_REJECTED, 1);
+	  rc = -1;
+	}
+      else
+	++*count;
+    }
+  else if ((count = shtab_insert (ct->tab, &cur)) != NULL)
+    *count = 1;
+  else
+    /* Don't refuse connections because of memory shortage. */
+    rc = 1;
+  if (rc == 0)
+    shtab_count (&cur, CONN_ACTIVE, 1);
+  shtab_unlock (&cur);
+
+  return rc < 0 ? -1 : 0;
+}
+
+/* Account for closing a connection from SA. */
+void
+conn_limit_release (struct conn_table *ct, struct sockaddr const *sa)
+{
+  struct conn_key key;
+  struct shtab_cursor cur;
+  unsigned *count;
+
+  if (conn_key_init (ct, &key, sa))
+    return;
+
+  if ((count = shtab_lookup (ct->tab, &key, sizeof (key), &cur)) != NULL)
+    {
+      if (--*count == 0)
+	shtab_remove (ct->tab, &cur);
+      shtab_count (&cur, CONN_ACTIVE, -1);
+    }
+  shtab_unlock (&cur);
+}
+
+void
+conn_limit_get_stats (struct conn_table *ct, struct conn_limit_stats *st)
+{
+  struct shtab_stats ts;
+
+  shtab_get_stats (ct->tab, &ts);
+  st->clients = ts.entries;
+  st->active = ts.counter[CONN_ACTIVE];
+  st->rejected = ts.counter[CONN_REJECTED];
+}
+
+struct json_value *
+conn_limit_serialize (struct conn_table *ct)
+{
+  struct json_value *obj;
+  struct conn_limit_stats st;
+  int err = 0;
+
+  conn_limit_get_stats (ct, &st);
+
+  obj = json_new_object ();
+  if (obj)
+    {
+      err = json_object_set (obj, "max", json_new_integer (ct->max))
+	|| json_object_set (obj, "ipv6_prefix", json_new_integer (ct->prefix))
+	|| json_object_set (obj, "clients", json_new_number (st.clients))
+	|| json_object_set (obj, "active", json_new_number (st.active))
+	|| json_object_set (obj, "rejected", json_new_number (st.rejected));
+    }
+  if (err)
+    {
+      json_value_free (obj);
+      obj = NULL;
+    }
+  return obj;
+}
@@ -0,0 +1,682 @@
+/*
+ * Pound - the reverse-proxy load-balancer
+ * Copyright (C) 2024 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Service dispatch index.
+ *
+ * A service for the request is selected by evaluating service conditions
+ * in order until one of them matches.  With thousands of services, most
+ * of which differ only by the host name or path prefix they serve, that
+ * amounts to thousands of regexec calls per request.
+ *
+ * To avoid that, each list of services is analyzed at startup.  If the
+ * top-level conditions of a service include an exact Host match, the
+ * service is filed in a hash table under that host name.  Otherwise, if
+ * they include an exact or prefix match on URL or path, the service is
+ * filed in a trie keyed by that string.  Remaining services are generic.
+ *
+ * The services that can possibly match a request are then those found in
+ * the hash table under its host name, those found in the trie nodes along
+ * its URL and path, and the generic ones.  These are evaluated in their
+ * original order using match_cond, so that the first match is exactly
+ * the same as without the index.
+ *
+ * In addition, a listener can have a route cache (the RouteCache
+ * statement), which remembers the service selected for each combination
+ * of Host header and URL.  It is used only if all service conditions
+ * depend on nothing but these two.  The cache is split into shards, each
+ * protected by its own mutex and holding a hash table of entries and an
+ * LRU list.  On a hit, conditions of the cached service are evaluated
+ * again, so that its submatches are available as usual.  The cache is
+ * flushed when a service is enabled or disabled.
+ */
+#include "pound.h"
+#include "extern.h"
+#include "json.h"
+#include "shtab.h"
+
+/* Sorted list of service numbers. */
+struct svc_list
+{
+  size_t n;
+  size_t max;
+  size_t *v;
+};
+
+static void
+svc_list_add (struct svc_list *list, size_t i)
+{
+  if (list->n == list->max)
+    list->v = x2nrealloc (list->v, &list->max, sizeof (list->v[0]));
+  list->v[list->n++] = i;
+}
+
+/* Trie of exact and prefix matches. */
+struct trie_node
+{
+  struct svc_list exact;     /* Services matching the string ending here. */
+  struct svc_list prefix;    /* Services matching any string with this
+				prefix. */
+  size_t nchild;             /* Number of children. */
+  unsigned char *chr;        /* Sorted array of their characters. */
+  struct trie_node **child;  /* Child nodes. */
+};
+
+static struct trie_node *
+trie_child (struct trie_node *node, unsigned char c)
+{
+  size_t lo = 0, hi = node->nchild;
+
+  while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (node->chr[mid] == c)
+	return node->child[mid];
+      if (node->chr[mid] < c)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return NULL;
+}
+
+static struct trie_node *
+trie_child_insert (struct trie_node *node, unsigned char c)
+{
+  struct trie_node *np;
+  size_t i;
+
+  if ((np = trie_child (node, c)) != NULL)
+    return np;
+  for (i = 0; i < node->nchild && node->chr[i] < c; i++)
+    ;
+  node->chr = xrealloc (node->chr, node->nchild + 1);
+  node->child = xrealloc (node->child,
+			  (node->nchild + 1) * sizeof (node->child[0]));
+  memmove (node->chr + i + 1, node->chr + i, node->nchild - i);
+  memmove (node->child + i + 1, node->child + i,
+	   (node->nchild - i) * sizeof (node->child[0]));
+  XZALLOC (np);
+  node->chr[i] = c;
+  node->child[i] = np;
+  node->nchild++;
+  return np;
+}
+
+static void
+trie_insert (struct trie_node *root, struct cond_literal const *lit, size_t n)
+{
+  unsigned char const *p;
+
+  for (p = (unsigned char const *) lit->str; *p; p++)
+    root = trie_child_insert (root, lit->icase ? tolower (*p) : *p);
+  svc_list_add (lit->mode == COND_LIT_EXACT ? &root->exact : &root->prefix,
+		n);
+}
+
+/* Hash table of services with exact Host matches. */
+typedef struct host_entry
+{
+  char *name;                /* Host name, in lower case. */
+  struct svc_list svcs;      /* Services. */
+} HOST_ENTRY;
+
+#define HT_TYPE HOST_ENTRY
+#define HT_NO_HASH_FREE
+#define HT_NO_DELETE
+#define HT_NO_FOREACH
+#include "ht.h"
+
+/* Longest host name that can appear in the index. */
+#define MAX_HOST_KEY 256
+
+enum
+  {
+    KEY_URL,
+    KEY_PATH,
+    KEY_MAX
+  };
+
+struct service_index
+{
+  size_t nsvc;               /* Number of services. */
+  SERVICE **svcv;            /* Services, in the order of evaluation. */
+  struct svc_list generic;   /* Services that cannot be indexed. */
+  HOST_ENTRY_HASH *hosts;    /* Services indexed by host name. */
+  /* Services indexed by URL or path, separately for case-sensitive
+     and case-insensitive matches. */
+  struct trie_node *trie[KEY_MAX][2];
+};
+
+/* Global services. */
+static struct service_index *global_service_index;
+
+/*
+ * Return the condition by which service SVC can be indexed, or NULL.
+ * Store its key type in *KEY.  For host conditions, KEY is set to -1.
+ */
+static SERVICE_COND *
+service_index_cond (SERVICE *svc, int *key)
+{
+  SERVICE_COND *cond, *found = NULL;
+
+  if (svc->cond.type != COND_BOOL || svc->cond.bool.op != BOOL_AND)
+    return NULL;
+  SLIST_FOREACH (cond, &svc->cond.bool.head, next)
+    {
+      switch (cond->type)
+	{
+	case COND_HOST:
+	  if (cond->lit.mode == COND_LIT_EXACT
+	      && strlen (cond->lit.str) < MAX_HOST_KEY)
+	    {
+	      *key = -1;
+	      return cond;
+	    }
+	  break;
+
+	case COND_URL:
+	case COND_PATH:
+	  if (cond->lit.mode != COND_LIT_NONE && found == NULL)
+	    {
+	      *key = cond->type == COND_URL ? KEY_URL : KEY_PATH;
+	      found = cond;
+	    }
+	  break;
+
+	default:
+	  break;
+	}
+    }
+  return found;
+}
+
+static void
+service_index_add_host (struct service_index *idx, char const *name, size_t n)
+{
+  HOST_ENTRY key, *ent;
+  char buf[MAX_HOST_KEY];
+  size_t i;
+
+  for (i = 0; name[i]; i++)
+    buf[i] = tolower ((unsigned char) name[i]);
+  buf[i] = 0;
+
+  if (idx->hosts == NULL)
+    idx->hosts = HOST_ENTRY_HASH_NEW ();
+  key.name = buf;
+  if ((ent = HOST_ENTRY_RETRIEVE (idx->hosts, &key)) == NULL)
+    {
+      XZALLOC (ent);
+      ent->name = xstrdup (buf);
+      HOST_ENTRY_INSERT (idx->hosts, ent);
+    }
+  svc_list_add (&ent->svcs, n);
+}
+
+/*
+ * Build the dispatch index for the service list HEAD.
+ */
+static struct service_index *
+service_index_build (SERVICE_HEAD *head)
+{
+  struct service_index *idx;
+  SERVICE *svc;
+  size_t n;
+
+  if (SLIST_EMPTY (head))
+    return NULL;
+  XZALLOC (idx);
+  SLIST_FOREACH (svc, head, next)
+    idx->nsvc++;
+  idx->svcv = xcalloc (idx->nsvc, sizeof (idx->svcv[0]));
+  n = 0;
+  SLIST_FOREACH (svc, head, next)
+    {
+      SERVICE_COND *cond;
+      int key;
+
+      idx->svcv[n] = svc;
+      if ((cond = service_index_cond (svc, &key)) == NULL)
+	svc_list_add (&idx->generic, n);
+      else if (key == -1)
+	service_index_add_host (idx, cond->lit.str, n);
+      else
+	{
+	  struct trie_node **tp = &idx->trie[key][cond->lit.icase];
+	  if (*tp == NULL)
+	    XZALLOC (*tp);
+	  trie_insert (*tp, &cond->lit, n);
+	}
+      n++;
+    }
+  return idx;
+}
+
+/* Request data used for index lookups. */
+struct dispatch_key
+{
+  char *host;                /* Host name in lower case, or NULL. */
+  char const *str[KEY_MAX];  /* URL and path. */
+  char hostbuf[MAX_HOST_KEY];
+};
+
+/*
+ * Initialize KEY from request REQ.  Return 0 on success and -1 if the
+ * index cannot be used for this request.
+ */
+static int
+dispatch_key_init (struct dispatch_key *key, struct http_request *req)
+{
+  struct http_header *hdr;
+  int nhost = 0;
+
+  key->host = NULL;
+  DLIST_FOREACH (hdr, &req->headers, link)
+    {
+      char const *p;
+      size_t i;
+
+      if (hdr->header == NULL || strncasecmp (hdr->header, "host:", 5))
+	continue;
+      /* A host condition may match any of several Host headers. */
+      if (nhost++)
+	return -1;
+      p = hdr->header + 5;
+      p += strspn (p, " \t\n\r\v\f");
+      for (i = 0; p[i] && i < MAX_HOST_KEY - 1; i++)
+	key->hostbuf[i] = tolower ((unsigned char) p[i]);
+      if (p[i] == 0)
+	{
+	  key->hostbuf[i] = 0;
+	  key->host = key->hostbuf;
+	}
+    }
+
+  /* On error, match_cond treats the condition as matching. */
+  if (http_request_get_url (req, &key->str[KEY_URL])
+      || http_request_get_path (req, &key->str[KEY_PATH]))
+    return -1;
+  return 0;
+}
+
+/* Maximum number of service lists a lookup can yield. */
+#define MAX_CURSORS 64
+
+struct cursor
+{
+  size_t const *v;
+  size_t n;
+};
+
+static int
+cursor_add (struct cursor *cv, int *pn, struct svc_list const *list)
+{
+  if (list->n == 0)
+    return 0;
+  if (*pn == MAX_CURSORS)
+    return -1;
+  cv[*pn].v = list->v;
+  cv[*pn].n = list->n;
+  ++*pn;
+  return 0;
+}
+
+static int
+trie_lookup (struct cursor *cv, int *pn, struct trie_node *node,
+	     char const *str, int icase)
+{
+  unsigned char const *p = (unsigned char const *) str;
+
+  for (;;)
+    {
+      if (cursor_add (cv, pn, &node->prefix))
+	return -1;
+      if (*p == 0)
+	return cursor_add (cv, pn, &node->exact);
+      if ((node = trie_child (node, icase ? tolower (*p) : *p)) == NULL)
+	return 0;
+      p++;
+    }
+}
+
+static inline int
+service_match (SERVICE *svc, POUND_HTTP *phttp)
+{
+  return !svc->disabled && match_cond (&svc->cond, phttp, &phttp->request);
+}
+
+/*
+ * Find the first service from the list HEAD that matches the request,
+ * using index IDX.  If KEY is NULL, or IDX is NULL, scan the list.
+ */
+static SERVICE *
+service_index_lookup (struct service_index *idx, SERVICE_HEAD *head,
+		      struct dispatch_key *key, POUND_HTTP *phttp)
+{
+  struct cursor cv[MAX_CURSORS];
+  int i, j, n = 0;
+  SERVICE *svc;
+
+  if (idx == NULL || key == NULL)
+    goto scan;
+
+  if (cursor_add (cv, &n, &idx->generic))
+    goto scan;
+  if (key->host && idx->hosts)
+    {
+      HOST_ENTRY hkey, *ent;
+
+      hkey.name = key->host;
+      if ((ent = HOST_ENTRY_RETRIEVE (idx->hosts, &hkey)) != NULL
+	  && cursor_add (cv, &n, &ent->svcs))
+	goto scan;
+    }
+  for (i = 0; i < KEY_MAX; i++)
+    for (j = 0; j < 2; j++)
+      if (idx->trie[i][j]
+	  && trie_lookup (cv, &n, idx->trie[i][j], key->str[i], j))
+	goto scan;
+
+  /* Evaluate the candidates in order. */
+  while (n > 0)
+    {
+      int k = 0;
+
+      for (i = 1; i < n; i++)
+	if (cv[i].v[0] < cv[k].v[0])
+	  k = i;
+      svc = idx->svcv[cv[k].v[0]];
+      if (service_match (svc, phttp))
+	return svc;
+      cv[k].v++;
+      if (--cv[k].n == 0)
+	cv[k] = cv[--n];
+    }
+  return NULL;
+
+ scan:
+  SLIST_FOREACH (svc, head, next)
+    {
+      if (service_match (svc, phttp))
+	return svc;
+    }
+  return NULL;
+}
+
+/* Route cache. */
+/* Requests with longer Host and URL are not cached. */
+#define ROUTE_KEY_MAX 1024
+
+/* Route cache counters. */
+enum
+  {
+    ROUTE_HITS,
+    ROUTE_MISSES
+  };
+
+/*
+ * Route cache maps "Host header, NUL, URL" keys to services.  Each entry
+ * carries a pointer to the service.
+ */
+struct route_cache
+{
+  SHTAB *tab;
+};
+
+static struct route_cache *
+route_cache_new (size_t size)
+{
+  struct route_cache *rc;
+
+  XZALLOC (rc);
+  rc->tab = shtab_new (size, sizeof (SERVICE *));
+  return rc;
+}
+
+/*
+ * Build the route cache key for request REQ in BUF.  Return key length,
+ * or 0 if the request cannot be cached.
+ */
+static size_t
+route_key_init (char *buf, struct http_request *req)
+{
+  struct http_header *hdr;
+  char const *host = "", *url;
+  size_t hlen, ulen;
+  int nhost = 0;
+
+  DLIST_FOREACH (hdr, &req->headers, link)
+    {
+      if (hdr->header && strncasecmp (hdr->header, "host:", 5) == 0)
+	{
+	  if (nhost++)
+	    return 0;
+	  host = hdr->header;
+	}
+    }
+  if (http_request_get_url (req, &url))
+    return 0;
+  hlen = strlen (host) + 1;
+  ulen = strlen (url);
+  if (hlen + ulen > ROUTE_KEY_MAX)
+    return 0;
+  memcpy (buf, host, hlen);
+  memcpy (buf + hlen, url, ulen);
+  return hlen + ulen;
+}
+
+/* Look up the KEY of length LEN in the cache RC. */
+static SERVICE *
+route_cache_lookup (struct route_cache *rc, char const *key, size_t len)
+{
+  struct shtab_cursor cur;
+  SERVICE **psvc, *svc = NULL;
+
+  if ((psvc = shtab_lookup (rc->tab, key, len, &cur)) != NULL)
+    {
+      svc = *psvc;
+      shtab_count (&cur, ROUTE_HITS, 1);
+    }
+  else
+    shtab_count (&cur, ROUTE_MISSES, 1);
+  shtab_unlock (&cur);
+  return svc;
+}
+
+/* Remember that KEY of length LEN maps to service SVC. */
+static void
+route_cache_insert (struct route_cache *rc, char const *key, size_t len,
+		    SERVICE *svc)
+{
+  struct shtab_cursor cur;
+  SERVICE **psvc;
+
+  if ((psvc = shtab_lookup (rc->tab, key, len, &cur)) != NULL
+      || (psvc = shtab_insert (rc->tab, &cur)) != NULL)
+    *psvc = svc;
+  shtab_unlock (&cur);
+}
+
+static int
+listener_route_cache_flush (LISTENER *lstn, void *data)
+{
+  if (lstn->route_cache)
+    shtab_flush (lstn->route_cache->tab);
+  return 0;
+}
+
+/*
+ * Invalidate route caches of all listeners.  This must be called when
+ * a service is enabled or disabled.
+ */
+void
+route_cache_invalidate (void)
+{
+  foreach_listener (listener_route_cache_flush, NULL);
+}
+
+void
+route_cache_get_stats (struct route_cache *rc, struct route_cache_stats *st)
+{
+  struct shtab_stats ts;
+
+  shtab_get_stats (rc->tab, &ts);
+  st->size = ts.size;
+  st->entries = ts.entries;
+  st->hits = ts.counter[ROUTE_HITS];
+  st->misses = ts.counter[ROUTE_MISSES];
+}
+
+struct json_value *
+route_cache_serialize (struct route_cache *rc)
+{
+  struct json_value *obj;
+  struct route_cache_stats st;
+  int err;
+
+  if ((obj = json_new_object ()) == NULL)
+    return NULL;
+  route_cache_get_stats (rc, &st);
+  err = json_object_set (obj, "size", json_new_number (st.size))
+    || json_object_set (obj, "entries", json_new_number (st.entries))
+    || json_object_set (obj, "hits", json_new_number (st.hits))
+    || json_object_set (obj, "misses", json_new_number (st.misses));
+  if (err)
+    {
+      json_value_free (obj);
+      obj = NULL;
+    }
+  return obj;
+}
+
+/*
+ * Return true if the result of evaluating condition COND depends only on
+ * the Host header and URL of the request.
+ */
+static int
+cond_is_cacheable (SERVICE_COND *cond)
+{
+  SERVICE_COND *subcond;
+
+  switch (cond->type)
+    {
+    case COND_URL:
+    case COND_PATH:
+    case COND_QUERY:
+    case COND_QUERY_PARAM:
+      return 1;
+
+    case COND_HOST:
+      /*
+       * Only anchored expressions are guaranteed to match the Host
+       * header alone.
+       */
+      return cond->lit.mode != COND_LIT_NONE;
+
+    case COND_BOOL:
+      if (cond->bool.patlist && cond->bool.patlist->mode != PATLIST_REGEX)
+	{
+	  switch (cond->bool.patlist->type)
+	    {
+	    case COND_HOST:
+	    case COND_URL:
+	    case COND_PATH:
+	    case COND_QUERY:
+	    case COND_QUERY_PARAM:
+	      return 1;
+
+	    default:
+	      return 0;
+	    }
+	}
+      SLIST_FOREACH (subcond, &cond->bool.head, next)
+	if (!cond_is_cacheable (subcond))
+	  return 0;
+      return 1;
+
+    default:
+      return 0;
+    }
+}
+
+static int
+services_are_cacheable (SERVICE_HEAD *head)
+{
+  SERVICE *svc;
+
+  SLIST_FOREACH (svc, head, next)
+    if (!cond_is_cacheable (&svc->cond))
+      return 0;
+  return 1;
+}
+
+static int
+listener_service_index_build (LISTENER *lstn, void *data)
+{
+  lstn->service_index = service_index_build (&lstn->services);
+  if (lstn->route_cache_size > 0)
+    {
+      if (services_are_cacheable (&lstn->services)
+	  && services_are_cacheable (&services))
+	lstn->route_cache = route_cache_new (lstn->route_cache_size);
+      else
+	logmsg (LOG_WARNING,
+		"%s: route cache disabled: service conditions depend on"
+		" more than request host and URL",
+		lstn->locus);
+    }
+  return 0;
+}
+
+/*
+ * Build dispatch indexes for all listeners and for global services.
+ */
+void
+service_index_init (void)
+{
+  foreach_listener (listener_service_index_build, NULL);
+  global_service_index = service_index_build (&services);
+}
+
+/*
+ * Find the right service for a request
+ */
+SERVICE *
+get_service (POUND_HTTP *phttp)
+{
+  struct dispatch_key key, *kp;
+  SERVICE *svc;
+  struct route_cache *rc = phttp->lstn->route_cache;
+  char rkey[ROUTE_KEY_MAX];
+  size_t rlen = 0;
+
+  if (rc && (rlen = route_key_init (rkey, &phttp->request)) > 0
+      && (svc = route_cache_lookup (rc, rkey, rlen)) != NULL
+      && service_match (svc, phttp))
+    return svc;
+
+  kp = dispatch_key_init (&key, &phttp->request) == 0 ? &key : NULL;
+  if ((svc = service_index_lookup (phttp->lstn->service_index,
+				   &phttp->lstn->services, kp, phttp)) == NULL)
+    /* try global services */
+    svc = service_index_lookup (global_service_index, &services, kp, phttp);
+  if (svc && rlen > 0)
+    route_cache_insert (rc, rkey, rlen, svc);
+  return svc;
+}
@@ -0,0 +1,474 @@
+/*
+ * Pound - the reverse-proxy load-balancer
+ * Copyright (C) 2024 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * TLS 1.3 early data (0-RTT).
+ *
+ * Early data are read with SSL_read_early_data, first by the handshake
+ * thread and then by the worker, via the "early data" BIO defined below.
+ * This allows the worker to process a request received in early data and
+ * send the reply before the handshake is complete.
+ *
+ * Early data can be replayed by an attacker.  By default, OpenSSL protects
+ * against that by making session tickets single-use, which requires keeping
+ * them in the session cache.  Instead, pound uses stateless tickets (which
+ * also survive certificate reloads) and ClientHello recording (RFC 8446,
+ * 8.2).  OpenSSL rejects early data sent with a ticket whose age is too far
+ * off.  Within that window, the anti-replay cache below remembers the client
+ * random of each ClientHello that had its early data accepted, and rejects
+ * early data of a repeated one.
+ *
+ * Requests received in early data are marked with the "Early-Data: 1"
+ * header (RFC 8470), and those with non-idempotent methods are refused
+ * with 425 (Too Early).
+ */
+#include "pound.h"
+#include "json.h"
+
+/* Number of entries in the anti-replay cache.  Must be a power of 2. */
+#define REPLAY_CACHE_SIZE 16384
+/* Number of slots to probe before giving up. */
+#define REPLAY_CACHE_PROBE 8
+/*
+ * Time to keep cache entries, in seconds.  OpenSSL tolerates ticket age
+ * discrepancy of up to 10 seconds, so this is safe.
+ */
+#define REPLAY_WINDOW 20
+
+struct replay_entry
+{
+  unsigned char random[SSL3_RANDOM_SIZE];
+  time_t expire;
+};
+
+static pthread_mutex_t replay_mut = PTHREAD_MUTEX_INITIALIZER;
+static struct replay_entry *replay_cache;
+
+/* Statistics */
+static pthread_mutex_t ed_stat_mut = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long ed_accepted;  /* Connections with accepted early data. */
+static unsigned long ed_rejected;  /* Connections with rejected early data. */
+static unsigned long ed_replayed;  /* Rejected by the anti-replay cache. */
+static unsigned long ed_too_early; /* Requests refused with 425. */
+
+static inline void
+ed_stat_incr (unsigned long *cnt)
+{
+  pthread_mutex_lock (&ed_stat_mut);
+  ++*cnt;
+  pthread_mutex_unlock (&ed_stat_mut);
+}
+
+static size_t
+replay_hash (unsigned char const *rnd)
+{
+  return fnv_hash (rnd, SSL3_RANDOM_SIZE);
+}
+
+/*
+ * Record the client random RND in the cache.  Return 0 if it has not been
+ * seen within REPLAY_WINDOW seconds, and -1 if it has, or if the cache is
+ * full.
+ */
+static int
+replay_check (unsigned char const *rnd)
+{
+  time_t now = time (NULL);
+  size_t i, n, h = replay_hash (rnd);
+  struct replay_entry *free_ent = NULL;
+  int rc = 0;
+
+  pthread_mutex_lock (&replay_mut);
+  if (replay_cache == NULL)
+    replay_cache = xcalloc (REPLAY_CACHE_SIZE, sizeof (replay_cache[0]));
+  for (n = 0; n < REPLAY_CACHE_PROBE; n++)
+    {
+      struct replay_entry *ent;
+
+      i = (h + n) & (REPLAY_CACHE_SIZE - 1);
+      ent = &replay_cache[i];
+      if (ent->expire <= now)
+	{
+	  if (!free_ent)
+	    free_ent = ent;
+	}
+      else if (memcmp (ent->random, rnd, SSL3_RANDOM_SIZE) == 0)
+	{
+	  rc = -1;
+	  break;
+	}
+    }
+  if (rc == 0)
+    {
+      if (free_ent)
+	{
+	  memcpy (free_ent->random, rnd, SSL3_RANDOM_SIZE);
+	  free_ent->expire = now + REPLAY_WINDOW;
+	}
+      else
+	rc = -1;
+    }
+  pthread_mutex_unlock (&replay_mut);
+  return rc;
+}
+
+/*
+ * Called by OpenSSL to decide whether to accept early data.
+ */
+static int
+early_data_allow (SSL *ssl, void *arg)
+{
+  unsigned char rnd[SSL3_RANDOM_SIZE];
+
+  if (SSL_get_client_random (ssl, rnd, sizeof (rnd)) != sizeof (rnd)
+      || replay_check (rnd))
+    {
+      ed_stat_incr (&ed_replayed);
+      return 0;
+    }
+  return 1;
+}
+
+/*
+ * Enable receiving up to MAX bytes of early data on CTX.
+ */
+void
+early_data_ctx_init (SSL_CTX *ctx, unsigned max)
+{
+  SSL_CTX_set_options (ctx, SSL_OP_NO_ANTI_REPLAY);
+  SSL_CTX_set_max_early_data (ctx, max);
+  SSL_CTX_set_recv_max_early_data (ctx, max);
+  SSL_CTX_set_allow_early_data_cb (ctx, early_data_allow, NULL);
+}
+
+/*
+ * Update statistics once the fate of early data on SSL is known.
+ */
+void
+early_data_account (SSL *ssl)
+{
+  switch (SSL_get_early_data_status (ssl))
+    {
+    case SSL_EARLY_DATA_ACCEPTED:
+      ed_stat_incr (&ed_accepted);
+      break;
+
+    case SSL_EARLY_DATA_REJECTED:
+      ed_stat_incr (&ed_rejected);
+      break;
+    }
+}
+
+/*
+ * Return 1 if requests with method METHOD may be served from early data.
+ * Only safe methods are allowed (RFC 8470, 4.1): idempotent ones such as
+ * PUT and DELETE may still have effects that must not be replayed.
+ */
+int
+early_data_method_ok (int method)
+{
+  switch (method)
+    {
+    case METH_GET:
+    case METH_HEAD:
+    case METH_OPTIONS:
+      return 1;
+    }
+  ed_stat_incr (&ed_too_early);
+  return 0;
+}
+
+struct json_value *
+early_data_serialize (void)
+{
+  struct json_value *obj;
+  int err = 0;
+
+  obj = json_new_object ();
+  if (obj)
+    {
+      pthread_mutex_lock (&ed_stat_mut);
+      err = json_object_set (obj, "accepted", json_new_number (ed_accepted))
+	|| json_object_set (obj, "rejected", json_new_number (ed_rejected))
+	|| json_object_set (obj, "replayed", json_new_number (ed_replayed))
+	|| json_object_set (obj, "too_early", json_new_number (ed_too_early));
+      pthread_mutex_unlock (&ed_stat_mut);
+    }
+  if (err)
+    {
+      json_value_free (obj);
+      obj = NULL;
+    }
+  return obj;
+}
+
+/*
+ * Early data BIO.
+ *
+ * It is used in place of BIO_f_ssl on connections that may still have
+ * early data to read.  Reads first return the early data buffered by the
+ * handshake thread, then the rest of early data, and finally normal
+ * application data.  Writes done before the end of early data are sent
+ * to the (yet unauthenticated) client with SSL_write_early_data.
+ *
+ * The BIO is used below a buffering BIO, which reads from it only when
+ * its own buffer is empty.  Thus, once the BIO is first asked for data
+ * past the end of early data, all early data have been consumed.  That
+ * allows to tell which requests have been received in early data (see
+ * early_data_bio_state).
+ */
+struct early_bio
+{
+  SSL *ssl;
+  char *buf;            /* Early data read by the handshake thread. */
+  size_t len;           /* Length of buf. */
+  size_t off;           /* Offset of unread data in buf. */
+  int reading;          /* True while reading early data. */
+  int accounted;        /* Statistics have been updated. */
+  int done;             /* All early data have been consumed. */
+  unsigned long count;  /* Number of early data bytes returned so far. */
+};
+
+static int early_bio_type;
+
+static void
+early_bio_set_retry (BIO *b, SSL *ssl, int rc)
+{
+  BIO_clear_retry_flags (b);
+  switch (SSL_get_error (ssl, rc))
+    {
+    case SSL_ERROR_WANT_READ:
+      BIO_set_retry_read (b);
+      break;
+
+    case SSL_ERROR_WANT_WRITE:
+      BIO_set_retry_write (b);
+      break;
+    }
+}
+
+static int
+early_bio_read (BIO *b, char *out, int outl)
+{
+  struct early_bio *eb = BIO_get_data (b);
+  size_t n;
+  int rc;
+
+  BIO_clear_retry_flags (b);
+  if (eb->off < eb->len)
+    {
+      n = eb->len - eb->off;
+      if (n > outl)
+	n = outl;
+      memcpy (out, eb->buf + eb->off, n);
+      eb->off += n;
+      eb->count += n;
+      return n;
+    }
+
+  while (eb->reading)
+    {
+      switch (SSL_read_early_data (eb->ssl, out, outl, &n))
+	{
+	case SSL_READ_EARLY_DATA_SUCCESS:
+	  if (!eb->accounted)
+	    {
+	      early_data_account (eb->ssl);
+	      eb->accounted = 1;
+	    }
+	  eb->count += n;
+	  if (n > 0)
+	    return n;
+	  break;
+
+	case SSL_READ_EARLY_DATA_FINISH:
+	  eb->reading = 0;
+	  if (!eb->accounted)
+	    {
+	      early_data_account (eb->ssl);
+	      eb->accounted = 1;
+	    }
+	  eb->count += n;
+	  if (n > 0)
+	    return n;
+	  break;
+
+	default:
+	  early_bio_set_retry (b, eb->ssl, 0);
+	  return -1;
+	}
+    }
+  eb->done = 1;
+
+  if ((rc = SSL_read (eb->ssl, out, outl)) <= 0)
+    early_bio_set_retry (b, eb->ssl, rc);
+  return rc;
+}
+
+static int
+early_bio_write (BIO *b, char const *in, int inl)
+{
+  struct early_bio *eb = BIO_get_data (b);
+  size_t n;
+  int rc;
+
+  BIO_clear_retry_flags (b);
+  if (!SSL_is_init_finished (eb->ssl) && eb->reading)
+    {
+      if (!SSL_write_early_data (eb->ssl, in, inl, &n))
+	{
+	  early_bio_set_retry (b, eb->ssl, 0);
+	  return -1;
+	}
+      return n;
+    }
+  if ((rc = SSL_write (eb->ssl, in, inl)) <= 0)
+    early_bio_set_retry (b, eb->ssl, rc);
+  return rc;
+}
+
+static long
+early_bio_ctrl (BIO *b, int cmd, long num, void *ptr)
+{
+  struct early_bio *eb = BIO_get_data (b);
+
+  switch (cmd)
+    {
+    case BIO_CTRL_GET_CLOSE:
+      return BIO_get_shutdown (b);
+
+    case BIO_CTRL_SET_CLOSE:
+      BIO_set_shutdown (b, num);
+      return 1;
+
+    case BIO_CTRL_PENDING:
+      if (eb->off < eb->len)
+	return eb->len - eb->off;
+      return SSL_pending (eb->ssl);
+
+    case BIO_CTRL_WPENDING:
+      return 0;
+
+    case BIO_CTRL_FLUSH:
+    case BIO_CTRL_RESET:
+    case BIO_CTRL_PUSH:
+    case BIO_CTRL_POP:
+      return 1;
+
+    case BIO_C_DO_STATE_MACHINE:
+      /* The handshake completes after early data have been read. */
+      if (eb->reading)
+	return 1;
+      return SSL_do_handshake (eb->ssl);
+
+    default:
+      return BIO_ctrl (SSL_get_rbio (eb->ssl), cmd, num, ptr);
+    }
+}
+
+static int
+early_bio_destroy (BIO *b)
+{
+  struct early_bio *eb = BIO_get_data (b);
+
+  if (eb)
+    {
+      if (BIO_get_shutdown (b))
+	SSL_free (eb->ssl);
+      free (eb->buf);
+      free (eb);
+      BIO_set_data (b, NULL);
+    }
+  return 1;
+}
+
+static BIO_METHOD *early_bio_method;
+static pthread_once_t early_bio_once = PTHREAD_ONCE_INIT;
+
+static void
+early_bio_method_init (void)
+{
+  BIO_METHOD *m;
+
+  early_bio_type = BIO_get_new_index () | BIO_TYPE_SOURCE_SINK;
+  if ((m = BIO_meth_new (early_bio_type, "early data")) == NULL
+      || !BIO_meth_set_read (m, early_bio_read)
+      || !BIO_meth_set_write (m, early_bio_write)
+      || !BIO_meth_set_ctrl (m, early_bio_ctrl)
+      || !BIO_meth_set_destroy (m, early_bio_destroy))
+    {
+      BIO_meth_free (m);
+      return;
+    }
+  early_bio_method = m;
+}
+
+/*
+ * Create early data BIO for SSL.  BUF (of LEN bytes) contains early data
+ * read so far.  READING is 0 if the end of early data has been reached.
+ * The BIO takes ownership of BUF and SSL.  The latter is freed with the
+ * BIO, if it has the BIO_CLOSE flag set (the default).
+ */
+BIO *
+early_data_bio_new (SSL *ssl, char *buf, size_t len, int reading)
+{
+  BIO *b;
+  struct early_bio *eb;
+
+  pthread_once (&early_bio_once, early_bio_method_init);
+  if (early_bio_method == NULL)
+    return NULL;
+  if ((eb = calloc (1, sizeof (*eb))) == NULL)
+    return NULL;
+  if ((b = BIO_new (early_bio_method)) == NULL)
+    {
+      free (eb);
+      return NULL;
+    }
+  eb->ssl = ssl;
+  eb->buf = buf;
+  eb->len = len;
+  eb->reading = reading;
+  /* If early data were received, the handshake thread has accounted them. */
+  eb->accounted = buf != NULL;
+  BIO_set_data (b, eb);
+  BIO_set_shutdown (b, BIO_CLOSE);
+  BIO_set_init (b, 1);
+  return b;
+}
+
+/*
+ * Return the state of the early data BIO in the chain BIO: -1 if there
+ * is no such BIO, 0 if all early data have been consumed, and 1 otherwise.
+ * In the latter case, store the number of early data bytes returned so far
+ * in *COUNT.
+ */
+int
+early_data_bio_state (BIO *bio, unsigned long *count)
+{
+  struct early_bio *eb;
+
+  if (early_bio_type == 0
+      || (bio = BIO_find_type (bio, early_bio_type)) == NULL)
+    return -1;
+  eb = BIO_get_data (bio);
+  if (eb->done)
+    return 0;
+  *count = eb->count;
+  return 1;
+}
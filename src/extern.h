@@ -13,8 +13,13 @@ extern char *user,		/* user to run as */
 extern unsigned worker_min_count; /* min. number of worker threads */
 extern unsigned worker_max_count; /* max. number of worker threads */
 extern unsigned worker_idle_timeout;
+extern unsigned prio_weight[]; /* worker queue weights by priority class */
+extern unsigned handshake_threads; /* number of TLS handshake threads */
 
 extern unsigned grace;		/* grace period before shutdown */
+extern unsigned basic_auth_check; /* password file check interval */
+extern unsigned basic_auth_cache_size; /* max. verified credentials per file */
+extern unsigned basic_auth_cache_ttl;  /* lifetime of a verified credential */
 
 extern int anonymise;		/* anonymise client address */
 extern unsigned alive_to;	/* check interval for resurrection */
@@ -24,6 +29,12 @@ extern int log_facility;	/* log facility to use */
 extern int print_log;           /* print log messages to stdout/stderr during
 				   startup */
 extern int enable_backend_stats;
+extern unsigned log_queue_size; /* size of per-thread log queues */
+extern int log_queue_overflow;  /* log queue overflow policy */
+extern unsigned log_throttle_burst; /* max. messages per call site ... */
+extern unsigned log_throttle_interval; /* ... and this many seconds */
+extern unsigned metrics_cache_ttl; /* lifetime of cached metrics (ms) */
+extern TRACE_CONF trace_conf;   /* tracing configuration */
 
 extern regex_t HEADER,		/* Allowed header */
   CONN_UPGRD,			/* upgrade in connection header */
@@ -0,0 +1,476 @@
+/*
+ * Pound - the reverse-proxy load-balancer
+ * Copyright (C) 2024 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Non-blocking TLS handshakes.
+ *
+ * Connections accepted on HTTPS listeners are first handed to one of
+ * the handshake threads.  Each thread multiplexes any number of
+ * connections using non-blocking sockets and poll(2), driving
+ * SSL_do_handshake as the sockets become ready.  Only when the handshake
+ * is complete is the connection placed on the worker queue, so that
+ * slow or idle clients never tie up a worker thread.
+ */
+#include "pound.h"
+#include "extern.h"
+#include "json.h"
+
+unsigned handshake_threads = DEFAULT_HANDSHAKE_THREADS;
+
+struct handshake
+{
+  POUND_HTTP *phttp;            /* Connection being set up. */
+  struct timespec start;        /* Time it was submitted. */
+  struct timespec deadline;     /* Time it must complete by. */
+  short events;                 /* Events to wait for. */
+  int early;                    /* Reading early data. */
+  DLIST_ENTRY (handshake) link;
+};
+
+typedef DLIST_HEAD (,handshake) HANDSHAKE_HEAD;
+
+struct handshake_thread
+{
+  pthread_mutex_t mut;          /* Protects incoming. */
+  HANDSHAKE_HEAD incoming;      /* Submitted, but not yet picked up. */
+  int wakeup[2];                /* Wake-up pipe. */
+};
+
+static struct handshake_thread *hs_thread;
+static unsigned hs_next;        /* Index of the thread to submit to. */
+
+/* Statistics */
+static pthread_mutex_t hs_stat_mut = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long hs_pending; /* Handshakes in progress. */
+static unsigned long hs_count;   /* Completed handshakes. */
+static unsigned long hs_failed;  /* Failed handshakes (including timeouts). */
+static unsigned long hs_timeout; /* Handshakes that timed out. */
+static double hs_time_total;     /* Total handshake time (nanoseconds). */
+static double hs_time_max;       /* Longest handshake time (nanoseconds). */
+
+static void
+hs_stat_update (struct handshake *hs, int res)
+{
+  struct timespec now, diff;
+  double t;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  diff = timespec_sub (&now, &hs->start);
+  t = (double) diff.tv_sec * 1e9 + diff.tv_nsec;
+
+  pthread_mutex_lock (&hs_stat_mut);
+  hs_pending--;
+  switch (res)
+    {
+    case 0:
+      hs_count++;
+      hs_time_total += t;
+      if (t > hs_time_max)
+	hs_time_max = t;
+      break;
+
+    case ETIMEDOUT:
+      hs_timeout++;
+      /* fall through */
+    default:
+      hs_failed++;
+    }
+  pthread_mutex_unlock (&hs_stat_mut);
+}
+
+struct json_value *
+tls_handshake_serialize (void)
+{
+  struct json_value *obj;
+  int err = 0;
+
+  obj = json_new_object ();
+  if (obj)
+    {
+      pthread_mutex_lock (&hs_stat_mut);
+      err = json_object_set (obj, "threads",
+			     json_new_number (hs_thread ? handshake_threads : 0))
+	|| json_object_set (obj, "pending", json_new_number (hs_pending))
+	|| json_object_set (obj, "count", json_new_number (hs_count))
+	|| json_object_set (obj, "failed", json_new_number (hs_failed))
+	|| json_object_set (obj, "timeout", json_new_number (hs_timeout))
+	|| json_object_set (obj, "time_avg",
+			    json_new_number (hs_count
+					     ? hs_time_total / hs_count : 0))
+	|| json_object_set (obj, "time_max", json_new_number (hs_time_max));
+      pthread_mutex_unlock (&hs_stat_mut);
+    }
+  if (err)
+    {
+      json_value_free (obj);
+      obj = NULL;
+    }
+  return obj;
+}
+
+static int
+set_nonblock (int fd, int nb)
+{
+  int flags = fcntl (fd, F_GETFL);
+  if (flags == -1)
+    return -1;
+  if (nb)
+    flags |= O_NONBLOCK;
+  else
+    flags &= ~O_NONBLOCK;
+  return fcntl (fd, F_SETFL, flags);
+}
+
+/*
+ * Finish the handshake HS.  RES is 0 if it succeeded and an error code
+ * otherwise.  In the former case, pass the connection to the workers,
+ * otherwise close it.
+ */
+static void
+handshake_finish (struct handshake *hs, int res)
+{
+  POUND_HTTP *phttp = hs->phttp;
+
+  hs_stat_update (hs, res);
+  free (hs);
+
+  if (res == 0 && set_nonblock (phttp->sock, 0) == 0)
+    {
+      phase_mark (phttp, PHASE_HANDSHAKE);
+      pound_http_push (phttp);
+    }
+  else
+    {
+      if (res == ETIMEDOUT)
+	{
+	  char caddr[MAX_ADDR_BUFSIZE];
+	  logmsg (LOG_INFO, "TLS handshake with %s timed out",
+		  addr2str (caddr, sizeof (caddr), &phttp->from_host, 1));
+	}
+      /* Freeing the SSL frees the socket BIO and closes the socket. */
+      SSL_free (phttp->ssl);
+      phttp->ssl = NULL;
+      pound_http_destroy (phttp);
+    }
+}
+
+/*
+ * Read early data on the connection of HS into phttp->early_buf.  Return
+ * values are as for handshake_step.  If early data have been received,
+ * the connection is passed to the worker as soon as no more of them are
+ * immediately available: it will read the rest and complete the handshake
+ * (see earlydata.c).  Otherwise, the handshake proceeds as usual.
+ */
+static int
+early_data_step (struct handshake *hs)
+{
+  POUND_HTTP *phttp = hs->phttp;
+  size_t max = phttp->lstn->early_data;
+  size_t n;
+
+  if (phttp->early_buf == NULL && (phttp->early_buf = malloc (max)) == NULL)
+    {
+      lognomem ();
+      return EPROTO;
+    }
+
+  while (phttp->early_len < max)
+    {
+      switch (SSL_read_early_data (phttp->ssl,
+				   phttp->early_buf + phttp->early_len,
+				   max - phttp->early_len, &n))
+	{
+	case SSL_READ_EARLY_DATA_SUCCESS:
+	  phttp->early_len += n;
+	  break;
+
+	case SSL_READ_EARLY_DATA_FINISH:
+	  hs->early = 0;
+	  phttp->early_len += n;
+	  phttp->early_finished = 1;
+	  early_data_account (phttp->ssl);
+	  return phttp->early_len > 0 ? 0 : EAGAIN;
+
+	default:
+	  if (phttp->early_len > 0)
+	    {
+	      early_data_account (phttp->ssl);
+	      return 0;
+	    }
+	  switch (SSL_get_error (phttp->ssl, 0))
+	    {
+	    case SSL_ERROR_WANT_READ:
+	      hs->events = POLLIN;
+	      return EAGAIN;
+
+	    case SSL_ERROR_WANT_WRITE:
+	      hs->events = POLLOUT;
+	      return EAGAIN;
+
+	    default:
+	      return EPROTO;
+	    }
+	}
+    }
+  /* The maximum amount of early data has been received. */
+  early_data_account (phttp->ssl);
+  return 0;
+}
+
+/*
+ * Advance the handshake HS.  Return 0 if it is complete, EAGAIN if it
+ * should be retried when the socket becomes ready and EPROTO on error.
+ */
+static int
+handshake_step (struct handshake *hs)
+{
+  int rc;
+
+  ERR_clear_error ();
+  if (hs->early)
+    {
+      if ((rc = early_data_step (hs)) != EAGAIN || hs->early)
+	return rc;
+      /* End of early data reached: continue the handshake. */
+      free (hs->phttp->early_buf);
+      hs->phttp->early_buf = NULL;
+    }
+  if ((rc = SSL_do_handshake (hs->phttp->ssl)) == 1)
+    return 0;
+  switch (SSL_get_error (hs->phttp->ssl, rc))
+    {
+    case SSL_ERROR_WANT_READ:
+      hs->events = POLLIN;
+      return EAGAIN;
+
+    case SSL_ERROR_WANT_WRITE:
+      hs->events = POLLOUT;
+      return EAGAIN;
+
+    default:
+      break;
+    }
+  return EPROTO;
+}
+
+/* Return number of milliseconds from NOW until TS, rounded up. */
+static int
+ms_until (struct timespec const *ts, struct timespec const *now)
+{
+  struct timespec d;
+
+  if (timespec_cmp (ts, now) <= 0)
+    return 0;
+  d = timespec_sub (ts, now);
+  return d.tv_sec * 1000 + (d.tv_nsec + 999999) / 1000000;
+}
+
+static void *
+thr_handshake (void *arg)
+{
+  struct handshake_thread *ht = arg;
+  HANDSHAKE_HEAD active = DLIST_HEAD_INITIALIZER (active);
+  size_t nactive = 0;
+  struct pollfd *pfd = NULL;
+  size_t pfd_max = 0;
+
+  for (;;)
+    {
+      struct handshake *hs, *tmp;
+      struct timespec now;
+      int timeout;
+      size_t i;
+
+      /* Pick up newly submitted connections. */
+      pthread_mutex_lock (&ht->mut);
+      while ((hs = DLIST_FIRST (&ht->incoming)) != NULL)
+	{
+	  DLIST_SHIFT (&ht->incoming, link);
+	  DLIST_PUSH (&active, hs, link);
+	  nactive++;
+	}
+      pthread_mutex_unlock (&ht->mut);
+
+      while (nactive + 1 > pfd_max)
+	pfd = x2nrealloc (pfd, &pfd_max, sizeof (pfd[0]));
+
+      pfd[0].fd = ht->wakeup[0];
+      pfd[0].events = POLLIN;
+      timeout = -1;
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      i = 1;
+      DLIST_FOREACH (hs, &active, link)
+	{
+	  int t = ms_until (&hs->deadline, &now);
+	  if (timeout == -1 || t < timeout)
+	    timeout = t;
+	  pfd[i].fd = hs->phttp->sock;
+	  pfd[i].events = hs->events;
+	  i++;
+	}
+
+      if (poll (pfd, i, timeout) < 0)
+	{
+	  if (errno != EINTR)
+	    logmsg (LOG_WARNING, "handshake poll: %s", strerror (errno));
+	  continue;
+	}
+
+      if (pfd[0].revents & POLLIN)
+	{
+	  char buf[64];
+	  while (read (ht->wakeup[0], buf, sizeof (buf)) > 0)
+	    ;
+	}
+
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      i = 1;
+      DLIST_FOREACH_SAFE (hs, tmp, &active, link)
+	{
+	  int res = EAGAIN;
+
+	  if (pfd[i++].revents)
+	    res = handshake_step (hs);
+	  /*
+	   * Check the deadline even if the socket was ready: a client
+	   * trickling its handshake byte by byte would otherwise never
+	   * time out.
+	   */
+	  if (res == EAGAIN && timespec_cmp (&hs->deadline, &now) <= 0)
+	    res = ETIMEDOUT;
+
+	  if (res != EAGAIN)
+	    {
+	      DLIST_REMOVE (&active, hs, link);
+	      nactive--;
+	      handshake_finish (hs, res);
+	    }
+	}
+    }
+  return NULL;
+}
+
+/*
+ * Submit the connection PHTTP for handshake.  Return 0 on success and
+ * -1 if the handshake threads are not running.  In the latter case the
+ * caller should process the connection as usual.
+ */
+int
+tls_handshake_submit (POUND_HTTP *phttp)
+{
+  struct handshake *hs;
+  struct handshake_thread *ht;
+  LISTENER *lstn = phttp->lstn;
+
+  if (hs_thread == NULL)
+    return -1;
+
+  if ((hs = calloc (1, sizeof (*hs))) == NULL)
+    {
+      lognomem ();
+      goto err;
+    }
+
+  if ((phttp->ssl = listener_ssl_new (lstn)) == NULL)
+    {
+      logmsg (LOG_ERR, "SSL_new: failed");
+      goto err;
+    }
+  SSL_set_app_data (phttp->ssl, &phttp->reneg_state);
+  if (set_nonblock (phttp->sock, 1) || !SSL_set_fd (phttp->ssl, phttp->sock))
+    {
+      logmsg (LOG_ERR, "can't set up TLS socket: %s", strerror (errno));
+      goto err;
+    }
+  /*
+   * The BIO created by SSL_set_fd does not own the socket.  Make it do so,
+   * so that the socket gets closed along with the SSL object.
+   */
+  BIO_set_close (SSL_get_rbio (phttp->ssl), BIO_CLOSE);
+  SSL_set_accept_state (phttp->ssl);
+
+  hs->phttp = phttp;
+  hs->events = POLLIN;
+  hs->early = lstn->early_data > 0;
+  clock_gettime (CLOCK_MONOTONIC, &hs->start);
+  hs->deadline = hs->start;
+  hs->deadline.tv_sec += lstn->to;
+
+  pthread_mutex_lock (&hs_stat_mut);
+  hs_pending++;
+  pthread_mutex_unlock (&hs_stat_mut);
+
+  /* Only the dispatcher thread submits connections, so no locking here. */
+  ht = &hs_thread[hs_next];
+  hs_next = (hs_next + 1) % handshake_threads;
+
+  pthread_mutex_lock (&ht->mut);
+  DLIST_PUSH (&ht->incoming, hs, link);
+  pthread_mutex_unlock (&ht->mut);
+  /* If the pipe is full, the thread is going to wake up anyway. */
+  write (ht->wakeup[1], "", 1);
+
+  return 0;
+
+ err:
+  free (hs);
+  if (phttp->ssl)
+    {
+      SSL_free (phttp->ssl);
+      phttp->ssl = NULL;
+    }
+  close (phttp->sock);
+  pound_http_destroy (phttp);
+  return 0;
+}
+
+/*
+ * Start handshake threads, if there are any HTTPS listeners.
+ */
+void
+tls_handshake_start (pthread_attr_t *attr)
+{
+  LISTENER *lstn;
+  unsigned i;
+
+  if (handshake_threads == 0)
+    return;
+
+  SLIST_FOREACH (lstn, &listeners, next)
+    if (!SLIST_EMPTY (&lstn->ctx_head))
+      break;
+  if (!lstn)
+    return;
+
+  hs_thread = xcalloc (handshake_threads, sizeof (hs_thread[0]));
+  for (i = 0; i < handshake_threads; i++)
+    {
+      struct handshake_thread *ht = &hs_thread[i];
+      pthread_t tid;
+      int rc;
+
+      pthread_mutex_init (&ht->mut, NULL);
+      DLIST_INIT (&ht->incoming);
+      if (pipe (ht->wakeup))
+	abend ("can't create pipe: %s", strerror (errno));
+      set_nonblock (ht->wakeup[0], 1);
+      set_nonblock (ht->wakeup[1], 1);
+      if ((rc = pthread_create (&tid, attr, thr_handshake, ht)) != 0)
+	abend ("can't create handshake thread: %s", strerror (rc));
+    }
+}
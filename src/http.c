@@ -129,6 +129,18 @@ static HTTP_STATUS http_status[] = {
     "The length of the requested URL exceeds the capacity limit for"
     " this server."
   },
+  [HTTP_STATUS_TOO_EARLY] = {
+    425,
+    "Too Early",
+    "The server is unwilling to process a request that might be replayed."
+    " Please retry it."
+  },
+  [HTTP_STATUS_TOO_MANY_REQUESTS] = {
+    429,
+    "Too Many Requests",
+    "You have sent too many requests in a given amount of time."
+    " Please retry later."
+  },
   [HTTP_STATUS_INTERNAL_SERVER_ERROR] = {
     500,
     "Internal Server Error",
@@ -187,12 +199,14 @@ pound_to_http_status (int err)
  * Write to BIO an error HTTP 1.PROTO response.  ERR is one of
  * HTTP_STATUS_* constants.  TXT supplies the error page content.
  * If it is NULL, the default text from the http_status table is
- * used.
+ * used.  HEADERS, if not NULL, supplies additional headers, each
+ * terminated with CRLF.
  */
 static void
-bio_err_reply (BIO *bio, int proto, int err, char const *content)
+bio_err_reply (BIO *bio, int proto, int err, char const *content,
+	       char const *headers)
 {
-  struct stringbuf sb;
+  struct stringbuf sb, hb;
 
   if (!(err >= 0 && err < HTTP_STATUS_MAX))
     {
@@ -211,11 +225,32 @@ bio_err_reply (BIO *bio, int proto, int err, char const *content)
       if ((content = stringbuf_finish (&sb)) == NULL)
 	content = http_status[err].text;
     }
+  stringbuf_init_log (&hb);
+  if (headers)
+    {
+      stringbuf_add_string (&hb, err_headers);
+      stringbuf_add_string (&hb, headers);
+      headers = stringbuf_finish (&hb);
+    }
   bio_http_reply (bio, proto, http_status[err].code, http_status[err].reason,
-		  err_headers, "text/html", content);
+		  headers ? headers : err_headers, "text/html", content);
+  stringbuf_free (&hb);
   stringbuf_free (&sb);
 }
 
+/*
+ * Finish processing of the request PHTTP, to which an error reply with
+ * status ERR has been sent.  Since such replies close the connection,
+ * this is the common exit for requests refused by pound.
+ */
+static void
+http_err_finish (POUND_HTTP *phttp, int err)
+{
+  phttp->response_code = http_status[err].code;
+  phttp->conn_closed = 1;
+  trace_request_end (phttp, 1);
+}
+
 /*
  * Send error response to the client BIO.  ERR is one of HTTP_STATUS_*
  * constants.  Status code and reason phrase will be taken from the
@@ -227,8 +262,24 @@ static void
 http_err_reply (POUND_HTTP *phttp, int err)
 {
   bio_err_reply (phttp->cl, phttp->request.version, err,
-		 phttp->lstn->http_err[err]);
-  phttp->conn_closed = 1;
+		 phttp->lstn->http_err[err], NULL);
+  http_err_finish (phttp, err);
+}
+
+/*
+ * Send 429 response, asking the client to retry after RETRY_AFTER
+ * seconds.
+ */
+static void
+http_too_many_requests_reply (POUND_HTTP *phttp, unsigned retry_after)
+{
+  char buf[80];
+
+  snprintf (buf, sizeof (buf), "Retry-After: %u\r\n", retry_after);
+  bio_err_reply (phttp->cl, phttp->request.version,
+		 HTTP_STATUS_TOO_MANY_REQUESTS,
+		 phttp->lstn->http_err[HTTP_STATUS_TOO_MANY_REQUESTS], buf);
+  http_err_finish (phttp, HTTP_STATUS_TOO_MANY_REQUESTS);
 }
 
 static int
@@ -517,80 +568,187 @@ find_accessor (char const *input, size_t len, char **ret_arg, size_t *ret_arglen
 }
 
 /*
- * Expand backreferences and request accessors in STR, using the submatch
- * queue SMQ and HTTP request REQ.  If the latter is NULL, request accessors
- * are not handled.  Place the result in string buffer SB.  The string
- * WHAT gives the identifier for use in diagnostic messages.
- *
- * On success, returns number of expansions made.  If invalid references or
- * accessors are encountered, returns -1.  The failed references are copied
- * to the output buffer verbatim and error message is logged for each of
- * them.
+ * Expansion strings.
  *
- * Eventual memory allocation failures are handled by SB.  The caller is
- * supposed to check its error status.
+ * Strings that can contain back-references ($N, ${N}, $N(M) and %N) and
+ * request accessors (%[name arg]) are parsed once, when reading the
+ * configuration, into an array of segments.  Each segment is either
+ * literal text, a reference to a group of a submatch from the submatch
+ * queue, a request accessor with its function resolved, or a malformed
+ * reference, which is copied to the output verbatim with a warning.
+ * Literal text of all segments is kept in a single buffer.
  */
-static int
-expand_string_to_buffer (struct stringbuf *sb, char const *str,
-			 POUND_HTTP *phttp,
-			 struct http_request *req, char *what)
+enum
+  {
+    XSEG_LITERAL,    /* Literal text. */
+    XSEG_ACCESSOR,   /* Request accessor. */
+    XSEG_BACKREF,    /* Back-reference. */
+    XSEG_ERROR       /* Malformed reference. */
+  };
+
+struct expansion_segment
+{
+  int type;              /* Segment type (see above). */
+  size_t off;            /* Offset of the text in buf. */
+  size_t len;            /* Length of the text. */
+  union
+  {
+    struct
+    {
+      accessor_func func;
+      size_t argoff;     /* Argument offset in buf, or -1 if none. */
+      size_t arglen;
+    } acc;               /* XSEG_ACCESSOR */
+    struct
+    {
+      int refno;         /* Submatch number in the queue. */
+      long groupno;      /* Group number. */
+    } ref;               /* XSEG_BACKREF */
+    char *msg;           /* XSEG_ERROR: diagnostic message. */
+  } v;
+};
+
+struct expansion
+{
+  char *str;                         /* Source string. */
+  char *buf;                         /* Text of the segments. */
+  size_t segc;                       /* Number of segments. */
+  struct expansion_segment *segv;    /* Segments. */
+};
+
+struct expansion_builder
+{
+  EXPANSION *exp;
+  struct stringbuf text;
+  size_t segmax;
+};
+
+static struct expansion_segment *
+xseg_new (struct expansion_builder *xb, int type, char const *text,
+	  size_t len)
+{
+  EXPANSION *exp = xb->exp;
+  struct expansion_segment *seg;
+
+  if (exp->segc == xb->segmax)
+    exp->segv = x2nrealloc (exp->segv, &xb->segmax, sizeof (exp->segv[0]));
+  seg = &exp->segv[exp->segc++];
+  memset (seg, 0, sizeof (*seg));
+  seg->type = type;
+  seg->off = stringbuf_len (&xb->text);
+  seg->len = len;
+  stringbuf_add (&xb->text, text, len);
+  return seg;
+}
+
+static void
+xseg_literal (struct expansion_builder *xb, char const *text, size_t len)
+{
+  EXPANSION *exp = xb->exp;
+
+  if (len == 0)
+    return;
+  if (exp->segc > 0 && exp->segv[exp->segc-1].type == XSEG_LITERAL
+      && exp->segv[exp->segc-1].off + exp->segv[exp->segc-1].len
+	   == stringbuf_len (&xb->text))
+    {
+      exp->segv[exp->segc-1].len += len;
+      stringbuf_add (&xb->text, text, len);
+    }
+  else
+    xseg_new (xb, XSEG_LITERAL, text, len);
+}
+
+static void
+xseg_error (struct expansion_builder *xb, char const *text, size_t len,
+	    char const *fmt, ...)
+{
+  struct expansion_segment *seg = xseg_new (xb, XSEG_ERROR, text, len);
+  struct stringbuf sb;
+  va_list ap;
+
+  xstringbuf_init (&sb);
+  va_start (ap, fmt);
+  stringbuf_vprintf (&sb, fmt, ap);
+  va_end (ap);
+  seg->v.msg = stringbuf_finish (&sb);
+}
+
+/*
+ * Parse the string STR into an expansion.
+ */
+EXPANSION *
+expansion_compile (char const *str)
 {
+  struct expansion_builder xb;
+  EXPANSION *exp;
+  char const *start = str;
   char *p;
-  char const *start = str; /* Save the string for error reporting. */
-  int result = 0; /* Number of expansions made. */
+
+  XZALLOC (exp);
+  exp->str = xstrdup (str);
+  xb.exp = exp;
+  xb.segmax = 0;
+  xstringbuf_init (&xb.text);
 
   while (*str)
     {
       int brace;
       size_t len = strcspn (str, "$%");
-      stringbuf_add (sb, str, len);
+      xseg_literal (&xb, str, len);
       str += len;
       if (*str == 0)
 	break;
-      else if ((str[0] == '$' && (str[1] == '$' || str[1] == '%')) ||
-	       str[1] == 0)
+      else if (str[1] == 0)
+	{
+	  xseg_literal (&xb, str, 1);
+	  break;
+	}
+      else if (str[0] == '$' && (str[1] == '$' || str[1] == '%'))
 	{
-	  stringbuf_add_char (sb, str[0]);
+	  xseg_literal (&xb, str, 1);
 	  str += 2;
 	}
       else if (str[0] == '%' && isxdigit (str[1]) && isxdigit (str[2]))
 	{
-	  stringbuf_add (sb, str, 3);
+	  xseg_literal (&xb, str, 3);
 	  str += 3;
 	}
-      else if (req && str[0] == '%' && str[1] == '[')
+      else if (str[0] == '%' && str[1] == '[')
 	{
 	  char *q;
-	  size_t len;
 	  accessor_func acc;
 	  char *arg;
 	  size_t arglen;
-	  char const *val;
 
 	  q = strchr (str + 2, ']');
 	  if (q == NULL)
 	    {
-	      logmsg (LOG_WARNING, "%s \"%s\": unclosed %%[ at offset %d",
-		      what, start, (int)(str - start));
-	      stringbuf_add (sb, str, 2);
+	      xseg_error (&xb, str, 2, ": unclosed %%[ at offset %d",
+			  (int)(str - start));
 	      str += 2;
-	      result = -1;
 	      continue;
 	    }
 
 	  len = q - str;
 
 	  if ((acc = find_accessor (str + 2, len - 2, &arg, &arglen)) == NULL)
+	    xseg_literal (&xb, str, len + 1);
+	  else
 	    {
-	      stringbuf_add (sb, str, len + 1);
-	    }
-	  else if (acc (&phttp->request, arg, arglen, &val, &len) == 0 && val)
-	    {
-	      stringbuf_add (sb, val, len);
-	      if (result >= 0)
-		result++;
-	    }
+	      struct expansion_segment *seg;
 
+	      seg = xseg_new (&xb, XSEG_ACCESSOR, NULL, 0);
+	      seg->v.acc.func = acc;
+	      if (arg)
+		{
+		  seg->v.acc.argoff = stringbuf_len (&xb.text);
+		  seg->v.acc.arglen = arglen;
+		  stringbuf_add (&xb.text, arg, arglen);
+		}
+	      else
+		seg->v.acc.argoff = (size_t) -1;
+	    }
 	  str = q + 1;
 	}
       else if ((brace = (str[1] == '{')) || isdigit (str[1]))
@@ -600,7 +758,7 @@ expand_string_to_buffer (struct stringbuf *sb, char const *str,
 	  groupno = strtoul (str + 1 + brace, &p, 10);
 	  if (errno)
 	    {
-	      stringbuf_add (sb, str, 2);
+	      xseg_literal (&xb, str, 2);
 	      str += 2;
 	    }
 	  else
@@ -610,7 +768,7 @@ expand_string_to_buffer (struct stringbuf *sb, char const *str,
 	       * mean $N(1).
 	       */
 	      int refno = str[0] == '$' ? 0 : 1;
-	      struct submatch *sm;
+	      struct expansion_segment *seg;
 
 	      if (str[0] == '$' && *p == '(')
 		{
@@ -619,25 +777,20 @@ expand_string_to_buffer (struct stringbuf *sb, char const *str,
 		  n = strtoul (p + 1, &p, 10);
 		  if (errno || *p != ')')
 		    {
-		      int len = str - start + 1;
-		      logmsg (LOG_WARNING,
-			      "%s \"%s\": missing closing parenthesis in"
-			      " reference started in position %d ",
-			      what, start, len);
-		      stringbuf_add (sb, str, p - str);
+		      xseg_error (&xb, str, p - str,
+				  ": missing closing parenthesis in"
+				  " reference started in position %d ",
+				  (int)(str - start + 1));
 		      str = p;
-		      result = -1;
 		      continue;
 		    }
 		  if (n < 0 || n >= SMQ_SIZE)
 		    {
 		      int len = p - str + 1;
-		      logmsg (LOG_WARNING,
-			      "%s \"%s\" refers to non-existing group %*.*s",
-			      what, start, len, len, str);
-		      stringbuf_add (sb, str, p - str);
+		      xseg_error (&xb, str, p - str,
+				  " refers to non-existing group %*.*s",
+				  len, len, str);
 		      str = p;
-		      result = -1;
 		      continue;
 		    }
 		  refno = n;
@@ -648,77 +801,149 @@ expand_string_to_buffer (struct stringbuf *sb, char const *str,
 		{
 		  if (*p != '}')
 		    {
-		      int n = str - start + 1;
-		      logmsg (LOG_WARNING,
-			      "%s \"%s\": missing closing brace in reference"
-			      " started in position %d", what, start, n);
-		      stringbuf_add (sb, str, p - str);
+		      xseg_error (&xb, str, p - str,
+				  ": missing closing brace in reference"
+				  " started in position %d",
+				  (int)(str - start + 1));
 		      str = p;
-		      result = -1;
 		      continue;
 		    }
 		  p++;
 		}
 
-	      sm = submatch_queue_get (&phttp->smq, refno);
-
-	      if (sm->subject && groupno <= sm->matchn)
-		{
-		  stringbuf_add (sb, sm->subject + sm->matchv[groupno].rm_so,
-				 sm->matchv[groupno].rm_eo - sm->matchv[groupno].rm_so);
-		  if (result >= 0)
-		    result++;
-		}
-	      else
-		{
-		  int n = p - str;
-		  stringbuf_add (sb, str, n);
-		  logmsg (LOG_WARNING,
-			  "%s \"%s\" refers to non-existing group %*.*s",
-			  what, start, n, n, str);
-		  result = -1;
-		}
+	      seg = xseg_new (&xb, XSEG_BACKREF, str, p - str);
+	      seg->v.ref.refno = refno;
+	      seg->v.ref.groupno = groupno;
 	      str = p;
 	    }
 	}
       else
 	{
-	  int n = str - start + 1;
-	  logmsg (LOG_WARNING,
-		  "%s \"%s\": unescaped %% character in position %d",
-		  what, start, n);
-	  stringbuf_add_char (sb, *str);
+	  xseg_error (&xb, str, 1,
+		      ": unescaped %% character in position %d",
+		      (int)(str - start + 1));
 	  str++;
+	}
+    }
+
+  exp->buf = stringbuf_finish (&xb.text);
+  return exp;
+}
+
+void
+expansion_free (EXPANSION *exp)
+{
+  size_t i;
+
+  if (!exp)
+    return;
+  for (i = 0; i < exp->segc; i++)
+    if (exp->segv[i].type == XSEG_ERROR)
+      free (exp->segv[i].v.msg);
+  free (exp->segv);
+  free (exp->buf);
+  free (exp->str);
+  free (exp);
+}
+
+/*
+ * Expand backreferences and request accessors in EXP, using the submatch
+ * queue and request of PHTTP.  Place the result in string buffer SB.  The
+ * string WHAT gives the identifier for use in diagnostic messages.
+ *
+ * On success, returns number of expansions made.  If invalid references or
+ * accessors are encountered, returns -1.  The failed references are copied
+ * to the output buffer verbatim and error message is logged for each of
+ * them.
+ *
+ * Eventual memory allocation failures are handled by SB.  The caller is
+ * supposed to check its error status.
+ */
+static int
+expand_string_to_buffer (struct stringbuf *sb, EXPANSION const *exp,
+			 POUND_HTTP *phttp, char *what)
+{
+  int result = 0; /* Number of expansions made. */
+  size_t i;
+
+  for (i = 0; i < exp->segc; i++)
+    {
+      struct expansion_segment const *seg = &exp->segv[i];
+      char const *text = exp->buf + seg->off;
+      struct submatch *sm;
+      char const *val;
+      size_t len;
+
+      switch (seg->type)
+	{
+	case XSEG_LITERAL:
+	  stringbuf_add (sb, text, seg->len);
+	  break;
+
+	case XSEG_ACCESSOR:
+	  if (seg->v.acc.func (&phttp->request,
+			       seg->v.acc.argoff == (size_t) -1
+				 ? NULL : exp->buf + seg->v.acc.argoff,
+			       seg->v.acc.arglen, &val, &len) == 0 && val)
+	    {
+	      stringbuf_add (sb, val, len);
+	      if (result >= 0)
+		result++;
+	    }
+	  break;
+
+	case XSEG_BACKREF:
+	  sm = submatch_queue_get (&phttp->smq, seg->v.ref.refno);
+	  if (sm->subject && seg->v.ref.groupno <= sm->matchn)
+	    {
+	      regmatch_t const *m = &sm->matchv[seg->v.ref.groupno];
+	      stringbuf_add (sb, sm->subject + m->rm_so, m->rm_eo - m->rm_so);
+	      if (result >= 0)
+		result++;
+	    }
+	  else
+	    {
+	      int n = seg->len;
+	      stringbuf_add (sb, text, n);
+	      logmsg (LOG_WARNING,
+		      "%s \"%s\" refers to non-existing group %*.*s",
+		      what, exp->str, n, n, text);
+	      result = -1;
+	    }
+	  break;
+
+	case XSEG_ERROR:
+	  stringbuf_add (sb, text, seg->len);
+	  logmsg (LOG_WARNING, "%s \"%s\"%s", what, exp->str, seg->v.msg);
 	  result = -1;
+	  break;
 	}
     }
   return result;
 }
 
-char *
-expand_string (char const *str, POUND_HTTP *phttp, struct http_request *req,
-	       char *what)
+static char *
+expand_string (EXPANSION const *exp, POUND_HTTP *phttp, char *what)
 {
   struct stringbuf sb;
   char *p = NULL;
 
   stringbuf_init_log (&sb);
-  if (expand_string_to_buffer (&sb, str, phttp, req, what) == -1
+  if (expand_string_to_buffer (&sb, exp, phttp, what) == -1
       || (p = stringbuf_finish (&sb)) == NULL)
     stringbuf_free (&sb);
   return p;
 }
 
 static char *
-expand_url (char const *url, POUND_HTTP *phttp, int has_uri)
+expand_url (EXPANSION const *exp, POUND_HTTP *phttp, int has_uri)
 {
   struct stringbuf sb;
   char *p;
 
   stringbuf_init_log (&sb);
 
-  switch (expand_string_to_buffer (&sb, url, phttp, &phttp->request,
-				   "Redirect expression"))
+  switch (expand_string_to_buffer (&sb, exp, phttp, "Redirect expression"))
     {
     case -1:
       stringbuf_free (&sb);
@@ -740,7 +965,7 @@ expand_url (char const *url, POUND_HTTP *phttp, int has_uri)
   return p;
 }
 
-static int rewrite_apply (REWRITE_RULE_HEAD *rewrite_rules,
+static int rewrite_apply (struct rewrite_program const *prog,
 			  struct http_request *request, POUND_HTTP *phttp);
 
 /*
@@ -789,13 +1014,13 @@ redirect_response (POUND_HTTP *phttp)
       return HTTP_STATUS_INTERNAL_SERVER_ERROR;
     }
 
-  if (rewrite_apply (&phttp->lstn->rewrite[REWRITE_REQUEST], &phttp->request,
+  if (rewrite_apply (phttp->lstn->rewrite_prog[REWRITE_REQUEST], &phttp->request,
 		     phttp) ||
-      rewrite_apply (&phttp->svc->rewrite[REWRITE_REQUEST], &phttp->request,
+      rewrite_apply (phttp->svc->rewrite_prog[REWRITE_REQUEST], &phttp->request,
 		     phttp))
     return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 
-  xurl = expand_url (redirect->url, phttp, redirect->has_uri);
+  xurl = expand_url (redirect->exp, phttp, redirect->has_uri);
   if (!xurl)
     {
       return HTTP_STATUS_INTERNAL_SERVER_ERROR;
@@ -896,6 +1121,16 @@ copy_bin (BIO *cl, BIO *be, CONTENT_LENGTH cont, CONTENT_LENGTH *res_bytes,
   return 0;
 }
 
+/* ACME challenge file name: first group of the last match. */
+static EXPANSION *acme_file_exp;
+static pthread_once_t acme_file_once = PTHREAD_ONCE_INIT;
+
+static void
+acme_file_init (void)
+{
+  acme_file_exp = expansion_compile ("$1");
+}
+
 static int
 acme_response (POUND_HTTP *phttp)
 {
@@ -905,13 +1140,14 @@ acme_response (POUND_HTTP *phttp)
   char *file_name;
   int rc = HTTP_STATUS_OK;
 
-  if (rewrite_apply (&phttp->lstn->rewrite[REWRITE_REQUEST], &phttp->request,
+  if (rewrite_apply (phttp->lstn->rewrite_prog[REWRITE_REQUEST], &phttp->request,
 		     phttp) ||
-      rewrite_apply (&phttp->svc->rewrite[REWRITE_REQUEST], &phttp->request,
+      rewrite_apply (phttp->svc->rewrite_prog[REWRITE_REQUEST], &phttp->request,
 		     phttp))
     return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 
-  file_name = expand_url ("$1", phttp, 1);
+  pthread_once (&acme_file_once, acme_file_init);
+  file_name = expand_url (acme_file_exp, phttp, 1);
 
   if ((fd = openat (phttp->backend->v.acme.wd, file_name, O_RDONLY)) == -1)
     {
@@ -1004,8 +1240,8 @@ error_response (POUND_HTTP *phttp)
   if (parse_header_text (&req.headers, err_headers))
     return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 
-  if (rewrite_apply (&phttp->lstn->rewrite[REWRITE_RESPONSE], &req, phttp) ||
-      rewrite_apply (&phttp->svc->rewrite[REWRITE_RESPONSE], &req, phttp))
+  if (rewrite_apply (phttp->lstn->rewrite_prog[REWRITE_RESPONSE], &req, phttp) ||
+      rewrite_apply (phttp->svc->rewrite_prog[REWRITE_RESPONSE], &req, phttp))
     return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 
   bin = BIO_new_mem_buf (text, len);
@@ -1367,12 +1603,110 @@ copy_chunks (BIO *cl, BIO *be, CONTENT_LENGTH *res_bytes, int no_write,
 
 static int err_to = -1;
 
-typedef struct
+typedef struct bio_arg
 {
   int timeout;
   RENEG_STATE *reneg_state;
+
+  /*
+   * Deadline for reads, in addition to the per-read time-out.  If
+   * min_rate is 0, the deadline is fixed.  Otherwise, it is start +
+   * timeout + bytes / min_rate, i.e. it is moved forward as the data
+   * arrive.
+   */
+  int reason;                  /* CLIENT_TMO_* constant, or -1 if not set */
+  int expired;                 /* Reason of expired deadline, or -1 */
+  struct timespec start;       /* Start of the timed phase */
+  struct timespec deadline;    /* Fixed deadline */
+  unsigned min_rate;           /* Minimal rate, bytes per second */
+  CONTENT_LENGTH bytes;        /* Number of bytes read since start */
 } BIO_ARG;
 
+/*
+ * Arm the deadline REASON on the client BIO, expiring in SECONDS.
+ */
+static void
+bio_deadline_set (BIO_ARG *arg, int reason, unsigned seconds)
+{
+  if (!arg)
+    return;
+  clock_gettime (CLOCK_MONOTONIC, &arg->start);
+  arg->deadline = arg->start;
+  arg->deadline.tv_sec += seconds;
+  arg->min_rate = 0;
+  arg->reason = reason;
+}
+
+/*
+ * Arm the minimal rate deadline on the client BIO: reading must proceed
+ * at the rate of at least RATE bytes per second on average, after the
+ * initial allowance of the client time-out.
+ */
+static void
+bio_min_rate_set (BIO_ARG *arg, unsigned rate)
+{
+  if (!arg)
+    return;
+  clock_gettime (CLOCK_MONOTONIC, &arg->start);
+  arg->bytes = 0;
+  arg->min_rate = rate;
+  arg->reason = CLIENT_TMO_BODY_RATE;
+}
+
+static void
+bio_deadline_clear (BIO_ARG *arg)
+{
+  if (arg)
+    arg->reason = -1;
+}
+
+/*
+ * Return the number of milliseconds remaining till the deadline.
+ */
+static long
+bio_deadline_remaining (BIO_ARG *arg)
+{
+  struct timespec now, dl;
+  long ms;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  if (arg->min_rate)
+    {
+      dl = arg->start;
+      dl.tv_sec += (arg->timeout > 0 ? arg->timeout : 0)
+		   + arg->bytes / arg->min_rate;
+      dl.tv_nsec += (long) ((arg->bytes % arg->min_rate) * 1000000000LL
+			    / arg->min_rate);
+      if (dl.tv_nsec >= 1000000000)
+	{
+	  dl.tv_sec++;
+	  dl.tv_nsec -= 1000000000;
+	}
+    }
+  else
+    dl = arg->deadline;
+  ms = (dl.tv_sec - now.tv_sec) * 1000 + (dl.tv_nsec - now.tv_nsec) / 1000000;
+  return ms < 0 ? 0 : ms;
+}
+
+/*
+ * Check whether the client deadline has expired.  If so, account for
+ * it in the listener statistics and return the reason.  Otherwise,
+ * return -1.
+ */
+static int
+client_deadline_expired (POUND_HTTP *phttp)
+{
+  int reason;
+
+  if (!phttp->cl_arg || (reason = phttp->cl_arg->expired) == -1)
+    return -1;
+  pthread_mutex_lock (&phttp->lstn->tmo_mutex);
+  phttp->lstn->tmo_count[reason]++;
+  pthread_mutex_unlock (&phttp->lstn->tmo_mutex);
+  return reason;
+}
+
 /*
  * Time-out for client read/gets
  * the SSL manual says not to do it, but it works well enough anyway...
@@ -1389,7 +1723,7 @@ bio_callback
 {
   BIO_ARG *bio_arg;
   struct pollfd p;
-  int to, p_res, p_err;
+  int to, wait, p_res, p_err, dl;
 
   if ((bio_arg = (BIO_ARG *) BIO_get_callback_arg (bio)) == NULL)
     return ret;
@@ -1400,6 +1734,18 @@ bio_callback
       return ret;
     }
 
+  if (cmd == (BIO_CB_READ | BIO_CB_RETURN))
+    {
+      /* Count bytes for the minimal rate check. */
+      if (bio_arg->min_rate && ret > 0)
+#if OPENSSL_VERSION_MAJOR >= 3
+	bio_arg->bytes += *processed;
+#else
+	bio_arg->bytes += ret;
+#endif
+      return ret;
+    }
+
   if (cmd != BIO_CB_READ && cmd != BIO_CB_WRITE)
     return ret;
 
@@ -1426,15 +1772,26 @@ bio_callback
       return -1;
     }
 
-  if (to == 0)
+  if (to == 0 && (cmd != BIO_CB_READ || bio_arg->reason == -1))
     return ret;
 
   for (;;)
     {
+      wait = to ? to : -1;
+      dl = 0;
+      if (cmd == BIO_CB_READ && bio_arg->reason != -1)
+	{
+	  long rem = bio_deadline_remaining (bio_arg);
+	  if (wait == -1 || rem < wait)
+	    {
+	      wait = rem;
+	      dl = 1;
+	    }
+	}
       memset (&p, 0, sizeof (p));
       BIO_get_fd (bio, &p.fd);
       p.events = (cmd == BIO_CB_READ) ? (POLLIN | POLLPRI) : POLLOUT;
-      p_res = poll (&p, 1, to);
+      p_res = poll (&p, 1, wait);
       p_err = errno;
       switch (p_res)
 	{
@@ -1478,10 +1835,12 @@ bio_callback
 	   * timeout - mark the BIO as unusable for the future
 	   */
 	  bio_arg->timeout = err_to;
+	  if (dl)
+	    bio_arg->expired = bio_arg->reason;
 #ifdef  EBUG
 	  logmsg (LOG_WARNING,
-		  "(%lx) CALLBACK timeout poll after %d secs: %s",
-		  pthread_self (), to / 1000, strerror (p_err));
+		  "(%lx) CALLBACK timeout poll after %d msecs: %s",
+		  pthread_self (), wait, strerror (p_err));
 #endif
 	  errno = ETIMEDOUT;
 	  return 0;
@@ -1509,18 +1868,20 @@ bio_callback
     }
 }
 
-static void
+static BIO_ARG *
 set_callback (BIO *cl, int timeout, RENEG_STATE *state)
 {
-  BIO_ARG *arg = malloc (sizeof (*arg));
+  BIO_ARG *arg = calloc (1, sizeof (*arg));
   if (!arg)
     {
       lognomem ();
-      return;
+      return NULL;
     }
 
   arg->timeout = timeout;
   arg->reneg_state = state;
+  arg->reason = -1;
+  arg->expired = -1;
 
   BIO_set_callback_arg (cl, (char *) arg);
 #if OPENSSL_VERSION_MAJOR >= 3
@@ -1528,6 +1889,7 @@ set_callback (BIO *cl, int timeout, RENEG_STATE *state)
 #else
   BIO_set_callback (cl, bio_callback);
 #endif
+  return arg;
 }
 
 /*
@@ -2013,7 +2375,7 @@ http_header_list_append_list (HTTP_HEADER_LIST *head, HTTP_HEADER_LIST *add,
   return 0;
 }
 
-static void
+void
 http_header_list_free (HTTP_HEADER_LIST *head)
 {
   while (!DLIST_EMPTY (head))
@@ -2858,55 +3220,206 @@ match_headers (HTTP_HEADER_LIST *headers, regex_t const *re,
   return 0;
 }
 
-int
-match_cond (SERVICE_COND *cond, POUND_HTTP *phttp,
-	    struct http_request *req)
+/*
+ * Given the Host: header HDR, return pointer to its value.
+ */
+static char const *
+host_header_value (char const *hdr)
 {
-  int res = 1;
-  SERVICE_COND *subcond;
-  char const *str;
+  /* Skip initial whitespace and "host:" */
+  hdr += strspn (hdr, " \t\n") + 5;
+  /* Skip whitespace after header name. */
+  return hdr + strspn (hdr, " \t\n");
+}
 
-  switch (cond->type)
+/*
+ * Store the subject STR, matched as a whole, in the submatch SM.
+ * Return 1 on success and -1 on error.
+ */
+static int
+submatch_set_whole (struct submatch *sm, char const *str)
+{
+  submatch_free (sm);
+  if ((sm->matchv = malloc (sizeof (sm->matchv[0]))) == NULL
+      || (sm->subject = strdup (str)) == NULL)
     {
-    case COND_ACL:
-      res = acl_match (cond->acl, phttp->from_host.ai_addr) == 0;
-      break;
+      lognomem ();
+      return -1;
+    }
+  sm->matchmax = sm->matchn = 1;
+  sm->matchv[0].rm_so = 0;
+  sm->matchv[0].rm_eo = strlen (str);
+  return 1;
+}
+
+/*
+ * Match the pattern list PL against the request REQ.
+ *
+ * For literal lists, return 1 if one of the patterns matches, 0 if none
+ * does, and -1 on error.  The submatch queue is updated as if the
+ * matching pattern were tried alone.
+ *
+ * For regular expressions, return 0 if none of the patterns can match
+ * and 1 if the patterns need to be tried one by one.
+ */
+static int
+match_pattern_list (struct pattern_list *pl, POUND_HTTP *phttp,
+		    struct http_request *req)
+{
+  char const *str = NULL;
+  char *subj = NULL;
+  struct http_header *hdr;
+  char const *match = NULL;
+  ssize_t n, idx = -1;
+  int res = 0;
 
+  switch (pl->type)
+    {
     case COND_URL:
       if (http_request_get_url (req, &str) == -1)
-	res = -1;
-      else
-	res = submatch_exec (&cond->re, str, submatch_queue_push (&phttp->smq));
+	return pl->mode == PATLIST_REGEX ? 1 : -1;
       break;
 
     case COND_PATH:
       if (http_request_get_path (req, &str) == -1)
-	res = -1;
-      else
-	res = submatch_exec (&cond->re, str, submatch_queue_push (&phttp->smq));
+	return pl->mode == PATLIST_REGEX ? 1 : -1;
       break;
 
     case COND_QUERY:
       if (http_request_get_query (req, &str) == -1)
-	res = -1;
-      else
-	res = submatch_exec (&cond->re, str, submatch_queue_push (&phttp->smq));
+	return pl->mode == PATLIST_REGEX ? 1 : -1;
       break;
 
     case COND_QUERY_PARAM:
-      switch (http_request_get_query_param_value (req, cond->sm.string->value,
+      switch (http_request_get_query_param_value (req, pl->string->value,
 						  &str))
 	{
 	case RETRIEVE_ERROR:
-	  res = -1;
-	  break;
+	  return pl->mode == PATLIST_REGEX ? 1 : -1;
 
 	case RETRIEVE_NOT_FOUND:
-	  res = 0;
+	  str = NULL;
 	  break;
 
 	default:
-	  if (str == NULL)
+	  break;
+	}
+      if (str == NULL)
+	{
+	  if (pl->mode == PATLIST_REGEX)
+	    break;
+	  submatch_queue_push (&phttp->smq);
+	  return 0;
+	}
+      break;
+
+    case COND_STRING_MATCH:
+      subj = expand_string (pl->string->exp, phttp, "string_match");
+      if (subj == NULL)
+	return pl->mode == PATLIST_REGEX ? 1 : -1;
+      str = subj;
+      break;
+
+    case COND_HDR:
+    case COND_HOST:
+      DLIST_FOREACH (hdr, &req->headers, link)
+	{
+	  char const *s = hdr->header;
+
+	  if (s == NULL)
+	    continue;
+	  if (pl->mode == PATLIST_REGEX)
+	    {
+	      if (pattern_list_regexec (pl, s))
+		return 1;
+	      continue;
+	    }
+	  if (pl->type == COND_HOST)
+	    {
+	      if (strncasecmp (s, "host:", 5))
+		continue;
+	      s = host_header_value (s);
+	    }
+	  if ((n = pattern_list_lookup (pl, s)) != -1
+	      && (idx == -1 || n < idx))
+	    {
+	      idx = n;
+	      match = s;
+	    }
+	}
+      break;
+
+    default:
+      abort ();
+    }
+
+  if (pl->mode == PATLIST_REGEX)
+    {
+      if (str)
+	res = pattern_list_regexec (pl, str);
+    }
+  else
+    {
+      if (str && pattern_list_lookup (pl, str) != -1)
+	match = str;
+      if (match)
+	res = submatch_set_whole (submatch_queue_push (&phttp->smq), match);
+    }
+  free (subj);
+  if (res == 0)
+    submatch_queue_push (&phttp->smq);
+  return res;
+}
+
+int
+match_cond (SERVICE_COND *cond, POUND_HTTP *phttp,
+	    struct http_request *req)
+{
+  int res = 1;
+  SERVICE_COND *subcond;
+  char const *str;
+
+  switch (cond->type)
+    {
+    case COND_ACL:
+      res = acl_match (cond->acl, phttp->from_host.ai_addr) == 0;
+      break;
+
+    case COND_URL:
+      if (http_request_get_url (req, &str) == -1)
+	res = -1;
+      else
+	res = submatch_exec (&cond->re, str, submatch_queue_push (&phttp->smq));
+      break;
+
+    case COND_PATH:
+      if (http_request_get_path (req, &str) == -1)
+	res = -1;
+      else
+	res = submatch_exec (&cond->re, str, submatch_queue_push (&phttp->smq));
+      break;
+
+    case COND_QUERY:
+      if (http_request_get_query (req, &str) == -1)
+	res = -1;
+      else
+	res = submatch_exec (&cond->re, str, submatch_queue_push (&phttp->smq));
+      break;
+
+    case COND_QUERY_PARAM:
+      switch (http_request_get_query_param_value (req, cond->sm.string->value,
+						  &str))
+	{
+	case RETRIEVE_ERROR:
+	  res = -1;
+	  break;
+
+	case RETRIEVE_NOT_FOUND:
+	  res = 0;
+	  break;
+
+	default:
+	  if (str == NULL)
 	    res = 0;
 	  else
 	    res = submatch_exec (&cond->sm.re, str,
@@ -2930,15 +3443,11 @@ match_cond (SERVICE_COND *cond, POUND_HTTP *phttp,
 	   */
 	  struct submatch *sm = submatch_queue_get (&phttp->smq, 0);
 	  int n, i;
-	  char const *s = sm->subject;
+	  char const *s = host_header_value (sm->subject);
 	  regmatch_t *mv = sm->matchv;
 	  int mc = sm->matchn;
 	  char *p;
 
-	  /* Skip initial whitespace and "host:" */
-	  s += strspn (s, " \t\n") + 5;
-	  /* Skip whitespace after header name. */
-	  s += strspn (s, " \t\n");
 	  /* Compute fix-up offset. */
 	  n = s - sm->subject;
 	  /* Adjust all subgroups. */
@@ -2971,8 +3480,7 @@ match_cond (SERVICE_COND *cond, POUND_HTTP *phttp,
       {
 	char *subj;
 
-	subj = expand_string (cond->sm.string->value, phttp, req,
-			      "string_match");
+	subj = expand_string (cond->sm.string->exp, phttp, "string_match");
 	if (subj)
 	  {
 	    res = submatch_exec (&cond->sm.re, subj,
@@ -2985,6 +3493,12 @@ match_cond (SERVICE_COND *cond, POUND_HTTP *phttp,
       break;
 
     case COND_BOOL:
+      if (cond->bool.patlist)
+	{
+	  res = match_pattern_list (cond->bool.patlist, phttp, req);
+	  if (res != 1 || cond->bool.patlist->mode != PATLIST_REGEX)
+	    break;
+	}
       if (cond->bool.op == BOOL_NOT)
 	{
 	  subcond = SLIST_FIRST (&cond->bool.head);
@@ -3102,8 +3616,12 @@ add_forwarded_headers (POUND_HTTP *phttp)
   return 0;
 }
 
+/*
+ * Compute the X-SSL-* headers for the connection PHTTP and store them in
+ * its ssl_headers list.
+ */
 static int
-add_ssl_headers (POUND_HTTP *phttp)
+ssl_headers_init (POUND_HTTP *phttp)
 {
   int res = 0;
   const SSL_CIPHER *cipher;
@@ -3121,7 +3639,7 @@ add_ssl_headers (POUND_HTTP *phttp)
 			SSL_get_version (phttp->ssl),
 			buf);
       if ((str = stringbuf_finish (&sb)) == NULL
-	  || http_header_list_append (&phttp->request.headers, str, H_REPLACE))
+	  || http_header_list_append (&phttp->ssl_headers, str, H_REPLACE))
 	{
 	  res = -1;
 	  goto end;
@@ -3137,7 +3655,7 @@ add_ssl_headers (POUND_HTTP *phttp)
       get_line (bio, buf, sizeof (buf));
       stringbuf_printf (&sb, "X-SSL-Subject: %s", buf);
       if ((str = stringbuf_finish (&sb)) == NULL
-	  || http_header_list_append (&phttp->request.headers, str, H_REPLACE))
+	  || http_header_list_append (&phttp->ssl_headers, str, H_REPLACE))
 	{
 	  res = -1;
 	  goto end;
@@ -3149,7 +3667,7 @@ add_ssl_headers (POUND_HTTP *phttp)
       get_line (bio, buf, sizeof (buf));
       stringbuf_printf (&sb, "X-SSL-Issuer: %s", buf);
       if ((str = stringbuf_finish (&sb)) == NULL
-	  || http_header_list_append (&phttp->request.headers, str, H_REPLACE))
+	  || http_header_list_append (&phttp->ssl_headers, str, H_REPLACE))
 	{
 	  res = -1;
 	  goto end;
@@ -3160,7 +3678,7 @@ add_ssl_headers (POUND_HTTP *phttp)
       get_line (bio, buf, sizeof (buf));
       stringbuf_printf (&sb, "X-SSL-notBefore: %s", buf);
       if ((str = stringbuf_finish (&sb)) == NULL
-	  || http_header_list_append (&phttp->request.headers, str, H_REPLACE))
+	  || http_header_list_append (&phttp->ssl_headers, str, H_REPLACE))
 	{
 	  res = -1;
 	  goto end;
@@ -3171,7 +3689,7 @@ add_ssl_headers (POUND_HTTP *phttp)
       get_line (bio, buf, sizeof (buf));
       stringbuf_printf (&sb, "X-SSL-notAfter: %s", buf);
       if ((str = stringbuf_finish (&sb)) == NULL
-	  || http_header_list_append (&phttp->request.headers, str, H_REPLACE))
+	  || http_header_list_append (&phttp->ssl_headers, str, H_REPLACE))
 	{
 	  res = -1;
 	  goto end;
@@ -3181,7 +3699,7 @@ add_ssl_headers (POUND_HTTP *phttp)
       stringbuf_printf (&sb, "X-SSL-serial: %ld",
 			ASN1_INTEGER_get (X509_get_serialNumber (phttp->x509)));
       if ((str = stringbuf_finish (&sb)) == NULL
-	  || http_header_list_append (&phttp->request.headers, str, H_REPLACE))
+	  || http_header_list_append (&phttp->ssl_headers, str, H_REPLACE))
 	{
 	  res = -1;
 	  goto end;
@@ -3195,7 +3713,7 @@ add_ssl_headers (POUND_HTTP *phttp)
 	  stringbuf_add_string (&sb, buf);
 	}
       if ((str = stringbuf_finish (&sb)) == NULL
-	  || http_header_list_append (&phttp->request.headers, str, H_REPLACE))
+	  || http_header_list_append (&phttp->ssl_headers, str, H_REPLACE))
 	{
 	  res = -1;
 	  goto end;
@@ -3210,26 +3728,116 @@ add_ssl_headers (POUND_HTTP *phttp)
   return res;
 }
 
-static int rewrite_rule_check (REWRITE_RULE *rule,
-			       struct http_request *request,
-			       POUND_HTTP *phttp);
+/*
+ * Add X-SSL-* headers to the request.  They don't change during the
+ * lifetime of the connection, so they are computed once, when handling
+ * its first request, and reused for the subsequent ones.
+ */
+static int
+add_ssl_headers (POUND_HTTP *phttp)
+{
+  if (!phttp->ssl_headers_ready)
+    {
+      if (ssl_headers_init (phttp))
+	return -1;
+      phttp->ssl_headers_ready = 1;
+    }
+  return http_header_list_append_list (&phttp->request.headers,
+				       &phttp->ssl_headers, H_REPLACE);
+}
+
+/*
+ * Rewrite programs.
+ *
+ * Rewrite rules of a listener or service are compiled into a flat array
+ * of instructions.  A rule with its chain of "Else" branches compiles to
+ *
+ *	COND c1, L1
+ *	<operations of rule 1>
+ *	JUMP END
+ *   L1:
+ *	COND c2, L2
+ *	<operations of rule 2>
+ *	JUMP END
+ *   L2:
+ *	...
+ *   END:
+ *
+ * COND is omitted for rules without conditions.  Nested "Rewrite"
+ * sections are compiled inline.  The array is terminated by HALT.
+ * Expansion strings of the operations are pre-parsed (see above).
+ */
+enum rewrite_opcode
+  {
+    RWI_HALT,             /* Stop successfully. */
+    RWI_COND,             /* Go to jump unless cond matches. */
+    RWI_JUMP,             /* Go to jump. */
+    RWI_HDR_DEL,          /* Remove headers matching hdrdel. */
+    RWI_HDR_SET,          /* Set header from exp. */
+    RWI_URL_SET,          /* Set URL from exp. */
+    RWI_PATH_SET,         /* Set path from exp. */
+    RWI_QUERY_SET,        /* Set query from exp. */
+    RWI_QUERY_PARAM_SET   /* Set query parameter name from exp. */
+  };
+
+struct rewrite_insn
+{
+  enum rewrite_opcode opcode;
+  size_t jump;                 /* RWI_COND, RWI_JUMP: target index. */
+  union
+  {
+    SERVICE_COND *cond;        /* RWI_COND */
+    MATCHER *hdrdel;           /* RWI_HDR_DEL */
+    char *name;                /* RWI_QUERY_PARAM_SET */
+  };
+  EXPANSION *exp;              /* RWI_*_SET */
+};
+
+struct rewrite_program
+{
+  size_t len;                  /* Number of instructions. */
+  size_t max;                  /* Allocated slots. */
+  struct rewrite_insn *insn;   /* Instructions. */
+};
+
+/* Marks the end of the JUMP chain being patched. */
+#define RWI_NOJUMP ((size_t)-1)
 
+static struct rewrite_insn *
+rewrite_emit (struct rewrite_program *prog, enum rewrite_opcode opcode)
+{
+  struct rewrite_insn *insn;
+
+  if (prog->len == prog->max)
+    prog->insn = x2nrealloc (prog->insn, &prog->max, sizeof (prog->insn[0]));
+  insn = &prog->insn[prog->len++];
+  memset (insn, 0, sizeof (*insn));
+  insn->opcode = opcode;
+  return insn;
+}
+
+/* Return true if COND always yields true. */
 static int
-rewrite_op_apply (REWRITE_OP_HEAD *head, struct http_request *request,
-		  POUND_HTTP *phttp)
+cond_is_true (SERVICE_COND const *cond)
+{
+  return cond->type == COND_BOOL && cond->bool.op == BOOL_AND
+	 && cond->bool.patlist == NULL && SLIST_EMPTY (&cond->bool.head);
+}
+
+static void rewrite_compile_rule (struct rewrite_program *prog,
+				  REWRITE_RULE *rule);
+
+static void
+rewrite_compile_ops (struct rewrite_program *prog, REWRITE_OP_HEAD *head)
 {
-  int res = 0;
   REWRITE_OP *op;
-  char *s;
+  struct rewrite_insn *insn;
 
-  static struct
-  {
-    char *name;
-    int (*setter) (struct http_request *, char const *);
-  } rwtab[] = {
-    [REWRITE_URL_SET]    = { "url", http_request_set_url },
-    [REWRITE_PATH_SET]   = { "path", http_request_set_path },
-    [REWRITE_QUERY_SET]  = { "query", http_request_set_query },
+  static enum rewrite_opcode optab[] = {
+    [REWRITE_HDR_SET]         = RWI_HDR_SET,
+    [REWRITE_URL_SET]         = RWI_URL_SET,
+    [REWRITE_PATH_SET]        = RWI_PATH_SET,
+    [REWRITE_QUERY_SET]       = RWI_QUERY_SET,
   };
 
   SLIST_FOREACH (op, head, next)
@@ -3237,15 +3845,151 @@ rewrite_op_apply (REWRITE_OP_HEAD *head, struct http_request *request,
       switch (op->type)
 	{
 	case REWRITE_REWRITE_RULE:
-	  res = rewrite_rule_check (op->v.rule, request, phttp);
+	  rewrite_compile_rule (prog, op->v.rule);
 	  break;
 
 	case REWRITE_HDR_DEL:
-	  http_header_list_filter (&request->headers, op->v.hdrdel);
+	  rewrite_emit (prog, RWI_HDR_DEL)->hdrdel = op->v.hdrdel;
+	  break;
+
+	case REWRITE_QUERY_PARAM_SET:
+	  insn = rewrite_emit (prog, RWI_QUERY_PARAM_SET);
+	  insn->name = op->v.qp.name;
+	  insn->exp = expansion_compile (op->v.qp.value);
 	  break;
 
-	case REWRITE_HDR_SET:
-	  if ((s = expand_string (op->v.str, phttp, request, "Header")) != NULL)
+	default:
+	  insn = rewrite_emit (prog, optab[op->type]);
+	  insn->exp = expansion_compile (op->v.str);
+	}
+    }
+}
+
+static void
+rewrite_compile_rule (struct rewrite_program *prog, REWRITE_RULE *rule)
+{
+  size_t jumps = RWI_NOJUMP; /* Chain of JUMPs to the end of the rule. */
+
+  for (; rule; rule = rule->iffalse)
+    {
+      size_t cond = RWI_NOJUMP;
+
+      if (!cond_is_true (&rule->cond))
+	{
+	  cond = prog->len;
+	  rewrite_emit (prog, RWI_COND)->cond = &rule->cond;
+	}
+      rewrite_compile_ops (prog, &rule->ophead);
+      if (cond == RWI_NOJUMP)
+	/* Remaining branches are never reached. */
+	break;
+      if (rule->iffalse)
+	{
+	  rewrite_emit (prog, RWI_JUMP)->jump = jumps;
+	  jumps = prog->len - 1;
+	}
+      prog->insn[cond].jump = prog->len;
+    }
+
+  while (jumps != RWI_NOJUMP)
+    {
+      size_t next = prog->insn[jumps].jump;
+      prog->insn[jumps].jump = prog->len;
+      jumps = next;
+    }
+}
+
+/*
+ * Compile the list of rewrite rules HEAD.  Return NULL if it is empty.
+ */
+static struct rewrite_program *
+rewrite_compile (REWRITE_RULE_HEAD *head)
+{
+  struct rewrite_program *prog;
+  REWRITE_RULE *rule;
+
+  if (SLIST_EMPTY (head))
+    return NULL;
+  XZALLOC (prog);
+  SLIST_FOREACH (rule, head, next)
+    rewrite_compile_rule (prog, rule);
+  rewrite_emit (prog, RWI_HALT);
+  return prog;
+}
+
+static void
+service_rewrite_compile (SERVICE *svc)
+{
+  svc->rewrite_prog[REWRITE_REQUEST] =
+    rewrite_compile (&svc->rewrite[REWRITE_REQUEST]);
+  svc->rewrite_prog[REWRITE_RESPONSE] =
+    rewrite_compile (&svc->rewrite[REWRITE_RESPONSE]);
+}
+
+static int
+listener_rewrite_compile (LISTENER *lstn, void *data)
+{
+  SERVICE *svc;
+
+  lstn->rewrite_prog[REWRITE_REQUEST] =
+    rewrite_compile (&lstn->rewrite[REWRITE_REQUEST]);
+  lstn->rewrite_prog[REWRITE_RESPONSE] =
+    rewrite_compile (&lstn->rewrite[REWRITE_RESPONSE]);
+  SLIST_FOREACH (svc, &lstn->services, next)
+    service_rewrite_compile (svc);
+  return 0;
+}
+
+void
+rewrite_init (void)
+{
+  SERVICE *svc;
+
+  foreach_listener (listener_rewrite_compile, NULL);
+  SLIST_FOREACH (svc, &services, next)
+    service_rewrite_compile (svc);
+}
+
+static int
+rewrite_apply (struct rewrite_program const *prog,
+	       struct http_request *request, POUND_HTTP *phttp)
+{
+  struct rewrite_insn const *insn;
+  int res = 0;
+  char *s;
+
+  static struct
+  {
+    char *name;
+    int (*setter) (struct http_request *, char const *);
+  } rwtab[] = {
+    [RWI_URL_SET]    = { "url", http_request_set_url },
+    [RWI_PATH_SET]   = { "path", http_request_set_path },
+    [RWI_QUERY_SET]  = { "query", http_request_set_query },
+  };
+
+  if (prog == NULL)
+    return 0;
+
+  for (insn = prog->insn; insn->opcode != RWI_HALT; insn++)
+    {
+      switch (insn->opcode)
+	{
+	case RWI_COND:
+	  if (!match_cond (insn->cond, phttp, request))
+	    insn = prog->insn + insn->jump - 1;
+	  continue;
+
+	case RWI_JUMP:
+	  insn = prog->insn + insn->jump - 1;
+	  continue;
+
+	case RWI_HDR_DEL:
+	  http_header_list_filter (&request->headers, insn->hdrdel);
+	  continue;
+
+	case RWI_HDR_SET:
+	  if ((s = expand_string (insn->exp, phttp, "Header")) != NULL)
 	    {
 	      res = http_header_list_append (&request->headers, s, H_REPLACE);
 	      free (s);
@@ -3254,11 +3998,11 @@ rewrite_op_apply (REWRITE_OP_HEAD *head, struct http_request *request,
 	    res = -1;
 	  break;
 
-	case REWRITE_QUERY_PARAM_SET:
-	  if ((s = expand_string (op->v.qp.value, phttp, request,
+	case RWI_QUERY_PARAM_SET:
+	  if ((s = expand_string (insn->exp, phttp,
 				  "query parameter")) != NULL)
 	    {
-	      res = http_request_set_query_param (request, op->v.qp.name, s);
+	      res = http_request_set_query_param (request, insn->name, s);
 	      free (s);
 	    }
 	  else
@@ -3266,10 +4010,10 @@ rewrite_op_apply (REWRITE_OP_HEAD *head, struct http_request *request,
 	  break;
 
 	default:
-	  if ((s = expand_string (op->v.str, phttp, request,
-				  rwtab[op->type].name)) != NULL)
+	  if ((s = expand_string (insn->exp, phttp,
+				  rwtab[insn->opcode].name)) != NULL)
 	    {
-	      res = rwtab[op->type].setter (request, s);
+	      res = rwtab[insn->opcode].setter (request, s);
 	      free (s);
 	    }
 	  else
@@ -3283,39 +4027,6 @@ rewrite_op_apply (REWRITE_OP_HEAD *head, struct http_request *request,
   return res;
 }
 
-static int
-rewrite_rule_check (REWRITE_RULE *rule, struct http_request *request,
-		    POUND_HTTP *phttp)
-{
-  int res = 0;
-
-  do
-    {
-      if (match_cond (&rule->cond, phttp, request))
-	{
-	  res = rewrite_op_apply (&rule->ophead, request, phttp);
-	  break;
-	}
-    }
-  while ((rule = rule->iffalse) != NULL);
-  return res;
-}
-
-static int
-rewrite_apply (REWRITE_RULE_HEAD *rewrite_rules,
-	       struct http_request *request, POUND_HTTP *phttp)
-{
-  int res = 0;
-  REWRITE_RULE *rule;
-
-  SLIST_FOREACH (rule, rewrite_rules, next)
-    {
-      if ((res = rewrite_rule_check (rule, request, phttp)) != 0)
-	break;
-    }
-  return res;
-}
-
 /*
  * Cleanup code. This should really be in the pthread_cleanup_push, except
  * for bugs in some implementations
@@ -3411,21 +4122,23 @@ backend_response (POUND_HTTP *phttp)
 
       if (http_request_read (phttp->be, phttp->lstn, &phttp->response))
 	{
-	  logmsg (LOG_NOTICE,
-		  "(%"PRItid") e500 for %s response error read from %s/%s: %s (%s secs)",
-		  POUND_TID (),
-		  addr2str (caddr, sizeof (caddr), &phttp->from_host, 1),
-		  str_be (caddr2, sizeof (caddr2), phttp->backend),
-		  phttp->request.request, strerror (errno),
-		  log_duration (duration_buf, sizeof (duration_buf),
-				&phttp->start_req));
+	  logmsg_throttled (LOG_NOTICE,
+			    "(%"PRItid") e500 for %s response error read from %s/%s: %s (%s secs)",
+			    POUND_TID (),
+			    addr2str (caddr, sizeof (caddr), &phttp->from_host, 1),
+			    str_be (caddr2, sizeof (caddr2), phttp->backend),
+			    phttp->request.request, strerror (errno),
+			    log_duration (duration_buf, sizeof (duration_buf),
+					  &phttp->start_req));
 	  return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 	}
+      if (!phase_is_set (phttp, PHASE_FIRST_BYTE))
+	phase_mark (phttp, PHASE_FIRST_BYTE);
 
-      if (rewrite_apply (&phttp->lstn->rewrite[REWRITE_RESPONSE],
+      if (rewrite_apply (phttp->lstn->rewrite_prog[REWRITE_RESPONSE],
 			 &phttp->response,
 			 phttp) ||
-	  rewrite_apply (&phttp->svc->rewrite[REWRITE_RESPONSE],
+	  rewrite_apply (phttp->svc->rewrite_prog[REWRITE_RESPONSE],
 			 &phttp->response,
 			 phttp))
 	return HTTP_STATUS_INTERNAL_SERVER_ERROR;
@@ -3881,9 +4594,30 @@ backend_response (POUND_HTTP *phttp)
   return HTTP_STATUS_OK;
 }
 
+/*
+ * Disarm the minimal body rate deadline.  Return 1 if it has expired,
+ * and 0 otherwise.
+ */
+static int
+client_body_rate_expired (POUND_HTTP *phttp)
+{
+  char caddr[MAX_ADDR_BUFSIZE];
+
+  bio_deadline_clear (phttp->cl_arg);
+  if (client_deadline_expired (phttp) == CLIENT_TMO_BODY_RATE)
+    {
+      logmsg (LOG_NOTICE, "(%"PRItid") request body from %s is too slow",
+	      POUND_TID (),
+	      addr2str (caddr, sizeof (caddr), &phttp->from_host, 1));
+      return 1;
+    }
+  return 0;
+}
+
 /*
  * Pass the request to the backend.  Return 0 on success and pound
- * http error number otherwise.
+ * http error number otherwise.  Return -1 if the connection must be
+ * dropped.
  */
 static int
 send_to_backend (POUND_HTTP *phttp, int chunked, CONTENT_LENGTH content_length)
@@ -3951,6 +4685,18 @@ send_to_backend (POUND_HTTP *phttp, int chunked, CONTENT_LENGTH content_length)
 	lognomem ();
     }
 
+  if (trace_inject (phttp))
+    lognomem ();
+
+  if (phttp->early_req)
+    {
+      /* RFC 8470, Section 5.1 */
+      static char early_data_header[] = "Early-Data: 1";
+      if (http_header_list_append (&phttp->request.headers, early_data_header,
+				   H_KEEP))
+	lognomem ();
+    }
+
   if (phttp->backend->v.reg.servername)
     {
       struct stringbuf sb;
@@ -3971,9 +4717,9 @@ send_to_backend (POUND_HTTP *phttp, int chunked, CONTENT_LENGTH content_length)
 	return HTTP_STATUS_INTERNAL_SERVER_ERROR;
     }
 
-  if (rewrite_apply (&phttp->lstn->rewrite[REWRITE_REQUEST], &phttp->request,
+  if (rewrite_apply (phttp->lstn->rewrite_prog[REWRITE_REQUEST], &phttp->request,
 		     phttp)
-      || rewrite_apply (&phttp->svc->rewrite[REWRITE_REQUEST], &phttp->request,
+      || rewrite_apply (phttp->svc->rewrite_prog[REWRITE_REQUEST], &phttp->request,
 			phttp))
     return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 
@@ -3984,12 +4730,12 @@ send_to_backend (POUND_HTTP *phttp, int chunked, CONTENT_LENGTH content_length)
     {
       if (errno)
 	{
-	  logmsg (LOG_WARNING,
-		  "(%"PRItid") e500 error write to %s/%s: %s (%s sec)",
-		  POUND_TID (),
-		  str_be (caddr, sizeof (caddr), phttp->backend),
-		  phttp->request.request, strerror (errno),
-		  log_duration (duration_buf, sizeof (duration_buf), &phttp->start_req));
+	  logmsg_throttled (LOG_WARNING,
+			    "(%"PRItid") e500 error write to %s/%s: %s (%s sec)",
+			    POUND_TID (),
+			    str_be (caddr, sizeof (caddr), phttp->backend),
+			    phttp->request.request, strerror (errno),
+			    log_duration (duration_buf, sizeof (duration_buf), &phttp->start_req));
 	}
       return HTTP_STATUS_INTERNAL_SERVER_ERROR;
     }
@@ -3999,15 +4745,20 @@ send_to_backend (POUND_HTTP *phttp, int chunked, CONTENT_LENGTH content_length)
    */
   BIO_puts (phttp->be, "\r\n");
 
+  if (phttp->lstn->body_min_rate && (chunked || content_length > 0))
+    bio_min_rate_set (phttp->cl_arg, phttp->lstn->body_min_rate);
+
   if (chunked)
     {
       /*
        * had Transfer-encoding: chunked so read/write all the chunks
        * (HTTP/1.1 only)
        */
-      int rc = copy_chunks (phttp->cl, phttp->be, NULL,
+      int rc = copy_chunks (phttp->cl, phttp->be, &phttp->req_bytes,
 			    phttp->backend->be_type != BE_BACKEND,
 			    phttp->lstn->max_req);
+      if (client_body_rate_expired (phttp))
+	return -1;
       if (rc != HTTP_STATUS_OK)
 	{
 	  logmsg (LOG_NOTICE,
@@ -4027,8 +4778,12 @@ send_to_backend (POUND_HTTP *phttp, int chunked, CONTENT_LENGTH content_length)
       /*
        * had Content-length, so do raw reads/writes for the length
        */
-      if (copy_bin (phttp->cl, phttp->be, content_length, NULL,
-		    phttp->backend->be_type != BE_BACKEND))
+      int rc = copy_bin (phttp->cl, phttp->be, content_length,
+			 &phttp->req_bytes,
+			 phttp->backend->be_type != BE_BACKEND);
+      if (client_body_rate_expired (phttp))
+	return -1;
+      if (rc)
 	{
 	  logmsg (LOG_NOTICE,
 		  "(%"PRItid") e500 for %s error copy client cont to %s/%s: %s (%s sec)",
@@ -4056,6 +4811,7 @@ send_to_backend (POUND_HTTP *phttp, int chunked, CONTENT_LENGTH content_length)
 			    &phttp->start_req));
       return HTTP_STATUS_INTERNAL_SERVER_ERROR;
     }
+  phase_mark (phttp, PHASE_SENT);
   return 0;
 }
 
@@ -4207,13 +4963,14 @@ select_backend (POUND_HTTP *phttp)
 		    }
 		  /* New backend selected. */
 		  phttp->backend = backend;
+		  phase_mark (phttp, PHASE_CONNECT);
 		  return 0;
 		}
 
-	      logmsg (LOG_WARNING, "(%"PRItid") backend %s connect: %s",
-		      POUND_TID (),
-		      str_be (caddr, sizeof (caddr), backend),
-		      strerror (errno));
+	      logmsg_throttled (LOG_WARNING, "(%"PRItid") backend %s connect: %s",
+				POUND_TID (),
+				str_be (caddr, sizeof (caddr), backend),
+				strerror (errno));
 	      shutdown (sock, 2);
 	      close (sock);
 	      /*
@@ -4239,28 +4996,234 @@ select_backend (POUND_HTTP *phttp)
    * No backend found or is available.
    */
   v_host = http_request_host (&phttp->request);
-  logmsg (LOG_NOTICE, "(%"PRItid") e503 no back-end \"%s\" from %s %s",
-	  POUND_TID (), phttp->request.request,
-	  addr2str (caddr, sizeof (caddr), &phttp->from_host, 1),
-	  (v_host && v_host[0]) ? v_host : "-");
+  logmsg_throttled (LOG_NOTICE, "(%"PRItid") e503 no back-end \"%s\" from %s %s",
+		    POUND_TID (), phttp->request.request,
+		    addr2str (caddr, sizeof (caddr), &phttp->from_host, 1),
+		    (v_host && v_host[0]) ? v_host : "-");
 
   return HTTP_STATUS_SERVICE_UNAVAILABLE;
 }
 
+/*
+ * Names of the request processing phases.  Each phase is named after
+ * the time interval that ends with the corresponding event.  The
+ * acceptance of the connection starts the first phase, and has no
+ * name.
+ */
+static char const *phase_names[PHASE_MAX] = {
+  [PHASE_HANDSHAKE] = "handshake",
+  [PHASE_DEQUEUE] = "queue",
+  [PHASE_HEADERS] = "headers",
+  [PHASE_SERVICE] = "route",
+  [PHASE_CONNECT] = "connect",
+  [PHASE_SENT] = "send",
+  [PHASE_FIRST_BYTE] = "wait",
+  [PHASE_LAST_BYTE] = "response"
+};
+
+char const *
+phase_name (int phase)
+{
+  return phase_names[phase];
+}
+
+/*
+ * Return the phase with the given NAME of length LEN, or -1 if there
+ * is no such phase.
+ */
+int
+phase_lookup (char const *name, size_t len)
+{
+  int i;
+
+  for (i = 0; i < PHASE_MAX; i++)
+    if (phase_names[i] && strlen (phase_names[i]) == len
+	&& memcmp (phase_names[i], name, len) == 0)
+      return i;
+  return -1;
+}
+
+/*
+ * Compute the duration of PHASE of the current request and store it in
+ * RET.  The phase starts at the latest of the events preceding it that
+ * took place (events don't necessarily happen in the order of their
+ * constants: e.g. the TLS handshake can be done by the worker after
+ * dequeuing the connection).  Return 0 on success, and -1 if the phase
+ * has not been reached, or there is no event to start it.
+ */
+int
+phase_time (POUND_HTTP const *phttp, int phase, struct timespec *ret)
+{
+  struct timespec const *end = &phttp->phase[phase], *start = NULL;
+  int i;
+
+  if (!phase_is_set (phttp, phase))
+    return -1;
+  for (i = 0; i < PHASE_MAX; i++)
+    {
+      int c;
+
+      if (i == phase || !phase_is_set (phttp, i))
+	continue;
+      /* Of simultaneous events, the one with lower number comes first. */
+      c = timespec_cmp (&phttp->phase[i], end);
+      if (c > 0 || (c == 0 && i > phase))
+	continue;
+      if (!start || timespec_cmp (&phttp->phase[i], start) > 0)
+	start = &phttp->phase[i];
+    }
+  if (!start)
+    return -1;
+  *ret = timespec_sub (end, start);
+  return 0;
+}
+
+/*
+ * Record the statistics of the request just processed, in the service
+ * and in the backend.  START is the time the request was passed to the
+ * backend, and OK is 0 if no response was sent.
+ */
+static void
+request_update_stats (POUND_HTTP *phttp, struct timespec const *start, int ok)
+{
+  struct timespec diff = timespec_sub (&phttp->end_req, start);
+  int status = ok ? phttp->response_code : 0;
+
+  stats_record (phttp->svc->stats, status, phttp->req_bytes,
+		phttp->res_bytes, &diff);
+  stats_record (phttp->backend->stats, status, phttp->req_bytes,
+		phttp->res_bytes, &diff);
+  stats_record_phases (phttp->svc->stats, phttp);
+}
+
+/*
+ * Record in the service statistics a request that pound has refused
+ * itself, replying with status ERR (one of HTTP_STATUS_* constants),
+ * instead of passing it to a backend.
+ */
 static void
-backend_update_stats (BACKEND *be, struct timespec const *start,
-		      struct timespec const *end)
+service_update_stats (POUND_HTTP *phttp, int err)
+{
+  struct timespec now, diff;
+
+  if (!enable_backend_stats)
+    return;
+  clock_gettime (CLOCK_REALTIME, &now);
+  diff = timespec_sub (&now, &phttp->start_req);
+  stats_record (phttp->svc->stats, http_status[err].code, 0, 0, &diff);
+}
+
+/*
+ * Store in BUF the rate limiting key identifying the client address of
+ * PHTTP.  If FALLBACK is true, prefix it with a NUL byte, so that it
+ * cannot coincide with a header value or expanded string.  Return key
+ * length, or 0 if the address family is not supported.
+ */
+static size_t
+rate_limit_addr_key (POUND_HTTP *phttp, char *buf, int fallback)
+{
+  void const *addr;
+  size_t len;
+
+  switch (phttp->from_host.ai_family)
+    {
+    case AF_INET:
+      addr = &((struct sockaddr_in *) phttp->from_host.ai_addr)->sin_addr;
+      len = sizeof (struct in_addr);
+      break;
+
+    case AF_INET6:
+      addr = &((struct sockaddr_in6 *) phttp->from_host.ai_addr)->sin6_addr;
+      len = sizeof (struct in6_addr);
+      break;
+
+    default:
+      return 0;
+    }
+  if (fallback)
+    *buf++ = 0;
+  memcpy (buf, addr, len);
+  return len + !!fallback;
+}
+
+/*
+ * Take a token from the rate limiter RL for the current request.
+ * Return 0 if the request is allowed, and 1 if it must be refused,
+ * storing in *RETRY_AFTER the number of seconds the client should
+ * wait.
+ */
+static int
+rate_limit_apply (RATE_LIMIT *rl, POUND_HTTP *phttp, unsigned *retry_after)
+{
+  char const *key = NULL;
+  size_t len = 0;
+  char *str = NULL;
+  char addrbuf[1 + sizeof (struct in6_addr)];
+  int rc;
+
+  switch (rl->type)
+    {
+    case RATE_LIMIT_IP:
+      break;
+
+    case RATE_LIMIT_HEADER:
+      if (accessor_header (&phttp->request, rl->id, strlen (rl->id),
+			   &key, &len) != RETRIEVE_OK)
+	key = NULL;
+      break;
+
+    case RATE_LIMIT_STRING:
+      if ((str = expand_string (rl->exp, phttp, "RateLimit ID")) == NULL)
+	return 0;
+      key = str;
+      len = strlen (str);
+      break;
+    }
+
+  /*
+   * Requests without a key (or with an empty one) are limited by
+   * client address.  Clients with no IP address share a single bucket.
+   */
+  if (key == NULL || len == 0)
+    {
+      len = rate_limit_addr_key (phttp, addrbuf, rl->type != RATE_LIMIT_IP);
+      key = len ? addrbuf : "";
+    }
+  rc = rate_limit_check (rl, key, len, retry_after);
+  free (str);
+  return rc;
+}
+
+/*
+ * Wait for the next request on a keep-alive connection.  Return 0 if
+ * input is available, and -1 if the connection has been idle for too
+ * long.
+ */
+static int
+client_wait_request (POUND_HTTP *phttp)
 {
-  struct timespec diff;
-  double t;
+  unsigned to;
+
+  if (phttp->lstn->keepalive_to)
+    to = phttp->lstn->keepalive_to;
+  else if (phttp->lstn->header_to)
+    /*
+     * Don't let the header time-out apply to the idle time: wait the
+     * usual client time-out instead.
+     */
+    to = phttp->lstn->to;
+  else
+    return 0;
 
-  pthread_mutex_lock (&be->mut);
-  diff = timespec_sub (end, start);
-  t = (double) diff.tv_sec * 1e9 + diff.tv_nsec;
-  be->avgtime = (be->numreq * be->avgtime + t) / (be->numreq + 1);
-  be->avgsqtime = (be->numreq * be->avgsqtime + t*t) / (be->numreq + 1);
-  be->numreq++;
-  pthread_mutex_unlock (&be->mut);
+  if (to == 0 || is_readable (phttp->cl, to))
+    return 0;
+  if (phttp->lstn->keepalive_to)
+    {
+      pthread_mutex_lock (&phttp->lstn->tmo_mutex);
+      phttp->lstn->tmo_count[CLIENT_TMO_KEEPALIVE]++;
+      pthread_mutex_unlock (&phttp->lstn->tmo_mutex);
+    }
+  return -1;
 }
 
 /*
@@ -4280,40 +5243,74 @@ do_http (POUND_HTTP *phttp)
   struct http_header *hdr, *hdrtemp;
   char *val;
   struct timespec be_start;
-
-  if (phttp->lstn->allow_client_reneg)
-    phttp->reneg_state = RENEG_ALLOW;
-  else
-    phttp->reneg_state = RENEG_INIT;
+  unsigned long early_count;
+  int early_count_check;
+  unsigned retry_after;
+  int keepalive = 0; /* True if waiting for a subsequent request */
+  CONC_LIMIT *conc_limit; /* Concurrency limiter holding a slot */
 
   socket_setup (phttp->sock);
 
-  if ((phttp->cl = BIO_new_socket (phttp->sock, 1)) == NULL)
+  if (phttp->ssl != NULL)
+    /* The TLS handshake has been completed by a handshake thread. */
+    phttp->cl = SSL_get_rbio (phttp->ssl);
+  else if ((phttp->cl = BIO_new_socket (phttp->sock, 1)) == NULL)
     {
       logmsg (LOG_ERR, "(%"PRItid") BIO_new_socket failed", POUND_TID ());
       shutdown (phttp->sock, 2);
       close (phttp->sock);
       return;
     }
-  set_callback (phttp->cl, phttp->lstn->to, &phttp->reneg_state);
+  phttp->cl_arg = set_callback (phttp->cl, phttp->lstn->to,
+			       &phttp->reneg_state);
 
   if (!SLIST_EMPTY (&phttp->lstn->ctx_head))
     {
-      if ((phttp->ssl = SSL_new (SLIST_FIRST (&phttp->lstn->ctx_head)->ctx)) == NULL)
+      if (phttp->ssl == NULL)
 	{
-	  logmsg (LOG_ERR, "(%"PRItid") SSL_new: failed", POUND_TID ());
-	  return;
+	  if ((phttp->ssl = listener_ssl_new (phttp->lstn)) == NULL)
+	    {
+	      logmsg (LOG_ERR, "(%"PRItid") SSL_new: failed", POUND_TID ());
+	      return;
+	    }
+	  SSL_set_app_data (phttp->ssl, &phttp->reneg_state);
+	  SSL_set_bio (phttp->ssl, phttp->cl, phttp->cl);
+	  SSL_set_accept_state (phttp->ssl);
 	}
-      SSL_set_app_data (phttp->ssl, &phttp->reneg_state);
-      SSL_set_bio (phttp->ssl, phttp->cl, phttp->cl);
-      if ((bb = BIO_new (BIO_f_ssl ())) == NULL)
+      if (phttp->lstn->early_data
+	  && (phttp->early_buf != NULL || !SSL_is_init_finished (phttp->ssl)))
+	{
+	  /*
+	   * Early data have been received or may still be coming.  Read
+	   * them using the early data BIO, which takes ownership of the
+	   * data already read.
+	   */
+	  if ((bb = early_data_bio_new (phttp->ssl, phttp->early_buf,
+					phttp->early_len,
+					!phttp->early_finished)) == NULL)
+	    {
+	      logmsg (LOG_ERR, "(%"PRItid") early_data_bio_new failed",
+		      POUND_TID ());
+	      return;
+	    }
+	  phttp->early_buf = NULL;
+	}
+      else if ((bb = BIO_new (BIO_f_ssl ())) == NULL)
 	{
 	  logmsg (LOG_ERR, "(%"PRItid") BIO_new(Bio_f_ssl()) failed",
 		  POUND_TID ());
 	  return;
 	}
-      BIO_set_ssl (bb, phttp->ssl, BIO_CLOSE);
-      BIO_set_ssl_mode (bb, 0);
+      else
+	{
+	  BIO_set_ssl (bb, phttp->ssl, BIO_CLOSE);
+	  /*
+	   * Setting the mode resets the SSL state, so don't do it if the
+	   * handshake has already been done.
+	   */
+	  if (!SSL_is_init_finished (phttp->ssl))
+	    BIO_set_ssl_mode (bb, 0);
+	}
       phttp->cl = bb;
       if (BIO_do_handshake (phttp->cl) <= 0)
 	{
@@ -4321,6 +5318,8 @@ do_http (POUND_HTTP *phttp)
 	}
       else
 	{
+	  if (!phase_is_set (phttp, PHASE_HANDSHAKE))
+	    phase_mark (phttp, PHASE_HANDSHAKE);
 	  if ((phttp->x509 = SSL_get_peer_certificate (phttp->ssl)) != NULL
 	      && phttp->lstn->clnt_check < 3
 	      && SSL_get_verify_result (phttp->ssl) != X509_V_OK)
@@ -4354,9 +5353,40 @@ do_http (POUND_HTTP *phttp)
 
       phttp->ws_state = WSS_INIT;
       phttp->conn_closed = 0;
-      if (http_request_read (phttp->cl, phttp->lstn, &phttp->request))
+      phttp->svc = NULL;
+      /*
+       * If early data are not all consumed, the request is received in
+       * early data if there is unread input, or if reading it consumes
+       * more early data.
+       */
+      if ((phttp->early_req = early_data_bio_state (phttp->cl, &early_count)) == 1
+	  && BIO_pending (phttp->cl) == 0)
+	early_count_check = 1;
+      else
+	early_count_check = 0;
+
+      if (keepalive)
+	{
+	  if (client_wait_request (phttp))
+	    return;
+	  /*
+	   * Phases of a subsequent request start when it arrives.
+	   */
+	  memset (phttp->phase, 0, sizeof (phttp->phase));
+	  phase_mark (phttp, PHASE_DEQUEUE);
+	}
+      if (phttp->lstn->header_to)
+	bio_deadline_set (phttp->cl_arg, CLIENT_TMO_HEADER,
+			  phttp->lstn->header_to);
+      res = http_request_read (phttp->cl, phttp->lstn, &phttp->request);
+      bio_deadline_clear (phttp->cl_arg);
+      if (res)
 	{
-	  if (!cl_11)
+	  if (client_deadline_expired (phttp) == CLIENT_TMO_HEADER)
+	    logmsg (LOG_NOTICE, "(%"PRItid") request head timeout from %s",
+		    POUND_TID (),
+		    addr2str (caddr, sizeof (caddr), &phttp->from_host, 1));
+	  else if (!cl_11)
 	    {
 	      if (errno)
 		{
@@ -4369,7 +5399,18 @@ do_http (POUND_HTTP *phttp)
 	  return;
 	}
 
+      if (early_count_check)
+	{
+	  unsigned long n;
+	  phttp->early_req = early_data_bio_state (phttp->cl, &n) == 1
+			     ? n > early_count
+			     : 0;
+	}
+      else if (phttp->early_req == -1)
+	phttp->early_req = 0;
+
       clock_gettime (CLOCK_REALTIME, &phttp->start_req);
+      phase_mark (phttp, PHASE_HEADERS);
 
       /*
        * check for correct request
@@ -4383,6 +5424,16 @@ do_http (POUND_HTTP *phttp)
 	  return;
 	}
       cl_11 = phttp->request.version;
+      trace_request_begin (phttp);
+
+      if (phttp->early_req && !early_data_method_ok (phttp->request.method))
+	{
+	  logmsg (LOG_NOTICE, "(%"PRItid") e425 \"%s\" in early data from %s",
+		  POUND_TID (), phttp->request.request,
+		  addr2str (caddr, sizeof (caddr), &phttp->from_host, 1));
+	  http_err_reply (phttp, HTTP_STATUS_TOO_EARLY);
+	  return;
+	}
 
       phttp->no_cont = phttp->request.method == METH_HEAD;
       if (phttp->request.method == METH_GET)
@@ -4566,20 +5617,61 @@ do_http (POUND_HTTP *phttp)
       if ((phttp->svc = get_service (phttp)) == NULL)
 	{
 	  char const *v_host = http_request_host (&phttp->request);
-	  logmsg (LOG_NOTICE, "(%"PRItid") e503 no service \"%s\" from %s %s",
-		  POUND_TID (), phttp->request.request,
-		  addr2str (caddr, sizeof (caddr), &phttp->from_host, 1),
-		  (v_host && v_host[0]) ? v_host : "-");
+	  logmsg_throttled (LOG_NOTICE, "(%"PRItid") e503 no service \"%s\" from %s %s",
+			    POUND_TID (), phttp->request.request,
+			    addr2str (caddr, sizeof (caddr), &phttp->from_host, 1),
+			    (v_host && v_host[0]) ? v_host : "-");
+	  http_err_reply (phttp, HTTP_STATUS_SERVICE_UNAVAILABLE);
+	  return;
+	}
+      phase_mark (phttp, PHASE_SERVICE);
+
+      if ((phttp->lstn->rate_limit
+	   && rate_limit_apply (phttp->lstn->rate_limit, phttp, &retry_after))
+	  || (phttp->svc->rate_limit
+	      && rate_limit_apply (phttp->svc->rate_limit, phttp,
+				   &retry_after)))
+	{
+	  logmsg_throttled (LOG_NOTICE, "(%"PRItid") e429 rate limit exceeded \"%s\" from %s",
+			    POUND_TID (), phttp->request.request,
+			    addr2str (caddr, sizeof (caddr), &phttp->from_host, 1));
+	  http_too_many_requests_reply (phttp, retry_after);
+	  service_update_stats (phttp, HTTP_STATUS_TOO_MANY_REQUESTS);
+	  return;
+	}
+
+      /*
+       * Take a concurrency limiter slot before selecting the backend,
+       * so that rejected requests don't open backend connections.
+       */
+      if ((conc_limit = phttp->svc->conc_limit) != NULL
+	  && conc_limit_acquire (conc_limit))
+	{
+	  logmsg_throttled (LOG_NOTICE,
+			    "(%"PRItid") e503 concurrency limit reached \"%s\" from %s",
+			    POUND_TID (), phttp->request.request,
+			    addr2str (caddr, sizeof (caddr), &phttp->from_host, 1));
 	  http_err_reply (phttp, HTTP_STATUS_SERVICE_UNAVAILABLE);
+	  service_update_stats (phttp, HTTP_STATUS_SERVICE_UNAVAILABLE);
 	  return;
 	}
 
       if ((res = select_backend (phttp)) != 0)
 	{
+	  if (conc_limit)
+	    conc_limit_release (conc_limit, NULL, 1);
 	  http_err_reply (phttp, res);
+	  service_update_stats (phttp, res);
 	  return;
 	}
 
+      if (conc_limit && phttp->backend->be_type != BE_BACKEND)
+	{
+	  /* Only requests passed to regular backends are limited. */
+	  conc_limit_release (conc_limit, NULL, 1);
+	  conc_limit = NULL;
+	}
+
       /*
        * if we have anything but a BACK_END we close the channel
        */
@@ -4589,6 +5681,7 @@ do_http (POUND_HTTP *phttp)
       if (force_http_10 (phttp))
 	phttp->conn_closed = 1;
 
+      phttp->req_bytes = 0;
       phttp->res_bytes = 0;
       http_request_free (&phttp->response);
 
@@ -4631,18 +5724,31 @@ do_http (POUND_HTTP *phttp)
 	}
 
       clock_gettime (CLOCK_REALTIME, &phttp->end_req);
-      if (enable_backend_stats)
-	backend_update_stats (phttp->backend, &be_start, &phttp->end_req);
+      phase_mark (phttp, PHASE_LAST_BYTE);
+      if (conc_limit)
+	{
+	  struct timespec latency = timespec_sub (&phttp->end_req, &be_start);
+	  conc_limit_release (conc_limit, res == -1 ? NULL : &latency,
+			      res == HTTP_STATUS_OK);
+	}
 
       if (res == -1)
-	break;
+	{
+	  if (enable_backend_stats)
+	    request_update_stats (phttp, &be_start, 0);
+	  trace_request_end (phttp, 0);
+	  break;
+	}
       else
 	{
 	  if (res != HTTP_STATUS_OK)
 	    http_err_reply (phttp, res);
 	  if (phttp->response_code == 0)
 	    phttp->response_code = http_status[res].code;
+	  if (enable_backend_stats)
+	    request_update_stats (phttp, &be_start, 1);
 	  http_log (phttp);
+	  trace_request_end (phttp, 1);
 	}
 
       /*
@@ -4653,6 +5759,7 @@ do_http (POUND_HTTP *phttp)
        */
       if (!cl_11 || phttp->conn_closed)
 	break;
+      keepalive = 1;
     }
 
   return;
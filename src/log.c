@@ -538,38 +538,71 @@ p_time (struct http_log_parser *parser, char const *arg, int len)
   return 0;
 }
 
+/*
+ * Compute the time interval to be printed by INSTR.  Instructions
+ * produced by %T with a phase name have the phase number plus one as
+ * their data, and print the duration of that phase.  Otherwise, the
+ * time taken to serve the request is printed.  Return 0 on success,
+ * and -1 if the phase has not been reached.
+ */
+static int
+instr_process_time (struct http_log_instr *instr, POUND_HTTP *phttp,
+		    struct timespec *ret)
+{
+  if (instr->data)
+    return phase_time (phttp, (intptr_t) instr->data - 1, ret);
+  *ret = timespec_sub (&phttp->end_req, &phttp->start_req);
+  return 0;
+}
+
 static void
 i_process_time_ms (struct stringbuf *sb, struct http_log_instr *instr,
 		   POUND_HTTP *phttp)
 {
-  struct timespec diff = timespec_sub (&phttp->end_req, &phttp->start_req);
-  stringbuf_printf (sb, "%ld",
-		    (unsigned long) diff.tv_sec * MILLI + diff.tv_nsec / MICRO);
+  struct timespec diff;
+
+  if (instr_process_time (instr, phttp, &diff))
+    print_str (sb, NULL);
+  else
+    stringbuf_printf (sb, "%ld",
+		      (unsigned long) diff.tv_sec * MILLI + diff.tv_nsec / MICRO);
 }
 
 static void
 i_process_time_us (struct stringbuf *sb, struct http_log_instr *instr,
 		   POUND_HTTP *phttp)
 {
-  struct timespec diff = timespec_sub (&phttp->end_req, &phttp->start_req);
-  stringbuf_printf (sb, "%ld",
-		    (unsigned long) diff.tv_sec * MICRO + diff.tv_nsec / MILLI);
+  struct timespec diff;
+
+  if (instr_process_time (instr, phttp, &diff))
+    print_str (sb, NULL);
+  else
+    stringbuf_printf (sb, "%ld",
+		      (unsigned long) diff.tv_sec * MICRO + diff.tv_nsec / MILLI);
 }
 
 static void
 i_process_time_s (struct stringbuf *sb, struct http_log_instr *instr,
 		  POUND_HTTP *phttp)
 {
-  struct timespec diff = timespec_sub (&phttp->end_req, &phttp->start_req);
-  stringbuf_printf (sb, "%ld", diff.tv_sec);
+  struct timespec diff;
+
+  if (instr_process_time (instr, phttp, &diff))
+    print_str (sb, NULL);
+  else
+    stringbuf_printf (sb, "%ld", diff.tv_sec);
 }
 
 static void
 i_process_time_f (struct stringbuf *sb, struct http_log_instr *instr,
 		  POUND_HTTP *phttp)
 {
-  struct timespec diff = timespec_sub (&phttp->end_req, &phttp->start_req);
-  stringbuf_printf (sb, "%ld.%03ld", diff.tv_sec, diff.tv_nsec / MICRO);
+  struct timespec diff;
+
+  if (instr_process_time (instr, phttp, &diff))
+    print_str (sb, NULL);
+  else
+    stringbuf_printf (sb, "%ld.%03ld", diff.tv_sec, diff.tv_nsec / MICRO);
 }
 
 static struct argprt proctimeprt[] = {
@@ -580,17 +613,39 @@ static struct argprt proctimeprt[] = {
   { NULL }
 };
 
+/*
+ * Parse the argument to %T: either a time unit, or a phase name,
+ * optionally followed by a colon and unit.  Phase times are printed in
+ * milliseconds by default.
+ */
 static int
 p_process_time (struct http_log_parser *parser, char const *arg, int len)
 {
   http_log_printer_fn prt;
+  char const *p;
+  int phase;
 
   if (arg == NULL)
     prt = i_process_time_s;
   else if ((prt = argprt_find (proctimeprt, arg, len)) == NULL)
     {
-      http_log_parser_error (parser, "bad process time format", arg);
-      return -1;
+      if ((p = memchr (arg, ':', len)) == NULL)
+	p = arg + len;
+      if ((phase = phase_lookup (arg, p - arg)) == -1)
+	{
+	  http_log_parser_error (parser, "bad process time format", arg);
+	  return -1;
+	}
+      if (p == arg + len)
+	prt = i_process_time_ms;
+      else if ((prt = argprt_find (proctimeprt, p + 1,
+				   arg + len - p - 1)) == NULL)
+	{
+	  http_log_parser_error (parser, "bad process time format", arg);
+	  return -1;
+	}
+      add_instr (parser->prog, prt, (void*) (intptr_t) (phase + 1), NULL, 0);
+      return 0;
     }
   add_instr (parser->prog, prt, NULL, NULL, 0);
   return 0;
@@ -845,7 +900,13 @@ static struct http_log_spec http_log_spec[] = {
 		   by UNIT. Valid units are ms for milliseconds, us for
 		   microseconds, s for seconds, and f for seconds with
 		   fractional part. Using s gives the same result as %T
-		   without any format; using us gives the same result as %D. */
+		   without any format; using us gives the same result as %D.
+       %{PHASE}T
+       %{PHASE:UNIT}T
+		   Duration of the request processing phase PHASE (handshake,
+		   queue, headers, route, connect, send, wait or response),
+		   in milliseconds or in the given UNIT.  A '-' is printed
+		   if the phase was not reached. */
     { 'T', NULL, SPEC_OPT_ARG, p_process_time },
     /* Remote user. */
     { 'u', i_user_name },
@@ -1022,10 +1083,101 @@ http_log_format_compile (char const *name, char const *fmt,
   return i;
 }
 
+/*
+ * Per-thread logging state: the buffer for formatting log messages,
+ * which is reused between requests, and the state of the random number
+ * generator used for sampling.
+ */
+struct log_thread
+{
+  struct stringbuf sb;
+  unsigned rnd;
+};
+
+static pthread_key_t log_thread_key;
+static pthread_once_t log_thread_key_once = PTHREAD_ONCE_INIT;
+
+static void
+log_thread_free (void *ptr)
+{
+  struct log_thread *lt = ptr;
+  stringbuf_free (&lt->sb);
+  free (lt);
+}
+
+static void
+log_thread_key_create (void)
+{
+  pthread_key_create (&log_thread_key, log_thread_free);
+}
+
+static struct log_thread *
+log_thread_get (void)
+{
+  struct log_thread *lt;
+
+  pthread_once (&log_thread_key_once, log_thread_key_create);
+  lt = pthread_getspecific (log_thread_key);
+  if (lt == NULL)
+    {
+      if ((lt = malloc (sizeof (*lt))) == NULL)
+	{
+	  lognomem ();
+	  return NULL;
+	}
+      stringbuf_init_log (&lt->sb);
+      lt->rnd = (unsigned) time (NULL) ^ (unsigned) (uintptr_t) lt;
+      if (lt->rnd == 0)
+	lt->rnd = 1;
+      pthread_setspecific (log_thread_key, lt);
+    }
+  else if (stringbuf_err (&lt->sb))
+    {
+      stringbuf_free (&lt->sb);
+      stringbuf_init_log (&lt->sb);
+    }
+  else
+    stringbuf_reset (&lt->sb);
+  return lt;
+}
+
+/* Return next pseudo-random number (xorshift32). */
+static inline unsigned
+log_random (struct log_thread *lt)
+{
+  unsigned x = lt->rnd;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return lt->rnd = x;
+}
+
+/*
+ * Return 1 if a request with the given status should be logged,
+ * according to the sampling rules.
+ */
+static int
+log_sampled (struct log_thread *lt, POUND_HTTP *phttp)
+{
+  int n = phttp->response_code / 100;
+  struct log_sample *ls;
+
+  if (n < 0 || n >= LOG_SAMPLE_CLASSES)
+    return 1;
+  if (phttp->svc->log_sample.mask & (1 << n))
+    ls = &phttp->svc->log_sample;
+  else if (phttp->lstn->log_sample.mask & (1 << n))
+    ls = &phttp->lstn->log_sample;
+  else
+    return 1;
+  return log_random (lt) % LOG_SAMPLE_SCALE < ls->rate[n];
+}
+
 void
 http_log (POUND_HTTP *phttp)
 {
-  struct stringbuf sb;
+  struct log_thread *lt;
+  struct stringbuf *sb;
   struct http_log_prog *prog;
   struct http_log_instr *ip;
   char *msg;
@@ -1038,18 +1190,25 @@ http_log (POUND_HTTP *phttp)
   if (SLIST_EMPTY (&prog->head))
     return;
 
-  stringbuf_init_log (&sb);
+  if ((lt = log_thread_get ()) == NULL)
+    return;
+  if (!log_sampled (lt, phttp))
+    return;
+  sb = &lt->sb;
   SLIST_FOREACH (ip, &prog->head, link)
     {
-      ip->prt (&sb, ip, phttp);
+      ip->prt (sb, ip, phttp);
     }
-  if ((msg = stringbuf_finish (&sb)) == NULL)
+  if ((msg = stringbuf_finish (sb)) == NULL)
     {
       logmsg (LOG_ERR, "error formatting log message");
     }
+  else if (phttp->lstn->log_file)
+    {
+      log_file_put (phttp->lstn->log_file, msg, stringbuf_len (sb) - 1);
+    }
   else
     {
       logmsg (LOG_INFO, "%s", msg);
     }
-  stringbuf_free (&sb);
 }
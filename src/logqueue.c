@@ -0,0 +1,785 @@
+/*
+ * Pound - the reverse-proxy load-balancer
+ * Copyright (C) 2024 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Asynchronous logging.
+ *
+ * Each thread that logs a message gets its own ring buffer of fixed-size
+ * records.  The message is formatted directly into the next free record
+ * of the ring, so that neither memory allocation nor locking is involved.
+ * Each ring has a single producer (its thread) and a single consumer (the
+ * log writer thread), so the two sides synchronize using only atomic
+ * loads and stores of the ring indices.
+ *
+ * The writer thread sleeps until woken up by a producer, or for at most
+ * a second.  It then drains all rings, passing records to syslog or, if
+ * logging to stdout/stderr, writing them in batches using writev.
+ *
+ * If a ring is full, the message is either dropped (and counted), or the
+ * thread waits until the writer frees some space, depending on the
+ * configured overflow policy.
+ *
+ * Rings of terminated threads are freed by the writer, once they are
+ * drained.
+ *
+ * Request logs can also be written directly to files (the LogFile
+ * statement).  Lines are appended to the file in batches by the writer
+ * thread or, if asynchronous logging is disabled, one by one by the
+ * thread that produced them.  Log files are reopened on SIGUSR1 or on
+ * request from the control interface, and can be rotated automatically
+ * when they reach the configured size or age.
+ */
+#include "pound.h"
+#include "extern.h"
+#include "json.h"
+#include <sys/uio.h>
+
+/* Max. length of a formatted message.  Longer messages are truncated. */
+#define LOG_RECORD_MAX 2048
+/* Max. number of records written in a single writev call. */
+#define LOG_BATCH 64
+
+unsigned log_queue_size = DEFAULT_LOG_QUEUE_SIZE;
+int log_queue_overflow = LOG_QUEUE_DROP;
+
+struct log_record
+{
+  int priority;
+  LOG_FILE *file;               /* Log file, or NULL for the log stream. */
+  unsigned len;
+  char text[LOG_RECORD_MAX];
+};
+
+struct log_ring
+{
+  struct log_ring *next;        /* Next ring in list. */
+  unsigned long head;           /* Number of records written (producer). */
+  unsigned long tail;           /* Number of records consumed (writer). */
+  unsigned long dropped;        /* Number of dropped records. */
+  unsigned long blocked;        /* Number of times the producer waited. */
+  int orphan;                   /* Owner thread has terminated. */
+  unsigned mask;                /* Ring size - 1. */
+  struct log_record rec[1];
+};
+
+static struct log_ring *ring_head;     /* List of rings. */
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+
+static int running;                    /* Writer thread is running. */
+static int stopping;                   /* Writer is requested to stop. */
+static int writer_idle;                /* Writer is sleeping. */
+static pthread_t writer_tid;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+
+static unsigned space_waiters;         /* Number of producers waiting. */
+static pthread_mutex_t space_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+
+/* Statistics of freed rings and of the writer. */
+static unsigned long freed_dropped;
+static unsigned long freed_blocked;
+static unsigned long written;
+
+#define load_acquire(p) __atomic_load_n (p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n (p, v, __ATOMIC_RELEASE)
+#define full_barrier() __atomic_thread_fence (__ATOMIC_SEQ_CST)
+
+static void
+ring_release (void *ptr)
+{
+  struct log_ring *ring = ptr;
+  store_release (&ring->orphan, 1);
+}
+
+static struct log_ring *
+ring_get (void)
+{
+  struct log_ring *ring = pthread_getspecific (ring_key);
+  if (ring == NULL)
+    {
+      unsigned size;
+
+      for (size = 1; size < log_queue_size; size <<= 1)
+	;
+      ring = calloc (1, sizeof (*ring) + (size - 1) * sizeof (ring->rec[0]));
+      if (ring == NULL)
+	return NULL;
+      ring->mask = size - 1;
+      pthread_mutex_lock (&ring_mutex);
+      ring->next = ring_head;
+      ring_head = ring;
+      pthread_mutex_unlock (&ring_mutex);
+      pthread_setspecific (ring_key, ring);
+    }
+  return ring;
+}
+
+static inline int
+ring_full (struct log_ring *ring)
+{
+  return ring->head - load_acquire (&ring->tail) > ring->mask;
+}
+
+static void
+writer_wakeup (void)
+{
+  full_barrier ();
+  if (__atomic_load_n (&writer_idle, __ATOMIC_RELAXED))
+    {
+      pthread_mutex_lock (&writer_mutex);
+      pthread_cond_signal (&writer_cond);
+      pthread_mutex_unlock (&writer_mutex);
+    }
+}
+
+/*
+ * Wait until RING has a free slot.  Return 0 on success and -1 if the
+ * writer is stopping.
+ */
+static int
+ring_wait (struct log_ring *ring)
+{
+  pthread_mutex_lock (&space_mutex);
+  space_waiters++;
+  __atomic_store_n (&ring->blocked, ring->blocked + 1, __ATOMIC_RELAXED);
+  while (ring_full (ring) && !load_acquire (&stopping))
+    {
+      struct timespec ts;
+
+      writer_wakeup ();
+      clock_gettime (CLOCK_REALTIME, &ts);
+      ts.tv_nsec += 100000000;
+      if (ts.tv_nsec >= 1000000000)
+	{
+	  ts.tv_sec++;
+	  ts.tv_nsec -= 1000000000;
+	}
+      pthread_cond_timedwait (&space_cond, &space_mutex, &ts);
+    }
+  space_waiters--;
+  pthread_mutex_unlock (&space_mutex);
+  return ring_full (ring) ? -1 : 0;
+}
+
+/*
+ * Return the next free record in the calling thread's ring, waiting for
+ * it if necessary.  Return NULL if the message should be dropped.  Set
+ * *RET_RING to NULL if the queue is not in use.
+ */
+static struct log_record *
+ring_reserve (struct log_ring **ret_ring)
+{
+  struct log_ring *ring;
+
+  *ret_ring = NULL;
+  if (!load_acquire (&running) || pthread_equal (pthread_self (), writer_tid))
+    return NULL;
+  if ((ring = ring_get ()) == NULL)
+    return NULL;
+  *ret_ring = ring;
+
+  if (ring_full (ring))
+    {
+      if (log_queue_overflow == LOG_QUEUE_DROP || ring_wait (ring))
+	{
+	  __atomic_store_n (&ring->dropped, ring->dropped + 1,
+			    __ATOMIC_RELAXED);
+	  return NULL;
+	}
+    }
+  return &ring->rec[ring->head & ring->mask];
+}
+
+/* Pass the record filled in after ring_reserve to the writer. */
+static void
+ring_commit (struct log_ring *ring)
+{
+  store_release (&ring->head, ring->head + 1);
+  writer_wakeup ();
+}
+
+/*
+ * Queue a message for writing.  Return 0 on success, and -1 if the
+ * queue is not in use, in which case the caller should log the message
+ * itself.  A message dropped due to overflow is considered a success.
+ */
+int
+log_queue_put (int priority, char const *fmt, va_list ap)
+{
+  struct log_ring *ring;
+  struct log_record *rec;
+  va_list aq;
+  int n;
+
+  if ((rec = ring_reserve (&ring)) == NULL)
+    return ring ? 0 : -1;
+
+  rec->priority = priority;
+  rec->file = NULL;
+  va_copy (aq, ap);
+  n = vsnprintf (rec->text, sizeof (rec->text), fmt, aq);
+  va_end (aq);
+  if (n < 0)
+    n = 0;
+  else if (n >= sizeof (rec->text))
+    n = sizeof (rec->text) - 1;
+  rec->len = n;
+  ring_commit (ring);
+  return 0;
+}
+
+/*
+ * Write COUNT iovecs from IOV to FD, restarting on short writes.
+ * Return 0 on success and -1 on error.
+ */
+static int
+writev_full (int fd, struct iovec *iov, int count)
+{
+  while (count > 0)
+    {
+      ssize_t n = writev (fd, iov, count);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      while (count > 0 && n >= iov->iov_len)
+	{
+	  n -= iov->iov_len;
+	  iov++;
+	  count--;
+	}
+      if (count > 0)
+	{
+	  iov->iov_base = (char*) iov->iov_base + n;
+	  iov->iov_len -= n;
+	}
+    }
+  return 0;
+}
+
+/* Batch of records to be written to a single stream. */
+struct log_batch
+{
+  int fd;                       /* Descriptor to write to, */
+  LOG_FILE *file;               /* or log file. */
+  int count;
+  struct iovec iov[4 * LOG_BATCH];
+};
+
+struct log_file_state
+{
+  pthread_mutex_t mutex;
+  int fd;                       /* File descriptor. */
+  CONTENT_LENGTH size;          /* Current size of the file. */
+  time_t next_rotate;           /* Time of the next rotation. */
+  unsigned long lines;          /* Statistics: lines written, */
+  unsigned long rotated;        /* number of rotations, */
+  unsigned long errors;         /* and write errors. */
+  struct log_batch batch;       /* Lines collected by the writer. */
+};
+
+static SLIST_HEAD (,log_file) log_files = SLIST_HEAD_INITIALIZER (log_files);
+
+static void log_file_writev (LOG_FILE *lf, struct iovec *iov, int count,
+			     unsigned long lines);
+
+static void
+log_batch_add (struct log_batch *bat, struct log_record *rec)
+{
+  struct iovec *iov = bat->iov + bat->count;
+
+  if (progname && !bat->file)
+    {
+      iov->iov_base = (char*) progname;
+      iov->iov_len = strlen (progname);
+      iov++;
+      iov->iov_base = ": ";
+      iov->iov_len = 2;
+      iov++;
+    }
+  iov->iov_base = rec->text;
+  iov->iov_len = rec->len;
+  iov++;
+  iov->iov_base = "\n";
+  iov->iov_len = 1;
+  iov++;
+  bat->count = iov - bat->iov;
+}
+
+static void
+log_batch_flush (struct log_batch *bat)
+{
+  if (bat->count)
+    {
+      if (bat->file)
+	log_file_writev (bat->file, bat->iov, bat->count, bat->count / 2);
+      else
+	writev_full (bat->fd, bat->iov, bat->count);
+      bat->count = 0;
+    }
+}
+
+/*
+ * Write out pending records from RING.  Return the number of records
+ * written.
+ */
+static unsigned long
+ring_drain (struct log_ring *ring)
+{
+  static struct log_batch out = { .fd = 1 }, err = { .fd = 2 };
+  unsigned long head = load_acquire (&ring->head);
+  unsigned long tail = ring->tail;
+  unsigned long n = head - tail;
+
+  while (tail != head)
+    {
+      LOG_FILE *lf;
+      int i;
+
+      for (i = 0; i < LOG_BATCH && tail != head; i++, tail++)
+	{
+	  struct log_record *rec = &ring->rec[tail & ring->mask];
+
+	  if (rec->file)
+	    log_batch_add (&rec->file->state->batch, rec);
+	  else if (log_facility != -1)
+	    syslog (rec->priority, "%.*s", (int) rec->len, rec->text);
+	  else
+	    log_batch_add ((rec->priority == LOG_INFO
+			    || rec->priority == LOG_DEBUG) ? &out : &err,
+			   rec);
+	}
+      log_batch_flush (&out);
+      log_batch_flush (&err);
+      SLIST_FOREACH (lf, &log_files, next)
+	log_batch_flush (&lf->state->batch);
+      store_release (&ring->tail, tail);
+    }
+  return n;
+}
+
+/*
+ * Drain all rings and free the orphaned ones.  Return the number of
+ * records written.
+ */
+static unsigned long
+log_queue_drain (void)
+{
+  struct log_ring *ring, *prev, *next;
+  unsigned long n = 0;
+
+  pthread_mutex_lock (&ring_mutex);
+  ring = ring_head;
+  pthread_mutex_unlock (&ring_mutex);
+
+  /*
+   * New rings are added only at the head of the list, and only this
+   * thread removes them, so the list can be traversed without locking.
+   */
+  for (prev = NULL; ring; ring = next)
+    {
+      int orphan = load_acquire (&ring->orphan);
+
+      next = ring->next;
+      n += ring_drain (ring);
+      if (orphan && ring->tail == load_acquire (&ring->head))
+	{
+	  pthread_mutex_lock (&ring_mutex);
+	  if (prev)
+	    prev->next = next;
+	  else
+	    {
+	      /* The ring may no longer be at the head of the list. */
+	      struct log_ring **pp;
+	      for (pp = &ring_head; *pp != ring; pp = &(*pp)->next)
+		;
+	      *pp = next;
+	    }
+	  freed_dropped += ring->dropped;
+	  freed_blocked += ring->blocked;
+	  pthread_mutex_unlock (&ring_mutex);
+	  free (ring);
+	}
+      else
+	prev = ring;
+    }
+
+  if (n)
+    {
+      pthread_mutex_lock (&ring_mutex);
+      written += n;
+      pthread_mutex_unlock (&ring_mutex);
+      if (__atomic_load_n (&space_waiters, __ATOMIC_RELAXED))
+	{
+	  pthread_mutex_lock (&space_mutex);
+	  pthread_cond_broadcast (&space_cond);
+	  pthread_mutex_unlock (&space_mutex);
+	}
+    }
+  return n;
+}
+
+static void *
+thr_log_writer (void *arg)
+{
+  for (;;)
+    {
+      if (log_queue_drain ())
+	continue;
+      if (load_acquire (&stopping))
+	break;
+
+      pthread_mutex_lock (&writer_mutex);
+      __atomic_store_n (&writer_idle, 1, __ATOMIC_RELAXED);
+      full_barrier ();
+      if (log_queue_drain () == 0 && !load_acquire (&stopping))
+	{
+	  struct timespec ts;
+	  clock_gettime (CLOCK_REALTIME, &ts);
+	  ts.tv_sec++;
+	  pthread_cond_timedwait (&writer_cond, &writer_mutex, &ts);
+	}
+      __atomic_store_n (&writer_idle, 0, __ATOMIC_RELAXED);
+      pthread_mutex_unlock (&writer_mutex);
+    }
+  return NULL;
+}
+
+/*
+ * Start the log writer thread, if asynchronous logging is enabled.
+ */
+void
+log_queue_start (void)
+{
+  int rc;
+
+  if (log_queue_size == 0)
+    return;
+  pthread_key_create (&ring_key, ring_release);
+  /* Flush messages written to stdio during startup. */
+  fflush (stdout);
+  fflush (stderr);
+  if ((rc = pthread_create (&writer_tid, NULL, thr_log_writer, NULL)) != 0)
+    abend ("can't create log writer thread: %s", strerror (rc));
+  store_release (&running, 1);
+}
+
+/*
+ * Write out all pending messages and stop the writer thread.  Messages
+ * logged after this point are written synchronously.
+ */
+void
+log_queue_stop (void)
+{
+  if (!__atomic_exchange_n (&running, 0, __ATOMIC_ACQ_REL))
+    return;
+  store_release (&stopping, 1);
+  pthread_mutex_lock (&writer_mutex);
+  pthread_cond_signal (&writer_cond);
+  pthread_mutex_unlock (&writer_mutex);
+  pthread_mutex_lock (&space_mutex);
+  pthread_cond_broadcast (&space_cond);
+  pthread_mutex_unlock (&space_mutex);
+  pthread_join (writer_tid, NULL);
+  /* Pick up messages queued while the writer was terminating. */
+  log_queue_drain ();
+}
+
+struct json_value *
+log_queue_serialize (void)
+{
+  struct json_value *obj;
+  struct log_ring *ring;
+  unsigned long queued = 0, dropped, blocked, threads = 0, nwritten;
+  int err = 0;
+
+  pthread_mutex_lock (&ring_mutex);
+  dropped = freed_dropped;
+  blocked = freed_blocked;
+  nwritten = written;
+  for (ring = ring_head; ring; ring = ring->next)
+    {
+      queued += load_acquire (&ring->head) - load_acquire (&ring->tail);
+      dropped += __atomic_load_n (&ring->dropped, __ATOMIC_RELAXED);
+      blocked += __atomic_load_n (&ring->blocked, __ATOMIC_RELAXED);
+      threads++;
+    }
+  pthread_mutex_unlock (&ring_mutex);
+
+  obj = json_new_object ();
+  if (obj)
+    {
+      err = json_object_set (obj, "size", json_new_integer (log_queue_size))
+	|| json_object_set (obj, "overflow",
+			    json_new_string (log_queue_overflow_to_str (log_queue_overflow)))
+	|| json_object_set (obj, "threads", json_new_number (threads))
+	|| json_object_set (obj, "queued", json_new_number (queued))
+	|| json_object_set (obj, "written", json_new_number (nwritten))
+	|| json_object_set (obj, "dropped", json_new_number (dropped))
+	|| json_object_set (obj, "blocked", json_new_number (blocked));
+    }
+  if (err)
+    {
+      json_value_free (obj);
+      obj = NULL;
+    }
+  return obj;
+}
+
+/*
+ * Log files.
+ */
+
+LOG_FILE *
+log_file_lookup (char const *name)
+{
+  LOG_FILE *lf;
+
+  SLIST_FOREACH (lf, &log_files, next)
+    if (strcmp (lf->name, name) == 0)
+      return lf;
+  return NULL;
+}
+
+LOG_FILE *
+log_file_new (char const *name)
+{
+  LOG_FILE *lf;
+
+  XZALLOC (lf);
+  lf->name = xstrdup (name);
+  lf->keep = DEFAULT_LOG_FILE_KEEP;
+  XZALLOC (lf->state);
+  pthread_mutex_init (&lf->state->mutex, NULL);
+  lf->state->fd = -1;
+  lf->state->batch.file = lf;
+  SLIST_PUSH (&log_files, lf, next);
+  return lf;
+}
+
+static void
+log_file_schedule (LOG_FILE *lf)
+{
+  if (lf->interval)
+    {
+      time_t t = time (NULL);
+      lf->state->next_rotate = t - t % lf->interval + lf->interval;
+    }
+}
+
+/*
+ * (Re)open the log file LF.  An already open file is replaced atomically,
+ * so that concurrent writes go either to the old or to the new file.
+ * On error, return -1 and leave the old file in use.
+ */
+static int
+log_file_open (LOG_FILE *lf)
+{
+  struct log_file_state *st = lf->state;
+  struct stat sb;
+  int fd;
+
+  if ((fd = open (lf->name, O_WRONLY | O_APPEND | O_CREAT, 0640)) == -1)
+    return -1;
+  if (st->fd == -1)
+    st->fd = fd;
+  else
+    {
+      dup2 (fd, st->fd);
+      close (fd);
+    }
+  st->size = fstat (st->fd, &sb) == 0 ? sb.st_size : 0;
+  return 0;
+}
+
+/* Rename NAME.N to NAME.N+1, for N from KEEP-1 down to 0. */
+static void
+log_file_shift (LOG_FILE *lf)
+{
+  size_t len = strlen (lf->name);
+  char *oldname, *newname;
+  unsigned i;
+
+  if (lf->keep == 0)
+    {
+      unlink (lf->name);
+      return;
+    }
+
+  oldname = malloc (2 * (len + 12));
+  if (oldname == NULL)
+    {
+      lognomem ();
+      return;
+    }
+  newname = oldname + len + 12;
+  for (i = lf->keep - 1; i > 0; i--)
+    {
+      snprintf (oldname, len + 12, "%s.%u", lf->name, i);
+      snprintf (newname, len + 12, "%s.%u", lf->name, i + 1);
+      rename (oldname, newname);
+    }
+  snprintf (newname, len + 12, "%s.1", lf->name);
+  if (rename (lf->name, newname))
+    logmsg (LOG_ERR, "can't rename %s to %s: %s", lf->name, newname,
+	    strerror (errno));
+  free (oldname);
+}
+
+/* Rotate LF, if it is due.  Must be called with the file mutex locked. */
+static void
+log_file_check_rotate (LOG_FILE *lf)
+{
+  struct log_file_state *st = lf->state;
+
+  if ((lf->max_size && st->size >= lf->max_size)
+      || (lf->interval && time (NULL) >= st->next_rotate))
+    {
+      log_file_shift (lf);
+      if (log_file_open (lf))
+	logmsg (LOG_ERR, "can't open log file %s: %s", lf->name,
+		strerror (errno));
+      log_file_schedule (lf);
+      st->rotated++;
+    }
+}
+
+/* Write COUNT iovecs (LINES lines) from IOV to the log file LF. */
+static void
+log_file_writev (LOG_FILE *lf, struct iovec *iov, int count,
+		 unsigned long lines)
+{
+  struct log_file_state *st = lf->state;
+  int i;
+
+  pthread_mutex_lock (&st->mutex);
+  log_file_check_rotate (lf);
+  for (i = 0; i < count; i++)
+    st->size += iov[i].iov_len;
+  st->lines += lines;
+  if (writev_full (st->fd, iov, count))
+    st->errors++;
+  pthread_mutex_unlock (&st->mutex);
+}
+
+/*
+ * Log the line TEXT of length LEN to the file LF.
+ */
+void
+log_file_put (LOG_FILE *lf, char const *text, size_t len)
+{
+  struct log_ring *ring;
+  struct log_record *rec;
+
+  if ((rec = ring_reserve (&ring)) != NULL)
+    {
+      if (len >= sizeof (rec->text))
+	len = sizeof (rec->text) - 1;
+      rec->priority = LOG_INFO;
+      rec->file = lf;
+      memcpy (rec->text, text, len);
+      rec->len = len;
+      ring_commit (ring);
+    }
+  else if (ring == NULL)
+    {
+      struct iovec iov[2];
+
+      iov[0].iov_base = (char*) text;
+      iov[0].iov_len = len;
+      iov[1].iov_base = "\n";
+      iov[1].iov_len = 1;
+      log_file_writev (lf, iov, 2, 1);
+    }
+}
+
+/* Open all log files.  Called at startup. */
+void
+log_file_open_all (void)
+{
+  LOG_FILE *lf;
+
+  SLIST_FOREACH (lf, &log_files, next)
+    {
+      if (log_file_open (lf))
+	abend ("can't open log file %s: %s", lf->name, strerror (errno));
+      log_file_schedule (lf);
+    }
+}
+
+/*
+ * Reopen all log files, e.g. after they have been rotated externally.
+ * Return 0 on success and -1 if some of them could not be reopened.
+ */
+int
+log_file_reopen_all (void)
+{
+  LOG_FILE *lf;
+  int rc = 0;
+
+  SLIST_FOREACH (lf, &log_files, next)
+    {
+      int ec = 0;
+
+      pthread_mutex_lock (&lf->state->mutex);
+      if (log_file_open (lf))
+	ec = errno;
+      pthread_mutex_unlock (&lf->state->mutex);
+      /* Log outside of the lock: the writer thread may be waiting for it. */
+      if (ec)
+	{
+	  logmsg (LOG_ERR, "can't reopen log file %s: %s", lf->name,
+		  strerror (ec));
+	  rc = -1;
+	}
+    }
+  return rc;
+}
+
+struct json_value *
+log_file_serialize (LOG_FILE *lf)
+{
+  struct log_file_state *st = lf->state;
+  struct json_value *obj;
+  int err = 0;
+
+  obj = json_new_object ();
+  if (obj)
+    {
+      pthread_mutex_lock (&st->mutex);
+      err = json_object_set (obj, "name", json_new_string (lf->name))
+	|| json_object_set (obj, "max_size", json_new_number (lf->max_size))
+	|| json_object_set (obj, "interval", json_new_integer (lf->interval))
+	|| json_object_set (obj, "keep", json_new_integer (lf->keep))
+	|| json_object_set (obj, "size", json_new_number (st->size))
+	|| json_object_set (obj, "lines", json_new_number (st->lines))
+	|| json_object_set (obj, "rotated", json_new_number (st->rotated))
+	|| json_object_set (obj, "errors", json_new_number (st->errors));
+      pthread_mutex_unlock (&st->mutex);
+    }
+  if (err)
+    {
+      json_value_free (obj);
+      obj = NULL;
+    }
+  return obj;
+}
@@ -14,250 +14,469 @@
  * You should have received a copy of the GNU General Public License
  * along with pound.  If not, see <http://www.gnu.org/licenses/>.
  */
+
+/*
+ * The exposition is generated directly from the live data structures:
+ * counters of listeners, services and backends are read using their
+ * accessors and formatted into the output buffer as they are obtained.
+ * Session tables are never traversed, only their counts are used.
+ * Small global objects (workers, worker queue, etc.) are read using
+ * their JSON serializers, which are cheap.
+ *
+ * Since OpenMetrics requires all samples of a metric family to be
+ * contiguous, the output is produced family by family.  Before that,
+ * a flat list of the objects to describe is collected, along with
+ * a snapshot of their request statistics, so that each object is
+ * visited (and its statistics aggregated) only once.
+ */
 #include "pound.h"
 #include "extern.h"
 #include "json.h"
 
 /*
- * Metric labels
+ * Object levels.
  */
-struct metric_label
+enum
+  {
+    METRIC_LISTENER,
+    METRIC_SERVICE,
+    METRIC_BACKEND,
+    METRIC_MAX_LEVEL
+  };
+
+/* Labels holding index of the object at each level. */
+static char const *metric_index_label[METRIC_MAX_LEVEL] = {
+  "listener",
+  "service",
+  "backend"
+};
+
+/* Number of request time histogram buckets (upper bounds 2^k us). */
+#define METRIC_HIST_BUCKETS 33
+
+/* Snapshot of request statistics. */
+struct metric_stats
 {
-  char *name;
-  char *value;
-  DLIST_ENTRY (metric_label) next;
+  unsigned long count;                    /* Number of requests */
+  unsigned long responses[STATS_CLASSES]; /* Responses by status class */
+  unsigned long long bytes_in;            /* Request body bytes */
+  unsigned long long bytes_out;           /* Response body bytes */
+  double sum;                             /* Total request time (ns) */
+  double avg;                             /* Average request time (ns) */
+  double stddev;                          /* Its standard deviation (ns) */
+  unsigned long hist[METRIC_HIST_BUCKETS]; /* Cumulative bucket counts */
 };
 
-typedef DLIST_HEAD (,metric_label) METRIC_LABELS;
+/* Snapshot of request processing phase times. */
+struct metric_phase
+{
+  unsigned long count;                     /* Number of samples */
+  double sum;                              /* Total time (ns) */
+  unsigned long hist[METRIC_HIST_BUCKETS]; /* Cumulative bucket counts */
+};
+
+/*
+ * Object to generate metrics for.
+ */
+struct metric_object
+{
+  int index[METRIC_MAX_LEVEL];  /* Indices identifying the object, or -1 */
+  LISTENER *lstn;               /* Listener (listener objects only) */
+  SERVICE *svc;                 /* Service (service and backend objects) */
+  struct json_value *json;      /* JSON object (global objects only) */
+  int alive;                    /* Backend state (backend objects only) */
+  int enabled;
+  double sessions;              /* Number of sessions (backend objects only) */
+  int has_stats;                /* Is stats valid? */
+  struct metric_stats stats;    /* Request statistics */
+  struct metric_phase *phase;   /* Phase times (service objects only) */
+};
 
-#define metric_labels_empty DLIST_EMPTY
+/* A list of objects. */
+struct metric_objects
+{
+  struct metric_object *obj;
+  size_t count;
+  size_t size;
+};
 
 /*
- * Add label NAME=VALUE to the label list HEAD.
+ * Allocate a new object at the end of the list OBJS.  Initialize its
+ * indices from PARENT (if not NULL) and set its own index at LEVEL to
+ * IDX.  On error, log the failure and return NULL.
  */
-static int
-metric_labels_add (METRIC_LABELS *head, char const *name, char const *value)
+static struct metric_object *
+metric_objects_add (struct metric_objects *objs,
+		    struct metric_object const *parent, int level, int idx)
 {
-  struct metric_label *label;
-  size_t nlen = strlen (name);
+  struct metric_object *obj;
+  int i;
 
-  if ((label = malloc (sizeof (*label) + nlen + strlen (value) + 2)) == NULL)
+  if (objs->count == objs->size)
     {
-      lognomem ();
-      return -1;
+      size_t n = objs->size ? objs->size * 2 : 16;
+      struct metric_object *p = realloc (objs->obj, n * sizeof (p[0]));
+      if (!p)
+	{
+	  lognomem ();
+	  return NULL;
+	}
+      objs->obj = p;
+      objs->size = n;
     }
-  label->name = (char*) (label + 1);
-  strcpy (label->name, name);
-  label->value = label->name + nlen + 1;
-  strcpy (label->value, value);
-
-  DLIST_PUSH (head, label, next);
-
-  return 0;
+  obj = &objs->obj[objs->count++];
+  memset (obj, 0, sizeof (*obj));
+  for (i = 0; i < METRIC_MAX_LEVEL; i++)
+    obj->index[i] = parent ? parent->index[i] : -1;
+  obj->index[level] = idx;
+  return obj;
 }
 
-/* Remove last label from the list. */
 static void
-metric_labels_pop (METRIC_LABELS *head)
+metric_objects_free (struct metric_objects *objs)
 {
-  struct metric_label *label = DLIST_LAST (head);
-  DLIST_REMOVE (head, label, next);
-  free (label);
-}
+  size_t i;
 
-/* Copy labels from SRC to DST.  Notice: does not initialize or reset DST. */
-static int
-metric_labels_copy (METRIC_LABELS *dst, METRIC_LABELS const *src)
-{
-  if (src)
-    {
-      struct metric_label *label;
-      DLIST_FOREACH (label, src, next)
-	{
-	  if (metric_labels_add (dst, label->name, label->value))
-	    return -1;
-	}
-    }
-  return 0;
+  for (i = 0; i < objs->count; i++)
+    free (objs->obj[i].phase);
+  free (objs->obj);
 }
 
-/* Free the label list. */
+/*
+ * Store in OBJ the snapshot of request statistics ST, using B as
+ * a scratch block.
+ */
 static void
-metric_labels_free (METRIC_LABELS *head)
+metric_object_stats (struct metric_object *obj, STATS *st,
+		     struct stats_block *b)
 {
-  while (!DLIST_EMPTY (head))
+  struct metric_stats *ms = &obj->stats;
+  int i;
+
+  stats_get (st, b);
+  ms->count = stats_hist_count (&b->latency);
+  memcpy (ms->responses, b->responses, sizeof (ms->responses));
+  ms->bytes_in = b->bytes_in;
+  ms->bytes_out = b->bytes_out;
+  ms->sum = (double) b->latency.sum * 1000;
+  if (ms->count > 0)
     {
-      struct metric_label *p = DLIST_FIRST (head);
-      DLIST_SHIFT (head, next);
-      free (p);
+      ms->avg = ms->sum / ms->count;
+      ms->stddev = stats_hist_stddev (&b->latency, ms->count) * 1000;
     }
+  for (i = 0; i < METRIC_HIST_BUCKETS; i++)
+    ms->hist[i] = stats_hist_count_below (&b->latency, i);
+  obj->has_stats = 1;
 }
-
+
 /*
- * Metric samples.
+ * Store in OBJ the snapshot of phase times from the block B, filled
+ * by a previous call to metric_object_stats.
  */
-struct metric_sample
+static void
+metric_object_phases (struct metric_object *obj, struct stats_block const *b)
 {
-  METRIC_LABELS labels;
-  double number;
-  SLIST_ENTRY (metric_sample) next;
-};
+  int i, k;
 
-typedef SLIST_HEAD (,metric_sample) METRIC_SAMPLES;
+  if ((obj->phase = calloc (PHASE_MAX, sizeof (obj->phase[0]))) == NULL)
+    {
+      lognomem ();
+      return;
+    }
+  for (i = 0; i < PHASE_MAX; i++)
+    {
+      struct metric_phase *mp = &obj->phase[i];
+
+      mp->count = stats_phase_count_below (&b->phase[i],
+					   STATS_PHASE_BUCKETS - 1);
+      mp->sum = (double) b->phase[i].sum * 1000;
+      for (k = 0; k < METRIC_HIST_BUCKETS; k++)
+	mp->hist[k] = stats_phase_count_below (&b->phase[i], k);
+    }
+}
 
 /*
- * Allocate a new metric sample and append it to the samples list.
- * On success, return the new sample.
- * On error, log the failure and return NULL.
+ * Collect the listeners, services, and backends to describe.  The
+ * state of each backend is copied while holding its service mutex,
+ * as service_serialize does.
  */
-static struct metric_sample *
-metric_samples_add (METRIC_SAMPLES *samples)
+static int
+metric_objects_collect (struct metric_objects objs[])
 {
-  struct metric_sample *sp;
+  struct stats_block *b = NULL;
+  LISTENER *lstn;
+  size_t i;
+  int rc = -1;
 
-  if ((sp = malloc (sizeof (*sp))) != NULL)
+  if (enable_backend_stats && (b = malloc (sizeof (*b))) == NULL)
     {
-      DLIST_INIT (&sp->labels);
-      sp->number = 0;
-      SLIST_PUSH (samples, sp, next);
+      lognomem ();
+      return -1;
     }
-  else
-    lognomem ();
-  return sp;
-}
 
-/* Free all samples in the list. */
-static void
-metric_samples_free (METRIC_SAMPLES *samples)
-{
-  while (!SLIST_EMPTY (samples))
+  i = 0;
+  SLIST_FOREACH (lstn, &listeners, next)
+    {
+      struct metric_object *lobj;
+
+      if ((lobj = metric_objects_add (&objs[METRIC_LISTENER], NULL,
+				      METRIC_LISTENER, i++)) == NULL)
+	goto end;
+      lobj->lstn = lstn;
+    }
+
+  for (i = 0; i <= objs[METRIC_LISTENER].count; i++)
     {
-      struct metric_sample *s = SLIST_FIRST (samples);
-      SLIST_SHIFT (samples, next);
-      metric_labels_free (&s->labels);
-      free (s);
+      SERVICE_HEAD *head;
+      struct metric_object *lobj;
+      SERVICE *svc;
+      int j;
+
+      if (i < objs[METRIC_LISTENER].count)
+	{
+	  lobj = &objs[METRIC_LISTENER].obj[i];
+	  head = &lobj->lstn->services;
+	}
+      else
+	{
+	  /* Global services. */
+	  lobj = NULL;
+	  head = &services;
+	}
+
+      j = 0;
+      SLIST_FOREACH (svc, head, next)
+	{
+	  struct metric_object *sobj;
+	  BACKEND *be;
+	  int k;
+
+	  if ((sobj = metric_objects_add (&objs[METRIC_SERVICE], lobj,
+					  METRIC_SERVICE, j++)) == NULL)
+	    goto end;
+	  sobj->svc = svc;
+	  if (svc->stats)
+	    {
+	      metric_object_stats (sobj, svc->stats, b);
+	      metric_object_phases (sobj, b);
+	    }
+
+	  k = 0;
+	  pthread_mutex_lock (&svc->mut);
+	  SLIST_FOREACH (be, &svc->backends, next)
+	    {
+	      struct metric_object *bobj;
+
+	      if ((bobj = metric_objects_add (&objs[METRIC_BACKEND], sobj,
+					      METRIC_BACKEND, k++)) == NULL)
+		{
+		  pthread_mutex_unlock (&svc->mut);
+		  goto end;
+		}
+	      bobj->svc = svc;
+	      bobj->alive = backend_is_alive (be);
+	      bobj->enabled = !be->disabled;
+	      bobj->sessions = be->session_count;
+	      if (be->stats)
+		metric_object_stats (bobj, be->stats, b);
+	    }
+	  pthread_mutex_unlock (&svc->mut);
+	}
     }
+  rc = 0;
+ end:
+  free (b);
+  return rc;
 }
-
+
 /*
- * Metrics.
+ * Metric output.
  */
-struct metric
+struct metric_output
 {
-  struct metric_family const *family;
-  METRIC_SAMPLES samples;
-  SLIST_ENTRY (metric) next;
+  struct stringbuf *sb;                /* Output buffer */
+  struct metric_family const *family;  /* Family being output */
+  int header_done;                     /* Family header has been output */
+  struct metric_object const *obj;     /* Object being described */
+  int nlabels;                         /* Number of labels in current sample */
 };
 
-/* Exposition is a list of metrics. */
-typedef SLIST_HEAD (,metric) EXPOSITION;
-
-#define EXPOSITION_INIT(exp) SLIST_INIT(exp)
-
 /*
- * Allocate a new metric sample and append it to the sample list in
- * the metric.  Set sample labels to PFX.
- * Return the new sample or NULL on allocation error.  In the latter
- * case the partially initialized object might be left attached to
- * the metric.  Thus, it will be freed when the caller disposes of
- * the metric.
+ * Mertric families.
  */
-static struct metric_sample *
-metric_add_sample (struct metric *metric, METRIC_LABELS *pfx)
+struct metric_family
+{
+  char const *name;
+  char const *type;
+  char const *unit;
+  char const *help;
+  int (*genfn) (struct metric_output *, struct metric_object const *);
+};
+
+/* Output label value STR, escaping it as required by Openmetrics. */
+static void
+metric_label_value (struct stringbuf *sb, char const *str)
 {
-  struct metric_sample *samp = metric_samples_add (&metric->samples);
-  if (samp)
+  for (; *str; str++)
     {
-      if (metric_labels_copy (&samp->labels, pfx))
-	return NULL;
+      switch (*str)
+	{
+	case '\\':
+	  stringbuf_add_string (sb, "\\\\");
+	  break;
+
+	case '"':
+	  stringbuf_add_string (sb, "\\\"");
+	  break;
+
+	case '\n':
+	  stringbuf_add_string (sb, "\\n");
+	  break;
+
+	default:
+	  stringbuf_add_char (sb, *str);
+	}
     }
-  return samp;
 }
 
-/* Free the metric and everything associated with it. */
+/* Add label NAME=VALUE to the current sample. */
 static void
-metric_free (struct metric *metric)
+sample_label (struct metric_output *out, char const *name, char const *value)
 {
-  metric_samples_free (&metric->samples);
+  stringbuf_add_char (out->sb, out->nlabels++ ? ',' : '{');
+  stringbuf_add_string (out->sb, name);
+  stringbuf_add_string (out->sb, "=\"");
+  metric_label_value (out->sb, value);
+  stringbuf_add_char (out->sb, '"');
 }
 
 /*
- * Find in the exposition a metric with the given family.  If not there,
- * allocate one and add to the exposition.
- * Return the metric.
- * On error, log the failure and return NULL.
+ * Begin new sample of the current family.  SUFFIX (if not NULL) is
+ * appended to the family name.  Output family header if it is the
+ * first sample and labels identifying the current object.
  */
-static struct metric *
-exposition_metric_find (EXPOSITION *exp, struct metric_family const *family)
+static void
+sample_begin (struct metric_output *out, char const *suffix)
 {
-  struct metric *mp;
+  struct metric_family const *family = out->family;
+  int i;
 
-  SLIST_FOREACH (mp, exp, next)
+  if (!out->header_done)
     {
-      if (mp->family == family)
-	return mp;
+      stringbuf_printf (out->sb, "# TYPE %s %s\n",
+			family->name, family->type);
+      if (family->unit)
+	stringbuf_printf (out->sb, "# UNIT %s %s\n", family->name,
+			  family->unit);
+      stringbuf_printf (out->sb, "# HELP %s %s\n", family->name, family->help);
+      out->header_done = 1;
     }
 
-  if ((mp = malloc (sizeof (*mp))) != NULL)
+  stringbuf_add_string (out->sb, family->name);
+  if (suffix)
+    stringbuf_add_string (out->sb, suffix);
+  out->nlabels = 0;
+  for (i = 0; i < METRIC_MAX_LEVEL; i++)
     {
-      mp->family = family;
-      SLIST_INIT (&mp->samples);
-      SLIST_PUSH (exp, mp, next);
+      if (out->obj->index[i] >= 0)
+	{
+	  char nbuf[80];
+	  snprintf (nbuf, sizeof nbuf, "%d", out->obj->index[i]);
+	  sample_label (out, metric_index_label[i], nbuf);
+	}
     }
-  else
-    lognomem ();
-  return mp;
 }
 
-/* Free the exposition. */
+/* Finish the current sample. */
 static void
-exposition_free (EXPOSITION *exp)
+sample_end (struct metric_output *out, double number)
 {
-  while (!SLIST_EMPTY (exp))
-    {
-      struct metric *mp = SLIST_FIRST (exp);
-      SLIST_SHIFT (exp, next);
-      metric_free (mp);
-      free (mp);
-    }
+  if (out->nlabels)
+    stringbuf_add_char (out->sb, '}');
+  stringbuf_printf (out->sb, " %.0f\n", number);
 }
-
+
 /*
- * Mertric families.
+ * Output a sample of the current family.  If NAME is not NULL, label
+ * NAME=VALUE is added to it.
  */
-struct metric_family
+static void
+metric_sample (struct metric_output *out, char const *name, char const *value,
+	       double number)
 {
-  char const *name;
-  char const *type;
-  char const *unit;
-  char const *help;
-  int (*setfn) (EXPOSITION *, struct metric *, METRIC_LABELS *, struct json_value *);
-};
+  sample_begin (out, NULL);
+  if (name)
+    sample_label (out, name, value);
+  sample_end (out, number);
+}
 
-static int gen_listener_enabled (EXPOSITION *exp, struct metric *metric,
-				 METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_listener_info (EXPOSITION *exp, struct metric *metric,
-			      METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_backends_count (EXPOSITION *exp, struct metric *metric,
-			       METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_service_info (EXPOSITION *exp, struct metric *metric,
-			     METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_service_enabled (EXPOSITION *exp, struct metric *metric,
-				METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_service_pri (EXPOSITION *exp, struct metric *metric,
-			    METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_backend_state (EXPOSITION *exp, struct metric *metric,
-			      METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_backend_requests (EXPOSITION *exp, struct metric *metric,
-				 METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_backend_request_time_avg (EXPOSITION *exp, struct metric *metric,
-				 METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_backend_request_stddev (EXPOSITION *exp, struct metric *metric,
-				 METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_workers (EXPOSITION *exp, struct metric *metric,
-			METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_backend_session_count (EXPOSITION *exp, struct metric *metric,
-			METRIC_LABELS *pfx, struct json_value *obj);
+static int gen_listener_enabled (struct metric_output *,
+				 struct metric_object const *);
+static int gen_listener_info (struct metric_output *,
+			      struct metric_object const *);
+static int gen_listener_route_cache (struct metric_output *,
+				     struct metric_object const *);
+static int gen_listener_rate_limit (struct metric_output *,
+				    struct metric_object const *);
+static int gen_listener_conn_limit (struct metric_output *,
+				    struct metric_object const *);
+static int gen_listener_client_timeouts (struct metric_output *,
+					 struct metric_object const *);
+static int gen_backends_count (struct metric_output *,
+			       struct metric_object const *);
+static int gen_service_info (struct metric_output *,
+			     struct metric_object const *);
+static int gen_service_enabled (struct metric_output *,
+				struct metric_object const *);
+static int gen_service_pri (struct metric_output *,
+			    struct metric_object const *);
+static int gen_service_rate_limit (struct metric_output *,
+				   struct metric_object const *);
+static int gen_service_conc_limit (struct metric_output *,
+				   struct metric_object const *);
+static int gen_backend_state (struct metric_output *,
+			      struct metric_object const *);
+static int gen_stats_requests (struct metric_output *,
+			       struct metric_object const *);
+static int gen_service_phase_time (struct metric_output *,
+				   struct metric_object const *);
+static int gen_stats_responses (struct metric_output *,
+				struct metric_object const *);
+static int gen_stats_bytes (struct metric_output *,
+			    struct metric_object const *);
+static int gen_stats_request_time (struct metric_output *,
+				   struct metric_object const *);
+static int gen_backend_request_time_avg (struct metric_output *,
+					 struct metric_object const *);
+static int gen_backend_request_stddev (struct metric_output *,
+				       struct metric_object const *);
+static int gen_backend_session_count (struct metric_output *,
+				      struct metric_object const *);
+static int gen_workers (struct metric_output *, struct metric_object const *);
+static int gen_worker_queue_length (struct metric_output *,
+				    struct metric_object const *);
+static int gen_worker_queue_dequeued (struct metric_output *,
+				      struct metric_object const *);
+static int gen_worker_queue_wait_avg (struct metric_output *,
+				      struct metric_object const *);
+static int gen_worker_queue_wait_max (struct metric_output *,
+				      struct metric_object const *);
+static int gen_tls_handshakes (struct metric_output *,
+			       struct metric_object const *);
+static int gen_tls_handshake_pending (struct metric_output *,
+				      struct metric_object const *);
+static int gen_tls_handshake_time_avg (struct metric_output *,
+				       struct metric_object const *);
+static int gen_tls_handshake_time_max (struct metric_output *,
+				       struct metric_object const *);
+static int gen_tls_early_data (struct metric_output *,
+			       struct metric_object const *);
+static int gen_trace (struct metric_output *,
+		      struct metric_object const *);
+static int gen_log_queue (struct metric_output *,
+			  struct metric_object const *);
+static int gen_basic_auth_cache (struct metric_output *,
+				 struct metric_object const *);
 
 static struct metric_family listener_metric_families[] = {
   { "pound_listener_enabled",
@@ -271,6 +490,26 @@ static struct metric_family listener_metric_families[] = {
     NULL,
     "Description of a listener.",
     gen_listener_info },
+  { "pound_listener_route_cache",
+    "gauge",
+    NULL,
+    "Route cache statistics.",
+    gen_listener_route_cache },
+  { "pound_listener_rate_limit",
+    "gauge",
+    NULL,
+    "Rate limiter statistics: number of buckets, passed, rejected, and evicted.",
+    gen_listener_rate_limit },
+  { "pound_listener_conn_limit",
+    "gauge",
+    NULL,
+    "Per-client connection limit: number of clients and connections tracked, and connections rejected.",
+    gen_listener_conn_limit },
+  { "pound_listener_client_timeouts",
+    "gauge",
+    NULL,
+    "Number of client connections dropped because of header, body rate, or keep-alive time-outs.",
+    gen_listener_client_timeouts },
   { NULL }
 };
 
@@ -296,6 +535,41 @@ static struct metric_family service_metric_families[] = {
     "Number of backends per service: total, alive, enabled, and active (both alive and enabled).",
     gen_backends_count,
   },
+  { "pound_service_rate_limit",
+    "gauge",
+    NULL,
+    "Rate limiter statistics: number of buckets, passed, rejected, and evicted.",
+    gen_service_rate_limit },
+  { "pound_service_concurrency_limit",
+    "gauge",
+    NULL,
+    "Adaptive concurrency limiter: current limit, requests in flight, passed, queued, rejected, and failed.",
+    gen_service_conc_limit },
+  { "pound_service_requests",
+    "gauge",
+    NULL,
+    "Number of requests processed by service.",
+    gen_stats_requests },
+  { "pound_service_responses",
+    "gauge",
+    NULL,
+    "Number of responses by status class.",
+    gen_stats_responses },
+  { "pound_service_bytes",
+    "gauge",
+    NULL,
+    "Number of request (in) and response (out) body bytes.",
+    gen_stats_bytes },
+  { "pound_service_request_time_nanoseconds",
+    "histogram",
+    "nanoseconds",
+    "Time per request spent in backends.",
+    gen_stats_request_time },
+  { "pound_service_phase_time_nanoseconds",
+    "histogram",
+    "nanoseconds",
+    "Time per request spent in each processing phase.",
+    gen_service_phase_time },
   { NULL }
 };
 
@@ -309,7 +583,7 @@ static struct metric_family backend_metric_families[] = {
     "gauge",
     NULL,
     "Number of requests processed by backend,",
-    gen_backend_requests },
+    gen_stats_requests },
   { "pound_backend_request_time_avg_nanoseconds",
     "gauge",
     "nanoseconds",
@@ -320,6 +594,21 @@ static struct metric_family backend_metric_families[] = {
     "nanoseconds",
     "Standard deviation of the average time per request.",
     gen_backend_request_stddev },
+  { "pound_backend_responses",
+    "gauge",
+    NULL,
+    "Number of responses by status class.",
+    gen_stats_responses },
+  { "pound_backend_bytes",
+    "gauge",
+    NULL,
+    "Number of request (in) and response (out) body bytes.",
+    gen_stats_bytes },
+  { "pound_backend_request_time_nanoseconds",
+    "histogram",
+    "nanoseconds",
+    "Time per request spent in backend.",
+    gen_stats_request_time },
   { "pound_backend_sessions_count",
     "gauge",
     NULL,
@@ -337,47 +626,119 @@ static struct metric_family workers_metric_families[] = {
   { NULL }
 };
 
-
+static struct metric_family worker_queue_metric_families[] = {
+  { "pound_worker_queue_length",
+    "gauge",
+    NULL,
+    "Number of connections waiting for a worker, by priority class.",
+    gen_worker_queue_length },
+  { "pound_worker_queue_dequeued",
+    "gauge",
+    NULL,
+    "Number of connections passed to workers, by priority class.",
+    gen_worker_queue_dequeued },
+  { "pound_worker_queue_wait_avg_nanoseconds",
+    "gauge",
+    "nanoseconds",
+    "Average time spent in the worker queue, by priority class.",
+    gen_worker_queue_wait_avg },
+  { "pound_worker_queue_wait_max_nanoseconds",
+    "gauge",
+    "nanoseconds",
+    "Longest time spent in the worker queue, by priority class.",
+    gen_worker_queue_wait_max },
+  { NULL }
+};
+
+static struct metric_family tls_handshake_metric_families[] = {
+  { "pound_tls_handshakes",
+    "gauge",
+    NULL,
+    "Number of TLS handshakes performed by handshake threads: completed, failed, and timed out.",
+    gen_tls_handshakes },
+  { "pound_tls_handshake_pending",
+    "gauge",
+    NULL,
+    "Number of TLS handshakes in progress.",
+    gen_tls_handshake_pending },
+  { "pound_tls_handshake_time_avg_nanoseconds",
+    "gauge",
+    "nanoseconds",
+    "Average time of a completed TLS handshake.",
+    gen_tls_handshake_time_avg },
+  { "pound_tls_handshake_time_max_nanoseconds",
+    "gauge",
+    "nanoseconds",
+    "Longest time of a completed TLS handshake.",
+    gen_tls_handshake_time_max },
+  { NULL }
+};
+
+static struct metric_family early_data_metric_families[] = {
+  { "pound_tls_early_data",
+    "gauge",
+    NULL,
+    "TLS 1.3 early data: connections with accepted and rejected early data, early data rejected as replayed, and requests refused as too early.",
+    gen_tls_early_data },
+  { NULL }
+};
+
+static struct metric_family log_queue_metric_families[] = {
+  { "pound_log_queue_records",
+    "gauge",
+    NULL,
+    "Asynchronous logging: records waiting in queues, written, dropped on overflow, and overflows that blocked the logging thread.",
+    gen_log_queue },
+  { NULL }
+};
+
+static struct metric_family trace_metric_families[] = {
+  { "pound_trace_spans",
+    "gauge",
+    NULL,
+    "Tracing: sampled requests, and spans waiting for export, exported, dropped on queue overflow, and lost on export errors.",
+    gen_trace },
+  { NULL }
+};
+
+static struct metric_family basic_auth_cache_metric_families[] = {
+  { "pound_basic_auth_cache",
+    "gauge",
+    NULL,
+    "Cache of verified basic authentication credentials: number of entries, hits, and misses.",
+    gen_basic_auth_cache },
+  { NULL }
+};
+
 /*
- * Metric family definitions describe how to iterate over the root
- * object and, if necessary, what family to descend into for each
- * object retrieved.
+ * Global metrics are obtained from the JSON serialization of the
+ * corresponding object.
  */
-struct metric_family_defn
+struct global_metric
 {
   struct metric_family const *family;
-  char const *attr;        /* JSON attribute that contains array of objects
-			      of this family. */
-  char const *index_label; /* Label to hold index of the current object. */
-  int descend_family;      /* After handling each retrieved object, descend
-			      into that family. */
+  struct json_value *(*serialize) (void);
+  unsigned *enabled;          /* If not NULL, *enabled must be non-zero. */
 };
 
-/* The table below is indexed by these constants: */
-enum
-  {
-    METRIC_FAMILY_NONE = -1,
-    METRIC_FAMILY_LISTENER,
-    METRIC_FAMILY_SERVICE,
-    METRIC_FAMILY_BACKEND
-  };
-
-struct metric_family_defn metric_family_defn[] = {
-  { listener_metric_families,
-    "listeners",
-    "listener",
-    METRIC_FAMILY_SERVICE },
-  { service_metric_families,
-    "services",
-    "service",
-    METRIC_FAMILY_BACKEND },
-  { backend_metric_families,
-    "backends",
-    "backend",
-    METRIC_FAMILY_NONE },
+static struct global_metric global_metrics[] = {
+  { workers_metric_families, workers_serialize },
+  { worker_queue_metric_families, worker_queue_serialize },
+  { tls_handshake_metric_families, tls_handshake_serialize },
+  { early_data_metric_families, early_data_serialize },
+  { basic_auth_cache_metric_families, basic_auth_cache_serialize },
+  { log_queue_metric_families, log_queue_serialize, &log_queue_size },
+  { trace_metric_families, trace_serialize, &trace_conf.enabled },
   { NULL }
 };
 
+/* Per-level metric families. */
+static struct metric_family const *object_metric_families[METRIC_MAX_LEVEL] = {
+  listener_metric_families,
+  service_metric_families,
+  backend_metric_families
+};
+
 /*
  * Version of json_object_get with error and type checking.
  * Retrieves from the object OBJ the value of attribute ATTR.
@@ -428,500 +789,652 @@ json_object_get_type (struct json_value *obj, char const *attr, int type,
   return -1;
 }
 
-static int
-json_object_get_name (struct json_value *obj, struct json_value **retval)
-{
-  struct json_value *jv;
-
-  if (json_object_get (obj, "name", &jv))
-    {
-      if (errno == ENOENT)
-	logmsg (LOG_NOTICE, "attribute \"%s\" not found", "name");
-      else
-	logmsg (LOG_NOTICE, "attribute lookup error: %s", strerror (errno));
-      return -1;
-    }
-
-  switch (jv->type)
-    {
-    case json_string:
-    case json_null:
-      *retval = jv;
-      break;
-
-    default:
-      logmsg (LOG_NOTICE, "attribute \"%s\" type mismatch (expected %d or %d, got %d)",
-	      "name", json_string, json_null, jv->type);
-      errno = EINVAL;
-      return -1;
-    }
-
-  return 0;
-}
-
 /*
- * For each entry in the FAMILY array, apply its setfn function to the metric
- * of this family in the exposition.  EXP, PFX and VAL are passed to setfn.
+ * Output all metrics of the given FAMILY array for each object in OBJS.
+ * If LOCK is set, lock the service of each object while describing it.
  *
  * Return 0 on success.
  * On error, log the failure and return -1.
  */
-int
-exposition_apply_family (EXPOSITION *exp,
-			 METRIC_LABELS *pfx,
-			 struct metric_family const *family,
-			 struct json_value *val)
+static int
+metric_family_output (struct stringbuf *sb, struct metric_family const *family,
+		      struct metric_objects const *objs, int lock)
 {
-  int res = 0;
   for (; family->name; family++)
     {
-      static struct metric *metric;
+      struct metric_output out;
+      size_t i;
 
-      if ((metric = exposition_metric_find (exp, family)) == NULL)
+      out.sb = sb;
+      out.family = family;
+      out.header_done = 0;
+      for (i = 0; i < objs->count; i++)
 	{
-	  logmsg (LOG_ERR, "INTERNAL ERROR at %s:%d: metric family not found; please report", __FILE__, __LINE__);
-	  res = -1;
-	  break;
+	  int rc;
+
+	  out.obj = &objs->obj[i];
+	  if (lock)
+	    pthread_mutex_lock (&out.obj->svc->mut);
+	  rc = family->genfn (&out, out.obj);
+	  if (lock)
+	    pthread_mutex_unlock (&out.obj->svc->mut);
+	  if (rc)
+	    return -1;
 	}
-
-      if ((res = family->setfn (exp, metric, pfx, val)) != 0)
-	break;
     }
-  return res;
+  return 0;
 }
 
-/*
- * Iterate over each value in OBJ using metric family definition at
- * index FN.
- *
- * Return 0 on success.
- * On error, log the failure and return -1.
- */
-int
-exposition_iterate (EXPOSITION *exp, METRIC_LABELS const *pfx, int fn,
-		    struct json_value *obj)
-{
-  struct metric_family_defn const *defn = metric_family_defn + fn;
-  struct json_value *arr, *jv;
-  size_t i, n;
-  char nbuf[80];
-  METRIC_LABELS pfxcopy;
-  int res;
+static int
+gen_listener_enabled (struct metric_output *out,
+		      struct metric_object const *obj)
+{
+  metric_sample (out, NULL, NULL, !obj->lstn->disabled);
+  return 0;
+}
 
-  if (json_object_get (obj, defn->attr, &arr))
-    {
-      if (errno == ENOENT)
-	return 0;
-      else
-	{
-	  logmsg (LOG_NOTICE, "attribute lookup error: %s", strerror (errno));
-	  return -1;
-	}
-    }
-  if (arr->type != json_array)
-    {
-      logmsg (LOG_NOTICE, "attribute \"%s\" type mismatch (expected %d, got %d)",
-	      defn->attr, json_array, arr->type);
-      return -1;
-    }
+static int
+gen_listener_info (struct metric_output *out, struct metric_object const *obj)
+{
+  LISTENER *lstn = obj->lstn;
+  char buf[MAX_ADDR_BUFSIZE];
+
+  addr2str (buf, sizeof (buf), &lstn->addr, 0);
+  sample_begin (out, NULL);
+  sample_label (out, "name", lstn->name ? lstn->name : "");
+  sample_label (out, "address", buf);
+  sample_label (out, "protocol",
+		SLIST_EMPTY (&lstn->ctx_head) ? "http" : "https");
+  sample_end (out, 1);
+  return 0;
+}
 
-  DLIST_INIT (&pfxcopy);
-  metric_labels_copy (&pfxcopy, pfx);
+static int
+gen_listener_route_cache (struct metric_output *out,
+			  struct metric_object const *obj)
+{
+  struct route_cache_stats st;
+
+  if (!obj->lstn->route_cache)
+    /* Route cache is not enabled. */
+    return 0;
+  route_cache_get_stats (obj->lstn->route_cache, &st);
+  metric_sample (out, "type", "entries", st.entries);
+  metric_sample (out, "type", "hits", st.hits);
+  metric_sample (out, "type", "misses", st.misses);
+  return 0;
+}
 
-  res = 0;
-  n = json_array_length (arr);
-  for (i = 0; i < n; i++)
-    {
-      jv = arr->v.a->ov[i];
-      snprintf (nbuf, sizeof nbuf, "%zu", i);
-      if ((res = metric_labels_add (&pfxcopy, defn->index_label, nbuf)) != 0)
-	break;
-      if ((res = exposition_apply_family (exp, &pfxcopy, defn->family, jv)) != 0)
-	break;
-      if (defn->descend_family != METRIC_FAMILY_NONE)
-	{
-	  if ((res = exposition_iterate (exp, &pfxcopy, defn->descend_family, jv)) != 0)
-	    break;
-	}
-      metric_labels_pop (&pfxcopy);
-    }
-  metric_labels_free (&pfxcopy);
-  return res;
+static void
+gen_rate_limit (struct metric_output *out, RATE_LIMIT *rl)
+{
+  struct rate_limit_stats st;
+
+  rate_limit_get_stats (rl, &st);
+  metric_sample (out, "type", "entries", st.entries);
+  metric_sample (out, "type", "passed", st.passed);
+  metric_sample (out, "type", "rejected", st.rejected);
+  metric_sample (out, "type", "evicted", st.evicted);
 }
-
+
 static int
-gen_listener_enabled (EXPOSITION *exp, struct metric *metric,
-		      METRIC_LABELS *pfx, struct json_value *obj)
+gen_listener_rate_limit (struct metric_output *out,
+			 struct metric_object const *obj)
 {
-  struct json_value *jv;
-  struct metric_sample *samp;
-
-  if (json_object_get_type (obj, "enabled", json_bool, &jv))
-    return -1;
+  if (obj->lstn->rate_limit)
+    gen_rate_limit (out, obj->lstn->rate_limit);
+  return 0;
+}
 
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  samp->number = jv->v.b;
+static int
+gen_listener_conn_limit (struct metric_output *out,
+			 struct metric_object const *obj)
+{
+  struct conn_limit_stats st;
+
+  if (!obj->lstn->conn_table)
+    /* Connection limit is not configured. */
+    return 0;
+  conn_limit_get_stats (obj->lstn->conn_table, &st);
+  metric_sample (out, "type", "clients", st.clients);
+  metric_sample (out, "type", "active", st.active);
+  metric_sample (out, "type", "rejected", st.rejected);
   return 0;
 }
 
 static int
-gen_listener_info (EXPOSITION *exp, struct metric *metric,
-		   METRIC_LABELS *pfx, struct json_value *obj)
+gen_listener_client_timeouts (struct metric_output *out,
+			      struct metric_object const *obj)
 {
-  struct metric_sample *samp;
-  struct json_value *jv;
+  LISTENER *lstn = obj->lstn;
+  unsigned long count[CLIENT_TMO_MAX];
+
+  if (!(lstn->header_to || lstn->body_min_rate || lstn->keepalive_to))
+    /* No client time-outs configured. */
+    return 0;
+  pthread_mutex_lock (&lstn->tmo_mutex);
+  memcpy (count, lstn->tmo_count, sizeof (count));
+  pthread_mutex_unlock (&lstn->tmo_mutex);
+  metric_sample (out, "type", "header", count[CLIENT_TMO_HEADER]);
+  metric_sample (out, "type", "body_rate", count[CLIENT_TMO_BODY_RATE]);
+  metric_sample (out, "type", "keepalive", count[CLIENT_TMO_KEEPALIVE]);
+  return 0;
+}
 
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
+static int
+gen_service_info (struct metric_output *out, struct metric_object const *obj)
+{
+  metric_sample (out, "name", obj->svc->name ? obj->svc->name : "", 1);
+  return 0;
+}
 
-  if (json_object_get_name (obj, &jv))
-    return -1;
-  if (metric_labels_add (&samp->labels, "name",
-			 jv->type == json_string ? jv->v.s : ""))
-    return -1;
+static int
+gen_service_enabled (struct metric_output *out,
+		     struct metric_object const *obj)
+{
+  metric_sample (out, NULL, NULL, !obj->svc->disabled);
+  return 0;
+}
 
-  if (json_object_get_type (obj, "address", json_string, &jv))
-    return -1;
-  metric_labels_add (&samp->labels, "address", jv->v.s);
-  if (json_object_get_type (obj, "protocol", json_string, &jv))
-    return -1;
-  if (metric_labels_add (&samp->labels, "protocol", jv->v.s))
-    return -1;
-  samp->number = 1;
+static int
+gen_service_pri (struct metric_output *out, struct metric_object const *obj)
+{
+  metric_sample (out, "entity", "total", obj->svc->tot_pri);
+  metric_sample (out, "entity", "absolute", obj->svc->abs_pri);
   return 0;
 }
-
+
 static int
-gen_backends_count (EXPOSITION *exp, struct metric *metric,
-		    METRIC_LABELS *pfx, struct json_value *obj)
+gen_backends_count (struct metric_output *out,
+		    struct metric_object const *obj)
 {
-  struct metric_sample *samp;
-  struct json_value *arr, *jv;
+  BACKEND *be;
+  size_t n = 0;
   size_t n_alive = 0;
   size_t n_enabled = 0;
   size_t n_active = 0;
-  size_t i, n;
-
-  if (json_object_get_type (obj, "backends", json_array, &arr))
-    return -1;
 
-  n = json_array_length (arr);
-  for (i = 0; i < n; i++)
+  SLIST_FOREACH (be, &obj->svc->backends, next)
     {
-      int enabled = 0;
-
-      jv = arr->v.a->ov[i];
-
-      if (json_object_get_type (arr->v.a->ov[i], "enabled", json_bool, &jv) == 0 &&
-	  (enabled = jv->v.b) != 0)
+      n++;
+      if (!be->disabled)
 	n_enabled++;
-
-      if (json_object_get_type (arr->v.a->ov[i], "alive", json_bool, &jv) == 0 &&
-	  jv->v.b)
+      if (backend_is_alive (be))
 	{
 	  n_alive++;
-	  if (enabled)
+	  if (!be->disabled)
 	    n_active++;
 	}
     }
 
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  if (metric_labels_add (&samp->labels, "state", "total"))
-    return -1;
-  samp->number = n;
-
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  if (metric_labels_add (&samp->labels, "state", "enabled"))
-    return -1;
-  samp->number = n_enabled;
-
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  if (metric_labels_add (&samp->labels, "state", "alive"))
-    return -1;
-  samp->number = n_alive;
-
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  if (metric_labels_add (&samp->labels, "state", "active"))
-    return -1;
-  samp->number = n_active;
+  metric_sample (out, "state", "total", n);
+  metric_sample (out, "state", "enabled", n_enabled);
+  metric_sample (out, "state", "alive", n_alive);
+  metric_sample (out, "state", "active", n_active);
   return 0;
 }
 
 static int
-gen_service_info (EXPOSITION *exp, struct metric *metric,
-		  METRIC_LABELS *pfx, struct json_value *obj)
+gen_service_rate_limit (struct metric_output *out,
+			struct metric_object const *obj)
 {
-  struct metric_sample *samp;
-  struct json_value *jv;
+  if (obj->svc->rate_limit)
+    gen_rate_limit (out, obj->svc->rate_limit);
+  return 0;
+}
 
-  if (json_object_get_name (obj, &jv))
-    return -1;
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  if (metric_labels_add (&samp->labels, "name",
-			 jv->type == json_string ? jv->v.s : ""))
-    return -1;
-  samp->number = 1;
+static int
+gen_service_conc_limit (struct metric_output *out,
+			struct metric_object const *obj)
+{
+  struct conc_limit_stats st;
+
+  if (!obj->svc->conc_limit)
+    /* Concurrency limiting is not configured. */
+    return 0;
+  conc_limit_get_stats (obj->svc->conc_limit, &st);
+  metric_sample (out, "type", "limit", st.limit);
+  metric_sample (out, "type", "inflight", st.inflight);
+  metric_sample (out, "type", "passed", st.passed);
+  metric_sample (out, "type", "queued", st.queued);
+  metric_sample (out, "type", "rejected", st.rejected);
+  metric_sample (out, "type", "failed", st.failed);
   return 0;
 }
 
 static int
-gen_service_enabled (EXPOSITION *exp, struct metric *metric,
-		     METRIC_LABELS *pfx, struct json_value *obj)
+gen_backend_state (struct metric_output *out,
+		   struct metric_object const *obj)
 {
-  struct metric_sample *samp;
-  struct json_value *jv;
+  metric_sample (out, "state", "alive", obj->alive);
+  metric_sample (out, "state", "enabled", obj->enabled);
+  return 0;
+}
 
-  if (json_object_get_type (obj, "enabled", json_bool, &jv))
-    return -1;
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  samp->number = jv->v.b;
+static int
+gen_stats_requests (struct metric_output *out,
+		    struct metric_object const *obj)
+{
+  if (obj->has_stats)
+    metric_sample (out, NULL, NULL, obj->stats.count);
   return 0;
 }
 
 static int
-gen_service_pri (EXPOSITION *exp, struct metric *metric,
-		 METRIC_LABELS *pfx, struct json_value *obj)
+gen_backend_request_time_avg (struct metric_output *out,
+			      struct metric_object const *obj)
 {
-  struct metric_sample *samp;
-  struct json_value *jv;
+  if (obj->has_stats && obj->stats.count > 0)
+    metric_sample (out, NULL, NULL, obj->stats.avg);
+  return 0;
+}
 
-  if (json_object_get_type (obj, "tot_pri", json_integer, &jv))
-    return -1;
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  if (metric_labels_add (&samp->labels, "entity", "total"))
-    return -1;
-  samp->number = jv->v.n;
+static int
+gen_backend_request_stddev (struct metric_output *out,
+			    struct metric_object const *obj)
+{
+  if (obj->has_stats && obj->stats.count > 0)
+    metric_sample (out, NULL, NULL, obj->stats.stddev);
+  return 0;
+}
 
-  if (json_object_get_type (obj, "abs_pri", json_integer, &jv))
-    return -1;
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  if (metric_labels_add (&samp->labels, "entity", "absolute"))
-    return -1;
-  samp->number = jv->v.n;
+static int
+gen_stats_responses (struct metric_output *out,
+		     struct metric_object const *obj)
+{
+  static char const *classes[STATS_CLASSES] = {
+    "1xx", "2xx", "3xx", "4xx", "5xx"
+  };
+  int i;
 
+  if (obj->has_stats)
+    for (i = 0; i < STATS_CLASSES; i++)
+      metric_sample (out, "class", classes[i], obj->stats.responses[i]);
   return 0;
 }
-
+
 static int
-gen_backend_state (EXPOSITION *exp, struct metric *metric,
-		   METRIC_LABELS *pfx, struct json_value *obj)
+gen_stats_bytes (struct metric_output *out, struct metric_object const *obj)
 {
-  struct metric_sample *samp;
-  struct json_value *jv;
+  if (obj->has_stats)
+    {
+      metric_sample (out, "type", "in", obj->stats.bytes_in);
+      metric_sample (out, "type", "out", obj->stats.bytes_out);
+    }
+  return 0;
+}
 
-  if (json_object_get_type (obj, "alive", json_bool, &jv))
-    return -1;
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  if (metric_labels_add (&samp->labels, "state", "alive"))
-    return -1;
-  samp->number = jv->v.b;
+/*
+ * Output a histogram sample with the given SUFFIX and, if LE is not NULL,
+ * "le" label.
+ */
+static void
+histogram_sample (struct metric_output *out, char const *suffix,
+		  char const *le, double number)
+{
+  sample_begin (out, suffix);
+  if (le)
+    sample_label (out, "le", le);
+  sample_end (out, number);
+}
 
-  if (json_object_get_type (obj, "enabled", json_bool, &jv))
-    return -1;
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  if (metric_labels_add (&samp->labels, "state", "enabled"))
-    return -1;
-  samp->number = jv->v.b;
+static int
+gen_stats_request_time (struct metric_output *out,
+			struct metric_object const *obj)
+{
+  int i;
+
+  if (!obj->has_stats)
+    return 0;
+  for (i = 0; i < METRIC_HIST_BUCKETS; i++)
+    {
+      char buf[80];
 
+      snprintf (buf, sizeof buf, "%.0f", (double) (1ULL << i) * 1000);
+      histogram_sample (out, "_bucket", buf, obj->stats.hist[i]);
+    }
+  histogram_sample (out, "_bucket", "+Inf", obj->stats.count);
+  histogram_sample (out, "_count", NULL, obj->stats.count);
+  histogram_sample (out, "_sum", NULL, obj->stats.sum);
   return 0;
 }
 
+/*
+ * Output a sample of phase time histogram for PHASE, with the given
+ * SUFFIX and, if LE is not NULL, "le" label.
+ */
+static void
+phase_histogram_sample (struct metric_output *out, int phase,
+			char const *suffix, char const *le, double number)
+{
+  sample_begin (out, suffix);
+  sample_label (out, "phase", phase_name (phase));
+  if (le)
+    sample_label (out, "le", le);
+  sample_end (out, number);
+}
+
 static int
-gen_backend_stats (EXPOSITION *exp, struct metric *metric,
-		   METRIC_LABELS *pfx, struct json_value *obj, char const *attr)
+gen_service_phase_time (struct metric_output *out,
+			struct metric_object const *obj)
 {
-  struct metric_sample *samp;
-  struct json_value *stats, *jv;
+  int i, k;
 
-  if (json_object_get (obj, "stats", &stats))
+  if (!obj->phase)
+    return 0;
+  for (i = 0; i < PHASE_MAX; i++)
     {
-      if (errno == ENOENT)
-	return 0;
-      else
+      struct metric_phase const *mp = &obj->phase[i];
+
+      if (mp->count == 0)
+	continue;
+      for (k = 0; k < METRIC_HIST_BUCKETS; k++)
 	{
-	  logmsg (LOG_NOTICE, "attribute lookup error: %s", strerror (errno));
-	  return -1;
+	  char buf[80];
+
+	  snprintf (buf, sizeof buf, "%.0f", (double) (1ULL << k) * 1000);
+	  phase_histogram_sample (out, i, "_bucket", buf, mp->hist[k]);
 	}
+      phase_histogram_sample (out, i, "_bucket", "+Inf", mp->count);
+      phase_histogram_sample (out, i, "_count", NULL, mp->count);
+      phase_histogram_sample (out, i, "_sum", NULL, mp->sum);
     }
-  if (stats->type != json_object)
-    {
-      logmsg (LOG_NOTICE, "attribute \"%s\" type mismatch (expected %d, got %d)",
-	      "stats", json_object, jv->type);
-      return -1;
-    }
+  return 0;
+}
 
-  if (json_object_get (stats, attr, &jv))
+static int
+gen_backend_session_count (struct metric_output *out,
+			   struct metric_object const *obj)
+{
+  if (obj->has_stats)
+    metric_sample (out, NULL, NULL, obj->sessions);
+  return 0;
+}
+
+/*
+ * Output a sample for each attribute from the NULL-terminated array
+ * ATTR in the JSON object OBJ, labeled with LABEL=attribute.
+ */
+static int
+gen_json_attrs (struct metric_output *out, struct json_value *obj,
+		char const *label, char const **attr)
+{
+  for (; *attr; attr++)
     {
-      if (errno == ENOENT)
-	return 0;
-      else
-	{
-	  logmsg (LOG_NOTICE, "attribute lookup error: %s", strerror (errno));
-	  return -1;
-	}
+      struct json_value *val;
+
+      if (json_object_get_type (obj, *attr, json_number, &val))
+	return -1;
+      metric_sample (out, label, *attr, val->v.n);
     }
-  if (jv->type != json_number)
+  return 0;
+}
+
+static int
+gen_workers (struct metric_output *out, struct metric_object const *obj)
+{
+  static char const *attr[] = { "active", "count", "max", "min", NULL };
+  return gen_json_attrs (out, obj->json, "type", attr);
+}
+
+/*
+ * Add a sample of attribute ATTR for each priority class in the
+ * worker queue object OBJ.
+ */
+static int
+gen_worker_queue_attr (struct metric_output *out, struct json_value *obj,
+		       char const *attr)
+{
+  static char *classes[] = { "high", "normal", "low", NULL };
+  int i;
+
+  for (i = 0; classes[i]; i++)
     {
-      logmsg (LOG_NOTICE, "stats: attribute \"%s\" type mismatch (expected %d, got %d)",
-	      attr, json_number, jv->type);
-      return -1;
+      struct json_value *q, *val;
+
+      if (json_object_get_type (obj, classes[i], json_object, &q)
+	  || json_object_get_type (q, attr, json_number, &val))
+	return -1;
+      metric_sample (out, "class", classes[i], val->v.n);
     }
+  return 0;
+}
 
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  samp->number = jv->v.n;
+static int
+gen_worker_queue_length (struct metric_output *out,
+			 struct metric_object const *obj)
+{
+  return gen_worker_queue_attr (out, obj->json, "length");
+}
 
-  return 0;
+static int
+gen_worker_queue_dequeued (struct metric_output *out,
+			   struct metric_object const *obj)
+{
+  return gen_worker_queue_attr (out, obj->json, "dequeued");
 }
 
 static int
-gen_backend_requests (EXPOSITION *exp, struct metric *metric,
-		      METRIC_LABELS *pfx, struct json_value *obj)
+gen_worker_queue_wait_avg (struct metric_output *out,
+			   struct metric_object const *obj)
 {
-  return gen_backend_stats (exp, metric, pfx, obj, "request_count");
+  return gen_worker_queue_attr (out, obj->json, "wait_avg");
 }
 
 static int
-gen_backend_request_time_avg (EXPOSITION *exp, struct metric *metric,
-			      METRIC_LABELS *pfx, struct json_value *obj)
+gen_worker_queue_wait_max (struct metric_output *out,
+			   struct metric_object const *obj)
 {
-  return gen_backend_stats (exp, metric, pfx, obj, "request_time_avg");
+  return gen_worker_queue_attr (out, obj->json, "wait_max");
 }
 
 static int
-gen_backend_request_stddev (EXPOSITION *exp, struct metric *metric,
-			    METRIC_LABELS *pfx, struct json_value *obj)
+gen_tls_handshakes (struct metric_output *out,
+		    struct metric_object const *obj)
 {
-  return gen_backend_stats (exp, metric, pfx, obj, "request_time_stddev");
+  static char const *attr[] = { "count", "failed", "timeout", NULL };
+  return gen_json_attrs (out, obj->json, "type", attr);
 }
 
 static int
-gen_backend_session_count (EXPOSITION *exp, struct metric *metric,
-			    METRIC_LABELS *pfx, struct json_value *obj)
+gen_tls_early_data (struct metric_output *out,
+		    struct metric_object const *obj)
 {
-  return gen_backend_stats (exp, metric, pfx, obj, "session_count");
+  static char const *attr[] = {
+    "accepted", "rejected", "replayed", "too_early", NULL
+  };
+  return gen_json_attrs (out, obj->json, "type", attr);
 }
 
+static int
+gen_log_queue (struct metric_output *out, struct metric_object const *obj)
+{
+  static char const *attr[] = {
+    "queued", "written", "dropped", "blocked", NULL
+  };
+  return gen_json_attrs (out, obj->json, "type", attr);
+}
 
 static int
-gen_workers (EXPOSITION *exp, struct metric *metric,
-	     METRIC_LABELS *pfx, struct json_value *obj)
+gen_trace (struct metric_output *out, struct metric_object const *obj)
 {
-  char *attr[] = { "active", "count", "max", "min", NULL };
-  int i;
+  static char const *attr[] = {
+    "sampled", "queued", "exported", "dropped", "failed", NULL
+  };
+  return gen_json_attrs (out, obj->json, "type", attr);
+}
 
-  for (i = 0; attr[i]; i++)
-    {
-      struct json_value *val;
-      struct metric_sample *samp;
+static int
+gen_basic_auth_cache (struct metric_output *out,
+		      struct metric_object const *obj)
+{
+  static char const *attr[] = { "entries", "hits", "misses", NULL };
+  return gen_json_attrs (out, obj->json, "type", attr);
+}
 
-      if (json_object_get_type (obj, attr[i], json_number, &val))
-	return -1;
-      if ((samp = metric_add_sample (metric, pfx)) == NULL)
-	return -1;
-      if (metric_labels_add (&samp->labels, "type", attr[i]))
-	return -1;
-      samp->number = val->v.n;
-    }
+static int
+gen_tls_handshake_number (struct metric_output *out, struct json_value *obj,
+			  char const *attr)
+{
+  struct json_value *val;
+
+  if (json_object_get_type (obj, attr, json_number, &val))
+    return -1;
+  metric_sample (out, NULL, NULL, val->v.n);
   return 0;
 }
-
+
+static int
+gen_tls_handshake_pending (struct metric_output *out,
+			   struct metric_object const *obj)
+{
+  return gen_tls_handshake_number (out, obj->json, "pending");
+}
+
+static int
+gen_tls_handshake_time_avg (struct metric_output *out,
+			    struct metric_object const *obj)
+{
+  return gen_tls_handshake_number (out, obj->json, "time_avg");
+}
+
+static int
+gen_tls_handshake_time_max (struct metric_output *out,
+			    struct metric_object const *obj)
+{
+  return gen_tls_handshake_number (out, obj->json, "time_max");
+}
+
 /*
- * Initialize the exposition and fill it, using OBJ as input.
+ * Generate the exposition in Openmetrics format into stringbuf.
+ * Return 0 on success and -1 on error.
  */
 static int
-exposition_fill (EXPOSITION *exp, struct json_value *obj)
+exposition_generate (struct stringbuf *sb)
 {
-  struct json_value *val;
+  struct global_metric *gm;
+  struct metric_objects objs[METRIC_MAX_LEVEL];
+  int i, rc = 0;
 
-  EXPOSITION_INIT (exp);
+  for (gm = global_metrics; gm->family; gm++)
+    {
+      struct metric_objects gobj;
+      struct metric_object obj;
 
-  if (json_object_get_type (obj, "workers", json_object, &val))
-    return -1;
+      if (gm->enabled && *gm->enabled == 0)
+	continue;
+      memset (&obj, 0, sizeof (obj));
+      if ((obj.json = gm->serialize ()) == NULL)
+	return -1;
+      for (i = 0; i < METRIC_MAX_LEVEL; i++)
+	obj.index[i] = -1;
+      gobj.obj = &obj;
+      gobj.count = 1;
+      rc = metric_family_output (sb, gm->family, &gobj, 0);
+      json_value_free (obj.json);
+      if (rc)
+	return -1;
+    }
 
-  if (exposition_apply_family (exp, NULL, workers_metric_families, val))
+  memset (objs, 0, sizeof (objs));
+  rc = metric_objects_collect (objs);
+  for (i = 0; rc == 0 && i < METRIC_MAX_LEVEL; i++)
+    rc = metric_family_output (sb, object_metric_families[i], &objs[i],
+			       i == METRIC_SERVICE);
+  for (i = 0; i < METRIC_MAX_LEVEL; i++)
+    metric_objects_free (&objs[i]);
+  if (rc)
     return -1;
 
-  if (exposition_iterate (exp, NULL, METRIC_FAMILY_LISTENER, obj))
-    return -1;
+  stringbuf_add_string (sb, "# EOF\n");
+  return stringbuf_err (sb) ? -1 : 0;
+}
 
-  return exposition_iterate (exp, NULL, METRIC_FAMILY_SERVICE, obj);
+/*
+ * Cached exposition.
+ */
+unsigned metrics_cache_ttl;     /* Cache lifetime in milliseconds. */
+
+struct metrics_snapshot
+{
+  unsigned refcount;            /* Reference count. */
+  struct timespec ts;           /* Time of creation. */
+  size_t len;                   /* Length of text. */
+  char text[1];                 /* Exposition text. */
+};
+
+static pthread_mutex_t metrics_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_snapshot *metrics_cache;
+
+static void
+metrics_snapshot_unref (struct metrics_snapshot *snap)
+{
+  if (snap && __atomic_sub_fetch (&snap->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    free (snap);
 }
 
 /*
- * Print the exposition in Openmetrics format into stringbuf.
+ * Return the cached exposition, regenerating it if it is older than
+ * metrics_cache_ttl.  The returned snapshot must be released using
+ * metrics_snapshot_unref.  The mutex serializes regeneration, so that
+ * concurrent scrapes of a stale snapshot generate it only once.
  */
-static char *
-exposition_format (struct stringbuf *sb, EXPOSITION *exp)
+static struct metrics_snapshot *
+metrics_snapshot_get (void)
 {
-  struct metric *metric;
+  struct metrics_snapshot *snap;
+  struct timespec now;
 
-  SLIST_FOREACH (metric, exp, next)
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  pthread_mutex_lock (&metrics_cache_mutex);
+  if ((snap = metrics_cache) != NULL)
     {
-      if (!SLIST_EMPTY (&metric->samples))
-	{
-	  struct metric_sample *samp;
-	  struct metric_family const *family = metric->family;
+      struct timespec age = timespec_sub (&now, &snap->ts);
+      if ((unsigned long long) age.tv_sec * 1000 + age.tv_nsec / 1000000
+	  >= metrics_cache_ttl)
+	snap = NULL;
+    }
 
-	  stringbuf_printf (sb, "# TYPE %s %s\n",
-			    family->name, family->type);
-	  if (family->unit)
-	    stringbuf_printf (sb, "# UNIT %s %s\n", family->name,
-			      family->unit);
-	  stringbuf_printf (sb, "# HELP %s %s\n", family->name, family->help);
+  if (!snap)
+    {
+      struct stringbuf sb;
 
-	  SLIST_FOREACH (samp, &metric->samples, next)
+      stringbuf_init_log (&sb);
+      if (exposition_generate (&sb) == 0)
+	{
+	  if ((snap = malloc (sizeof (*snap) + stringbuf_len (&sb))) == NULL)
+	    lognomem ();
+	  else
 	    {
-	      stringbuf_add_string (sb, family->name);
-	      if (!metric_labels_empty (&samp->labels))
-		{
-		  struct metric_label *label;
-
-		  stringbuf_add_char (sb, '{');
-		  DLIST_FOREACH (label, &samp->labels, next)
-		    {
-		      stringbuf_add_string (sb, label->name);
-		      stringbuf_add_char (sb, '=');
-		      stringbuf_add_char (sb, '"');
-		      //FIXME: escape value
-		      stringbuf_add_string (sb, label->value);
-		      stringbuf_add_char (sb, '"');
-		      if (DLIST_NEXT (label, next))
-			stringbuf_add_char (sb, ',');
-		    }
-		  stringbuf_add_char (sb, '}');
-		}
-	      stringbuf_add_char (sb, ' ');
-	      stringbuf_printf (sb, "%.0f\n", samp->number);
+	      snap->refcount = 1;
+	      snap->ts = now;
+	      snap->len = stringbuf_len (&sb);
+	      memcpy (snap->text, stringbuf_value (&sb), snap->len);
+	      snap->text[snap->len] = 0;
+	      metrics_snapshot_unref (metrics_cache);
+	      metrics_cache = snap;
 	    }
 	}
+      stringbuf_free (&sb);
     }
-  stringbuf_add_string (sb, "# EOF\n");
-  return stringbuf_finish (sb);
+
+  if (snap)
+    __atomic_add_fetch (&snap->refcount, 1, __ATOMIC_ACQ_REL);
+  pthread_mutex_unlock (&metrics_cache_mutex);
+  return snap;
 }
 
 static int
-send_reply (POUND_HTTP *phttp, char const *content)
+send_reply (POUND_HTTP *phttp, char const *content, size_t len)
 {
   BIO_printf (phttp->cl,
 	      "HTTP/1.%d %d %s\r\n"
 	      "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
 	      "Content-Length: %"PRICLEN"\r\n"
-	      "\r\n"
-	      "%s",
+	      "\r\n",
 	      phttp->request.version,
-	      200, "OK", (CONTENT_LENGTH) strlen (content), content);
+	      200, "OK", (CONTENT_LENGTH) len);
+  BIO_write (phttp->cl, content, len);
   BIO_flush (phttp->cl);
   return 0;
 }
@@ -929,28 +1442,25 @@ send_reply (POUND_HTTP *phttp, char const *content)
 int
 metrics_response (POUND_HTTP *phttp)
 {
-  struct json_value *obj;
-  EXPOSITION exp;
   int res;
 
-  if ((obj = pound_serialize ()) == NULL)
-    return -1;
-
-  EXPOSITION_INIT (&exp);
+  if (metrics_cache_ttl)
+    {
+      struct metrics_snapshot *snap;
 
-  if ((res = exposition_fill (&exp, obj)) == 0)
+      if ((snap = metrics_snapshot_get ()) == NULL)
+	return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+      res = send_reply (phttp, snap->text, snap->len);
+      metrics_snapshot_unref (snap);
+    }
+  else
     {
       struct stringbuf sb;
-      char *content;
 
       stringbuf_init_log (&sb);
-      if ((content = exposition_format (&sb, &exp)) == NULL)
-	res = -1;
-      else
-	res = send_reply (phttp, content);
+      if ((res = exposition_generate (&sb)) == 0)
+	res = send_reply (phttp, stringbuf_value (&sb), stringbuf_len (&sb));
       stringbuf_free (&sb);
     }
-  exposition_free (&exp);
-  json_value_free (obj);
   return res == 0 ? 0 : HTTP_STATUS_INTERNAL_SERVER_ERROR;
 }
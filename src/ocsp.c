@@ -0,0 +1,696 @@
+/*
+ * Pound - the reverse-proxy load-balancer
+ * Copyright (C) 2024 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * OCSP stapling.
+ *
+ * For each certificate with stapling enabled, a DER-encoded OCSP response
+ * is kept in memory and handed to OpenSSL from the status callback.  The
+ * response is obtained either from a file or from the OCSP responder.
+ * It is refreshed by a periodic job run in the timer thread, so that
+ * handshakes never wait for the responder.  Responders are queried from
+ * a separate thread, started by the job for each request, so that a slow
+ * responder doesn't delay other jobs.  When the response arrives, the
+ * thread schedules a job that installs it.
+ *
+ * The stapling data are reference counted.  One reference is held by the
+ * SSL_CTX (as its ex_data) and released when the context is freed, i.e.
+ * after the last connection using it is closed.  Another one is held by
+ * the refresh job, which drops it and stops once the context is gone.
+ */
+#include "pound.h"
+#include <openssl/ocsp.h>
+#include <openssl/x509v3.h>
+
+/* Retry interval after a failed refresh attempt. */
+#define OCSP_RETRY_INTERVAL 60
+/*
+ * Maximum interval between two refreshes.  It applies also to responses
+ * obtained from files, so that an updated file is picked up in time.
+ */
+#define OCSP_MAX_INTERVAL 3600
+/* Allowed clock skew when checking response validity. */
+#define OCSP_CLOCK_SKEW 300
+
+struct ocsp_stapling
+{
+  pthread_mutex_t mut;     /* Protects resp, resp_len, expire and refcount. */
+  char *file;              /* Response file name, or NULL. */
+  char *url;               /* Responder URL, if file is NULL. */
+  unsigned timeout;        /* Responder I/O timeout. */
+  X509 *cert;              /* Server certificate. */
+  X509 *issuer;            /* Its issuer. */
+  OCSP_CERTID *id;         /* Certificate ID for requests and lookups. */
+  unsigned char *resp;     /* Current DER-encoded response, or NULL. */
+  int resp_len;            /* Length of resp. */
+  time_t expire;           /* Response nextUpdate, or 0 if unspecified. */
+  unsigned refcount;       /* Reference count. */
+};
+
+static void
+ocsp_stapling_free (struct ocsp_stapling *st)
+{
+  pthread_mutex_destroy (&st->mut);
+  free (st->file);
+  free (st->url);
+  X509_free (st->cert);
+  X509_free (st->issuer);
+  OCSP_CERTID_free (st->id);
+  free (st->resp);
+  free (st);
+}
+
+static void
+ocsp_stapling_unref (struct ocsp_stapling *st)
+{
+  unsigned n;
+
+  pthread_mutex_lock (&st->mut);
+  n = --st->refcount;
+  pthread_mutex_unlock (&st->mut);
+  if (n == 0)
+    ocsp_stapling_free (st);
+}
+
+/*
+ * Check if the refresh job holds the only reference to ST, i.e. its
+ * context has been freed (e.g. after certificate reload).  If so, drop
+ * the reference and return 1.
+ */
+static int
+ocsp_orphaned (struct ocsp_stapling *st)
+{
+  int rc;
+
+  pthread_mutex_lock (&st->mut);
+  rc = st->refcount == 1;
+  pthread_mutex_unlock (&st->mut);
+  if (rc)
+    ocsp_stapling_unref (st);
+  return rc;
+}
+
+/* Index of the SSL_CTX ex_data slot holding the stapling data. */
+static int ocsp_ctx_index = -1;
+
+/* Free callback of the ex_data slot: drop the reference of the context. */
+static void
+ocsp_ctx_free (void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx,
+	       long argl, void *argp)
+{
+  if (ptr)
+    ocsp_stapling_unref (ptr);
+}
+
+static void
+ocsp_ctx_index_init (void)
+{
+  ocsp_ctx_index = SSL_CTX_get_ex_new_index (0, NULL, NULL, NULL,
+					     ocsp_ctx_free);
+}
+
+/*
+ * Status callback.  Attaches a copy of the cached response, if there
+ * is a valid one.
+ */
+static int
+ocsp_status_cb (SSL *ssl, void *arg)
+{
+  struct ocsp_stapling *st = arg;
+  unsigned char *buf = NULL;
+  int len = 0;
+
+  pthread_mutex_lock (&st->mut);
+  if (st->resp && (st->expire == 0 || st->expire > time (NULL)))
+    {
+      if ((buf = OPENSSL_malloc (st->resp_len)) != NULL)
+	{
+	  memcpy (buf, st->resp, st->resp_len);
+	  len = st->resp_len;
+	}
+    }
+  pthread_mutex_unlock (&st->mut);
+
+  if (buf == NULL)
+    return SSL_TLSEXT_ERR_NOACK;
+  if (!SSL_set_tlsext_status_ocsp_resp (ssl, buf, len))
+    {
+      OPENSSL_free (buf);
+      return SSL_TLSEXT_ERR_NOACK;
+    }
+  return SSL_TLSEXT_ERR_OK;
+}
+
+static void
+ocsp_log_openssl (char const *what, char const *msg)
+{
+  unsigned long n = ERR_get_error ();
+  if (n)
+    logmsg (LOG_ERR, "%s: %s: %s", what, msg, ERR_error_string (n, NULL));
+  else
+    logmsg (LOG_ERR, "%s: %s", what, msg);
+  ERR_clear_error ();
+}
+
+/*
+ * Convert ASN.1 time to the number of seconds relative to the current
+ * time.
+ */
+static long
+ocsp_time_offset (ASN1_GENERALIZEDTIME *t)
+{
+  int days, secs;
+
+  if (!ASN1_TIME_diff (&days, &secs, NULL, t))
+    return 0;
+  return (long) days * 86400 + secs;
+}
+
+/*
+ * Check the OCSP response RESP.  On success, store the expiration time
+ * in *EXPIRE, the recommended time of the next refresh in *REFRESH, and
+ * return 0.  Otherwise, log the reason and return -1.
+ */
+static int
+ocsp_response_check (struct ocsp_stapling *st, char const *what,
+		     OCSP_RESPONSE *resp, time_t *expire, time_t *refresh)
+{
+  OCSP_BASICRESP *bs;
+  X509_STORE *store = NULL;
+  STACK_OF (X509) *certs = NULL;
+  int status, reason, rc = -1;
+  ASN1_GENERALIZEDTIME *rev, *thisupd, *nextupd;
+  time_t now;
+
+  if ((status = OCSP_response_status (resp)) != OCSP_RESPONSE_STATUS_SUCCESSFUL)
+    {
+      logmsg (LOG_ERR, "%s: OCSP responder error: %s", what,
+	      OCSP_response_status_str (status));
+      return -1;
+    }
+
+  if ((bs = OCSP_response_get1_basic (resp)) == NULL)
+    {
+      ocsp_log_openssl (what, "can't parse OCSP response");
+      return -1;
+    }
+
+  if (!OCSP_resp_find_status (bs, st->id, &status, &reason, &rev,
+			      &thisupd, &nextupd))
+    {
+      logmsg (LOG_ERR, "%s: OCSP response does not cover the certificate",
+	      what);
+      goto end;
+    }
+
+  /*
+   * The response must be signed either by the issuer itself, or by a
+   * responder certificate issued by it.
+   */
+  store = X509_STORE_new ();
+  certs = sk_X509_new_null ();
+  if (store == NULL || certs == NULL)
+    {
+      lognomem ();
+      goto end;
+    }
+  X509_STORE_add_cert (store, st->issuer);
+  X509_STORE_set_flags (store, X509_V_FLAG_PARTIAL_CHAIN);
+  sk_X509_push (certs, st->issuer);
+
+  if (OCSP_basic_verify (bs, certs, store, 0) <= 0)
+    {
+      ocsp_log_openssl (what, "OCSP response verification failed");
+      goto end;
+    }
+
+  if (!OCSP_check_validity (thisupd, nextupd, OCSP_CLOCK_SKEW, -1))
+    {
+      ocsp_log_openssl (what, "OCSP response is outdated");
+      goto end;
+    }
+
+  if (status != V_OCSP_CERTSTATUS_GOOD)
+    logmsg (LOG_WARNING, "%s: certificate status is %s", what,
+	    OCSP_cert_status_str (status));
+
+  now = time (NULL);
+  if (nextupd)
+    {
+      long lifetime = ocsp_time_offset (nextupd);
+      long age = -ocsp_time_offset (thisupd);
+
+      *expire = now + lifetime;
+      /* Refresh when half of the validity period has elapsed. */
+      if (age < 0)
+	age = 0;
+      lifetime = (lifetime + age) / 2 - age;
+      if (lifetime < OCSP_RETRY_INTERVAL)
+	lifetime = OCSP_RETRY_INTERVAL;
+      *refresh = now + lifetime;
+    }
+  else
+    {
+      *expire = 0;
+      *refresh = now + OCSP_MAX_INTERVAL;
+    }
+  if (*refresh > now + OCSP_MAX_INTERVAL && st->file)
+    *refresh = now + OCSP_MAX_INTERVAL;
+  rc = 0;
+
+ end:
+  sk_X509_free (certs);
+  X509_STORE_free (store);
+  OCSP_BASICRESP_free (bs);
+  return rc;
+}
+
+static OCSP_RESPONSE *
+ocsp_response_read (char const *file)
+{
+  BIO *bio;
+  OCSP_RESPONSE *resp;
+
+  if ((bio = BIO_new_file (file, "rb")) == NULL)
+    {
+      ocsp_log_openssl (file, "can't open OCSP response file");
+      return NULL;
+    }
+  resp = d2i_OCSP_RESPONSE_bio (bio, NULL);
+  BIO_free (bio);
+  if (resp == NULL)
+    ocsp_log_openssl (file, "can't parse OCSP response file");
+  return resp;
+}
+
+/*
+ * Wait until the BIO becomes ready for the requested EVENTS, or DEADLINE
+ * expires.  Return 0 on success, -1 on timeout or error.
+ */
+static int
+ocsp_bio_wait (BIO *bio, int events, time_t deadline)
+{
+  struct pollfd pfd;
+  time_t now;
+  int rc;
+
+  if (BIO_get_fd (bio, &pfd.fd) < 0)
+    return -1;
+  pfd.events = events;
+  do
+    {
+      if ((now = time (NULL)) >= deadline)
+	{
+	  errno = ETIMEDOUT;
+	  return -1;
+	}
+      rc = poll (&pfd, 1, (deadline - now) * 1000);
+    }
+  while (rc == -1 && errno == EINTR);
+  if (rc == 0)
+    {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+  return rc < 0 ? -1 : 0;
+}
+
+/*
+ * Query the OCSP responder.  All I/O is non-blocking and limited by
+ * st->timeout.
+ */
+static OCSP_RESPONSE *
+ocsp_response_fetch (struct ocsp_stapling *st)
+{
+  char *host = NULL, *port = NULL, *path = NULL;
+  int use_ssl;
+  BIO *cbio = NULL;
+  OCSP_REQUEST *req = NULL;
+  OCSP_REQ_CTX *rctx = NULL;
+  OCSP_RESPONSE *resp = NULL;
+  time_t deadline;
+  int rc;
+
+  if (!OCSP_parse_url (st->url, &host, &port, &path, &use_ssl))
+    {
+      logmsg (LOG_ERR, "%s: can't parse OCSP responder URL", st->url);
+      goto end;
+    }
+  if (use_ssl)
+    {
+      logmsg (LOG_ERR, "%s: HTTPS OCSP responders are not supported",
+	      st->url);
+      goto end;
+    }
+
+  if ((req = OCSP_REQUEST_new ()) == NULL)
+    {
+      lognomem ();
+      goto end;
+    }
+  if (!OCSP_request_add0_id (req, OCSP_CERTID_dup (st->id)))
+    {
+      ocsp_log_openssl (st->url, "can't create OCSP request");
+      goto end;
+    }
+
+  if ((cbio = BIO_new_connect (host)) == NULL)
+    {
+      lognomem ();
+      goto end;
+    }
+  BIO_set_conn_port (cbio, port);
+  BIO_set_nbio (cbio, 1);
+
+  deadline = time (NULL) + st->timeout;
+  while ((rc = BIO_do_connect (cbio)) <= 0)
+    {
+      if (!BIO_should_retry (cbio) || ocsp_bio_wait (cbio, POLLOUT, deadline))
+	{
+	  logmsg (LOG_ERR, "%s: can't connect to OCSP responder: %s",
+		  st->url, errno == ETIMEDOUT ? strerror (errno)
+					      : "connection failed");
+	  ERR_clear_error ();
+	  goto end;
+	}
+    }
+
+  if ((rctx = OCSP_sendreq_new (cbio, path, NULL, -1)) == NULL
+      || !OCSP_REQ_CTX_add1_header (rctx, "Host", host)
+      || !OCSP_REQ_CTX_set1_req (rctx, req))
+    {
+      ocsp_log_openssl (st->url, "can't create OCSP request");
+      goto end;
+    }
+
+  while ((rc = OCSP_sendreq_nbio (&resp, rctx)) == -1)
+    {
+      if (ocsp_bio_wait (cbio, BIO_should_read (cbio) ? POLLIN : POLLOUT,
+			 deadline))
+	{
+	  logmsg (LOG_ERR, "%s: OCSP responder timed out", st->url);
+	  goto end;
+	}
+    }
+  if (rc == 0)
+    {
+      ocsp_log_openssl (st->url, "error querying OCSP responder");
+      resp = NULL;
+    }
+
+ end:
+  OCSP_REQ_CTX_free (rctx);
+  BIO_free_all (cbio);
+  OCSP_REQUEST_free (req);
+  OPENSSL_free (host);
+  OPENSSL_free (port);
+  OPENSSL_free (path);
+  return resp;
+}
+
+/*
+ * Check the freshly obtained response RESP and install it.  RESP is freed.
+ * Store the time of the next refresh in *REFRESH.  Return 0 on success
+ * and -1 on error.
+ */
+static int
+ocsp_update (struct ocsp_stapling *st, OCSP_RESPONSE *resp, time_t *refresh)
+{
+  char const *what = st->file ? st->file : st->url;
+  time_t expire;
+  unsigned char *buf = NULL, *p;
+  int len;
+
+  *refresh = time (NULL) + OCSP_RETRY_INTERVAL;
+
+  if (resp == NULL
+      || ocsp_response_check (st, what, resp, &expire, refresh))
+    {
+      OCSP_RESPONSE_free (resp);
+      return -1;
+    }
+
+  if ((len = i2d_OCSP_RESPONSE (resp, NULL)) <= 0
+      || (buf = malloc (len)) == NULL)
+    {
+      lognomem ();
+      OCSP_RESPONSE_free (resp);
+      *refresh = time (NULL) + OCSP_RETRY_INTERVAL;
+      return -1;
+    }
+  p = buf;
+  i2d_OCSP_RESPONSE (resp, &p);
+  OCSP_RESPONSE_free (resp);
+
+  pthread_mutex_lock (&st->mut);
+  free (st->resp);
+  st->resp = buf;
+  st->resp_len = len;
+  st->expire = expire;
+  pthread_mutex_unlock (&st->mut);
+
+  return 0;
+}
+
+static void ocsp_refresh (void *data);
+
+/*
+ * Install the response RESP and schedule the next refresh.  Called with
+ * the job queue locked.
+ */
+static void
+ocsp_publish (struct ocsp_stapling *st, OCSP_RESPONSE *resp)
+{
+  struct timespec ts;
+
+  if (ocsp_orphaned (st))
+    {
+      OCSP_RESPONSE_free (resp);
+      return;
+    }
+  if (ocsp_update (st, resp, &ts.tv_sec) == 0)
+    logmsg (LOG_DEBUG, "%s: OCSP response updated",
+	    st->file ? st->file : st->url);
+  ts.tv_nsec = 0;
+  job_enqueue_unlocked (&ts, ocsp_refresh, st);
+}
+
+/* Responder query in progress. */
+struct ocsp_fetch
+{
+  struct ocsp_stapling *st;
+  OCSP_RESPONSE *resp;     /* Response obtained, or NULL on error. */
+};
+
+/* Job: install the response obtained by the fetch thread. */
+static void
+ocsp_fetch_finish (void *data)
+{
+  struct ocsp_fetch *fetch = data;
+  struct ocsp_stapling *st = fetch->st;
+  OCSP_RESPONSE *resp = fetch->resp;
+
+  free (fetch);
+  ocsp_publish (st, resp);
+}
+
+static void *
+thr_ocsp_fetch (void *arg)
+{
+  struct ocsp_fetch *fetch = arg;
+
+  fetch->resp = ocsp_response_fetch (fetch->st);
+  job_enqueue_after (0, ocsp_fetch_finish, fetch);
+  return NULL;
+}
+
+/*
+ * Start querying the responder in a new thread.  Return 0 on success
+ * and -1 if the thread can't be created.
+ */
+static int
+ocsp_fetch_start (struct ocsp_stapling *st)
+{
+  struct ocsp_fetch *fetch;
+  pthread_attr_t attr;
+  pthread_t tid;
+  int rc;
+
+  if ((fetch = calloc (1, sizeof (*fetch))) == NULL)
+    {
+      lognomem ();
+      return -1;
+    }
+  fetch->st = st;
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  rc = pthread_create (&tid, &attr, thr_ocsp_fetch, fetch);
+  pthread_attr_destroy (&attr);
+  if (rc)
+    {
+      logmsg (LOG_ERR, "%s: can't create OCSP fetch thread: %s",
+	      st->url, strerror (rc));
+      free (fetch);
+      return -1;
+    }
+  return 0;
+}
+
+/*
+ * Periodic job: refresh the response.  Called with the job queue locked.
+ * Files are read right away.  For responders, a fetch thread is started,
+ * which schedules ocsp_fetch_finish when done.
+ */
+static void
+ocsp_refresh (void *data)
+{
+  struct ocsp_stapling *st = data;
+
+  if (ocsp_orphaned (st))
+    return;
+  if (st->file)
+    ocsp_publish (st, ocsp_response_read (st->file));
+  else if (ocsp_fetch_start (st))
+    job_enqueue_after_unlocked (OCSP_RETRY_INTERVAL, ocsp_refresh, st);
+}
+
+/*
+ * Find the issuer of the certificate in its chain.
+ */
+static X509 *
+ocsp_find_issuer (SSL_CTX *ctx, X509 *cert)
+{
+  STACK_OF (X509) *chain = NULL;
+  int i;
+
+  if (X509_check_issued (cert, cert) == X509_V_OK)
+    return cert;
+  SSL_CTX_get0_chain_certs (ctx, &chain);
+  for (i = 0; i < sk_X509_num (chain); i++)
+    {
+      X509 *x = sk_X509_value (chain, i);
+      if (X509_check_issued (x, cert) == X509_V_OK)
+	return x;
+    }
+  return NULL;
+}
+
+/*
+ * Enable OCSP stapling for the certificate context PC.  If pc->ocsp_file
+ * is set, the response is read from that file.  Otherwise, it is obtained
+ * from the responder at URL or, if it is NULL, from the one listed in the
+ * certificate's Authority Information Access extension.  TIMEOUT limits
+ * the time spent talking to the responder.
+ *
+ * Responses read from files are loaded immediately, so that errors are
+ * reported at startup.  Responses from responders are fetched by the
+ * timer thread, as soon as it starts.
+ *
+ * Return 0 on success, -1 on error.
+ */
+int
+ocsp_stapling_init (POUND_CTX *pc, char const *url, unsigned timeout)
+{
+  struct ocsp_stapling *st;
+  X509 *cert, *issuer;
+  time_t refresh;
+  char const *name = pc->server_name ? pc->server_name : "certificate";
+  static pthread_once_t index_once = PTHREAD_ONCE_INIT;
+
+  pthread_once (&index_once, ocsp_ctx_index_init);
+  if (ocsp_ctx_index == -1)
+    {
+      ocsp_log_openssl (name, "can't allocate SSL_CTX ex_data index");
+      return -1;
+    }
+
+  if ((cert = SSL_CTX_get0_certificate (pc->ctx)) == NULL)
+    {
+      logmsg (LOG_ERR, "%s: no certificate loaded", name);
+      return -1;
+    }
+
+  if ((issuer = ocsp_find_issuer (pc->ctx, cert)) == NULL)
+    {
+      logmsg (LOG_ERR, "%s: can't find issuer certificate in the chain;"
+	      " OCSP stapling requires it", name);
+      return -1;
+    }
+
+  XZALLOC (st);
+  pthread_mutex_init (&st->mut, NULL);
+  st->timeout = timeout;
+  X509_up_ref (cert);
+  st->cert = cert;
+  X509_up_ref (issuer);
+  st->issuer = issuer;
+  if ((st->id = OCSP_cert_to_id (NULL, cert, issuer)) == NULL)
+    {
+      ocsp_log_openssl (name, "can't compute OCSP certificate ID");
+      ocsp_stapling_free (st);
+      return -1;
+    }
+
+  if (pc->ocsp_file)
+    {
+      st->file = xstrdup (pc->ocsp_file);
+      if (ocsp_update (st, ocsp_response_read (st->file), &refresh))
+	{
+	  ocsp_stapling_free (st);
+	  return -1;
+	}
+    }
+  else if (url)
+    st->url = xstrdup (url);
+  else
+    {
+      STACK_OF (OPENSSL_STRING) *aia = X509_get1_ocsp (cert);
+
+      if (aia == NULL || sk_OPENSSL_STRING_num (aia) == 0)
+	{
+	  X509_email_free (aia);
+	  logmsg (LOG_ERR, "%s: certificate does not specify OCSP responder;"
+		  " use OCSPResponder or OCSPResponse", name);
+	  ocsp_stapling_free (st);
+	  return -1;
+	}
+      st->url = xstrdup (sk_OPENSSL_STRING_value (aia, 0));
+      X509_email_free (aia);
+    }
+
+  /* References of the context and of the refresh job. */
+  st->refcount = 2;
+  if (!SSL_CTX_set_ex_data (pc->ctx, ocsp_ctx_index, st))
+    {
+      ocsp_log_openssl (name, "can't attach OCSP stapling data");
+      ocsp_stapling_free (st);
+      return -1;
+    }
+  SSL_CTX_set_tlsext_status_cb (pc->ctx, ocsp_status_cb);
+  SSL_CTX_set_tlsext_status_arg (pc->ctx, st);
+
+  if (st->file)
+    {
+      struct timespec ts = { refresh, 0 };
+      job_enqueue (&ts, ocsp_refresh, st);
+    }
+  else
+    job_enqueue_after (0, ocsp_refresh, st);
+
+  return 0;
+}
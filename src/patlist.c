@@ -0,0 +1,264 @@
+/*
+ * Pound - the reverse-proxy load-balancer
+ * Copyright (C) 2024 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Pattern lists.
+ *
+ * Patterns read from a file ("-file" option) can be matched against a
+ * subject all at once.  For exact, prefix and suffix matches, the strings
+ * are kept in a hash table.  Along with the table, a bitmap of string
+ * lengths is maintained.  To look up prefixes of the subject, its hash is
+ * computed incrementally and the table is probed for each prefix length
+ * present in the bitmap.  Suffixes are handled the same way, hashing
+ * strings from the end.  Thus, a lookup takes time proportional to the
+ * length of the subject, no matter how many patterns there are.
+ *
+ * Each table entry remembers the number of the first pattern it came
+ * from, so that the lookup returns the same pattern as sequential
+ * evaluation would.
+ *
+ * For regular expressions, a single alternation of all patterns is
+ * compiled.  It is used to quickly reject subjects that don't match
+ * any of them.
+ */
+#include "pound.h"
+
+struct patlist_entry
+{
+  unsigned long hash;         /* Hash value. */
+  size_t len;                 /* String length. */
+  size_t index;               /* Number of the first pattern. */
+  char *str;                  /* String (NULL if the slot is empty). */
+};
+
+/* Lines read from pattern files are shorter than MAXBUF. */
+#define LENMAP_SIZE (MAXBUF / 8 + 1)
+
+static inline int
+pl_char (struct pattern_list const *pl, int c)
+{
+  return pl->icase ? tolower ((unsigned char) c) : (unsigned char) c;
+}
+
+struct pattern_list *
+pattern_list_new (int type, int mode, int icase)
+{
+  struct pattern_list *pl;
+
+  XZALLOC (pl);
+  pl->type = type;
+  pl->mode = mode;
+  pl->icase = icase;
+  pl->mem = sizeof (*pl);
+  return pl;
+}
+
+static struct patlist_entry *
+pattern_list_slot (struct pattern_list *pl, unsigned long hash,
+		   char const *str, size_t len, int rev)
+{
+  size_t i;
+
+  for (i = hash & (pl->size - 1); pl->tab[i].str;
+       i = (i + 1) & (pl->size - 1))
+    {
+      struct patlist_entry *ent = &pl->tab[i];
+
+      if (ent->hash == hash && ent->len == len)
+	{
+	  size_t j;
+
+	  for (j = 0; j < len; j++)
+	    {
+	      int c = rev ? str[-(ssize_t)j] : str[j];
+	      int d = rev ? ent->str[len - j - 1] : ent->str[j];
+	      if (pl_char (pl, c) != d)
+		break;
+	    }
+	  if (j == len)
+	    return ent;
+	}
+    }
+  return &pl->tab[i];
+}
+
+static void
+pattern_list_rehash (struct pattern_list *pl)
+{
+  struct patlist_entry *old = pl->tab;
+  size_t i, oldsize = pl->size;
+
+  pl->size = oldsize ? 2 * oldsize : 64;
+  pl->tab = xcalloc (pl->size, sizeof (pl->tab[0]));
+  pl->mem += (pl->size - oldsize) * sizeof (pl->tab[0]);
+  for (i = 0; i < oldsize; i++)
+    {
+      if (old[i].str)
+	{
+	  size_t j;
+	  for (j = old[i].hash & (pl->size - 1); pl->tab[j].str;
+	       j = (j + 1) & (pl->size - 1))
+	    ;
+	  pl->tab[j] = old[i];
+	}
+    }
+  free (old);
+}
+
+/*
+ * Add string STR to the literal pattern list PL.
+ */
+void
+pattern_list_add (struct pattern_list *pl, char const *str)
+{
+  size_t i, len = strlen (str);
+  unsigned long hash = FNV_INIT;
+  char *copy;
+  struct patlist_entry *ent;
+
+  copy = xmalloc (len + 1);
+  for (i = 0; i < len; i++)
+    copy[i] = pl_char (pl, str[i]);
+  copy[len] = 0;
+
+  if (pl->mode == PATLIST_SUFFIX)
+    for (i = len; i > 0; i--)
+      hash = fnv_next (hash, copy[i-1]);
+  else
+    for (i = 0; i < len; i++)
+      hash = fnv_next (hash, copy[i]);
+
+  if (2 * (pl->nent + 1) > pl->size)
+    pattern_list_rehash (pl);
+
+  ent = pl->mode == PATLIST_SUFFIX
+	  ? pattern_list_slot (pl, hash, copy + len - 1, len, 1)
+	  : pattern_list_slot (pl, hash, copy, len, 0);
+  if (ent->str)
+    /* Duplicate: the earlier pattern wins. */
+    free (copy);
+  else
+    {
+      ent->hash = hash;
+      ent->len = len;
+      ent->index = pl->count;
+      ent->str = copy;
+      pl->nent++;
+      pl->mem += len + 1;
+
+      if (pl->lenmap == NULL)
+	{
+	  pl->lenmap = xzalloc (LENMAP_SIZE);
+	  pl->mem += LENMAP_SIZE;
+	}
+      if (len > pl->maxlen)
+	pl->maxlen = len;
+      pl->lenmap[len / 8] |= 1 << (len % 8);
+    }
+  pl->count++;
+}
+
+static inline int
+lenmap_isset (struct pattern_list const *pl, size_t len)
+{
+  return len <= pl->maxlen && (pl->lenmap[len / 8] & (1 << (len % 8)));
+}
+
+/*
+ * Look up subject STR in the literal pattern list PL.  Return the number
+ * of the first pattern that matches it, or -1 if none does.
+ */
+ssize_t
+pattern_list_lookup (struct pattern_list *pl, char const *str)
+{
+  size_t len = strlen (str), i;
+  unsigned long hash = FNV_INIT;
+  ssize_t res = -1;
+  struct patlist_entry *ent;
+
+  if (pl->nent == 0 || len == 0)
+    return -1;
+
+  switch (pl->mode)
+    {
+    case PATLIST_EXACT:
+      if (!lenmap_isset (pl, len))
+	return -1;
+      for (i = 0; i < len; i++)
+	hash = fnv_next (hash, pl_char (pl, str[i]));
+      ent = pattern_list_slot (pl, hash, str, len, 0);
+      return ent->str ? ent->index : -1;
+
+    case PATLIST_PREFIX:
+      for (i = 0; ; i++)
+	{
+	  if (lenmap_isset (pl, i))
+	    {
+	      ent = pattern_list_slot (pl, hash, str, i, 0);
+	      if (ent->str && (res == -1 || (ssize_t) ent->index < res))
+		res = ent->index;
+	    }
+	  if (i == len || i == pl->maxlen)
+	    break;
+	  hash = fnv_next (hash, pl_char (pl, str[i]));
+	}
+      break;
+
+    case PATLIST_SUFFIX:
+      for (i = 0; ; i++)
+	{
+	  if (lenmap_isset (pl, i))
+	    {
+	      ent = pattern_list_slot (pl, hash, str + len - 1, i, 1);
+	      if (ent->str && (res == -1 || (ssize_t) ent->index < res))
+		res = ent->index;
+	    }
+	  if (i == len || i == pl->maxlen)
+	    break;
+	  hash = fnv_next (hash, pl_char (pl, str[len - i - 1]));
+	}
+      break;
+
+    default:
+      abort ();
+    }
+  return res;
+}
+
+/*
+ * Compile alternation EXPR of the regular expressions from the list PL,
+ * using FLAGS.  Return value is as for regcomp.
+ */
+int
+pattern_list_regcomp (struct pattern_list *pl, char const *expr, int flags)
+{
+  int rc;
+
+  if ((rc = regcomp (&pl->re, expr, flags | REG_NOSUB)) == 0)
+    pl->mem += strlen (expr) + 1;
+  return rc;
+}
+
+/*
+ * Return 1 if subject STR matches any regular expression from the list PL.
+ */
+int
+pattern_list_regexec (struct pattern_list *pl, char const *str)
+{
+  return regexec (&pl->re, str, 0, NULL, 0) == 0;
+}
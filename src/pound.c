@@ -68,6 +68,9 @@ static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 void
 vlogmsg (const int priority, const char *fmt, va_list ap)
 {
+  if (log_queue_put (priority, fmt, ap) == 0)
+    return;
+
   if (log_facility == -1 || print_log)
     {
       va_list aq;
@@ -103,6 +106,43 @@ logmsg (const int priority, const char *fmt, ...)
   va_end (ap);
 }
 
+unsigned log_throttle_burst;	/* Max. messages per call site and interval */
+unsigned log_throttle_interval = DEFAULT_LOG_THROTTLE_INTERVAL;
+
+void
+log_throttled (struct log_throttle *lt, int priority, char const *fmt, ...)
+{
+  va_list ap;
+
+  if (log_throttle_burst)
+    {
+      unsigned long window = time (NULL) / log_throttle_interval;
+      unsigned long cur = __atomic_load_n (&lt->window, __ATOMIC_RELAXED);
+
+      if (cur != window
+	  && __atomic_compare_exchange_n (&lt->window, &cur, window, 0,
+					  __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	{
+	  unsigned n = __atomic_exchange_n (&lt->suppressed, 0,
+					    __ATOMIC_RELAXED);
+	  __atomic_store_n (&lt->count, 0, __ATOMIC_RELAXED);
+	  if (n)
+	    logmsg (priority, "%u similar messages suppressed", n);
+	}
+
+      if (__atomic_fetch_add (&lt->count, 1, __ATOMIC_RELAXED)
+	  >= log_throttle_burst)
+	{
+	  __atomic_fetch_add (&lt->suppressed, 1, __ATOMIC_RELAXED);
+	  return;
+	}
+    }
+
+  va_start (ap, fmt);
+  vlogmsg (priority, fmt, ap);
+  va_end (ap);
+}
+
 /*
  * This is used as exit point if memory allocation failures occur at program
  * startup (e.g. when parsing config or the like).
@@ -135,6 +175,7 @@ abend (char const *fmt, ...)
   vlogmsg (LOG_CRIT, fmt, ap);
   va_end (ap);
   logmsg (LOG_NOTICE, "pound terminated");
+  log_queue_stop ();
   _exit (1);
 }
 
@@ -188,8 +229,33 @@ l_id (void)
 
 /*
  * work queue stuff
+ *
+ * Connections waiting for a worker are kept in a separate FIFO queue
+ * for each priority class.  Queues are served in weighted round-robin
+ * order: during each round, a class gets at most as many requests as
+ * its weight, higher classes first.  Thus, high-priority traffic is
+ * served with minimal delay, while lower classes still get their share
+ * and are not starved.
  */
-static POUND_HTTP_HEAD thr_head = SLIST_HEAD_INITIALIZER (thr_head);
+struct worker_queue
+{
+  POUND_HTTP_HEAD head;         /* Queued connections */
+  unsigned len;                 /* Length of the queue */
+  unsigned credit;              /* Dequeues left in the current round */
+  unsigned long dequeued;       /* Statistics: number of dequeued items, */
+  double wait_total;            /* total and */
+  double wait_max;              /* maximal waiting time (ns). */
+};
+
+static struct worker_queue thr_queue[PRIO_MAX];
+static unsigned thr_qlen;       /* Total number of queued connections */
+
+unsigned prio_weight[PRIO_MAX] = {
+  [PRIO_HIGH] = DEFAULT_PRIO_WEIGHT_HIGH,
+  [PRIO_NORMAL] = DEFAULT_PRIO_WEIGHT_NORMAL,
+  [PRIO_LOW] = DEFAULT_PRIO_WEIGHT_LOW
+};
+
 static pthread_cond_t arg_cond = PTHREAD_COND_INITIALIZER;
 static pthread_cond_t active_cond = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t arg_mut = PTHREAD_MUTEX_INITIALIZER;
@@ -232,6 +298,44 @@ workers_serialize (void)
   return obj;
 }
 
+struct json_value *
+worker_queue_serialize (void)
+{
+  struct json_value *obj;
+  int i, err = 0;
+
+  obj = json_new_object ();
+  if (obj)
+    {
+      pthread_mutex_lock (&arg_mut);
+      for (i = 0; !err && i < PRIO_MAX; i++)
+	{
+	  struct worker_queue *q = &thr_queue[i];
+	  struct json_value *qobj = json_new_object ();
+
+	  err = qobj == NULL
+	    || json_object_set (obj, prio_to_str (i), qobj)
+	    || json_object_set (qobj, "weight",
+				json_new_number (prio_weight[i]))
+	    || json_object_set (qobj, "length", json_new_number (q->len))
+	    || json_object_set (qobj, "dequeued",
+				json_new_number (q->dequeued))
+	    || json_object_set (qobj, "wait_avg",
+				json_new_number (q->dequeued
+						 ? q->wait_total / q->dequeued
+						 : 0))
+	    || json_object_set (qobj, "wait_max", json_new_number (q->wait_max));
+	}
+      pthread_mutex_unlock (&arg_mut);
+    }
+  if (err)
+    {
+      json_value_free (obj);
+      obj = NULL;
+    }
+  return obj;
+}
+
 static void
 worker_start (void)
 {
@@ -264,13 +368,33 @@ pound_http_enqueue (int sock, LISTENER *lstn, struct sockaddr *sa, socklen_t sal
       return -1;
     }
 
+  phase_mark (res, PHASE_ACCEPT);
   res->sock = sock;
   res->lstn = lstn;
+  if (lstn->allow_client_reneg)
+    res->reneg_state = RENEG_ALLOW;
+  else
+    res->reneg_state = RENEG_INIT;
 
   memcpy (res->from_host.ai_addr, sa, salen);
   res->from_host.ai_family = sa->sa_family;
   res->from_host.ai_addrlen = salen;
 
+  res->prio = lstn->prio;
+  if (!SLIST_EMPTY (&lstn->prio_acls))
+    {
+      struct prio_acl *pa;
+
+      SLIST_FOREACH (pa, &lstn->prio_acls, next)
+	{
+	  if (acl_match (pa->acl, sa) == 0)
+	    {
+	      res->prio = pa->prio;
+	      break;
+	    }
+	}
+    }
+
   http_request_init (&res->request);
   http_request_init (&res->response);
   /*
@@ -278,15 +402,78 @@ pound_http_enqueue (int sock, LISTENER *lstn, struct sockaddr *sa, socklen_t sal
    * filled with zeros.  Revise this if submatch_queue stuff changes.
    */
 
+  /*
+   * On HTTPS listeners, let the handshake threads establish the TLS
+   * session first.
+   */
+  if (!SLIST_EMPTY (&lstn->ctx_head) && tls_handshake_submit (res) == 0)
+    return 0;
+
+  pound_http_push (res);
+  return 0;
+}
+
+/*
+ * add a connection to the worker queue
+ */
+void
+pound_http_push (POUND_HTTP *phttp)
+{
+  clock_gettime (CLOCK_MONOTONIC, &phttp->queued);
   pthread_mutex_lock (&arg_mut);
-  SLIST_PUSH (&thr_head, res, next);
+  SLIST_PUSH (&thr_queue[phttp->prio].head, phttp, next);
+  thr_queue[phttp->prio].len++;
+  thr_qlen++;
   if (worker_count < worker_max_count && worker_count == active_threads)
     {
       worker_start ();
     }
   pthread_cond_signal (&arg_cond);
   pthread_mutex_unlock (&arg_mut);
-  return 0;
+}
+
+/*
+ * Remove the next connection from the worker queue, observing priority
+ * class weights.  The queue must not be empty.  Must be called with
+ * arg_mut locked.
+ */
+static POUND_HTTP *
+worker_queue_shift (void)
+{
+  int i;
+
+  for (;;)
+    {
+      for (i = 0; i < PRIO_MAX; i++)
+	{
+	  struct worker_queue *q = &thr_queue[i];
+
+	  if (q->len > 0 && q->credit > 0)
+	    {
+	      POUND_HTTP *phttp = SLIST_FIRST (&q->head);
+	      struct timespec now, diff;
+	      double t;
+
+	      SLIST_SHIFT (&q->head, next);
+	      q->len--;
+	      q->credit--;
+	      thr_qlen--;
+
+	      clock_gettime (CLOCK_MONOTONIC, &now);
+	      phttp->phase[PHASE_DEQUEUE] = now;
+	      diff = timespec_sub (&now, &phttp->queued);
+	      t = (double) diff.tv_sec * 1e9 + diff.tv_nsec;
+	      q->dequeued++;
+	      q->wait_total += t;
+	      if (t > q->wait_max)
+		q->wait_max = t;
+	      return phttp;
+	    }
+	}
+      /* Start new round. */
+      for (i = 0; i < PRIO_MAX; i++)
+	thr_queue[i].credit = prio_weight[i];
+    }
 }
 
 /*
@@ -307,7 +494,7 @@ pound_http_dequeue (void)
    * Wait until something becomes available in the queue.  Spurious wakeups
    * from pthread_cond_wait can occur, hence the need for a loop.
    */
-  while (SLIST_EMPTY (&thr_head))
+  while (thr_qlen == 0)
     {
       int rc;
 
@@ -340,10 +527,9 @@ pound_http_dequeue (void)
 	}
     }
 
-  /* Dequeue the head element */
-  res = SLIST_FIRST (&thr_head);
-  SLIST_SHIFT (&thr_head, next);
-  if (!SLIST_EMPTY (&thr_head))
+  /* Dequeue the next element */
+  res = worker_queue_shift ();
+  if (thr_qlen > 0)
     /*
      * If there's still more in the queue, signal other threads, so they
      * can have their share.
@@ -363,9 +549,12 @@ pound_http_dequeue (void)
 void
 pound_http_destroy (POUND_HTTP *arg)
 {
+  if (arg->lstn->conn_table)
+    conn_limit_release (arg->lstn->conn_table, arg->from_host.ai_addr);
   free (arg->from_host.ai_addr);
 
   free (arg->orig_forwarded_header);
+  free (arg->early_buf);
   http_request_free (&arg->request);
   http_request_free (&arg->response);
 
@@ -394,6 +583,8 @@ pound_http_destroy (POUND_HTTP *arg)
       X509_free (arg->x509);
     }
 
+  http_header_list_free (&arg->ssl_headers);
+
   submatch_queue_free (&arg->smq);
 
   free (arg);
@@ -405,12 +596,10 @@ pound_http_destroy (POUND_HTTP *arg)
 int
 get_thr_qlen (void)
 {
-  int res = 0;
-  POUND_HTTP *tap;
+  int res;
 
   pthread_mutex_lock (&arg_mut);
-  SLIST_FOREACH (tap, &thr_head, next)
-    res++;
+  res = thr_qlen;
   pthread_mutex_unlock (&arg_mut);
   return res;
 }
@@ -509,10 +698,28 @@ thr_dispatch (void *unused)
 			  continue;
 			}
 
-		      if (pound_http_enqueue (clnt, lstn,
-					   (struct sockaddr *) &clnt_addr,
-					   clnt_length))
-			close (clnt);
+		      if (lstn->conn_table
+			  && conn_limit_acquire (lstn->conn_table,
+						 (struct sockaddr *) &clnt_addr))
+			{
+			  /*
+			   * Too many connections from this client: reset
+			   * the connection.
+			   */
+			  struct linger lg = { 1, 0 };
+			  setsockopt (clnt, SOL_SOCKET, SO_LINGER,
+				      &lg, sizeof (lg));
+			  close (clnt);
+			}
+		      else if (pound_http_enqueue (clnt, lstn,
+						   (struct sockaddr *) &clnt_addr,
+						   clnt_length))
+			{
+			  if (lstn->conn_table)
+			    conn_limit_release (lstn->conn_table,
+						(struct sockaddr *) &clnt_addr);
+			  close (clnt);
+			}
 		    }
 		}
 	      i++;
@@ -694,8 +901,15 @@ server (void)
       act.sa_handler = fatal_signals[i].handler;
       sigaction (fatal_signals[i].signo, &act, NULL);
     }
+  act.sa_handler = signull;
+  sigaction (SIGUSR1, &act, NULL);
+  sigaddset (&sigs, SIGUSR1);
+
   pthread_sigmask (SIG_BLOCK, &sigs, NULL);
 
+  log_queue_start ();
+  trace_start ();
+
   /* thread stuff */
   pthread_attr_init (&attr);
   pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
@@ -724,10 +938,20 @@ server (void)
       worker_count--;
     }
 
+  tls_handshake_start (&attr);
+
   pthread_create (&thr, NULL, thr_dispatch, NULL);
 
   /* Wait for a signal to arrive */
-  sigwait (&sigs, &i);
+  for (;;)
+    {
+      sigwait (&sigs, &i);
+      if (i != SIGUSR1)
+	break;
+      /* Reopen log files. */
+      log_file_reopen_all ();
+      trace_export_reopen ();
+    }
 
   logmsg (LOG_NOTICE, "shutting down...");
 
@@ -748,6 +972,8 @@ server (void)
     }
 
   cleanup ();
+  trace_stop ();
+  log_queue_stop ();
 
   exit (0);
 }
@@ -787,6 +1013,10 @@ supervisor (void)
   sigaction (SIGALRM, &act, NULL);
   sigaddset (&sigs, SIGALRM);
 
+  act.sa_handler = signull;
+  sigaction (SIGUSR1, &act, NULL);
+  sigaddset (&sigs, SIGUSR1);
+
   for (;;)
     {
       if (pid == 0)
@@ -856,6 +1086,12 @@ supervisor (void)
 	  kill (pid, SIGKILL);
 	  break;
 	}
+      else if (i == SIGUSR1)
+	{
+	  /* Pass the log reopen request to the child. */
+	  if (pid)
+	    kill (pid, i);
+	}
       else if (state == S_RUNNING)
 	{
 	  /* Termination signal received.  Send it to child. */
@@ -1001,6 +1237,8 @@ main (const int argc, char **argv)
 
   if (log_facility != -1)
     openlog (progname, LOG_CONS | LOG_NDELAY | LOG_PID, log_facility);
+  log_file_open_all ();
+  trace_export_open ();
 
   /* set uid if necessary */
   if (user)
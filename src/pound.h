@@ -91,7 +91,60 @@
 # include <openssl/engine.h>
 #endif
 
-#if HAVE_LIBPCREPOSIX == 2
+#if HAVE_LIBPCRE2
+# define PCRE2_CODE_UNIT_WIDTH 8
+# include <pcre2.h>
+/*
+ * Native PCRE2 interface.  Patterns are JIT-compiled, if possible, and
+ * matched using per-thread match data.  The functions below mimic the
+ * POSIX regex API, so that the rest of the code needs no changes.
+ */
+typedef int regoff_t;
+
+typedef struct
+{
+  regoff_t rm_so;
+  regoff_t rm_eo;
+} regmatch_t;
+
+typedef struct
+{
+  pcre2_code *re_pcre;   /* Compiled pattern. */
+  size_t re_nsub;        /* Number of parenthesized subexpressions. */
+  int re_nosub;          /* REG_NOSUB was given. */
+  int re_errcode;        /* PCRE2 error code from compilation. */
+  size_t re_erroffset;   /* Offset where the error occurred. */
+} regex_t;
+
+enum
+  {
+    REG_EXTENDED = 0,    /* Always on. */
+    REG_ICASE    = 0x01,
+    REG_NEWLINE  = 0x02,
+    REG_NOSUB    = 0x04,
+    REG_NOTBOL   = 0x08,
+    REG_NOTEOL   = 0x10
+  };
+
+enum
+  {
+    REG_NOMATCH = 1,
+    REG_BADPAT,
+    REG_ESPACE
+  };
+
+# define regcomp  pound_regcomp
+# define regexec  pound_regexec
+# define regerror pound_regerror
+# define regfree  pound_regfree
+
+int regcomp (regex_t *preg, char const *pattern, int cflags);
+int regexec (regex_t const *preg, char const *string,
+	     size_t nmatch, regmatch_t pmatch[], int eflags);
+size_t regerror (int errcode, regex_t const *preg,
+		 char *errbuf, size_t errbuf_size);
+void regfree (regex_t *preg);
+#elif HAVE_LIBPCREPOSIX == 2
 # include <pcre2posix.h>
 #elif HAVE_LIBPCREPOSIX == 1
 # if HAVE_PCREPOSIX_H
@@ -131,10 +184,97 @@ int strtoclen (char const *arg, int base, CONTENT_LENGTH *retval, char **endptr)
 # define DEFAULT_WORKER_IDLE_TIMEOUT 30
 #endif
 
+/* Default worker queue weights of the priority classes. */
+#ifndef DEFAULT_PRIO_WEIGHT_HIGH
+# define DEFAULT_PRIO_WEIGHT_HIGH 8
+#endif
+
+#ifndef DEFAULT_PRIO_WEIGHT_NORMAL
+# define DEFAULT_PRIO_WEIGHT_NORMAL 4
+#endif
+
+#ifndef DEFAULT_PRIO_WEIGHT_LOW
+# define DEFAULT_PRIO_WEIGHT_LOW 1
+#endif
+
+/* Default length of the log throttling interval, in seconds. */
+#ifndef DEFAULT_LOG_THROTTLE_INTERVAL
+# define DEFAULT_LOG_THROTTLE_INTERVAL 1
+#endif
+
+/* Default number of rotated log files to keep. */
+#ifndef DEFAULT_LOG_FILE_KEEP
+# define DEFAULT_LOG_FILE_KEEP 5
+#endif
+
+/* Default size of per-thread log queues (0 means synchronous logging). */
+#ifndef DEFAULT_LOG_QUEUE_SIZE
+# define DEFAULT_LOG_QUEUE_SIZE 0
+#endif
+
+/* Default percentage of new traces to sample. */
+#ifndef DEFAULT_TRACE_SAMPLE_RATE
+# define DEFAULT_TRACE_SAMPLE_RATE 100
+#endif
+
+/* Default max. number of spans waiting for export. */
+#ifndef DEFAULT_TRACE_QUEUE_SIZE
+# define DEFAULT_TRACE_QUEUE_SIZE 1024
+#endif
+
+/* Default value of the service.name resource attribute of spans. */
+#ifndef DEFAULT_TRACE_SERVICE_NAME
+# define DEFAULT_TRACE_SERVICE_NAME "pound"
+#endif
+
+#ifndef DEFAULT_HANDSHAKE_THREADS
+# define DEFAULT_HANDSHAKE_THREADS 1
+#endif
+
 #ifndef DEFAULT_GRACE_TO
 # define DEFAULT_GRACE_TO 30
 #endif
 
+#ifndef DEFAULT_CONN_IPV6_PREFIX
+# define DEFAULT_CONN_IPV6_PREFIX 64
+#endif
+
+#ifndef DEFAULT_RATE_LIMIT_SIZE
+# define DEFAULT_RATE_LIMIT_SIZE 16384
+#endif
+
+#ifndef DEFAULT_CONC_LIMIT_MIN
+# define DEFAULT_CONC_LIMIT_MIN 1
+#endif
+
+#ifndef DEFAULT_CONC_LIMIT_MAX
+# define DEFAULT_CONC_LIMIT_MAX 1000
+#endif
+
+#ifndef DEFAULT_CONC_LIMIT_INITIAL
+# define DEFAULT_CONC_LIMIT_INITIAL 20
+#endif
+
+#ifndef DEFAULT_CONC_LIMIT_BACKOFF
+# define DEFAULT_CONC_LIMIT_BACKOFF 90
+#endif
+
+#ifndef DEFAULT_CONC_LIMIT_TOLERANCE
+# define DEFAULT_CONC_LIMIT_TOLERANCE 200
+#endif
+
+#ifndef DEFAULT_BASIC_AUTH_CHECK
+# define DEFAULT_BASIC_AUTH_CHECK 1
+#endif
+
+#ifndef DEFAULT_BASIC_AUTH_CACHE_SIZE
+# define DEFAULT_BASIC_AUTH_CACHE_SIZE 1024
+#endif
+
+#ifndef DEFAULT_BASIC_AUTH_CACHE_TTL
+# define DEFAULT_BASIC_AUTH_CACHE_TTL 300
+#endif
+
 #ifndef DEFAULT_ALIVE_TO
 # define DEFAULT_ALIVE_TO 30
 #endif
@@ -214,6 +354,8 @@ enum
     HTTP_STATUS_NOT_FOUND,         // 404
     HTTP_STATUS_PAYLOAD_TOO_LARGE, // 413
     HTTP_STATUS_URI_TOO_LONG,      // 414
+    HTTP_STATUS_TOO_EARLY,         // 425
+    HTTP_STATUS_TOO_MANY_REQUESTS, // 429
     HTTP_STATUS_INTERNAL_SERVER_ERROR,          // 500
     HTTP_STATUS_NOT_IMPLEMENTED,   // 501
     HTTP_STATUS_SERVICE_UNAVAILABLE, // 503
@@ -256,6 +398,29 @@ timespec_sub (struct timespec const *a, struct timespec const *b)
   return d;
 }
 
+/*
+ * FNV-1a hash
+ */
+#define FNV_INIT   2166136261UL
+#define FNV_PRIME  16777619UL
+
+static inline unsigned long
+fnv_next (unsigned long h, int c)
+{
+  return (h ^ (unsigned char) c) * FNV_PRIME;
+}
+
+static inline unsigned long
+fnv_hash (void const *data, size_t len)
+{
+  unsigned char const *p = data;
+  unsigned long h = FNV_INIT;
+
+  while (len--)
+    h = fnv_next (h, *p++);
+  return h;
+}
+
 
 /* List definitions. */
 #include "list.h"
@@ -337,6 +502,7 @@ enum
   };
 
 int http_header_list_append (HTTP_HEADER_LIST *head, char *text, int replace);
+void http_header_list_free (HTTP_HEADER_LIST *head);
 
 struct query_param
 {
@@ -374,18 +540,28 @@ void http_request_free (struct http_request *);
 #define POUND_TID() ((unsigned long)pthread_self ())
 #define PRItid "lx"
 
-struct cidr;
+/* Max. number of bytes in an inet address (suitable for both v4 and v6) */
+#define MAX_INADDR_BYTES 16
+
+struct cidr_node;
 
 typedef struct acl
 {
   char *name;                 /* ACL name (optional) */
-  SLIST_HEAD (,cidr) head;    /* List of CIDRs */
+  struct cidr_node *root4;    /* Trie of IPv4 CIDRs */
+  struct cidr_node *root6;    /* Trie of IPv6 CIDRs */
+  size_t count;               /* Number of CIDRs */
+  size_t mem;                 /* Memory used by the tries */
   SLIST_ENTRY (acl) next;
 } ACL;
 
 typedef SLIST_HEAD (,acl) ACL_HEAD;
 
 int acl_match (ACL *acl, struct sockaddr *sa);
+
+void cidr_trie_insert (struct cidr_node **root, unsigned char const *addr,
+		       unsigned masklen, size_t *mem);
+int cidr_trie_lookup (struct cidr_node const *node, unsigned char const *addr);
 
 /* matcher chain */
 typedef struct _matcher
@@ -432,11 +608,21 @@ struct be_regular
   char *servername;     /* SNI */
 };
 
+/*
+ * Expansion string: a string with back-references and request accessors,
+ * pre-parsed at configuration time (see http.c).
+ */
+typedef struct expansion EXPANSION;
+
+EXPANSION *expansion_compile (char const *str);
+void expansion_free (EXPANSION *exp);
+
 struct be_redirect
 {
   char *url;		 /* for redirectors */
   int status;            /* Redirection status (301, 302, 303, 307, or 308 ) */
   int has_uri;		 /* URL has path and/or query part. */
+  EXPANSION *exp;        /* Pre-parsed URL. */
 };
 
 struct be_acme
@@ -450,6 +636,67 @@ struct be_error
   char *text;            /* Error content page */
 };
 
+/*
+ * Request statistics.  Response times are kept in log-linear histograms,
+ * with STATS_HIST_SUB buckets per power of two microseconds.
+ */
+#define STATS_HIST_SUB_BITS 3
+#define STATS_HIST_SUB (1 << STATS_HIST_SUB_BITS)
+#define STATS_HIST_BUCKETS ((33 - STATS_HIST_SUB_BITS) * STATS_HIST_SUB)
+
+struct stats_hist
+{
+  unsigned long count[STATS_HIST_BUCKETS]; /* Number of samples per bucket */
+  unsigned long long sum;       /* Sum of samples, in microseconds */
+};
+
+#define STATS_CLASSES 5         /* Response status classes (1xx - 5xx) */
+
+/*
+ * Request processing phases.  Each constant identifies the event that
+ * ends the phase; its monotonic timestamp is kept in POUND_HTTP.  The
+ * phase itself lasts from the latest event preceding it in time.
+ */
+enum
+  {
+    PHASE_ACCEPT,           /* Connection accepted. */
+    PHASE_HANDSHAKE,        /* TLS handshake done. */
+    PHASE_DEQUEUE,          /* Connection taken by a worker (or, for
+			       subsequent requests on a keep-alive
+			       connection, next request arrived). */
+    PHASE_HEADERS,          /* Request headers read and parsed. */
+    PHASE_SERVICE,          /* Service matched. */
+    PHASE_CONNECT,          /* Backend connected. */
+    PHASE_SENT,             /* Request sent to backend. */
+    PHASE_FIRST_BYTE,       /* Response head received from backend. */
+    PHASE_LAST_BYTE,        /* Response sent to client. */
+    PHASE_MAX
+  };
+
+/*
+ * Phase times are kept in histograms with one bucket per power of two
+ * microseconds: bucket 0 holds values below 1us, bucket K (1 <= K <= 32)
+ * values in [2^(K-1), 2^K) us, and the last one values above that.
+ */
+#define STATS_PHASE_BUCKETS 34
+
+struct stats_phase
+{
+  unsigned long count[STATS_PHASE_BUCKETS];
+  unsigned long long sum;       /* Sum of samples, in microseconds */
+};
+
+struct stats_block
+{
+  unsigned long responses[STATS_CLASSES]; /* Responses by status class */
+  unsigned long long bytes_in;  /* Request body bytes */
+  unsigned long long bytes_out; /* Response body bytes */
+  struct stats_hist latency;    /* Response times */
+  struct stats_phase phase[PHASE_MAX]; /* Phase times (services only) */
+};
+
+typedef struct stats STATS;
+
 /* back-end definition */
 typedef struct _backend
 {
@@ -462,9 +709,7 @@ typedef struct _backend
 
   /* Statistics */
   pthread_mutex_t mut;		/* mutex for this back-end */
-  double numreq;		/* number of requests seen */
-  double avgtime;		/* Avg. time per request */
-  double avgsqtime;             /* Avg. squared time per request */
+  STATS *stats;                 /* Request statistics */
   double session_count;		/* number of active sessions */
 
   /* Data specific for each backend type. */
@@ -527,6 +772,7 @@ struct bool_service_cond
 {
   int op;
   SLIST_HEAD(,_service_cond) head;
+  struct pattern_list *patlist; /* For BOOL_OR: patterns read from file */
 };
 
 enum service_cond_type
@@ -547,6 +793,7 @@ enum service_cond_type
 typedef struct string_ref
 {
   unsigned refcount;
+  EXPANSION *exp;   /* Pre-parsed value. */
   char value[1];
 } STRING_REF;
 
@@ -556,27 +803,84 @@ struct string_match
   regex_t re;
 };
 
-struct user_pass
+/*
+ * Pattern list: patterns read from a file, compiled for matching all
+ * at once (see patlist.c).
+ */
+enum
+  {
+    PATLIST_EXACT,   /* Exact match. */
+    PATLIST_PREFIX,  /* Prefix match. */
+    PATLIST_SUFFIX,  /* Suffix match. */
+    PATLIST_REGEX    /* Regular expressions. */
+  };
+
+struct patlist_entry;
+
+struct pattern_list
 {
-  SLIST_ENTRY (user_pass) link;
-  char *pass;
-  char user[1];
+  int type;                   /* Condition type (COND_*) */
+  STRING_REF *string;         /* For COND_QUERY_PARAM and COND_STRING_MATCH */
+  int mode;                   /* PATLIST_* constant */
+  int icase;                  /* Case-insensitive match */
+  size_t count;               /* Number of patterns */
+  size_t mem;                 /* Memory used */
+  /* Literal patterns: */
+  struct patlist_entry *tab;  /* Hash table */
+  size_t size;                /* Size of the table */
+  size_t nent;                /* Number of entries in it */
+  size_t maxlen;              /* Length of the longest string */
+  unsigned char *lenmap;      /* Bitmap of string lengths */
+  /* Regular expressions: */
+  regex_t re;                 /* Alternation of all patterns */
 };
 
-typedef SLIST_HEAD(,user_pass) USER_PASS_HEAD;
+struct pattern_list *pattern_list_new (int type, int mode, int icase);
+void pattern_list_add (struct pattern_list *pl, char const *str);
+ssize_t pattern_list_lookup (struct pattern_list *pl, char const *str);
+int pattern_list_regcomp (struct pattern_list *pl, char const *expr,
+			  int flags);
+int pattern_list_regexec (struct pattern_list *pl, char const *str);
+
+struct pass_table;
+struct shtab;
 
 struct pass_file
 {
   WORKDIR *wd;
   char *filename;
   struct locus_range locus;
-  struct timespec mtim;
-  USER_PASS_HEAD head;
+  struct timespec mtim;         /* Modification time of the file. */
+  int err;                      /* Error code of the last load attempt. */
+  pthread_mutex_t lock;         /* Protects table pointer. */
+  struct pass_table *table;     /* Users and passwords (NULL if none). */
+  struct shtab *cache;          /* Verified credentials (NULL if disabled). */
+  SLIST_ENTRY (pass_file) next;
+};
+
+/*
+ * Literal form of an exact or prefix match.  It is kept along with the
+ * compiled regex for COND_HOST, COND_URL and COND_PATH conditions, for
+ * use by the service dispatch index.
+ */
+enum
+  {
+    COND_LIT_NONE,   /* Not a literal match. */
+    COND_LIT_EXACT,  /* Exact match. */
+    COND_LIT_PREFIX  /* Prefix match. */
+  };
+
+struct cond_literal
+{
+  int mode;        /* One of the above. */
+  int icase;       /* Case-insensitive match. */
+  char *str;       /* String to match. */
 };
 
 typedef struct _service_cond
 {
   enum service_cond_type type;
+  struct cond_literal lit;
   union
   {
     ACL *acl;
@@ -659,6 +963,63 @@ enum
     REWRITE_RESPONSE
   };
 
+/* Rewrite rules compiled into instruction array (see http.c). */
+struct rewrite_program;
+
+/* Rate limiter key types */
+enum
+  {
+    RATE_LIMIT_IP,              /* Client IP address */
+    RATE_LIMIT_HEADER,          /* Value of the header named by id */
+    RATE_LIMIT_STRING           /* Expansion of id */
+  };
+
+typedef struct rate_limit
+{
+  int type;                     /* Key type (see above) */
+  char *id;                     /* Header name or string to expand */
+  EXPANSION *exp;               /* Compiled id, for RATE_LIMIT_STRING */
+  unsigned rate;                /* Number of requests allowed ... */
+  unsigned interval;            /* ... per this many seconds */
+  unsigned burst;               /* Bucket capacity */
+  unsigned size;                /* Max. number of buckets */
+  struct shtab *table;          /* Token buckets */
+} RATE_LIMIT;
+
+/* Adaptive concurrency limiter */
+typedef struct conc_limit
+{
+  unsigned min;                 /* Lower bound of the limit */
+  unsigned max;                 /* Upper bound of the limit */
+  unsigned initial;             /* Initial limit */
+  unsigned backoff;             /* Decrease factor, percent */
+  unsigned tolerance;           /* Allowed latency increase, percent */
+  unsigned queue_timeout;       /* Max. time to wait for a slot, ms */
+  struct conc_state *state;     /* Current state */
+} CONC_LIMIT;
+
+/* Access log sampling */
+#define LOG_SAMPLE_CLASSES 6    /* Number of status classes (0xx - 5xx) */
+#define LOG_SAMPLE_SCALE 1000000
+
+struct log_sample
+{
+  int mask;                     /* Status classes subject to sampling */
+  unsigned rate[LOG_SAMPLE_CLASSES]; /* Lines logged per LOG_SAMPLE_SCALE
+					requests, by status class */
+};
+
+/* Access log file */
+typedef struct log_file
+{
+  char *name;                   /* File name */
+  CONTENT_LENGTH max_size;      /* Rotate when the file exceeds this size */
+  unsigned interval;            /* Rotate every this many seconds */
+  unsigned keep;                /* Number of rotated files to keep */
+  struct log_file_state *state; /* Current state */
+  SLIST_ENTRY (log_file) next;
+} LOG_FILE;
+
 /* service definition */
 typedef struct _service
 {
@@ -666,6 +1027,7 @@ typedef struct _service
   char *locus;                  /* Location in the config file */
   SERVICE_COND cond;
   REWRITE_RULE_HEAD rewrite[2];
+  struct rewrite_program *rewrite_prog[2]; /* Compiled rewrite rules */
   BACKEND_HEAD backends;
   BACKEND *emergency;
   int abs_pri;			/* abs total priority for all back-ends */
@@ -680,12 +1042,16 @@ typedef struct _service
   unsigned sess_ttl;		/* session time-to-live */
   char *sess_id;                /* Session anchor ID */
   SESSION_TABLE *sessions;	/* currently active sessions */
+  RATE_LIMIT *rate_limit;       /* Request rate limiter */
+  CONC_LIMIT *conc_limit;       /* Adaptive concurrency limiter */
+  STATS *stats;                 /* Request statistics */
   int disabled;			/* true if the service is disabled */
   /* Logging */
   char *forwarded_header;       /* "forwarded" header name */
   ACL *trusted_ips;             /* Trusted IP addresses */
   int log_suppress_mask;        /* Suppress HTTP logging for these status
 				   codes.  A bitmask. */
+  struct log_sample log_sample; /* Access log sampling */
   SLIST_ENTRY (_service) next;
 } SERVICE;
 
@@ -699,11 +1065,27 @@ typedef struct _pound_ctx
   char *server_name;
   char **subjectAltNames;
   size_t subjectAltNameCount;
+  char *ocsp_file;              /* OCSP response file (from OCSPResponse) */
   SLIST_ENTRY (_pound_ctx) next;
 } POUND_CTX;
 
 typedef SLIST_HEAD (,_pound_ctx) POUND_CTX_HEAD;
 
+/* Certificate source, as given by a Cert statement. */
+typedef struct cert_source
+{
+  char *path;                   /* Certificate file or directory */
+  char *ocsp_file;              /* OCSP response file (from OCSPResponse) */
+  SLIST_ENTRY (cert_source) next;
+} CERT_SOURCE;
+
+typedef SLIST_HEAD (,cert_source) CERT_SOURCE_HEAD;
+
+/* OCSP stapling */
+#define OCSP_DEFAULT_TIMEOUT 5
+
+int ocsp_stapling_init (POUND_CTX *pc, char const *url, unsigned timeout);
+
 /* HTTP logger */
 #define MAX_HTTP_LOG_FORMATS 32
 
@@ -718,6 +1100,34 @@ int http_log_format_check (int n);
 #define HDROPT_FORWARDED_HEADERS 0x1 /* Add X-Forwarded headers */
 #define HDROPT_SSL_HEADERS       0x2 /* Add X-SSL- headers */
 
+/* Priority classes of the worker queue. */
+enum
+  {
+    PRIO_HIGH,
+    PRIO_NORMAL,
+    PRIO_LOW,
+    PRIO_MAX
+  };
+
+/* Priority assigned to clients matching an ACL. */
+struct prio_acl
+{
+  ACL *acl;
+  int prio;
+  SLIST_ENTRY (prio_acl) next;
+};
+
+typedef SLIST_HEAD (,prio_acl) PRIO_ACL_HEAD;
+
+/* Reasons for dropping slow or idle client connections. */
+enum
+  {
+    CLIENT_TMO_HEADER,          /* Request head not received in time */
+    CLIENT_TMO_BODY_RATE,       /* Request body sent too slowly */
+    CLIENT_TMO_KEEPALIVE,       /* Idle between requests for too long */
+    CLIENT_TMO_MAX
+  };
+
 /* Listener definition */
 typedef struct _listener
 {
@@ -728,12 +1138,19 @@ typedef struct _listener
   int chowner;                  /* Change to effective owner, for AF_UNIX */
   int sock;			/* listening socket */
   POUND_CTX_HEAD ctx_head;	/* CTX for SSL connections */
+  pthread_rwlock_t ctx_lock;    /* Protects ctx_head */
   int clnt_check;		/* client verification mode */
   int noHTTPS11;		/* HTTP 1.1 mode for SSL */
   int header_options;           /* additional header options */
   REWRITE_RULE_HEAD rewrite[2];
+  struct rewrite_program *rewrite_prog[2]; /* Compiled rewrite rules */
   int verb;			/* allowed HTTP verb group */
   unsigned to;			/* client time-out */
+  unsigned header_to;           /* request head time-out (0 - off) */
+  unsigned body_min_rate;       /* min. request body rate, bytes/s (0 - off) */
+  unsigned keepalive_to;        /* keep-alive idle time-out (0 - off) */
+  pthread_mutex_t tmo_mutex;    /* Protects tmo_count */
+  unsigned long tmo_count[CLIENT_TMO_MAX]; /* Dropped connections by reason */
   int has_pat;			/* was a URL pattern defined? */
   regex_t url_pat;		/* pattern to match the request URL against */
   char *http_err[HTTP_STATUS_MAX];	/* error messages */
@@ -742,16 +1159,43 @@ typedef struct _listener
   int rewr_dest;		/* rewrite destination header */
   int disabled;			/* true if the listener is disabled */
   int log_level;		/* log level for this listener */
+  LOG_FILE *log_file;           /* Access log file, if not logging to syslog */
+  struct log_sample log_sample; /* Access log sampling */
   char *forwarded_header;       /* "forwarded" header name */
   ACL *trusted_ips;             /* Trusted IP addresses */
   int allow_client_reneg;	/* Allow Client SSL Renegotiation */
+  int ocsp_stapling;            /* Enable OCSP stapling */
+  char *ocsp_url;               /* OCSP responder URL */
+  unsigned ocsp_timeout;        /* OCSP responder timeout */
+  unsigned early_data;          /* Max. TLS 1.3 early data size (0 - off) */
   SERVICE_HEAD services;
+  struct service_index *service_index; /* Dispatch index for services */
+  unsigned route_cache_size;    /* Max. number of route cache entries */
+  struct route_cache *route_cache; /* Route cache (NULL if disabled) */
+  RATE_LIMIT *rate_limit;       /* Request rate limiter */
+  unsigned max_conn_per_ip;     /* Max. connections per client (0 - any) */
+  unsigned max_conn_ipv6_prefix; /* IPv6 prefix length for the above */
+  struct conn_table *conn_table; /* Per-client connection counters */
+  int prio;                     /* Worker queue priority class */
+  PRIO_ACL_HEAD prio_acls;      /* Per-client priority classes */
   SLIST_ENTRY (_listener) next;
 
-  /* Used during configuration parsing */
+  /* Used to rebuild ctx_head when reloading certificates */
+  CERT_SOURCE_HEAD cert_sources; /* Certificate sources */
   int ssl_op_enable;
   int ssl_op_disable;
+  int verify_depth;             /* Client certificate verification depth */
+  char *ciphers;                /* Cipher list */
+  char *calist;                 /* CAlist file */
+  char *verifylist;             /* VerifyList file */
+  char *crlist;                 /* CRLlist file */
+  char *sid_ctx;                /* Session id context */
+  unsigned cert_watch;          /* Certificate check interval (0 - off) */
+  time_t cert_mtime;            /* Last modification time of certificates */
+
+  /* Used during configuration parsing */
   int has_other;
+  int cert_dir;                 /* Last Cert statement named a directory */
 } LISTENER;
 
 typedef SLIST_HEAD(,_listener) LISTENER_HEAD;
@@ -811,6 +1255,21 @@ typedef enum
   }
   RENEG_STATE;
 
+/* Trace context of a request (W3C Trace Context). */
+#define TRACE_ID_SIZE 16
+#define SPAN_ID_SIZE 8
+
+struct trace_context
+{
+  int sampled;                            /* Request is sampled. */
+  int has_parent;                         /* Parent span ID is valid. */
+  int has_client;                         /* Request was sent to a backend. */
+  unsigned char trace_id[TRACE_ID_SIZE];
+  unsigned char parent_id[SPAN_ID_SIZE];  /* Span ID of the caller. */
+  unsigned char span_id[SPAN_ID_SIZE];    /* Pound's (server) span ID. */
+  unsigned char client_id[SPAN_ID_SIZE];  /* Span ID of the backend request. */
+};
+
 typedef struct _pound_http
 {
   /* Input parameters */
@@ -824,25 +1283,38 @@ typedef struct _pound_http
 
   /* Data used during http processing */
   BIO *cl;
+  struct bio_arg *cl_arg;  /* Time-out state of the client BIO */
   BIO *be;
   X509 *x509;
   SSL *ssl;
   struct submatch_queue smq;
   RENEG_STATE reneg_state;
+  char *early_buf;   /* Early data read by the handshake thread */
+  size_t early_len;  /* Length of early_buf */
+  int early_finished; /* All early data have been read */
+  int early_req;     /* Current request was (partly) received in early data */
+  HTTP_HEADER_LIST ssl_headers; /* Cached X-SSL-* headers */
+  int ssl_headers_ready;  /* ssl_headers have been computed */
 
   int ws_state;  /* Websocket state */
   int no_cont;   /* True if no content is expected */
   int conn_closed; /* True if the connection is closed */
+  int prio;        /* Worker queue priority class */
+  struct timespec queued; /* Time when placed in the worker queue */
 
   struct http_request request;
   struct http_request response;
 
   struct timespec start_req; /* Time when original request was received */
   struct timespec end_req;   /* Time after the response was sent */
+  struct timespec phase[PHASE_MAX]; /* Monotonic times of processing
+				       phase events; zero if not reached */
+  struct trace_context trace; /* Trace context */
 
   char *orig_forwarded_header; /* Original value of forwarded header */
   int response_code;
 
+  CONTENT_LENGTH req_bytes;
   CONTENT_LENGTH res_bytes;
 
   SLIST_ENTRY(_pound_http) next;
@@ -851,10 +1323,30 @@ typedef struct _pound_http
 typedef SLIST_HEAD(,_pound_http) POUND_HTTP_HEAD;
 
 void save_forwarded_header (POUND_HTTP *phttp);
+
+/* Record the time of the phase event PHASE. */
+static inline void
+phase_mark (POUND_HTTP *phttp, int phase)
+{
+  clock_gettime (CLOCK_MONOTONIC, &phttp->phase[phase]);
+}
+
+static inline int
+phase_is_set (POUND_HTTP const *phttp, int phase)
+{
+  return phttp->phase[phase].tv_sec != 0 || phttp->phase[phase].tv_nsec != 0;
+}
+
+int phase_time (POUND_HTTP const *phttp, int phase, struct timespec *ret);
+char const *phase_name (int phase);
+int phase_lookup (char const *name, size_t len);
+
 void http_log (POUND_HTTP *phttp);
 
 /* add a request to the queue */
 int pound_http_enqueue (int sock, LISTENER *lstn, struct sockaddr *sa, socklen_t salen);
+/* add a connection with completed TLS handshake to the queue */
+void pound_http_push (POUND_HTTP *phttp);
 /* get a request from the queue */
 POUND_HTTP *pound_http_dequeue (void);
 /* Free the argument */
@@ -867,12 +1359,48 @@ void active_threads_decr (void);
 /* handle HTTP requests */
 void *thr_http (void *);
 
+/* Non-blocking TLS handshakes */
+int tls_handshake_submit (POUND_HTTP *phttp);
+void tls_handshake_start (pthread_attr_t *attr);
+
+/* TLS 1.3 early data */
+void early_data_ctx_init (SSL_CTX *ctx, unsigned max);
+void early_data_account (SSL *ssl);
+int early_data_method_ok (int method);
+BIO *early_data_bio_new (SSL *ssl, char *buf, size_t len, int reading);
+int early_data_bio_state (BIO *bio, unsigned long *count);
+
 /* Log an error to the syslog or to stderr */
 void logmsg (const int, const char *, ...)
   ATTR_PRINTFLIKE(2,3);
 void abend (char const *fmt, ...)
   ATTR_PRINTFLIKE(1,2);
 
+/*
+ * Rate-limited logging.  Each call site of logmsg_throttled logs at
+ * most log_throttle_burst messages per log_throttle_interval seconds.
+ * The number of suppressed messages is reported when the next message
+ * from the same site is logged.
+ */
+struct log_throttle
+{
+  unsigned long window;         /* Current interval number */
+  unsigned count;               /* Messages logged in this interval */
+  unsigned suppressed;          /* Messages suppressed since last report */
+};
+
+void log_throttled (struct log_throttle *lt, int priority,
+		    char const *fmt, ...)
+  ATTR_PRINTFLIKE(3,4);
+
+#define logmsg_throttled(pri, ...)				\
+  do								\
+    {								\
+      static struct log_throttle log_throttle_;		\
+      log_throttled (&log_throttle_, pri, __VA_ARGS__);	\
+    }								\
+  while (0)
+
 /* Translate inet/inet6 address into a string */
 char *addr2str (char *, int, const struct addrinfo *, int);
 
@@ -881,6 +1409,12 @@ char *str_be (char *buf, size_t size, BACKEND *be);
 
 /* Find the right service for a request */
 SERVICE *get_service (POUND_HTTP *);
+/* Build service dispatch indexes */
+void service_index_init (void);
+/* Flush route caches */
+void route_cache_invalidate (void);
+/* Compile rewrite rules of all listeners and services */
+void rewrite_init (void);
 
 /* Find the right back-end for a request */
 BACKEND *get_backend (POUND_HTTP *phttp);
@@ -940,6 +1474,11 @@ void config_parse (int, char **);
  */
 void SSLINFO_callback (const SSL * s, int where, int rc);
 
+/* Create SSL object for a new connection on HTTPS listener. */
+SSL *listener_ssl_new (LISTENER *lstn);
+/* Reload certificates of HTTPS listener. */
+int listener_reload_certs (LISTENER *lstn);
+
 /*
  * run periodic functions:
  *  - RSAgen every T_RSA_KEYS seconds (on older OpenSSL)
@@ -1025,7 +1564,69 @@ void job_enqueue_after (unsigned t, void (*func) (void *), void *data);
 void job_rearm_unlocked (struct timespec *ts, void (*func) (void *), void *data);
 void job_rearm (struct timespec *ts, void (*func) (void *), void *data);
 
+void job_unlock (void);
+void job_lock (void);
+
 char const *sess_type_to_str (int type);
+char const *rate_limit_type_to_str (int type);
+char const *prio_to_str (int prio);
+
+void rate_limit_init (RATE_LIMIT *rl);
+int rate_limit_check (RATE_LIMIT *rl, char const *key, size_t len,
+		      unsigned *retry_after);
+
+struct rate_limit_stats
+{
+  unsigned long entries;        /* Number of buckets */
+  unsigned long passed;         /* Requests passed */
+  unsigned long rejected;       /* Requests rejected */
+  unsigned long evicted;        /* Buckets evicted */
+};
+
+void rate_limit_get_stats (RATE_LIMIT *rl, struct rate_limit_stats *st);
+
+void conc_limit_init (CONC_LIMIT *cl);
+int conc_limit_acquire (CONC_LIMIT *cl);
+void conc_limit_release (CONC_LIMIT *cl, struct timespec const *latency,
+			 int ok);
+
+struct conc_limit_stats
+{
+  unsigned limit;               /* Current limit */
+  unsigned inflight;            /* Requests in flight */
+  double latency;               /* Short-term latency average (ns) */
+  double baseline_latency;      /* Long-term latency average (ns) */
+  unsigned long passed;         /* Requests passed */
+  unsigned long queued;         /* Requests that had to wait */
+  unsigned long rejected;       /* Requests rejected */
+  unsigned long failed;         /* Requests failed */
+};
+
+void conc_limit_get_stats (CONC_LIMIT *cl, struct conc_limit_stats *st);
+
+struct conn_table *conn_table_new (unsigned max, unsigned prefix);
+int conn_limit_acquire (struct conn_table *ct, struct sockaddr const *sa);
+void conn_limit_release (struct conn_table *ct, struct sockaddr const *sa);
+
+struct conn_limit_stats
+{
+  unsigned long clients;        /* Number of clients tracked */
+  unsigned long active;         /* Connections open */
+  unsigned long rejected;       /* Connections rejected */
+};
+
+void conn_limit_get_stats (struct conn_table *ct, struct conn_limit_stats *st);
+
+struct route_cache_stats
+{
+  unsigned long size;           /* Max. number of entries */
+  unsigned long entries;        /* Number of entries */
+  unsigned long hits;
+  unsigned long misses;
+};
+
+void route_cache_get_stats (struct route_cache *rc,
+			    struct route_cache_stats *st);
 int control_response (POUND_HTTP *arg);
 void pound_atexit (void (*func) (void *), void *arg);
 int unlink_at_exit (char const *file_name);
@@ -1083,8 +1684,71 @@ void json_error (struct json_value *val, char const *fmt, ...);
 int http_status_to_pound (int status);
 int pound_to_http_status (int err);
 
+/* Log queue overflow policies. */
+enum
+  {
+    LOG_QUEUE_DROP,             /* Drop the message. */
+    LOG_QUEUE_BLOCK             /* Wait for free space. */
+  };
+
+int log_queue_put (int priority, char const *fmt, va_list ap);
+void log_queue_start (void);
+void log_queue_stop (void);
+char const *log_queue_overflow_to_str (int n);
+struct json_value *log_queue_serialize (void);
+
+LOG_FILE *log_file_lookup (char const *name);
+LOG_FILE *log_file_new (char const *name);
+void log_file_open_all (void);
+int log_file_reopen_all (void);
+void log_file_put (LOG_FILE *lf, char const *text, size_t len);
+struct json_value *log_file_serialize (LOG_FILE *lf);
+
+/* Tracing configuration. */
+typedef struct trace_conf
+{
+  unsigned enabled;          /* Tracing is configured. */
+  unsigned sample_rate;      /* Percentage of new traces to sample. */
+  char *file;                /* Export file name, */
+  struct addrinfo addr;      /* or datagram socket address. */
+  char *service_name;        /* Value of the service.name attribute. */
+  unsigned queue_size;       /* Max. number of spans waiting for export. */
+} TRACE_CONF;
+
+void trace_request_begin (POUND_HTTP *phttp);
+int trace_inject (POUND_HTTP *phttp);
+void trace_request_end (POUND_HTTP *phttp, int ok);
+void trace_export_open (void);
+void trace_export_reopen (void);
+void trace_start (void);
+void trace_stop (void);
+struct json_value *trace_serialize (void);
+
 struct json_value *workers_serialize (void);
+struct json_value *worker_queue_serialize (void);
+struct json_value *tls_handshake_serialize (void);
+struct json_value *early_data_serialize (void);
+struct json_value *route_cache_serialize (struct route_cache *rc);
+struct json_value *rate_limit_serialize (RATE_LIMIT *rl);
+struct json_value *conc_limit_serialize (CONC_LIMIT *cl);
+struct json_value *conn_limit_serialize (struct conn_table *ct);
 struct json_value *pound_serialize (void);
+
+STATS *stats_new (void);
+void stats_init (void);
+void stats_record (STATS *st, int status,
+		   CONTENT_LENGTH bytes_in, CONTENT_LENGTH bytes_out,
+		   struct timespec const *latency);
+void stats_get (STATS *st, struct stats_block *res);
+void stats_hist_add (struct stats_hist *h, struct timespec const *ts);
+unsigned long long stats_hist_bound (int i);
+unsigned long stats_hist_count (struct stats_hist const *h);
+unsigned long stats_hist_count_below (struct stats_hist const *h, int k);
+unsigned long long stats_hist_quantile (struct stats_hist const *h, double q);
+double stats_hist_stddev (struct stats_hist const *h, unsigned long total);
+void stats_record_phases (STATS *st, POUND_HTTP const *phttp);
+unsigned long stats_phase_count_below (struct stats_phase const *p, int k);
+struct json_value *stats_serialize (STATS *st);
 int metrics_response (POUND_HTTP *phttp);
 
 int match_cond (SERVICE_COND *cond, POUND_HTTP *phttp,
@@ -1131,6 +1795,9 @@ typedef int (*BACKEND_ITERATOR) (BACKEND *, void *);
 int foreach_backend (BACKEND_ITERATOR itr, void *data);
 
 int basic_auth (struct pass_file *pwf, struct http_request *req);
+void pass_file_register (struct pass_file *pwf);
+void basic_auth_init (void);
+struct json_value *basic_auth_cache_serialize (void);
 
 void combinable_header_add (char const *name);
 int is_combinable_header (struct http_header *hdr);
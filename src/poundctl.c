@@ -647,7 +647,79 @@ command_add_session (BIO *bio, int argc, char **argv)
   return 0;
 }
 
+int
+command_reload_certs (BIO *bio, int argc, char **argv)
+{
+  char *uri;
+  struct json_value *val;
+  OBJID objid;
+
+  if (argc == 0)
+    {
+      errormsg (0, 0, "required argument missing");
+      return 1;
+    }
+  else if (argc > 1)
+    {
+      errormsg (0, 0, "too many arguments");
+      return 1;
+    }
+  uri = argv[0];
+  check_uri (uri, objid);
+  if (objid[OI_LAST] != OI_LISTENER || objid[OI_LISTENER] == -1)
+    {
+      errormsg (0, 0, "bad uri: listener expected");
+      return 1;
+    }
+
+  BIO_printf (bio, "POST /certs%s HTTP/1.1\r\n"
+		   "Host: localhost\r\n\r\n",
+	      uri);
+  val = read_response (bio);
+  if (json_option)
+    print_json (val, stdout);
+  if (val->type != json_bool)
+    {
+      json_error (val, "unexpected object type");
+      return 1;
+    }
+  if (val->v.b == 0)
+    {
+      errormsg (1, 0, "command failed");
+    }
+  json_value_free (val);
+  return 0;
+}
 
+int
+command_reopen_logs (BIO *bio, int argc, char **argv)
+{
+  struct json_value *val;
+
+  if (argc > 0)
+    {
+      errormsg (0, 0, "too many arguments");
+      return 1;
+    }
+
+  BIO_printf (bio, "POST /logs HTTP/1.1\r\n"
+		   "Host: localhost\r\n\r\n");
+  val = read_response (bio);
+  if (json_option)
+    print_json (val, stdout);
+  if (val->type != json_bool)
+    {
+      json_error (val, "unexpected object type");
+      return 1;
+    }
+  if (val->v.b == 0)
+    {
+      errormsg (1, 0, "command failed");
+    }
+  json_value_free (val);
+  return 0;
+}
+
 typedef int (*COMMAND) (BIO *, int, char **);
 
 struct dispatch_table
@@ -665,6 +737,8 @@ static struct dispatch_table dispatch[] = {
   { "delete", command_delete_session },
   { "del", command_delete_session },
   { "add", command_add_session },
+  { "reload", command_reload_certs },
+  { "reopen", command_reopen_logs },
   { NULL }
 };
 
@@ -692,6 +766,8 @@ static char *usage_text[] = {
   "   disable /L/S/B    disable listener, service, or backend.",
   "   delete /L/S KEY   delete session with given key.",
   "   add /L/S/B KEY    add session with given key.",
+  "   reload /L         reload certificates of HTTPS listener.",
+  "   reopen            reopen log files.",
   "",
   "Shortcuts:",
   "   on                same as enable",
@@ -0,0 +1,156 @@
+/*
+ * Pound - the reverse-proxy load-balancer
+ * Copyright (C) 2024 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Request rate limiting.
+ *
+ * Each client, identified by a key (its IP address, a header value or
+ * an expanded string), is assigned a token bucket of the configured
+ * capacity (burst size), which is refilled at the configured rate.
+ * Each request takes one token from the bucket; if it is empty, the
+ * request is refused.  Buckets are refilled lazily, when the next
+ * request arrives.
+ *
+ * Buckets are kept in a bounded sharded table (see shtab.c), so that
+ * concurrent requests from different clients rarely contend.  When the
+ * table is full, the least recently used bucket is evicted.
+ */
+#include "pound.h"
+#include "json.h"
+#include "shtab.h"
+
+/* Rate limiter counters. */
+enum
+  {
+    RATE_PASSED,
+    RATE_REJECTED
+  };
+
+struct rate_bucket
+{
+  double tokens;                   /* Number of tokens available. */
+  struct timespec last;            /* Time of the last refill. */
+};
+
+/* Create the bucket table for the rate limiter RL. */
+void
+rate_limit_init (RATE_LIMIT *rl)
+{
+  rl->table = shtab_new (rl->size, sizeof (struct rate_bucket));
+}
+
+/*
+ * Take a token from the bucket identified by KEY of length LEN.
+ * Return 0 if the request is allowed.  Otherwise, return 1 and store
+ * in *RETRY_AFTER the number of seconds after which the next token
+ * will be available.
+ */
+int
+rate_limit_check (RATE_LIMIT *rl, char const *key, size_t len,
+		  unsigned *retry_after)
+{
+  struct shtab_cursor cur;
+  struct rate_bucket *b;
+  struct timespec now;
+  double rate = (double) rl->rate / rl->interval;
+  int rc;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  if ((b = shtab_lookup (rl->table, key, len, &cur)) != NULL)
+    {
+      double elapsed = (now.tv_sec - b->last.tv_sec)
+			 + (now.tv_nsec - b->last.tv_nsec) / 1e9;
+      b->tokens += elapsed * rate;
+      if (b->tokens > rl->burst)
+	b->tokens = rl->burst;
+      b->last = now;
+    }
+  else if ((b = shtab_insert (rl->table, &cur)) != NULL)
+    {
+      b->tokens = rl->burst;
+      b->last = now;
+    }
+  else
+    {
+      /* Don't refuse requests because of memory shortage. */
+      shtab_unlock (&cur);
+      return 0;
+    }
+
+  if (b->tokens >= 1)
+    {
+      b->tokens -= 1;
+      shtab_count (&cur, RATE_PASSED, 1);
+      rc = 0;
+    }
+  else
+    {
+      double wait = (1 - b->tokens) / rate;
+      *retry_after = (unsigned) wait;
+      if (*retry_after < wait)
+	++*retry_after;
+      shtab_count (&cur, RATE_REJECTED, 1);
+      rc = 1;
+    }
+  shtab_unlock (&cur);
+  return rc;
+}
+
+void
+rate_limit_get_stats (RATE_LIMIT *rl, struct rate_limit_stats *st)
+{
+  struct shtab_stats ts;
+
+  shtab_get_stats (rl->table, &ts);
+  st->entries = ts.entries;
+  st->passed = ts.counter[RATE_PASSED];
+  st->rejected = ts.counter[RATE_REJECTED];
+  st->evicted = ts.evicted;
+}
+
+struct json_value *
+rate_limit_serialize (RATE_LIMIT *rl)
+{
+  struct json_value *obj;
+  struct rate_limit_stats st;
+  int err = 0;
+
+  rate_limit_get_stats (rl, &st);
+
+  obj = json_new_object ();
+  if (obj)
+    {
+      err = json_object_set (obj, "type",
+			     json_new_string (rate_limit_type_to_str (rl->type)))
+	|| (rl->id && json_object_set (obj, "id", json_new_string (rl->id)))
+	|| json_object_set (obj, "rate", json_new_integer (rl->rate))
+	|| json_object_set (obj, "interval", json_new_integer (rl->interval))
+	|| json_object_set (obj, "burst", json_new_integer (rl->burst))
+	|| json_object_set (obj, "size", json_new_integer (rl->size))
+	|| json_object_set (obj, "entries", json_new_number (st.entries))
+	|| json_object_set (obj, "passed", json_new_number (st.passed))
+	|| json_object_set (obj, "rejected", json_new_number (st.rejected))
+	|| json_object_set (obj, "evicted", json_new_number (st.evicted));
+    }
+  if (err)
+    {
+      json_value_free (obj);
+      obj = NULL;
+    }
+  return obj;
+}
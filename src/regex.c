@@ -0,0 +1,205 @@
+/*
+ * Pound - the reverse-proxy load-balancer
+ * Copyright (C) 2024 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * POSIX-like regex interface to the native PCRE2 API.
+ *
+ * Unlike the pcre2posix library, patterns are JIT-compiled when possible,
+ * and regexec does not allocate match data on each call.  Instead, each
+ * thread keeps its own match data block, which is enlarged as needed.
+ *
+ * Matching semantics are the same as those of pcre2posix: REG_ICASE and
+ * REG_NEWLINE map to PCRE2_CASELESS and PCRE2_MULTILINE, REG_EXTENDED is
+ * ignored, and unset subexpressions are reported with offsets of -1.
+ */
+#include "pound.h"
+
+#if HAVE_LIBPCRE2
+
+/* Minimal number of ovector pairs in a match data block. */
+#define MATCH_DATA_MIN 10
+
+static pthread_key_t match_data_key;
+static pthread_once_t match_data_key_once = PTHREAD_ONCE_INIT;
+
+static void
+match_data_free (void *ptr)
+{
+  pcre2_match_data_free (ptr);
+}
+
+static void
+match_data_key_create (void)
+{
+  pthread_key_create (&match_data_key, match_data_free);
+}
+
+/*
+ * Return the match data block of the calling thread, capable of holding
+ * at least N ovector pairs.
+ */
+static pcre2_match_data *
+match_data_get (uint32_t n)
+{
+  pcre2_match_data *md;
+
+  pthread_once (&match_data_key_once, match_data_key_create);
+  md = pthread_getspecific (match_data_key);
+  if (md == NULL || pcre2_get_ovector_count (md) < n)
+    {
+      if (n < MATCH_DATA_MIN)
+	n = MATCH_DATA_MIN;
+      pcre2_match_data_free (md);
+      md = pcre2_match_data_create (n, NULL);
+      pthread_setspecific (match_data_key, md);
+    }
+  return md;
+}
+
+int
+regcomp (regex_t *preg, char const *pattern, int cflags)
+{
+  uint32_t options = 0;
+  uint32_t n;
+  int errcode;
+  PCRE2_SIZE erroffset;
+
+  if (cflags & REG_ICASE)
+    options |= PCRE2_CASELESS;
+  if (cflags & REG_NEWLINE)
+    options |= PCRE2_MULTILINE;
+
+  memset (preg, 0, sizeof (*preg));
+  preg->re_pcre = pcre2_compile ((PCRE2_SPTR) pattern, PCRE2_ZERO_TERMINATED,
+				 options, &errcode, &erroffset, NULL);
+  if (preg->re_pcre == NULL)
+    {
+      preg->re_errcode = errcode;
+      preg->re_erroffset = erroffset;
+      return errcode == PCRE2_ERROR_NOMEMORY ? REG_ESPACE : REG_BADPAT;
+    }
+
+  pcre2_pattern_info (preg->re_pcre, PCRE2_INFO_CAPTURECOUNT, &n);
+  preg->re_nsub = n;
+  preg->re_nosub = (cflags & REG_NOSUB) != 0;
+  /* If JIT is not available, the interpreter will be used. */
+  pcre2_jit_compile (preg->re_pcre, PCRE2_JIT_COMPLETE);
+  return 0;
+}
+
+int
+regexec (regex_t const *preg, char const *string,
+	 size_t nmatch, regmatch_t pmatch[], int eflags)
+{
+  pcre2_match_data *md;
+  uint32_t options = 0;
+  PCRE2_SIZE *ovector;
+  size_t i;
+  int rc;
+
+  if (preg->re_nosub)
+    nmatch = 0;
+  if ((md = match_data_get (nmatch)) == NULL)
+    return REG_ESPACE;
+
+  if (eflags & REG_NOTBOL)
+    options |= PCRE2_NOTBOL;
+  if (eflags & REG_NOTEOL)
+    options |= PCRE2_NOTEOL;
+
+  /* This uses JIT code, if available. */
+  rc = pcre2_match (preg->re_pcre, (PCRE2_SPTR) string,
+		    PCRE2_ZERO_TERMINATED, 0, options, md, NULL);
+  if (rc == PCRE2_ERROR_NOMATCH)
+    return REG_NOMATCH;
+  else if (rc == PCRE2_ERROR_NOMEMORY)
+    return REG_ESPACE;
+  else if (rc < 0)
+    return REG_BADPAT;
+
+  /* Zero return means the ovector is full. */
+  if (rc == 0)
+    rc = pcre2_get_ovector_count (md);
+  ovector = pcre2_get_ovector_pointer (md);
+  for (i = 0; i < nmatch; i++)
+    {
+      if (i < (size_t) rc && ovector[2*i] != PCRE2_UNSET)
+	{
+	  pmatch[i].rm_so = ovector[2*i];
+	  pmatch[i].rm_eo = ovector[2*i+1];
+	}
+      else
+	pmatch[i].rm_so = pmatch[i].rm_eo = -1;
+    }
+  return 0;
+}
+
+size_t
+regerror (int errcode, regex_t const *preg, char *errbuf, size_t errbuf_size)
+{
+  char buf[256];
+  size_t len;
+
+  switch (errcode)
+    {
+    case REG_NOMATCH:
+      strcpy (buf, "regexec failed to match");
+      break;
+
+    case REG_ESPACE:
+      strcpy (buf, "out of memory");
+      break;
+
+    case REG_BADPAT:
+      if (preg && preg->re_errcode)
+	{
+	  char msg[200];
+
+	  if (pcre2_get_error_message (preg->re_errcode, (PCRE2_UCHAR *) msg,
+				       sizeof (msg)) < 0)
+	    strcpy (msg, "unknown error");
+	  snprintf (buf, sizeof (buf), "%s at offset %zu",
+		    msg, preg->re_erroffset);
+	  break;
+	}
+      /* fall through */
+    default:
+      strcpy (buf, "invalid regular expression");
+    }
+
+  len = strlen (buf) + 1;
+  if (errbuf_size > 0)
+    {
+      if (len > errbuf_size)
+	{
+	  memcpy (errbuf, buf, errbuf_size - 1);
+	  errbuf[errbuf_size - 1] = 0;
+	}
+      else
+	memcpy (errbuf, buf, len);
+    }
+  return len;
+}
+
+void
+regfree (regex_t *preg)
+{
+  pcre2_code_free (preg->re_pcre);
+  preg->re_pcre = NULL;
+}
+#endif
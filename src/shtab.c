@@ -0,0 +1,347 @@
+/*
+ * Pound - the reverse-proxy load-balancer
+ * Copyright (C) 2024 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Sharded hash table with optional LRU eviction.  See shtab.h for the
+ * description of the interface.
+ */
+#include "pound.h"
+#include "shtab.h"
+#include <openssl/rand.h>
+
+/* Number of shards.  Must be a power of 2. */
+#define SHTAB_SHARDS 16
+/* Initial number of hash buckets per shard of an unbounded table. */
+#define SHTAB_BUCKETS 64
+
+struct shtab_entry
+{
+  DLIST_ENTRY (shtab_entry) lru;   /* LRU list: most recently used first. */
+  struct shtab_entry *hnext;       /* Next entry in hash chain. */
+  unsigned long hash;              /* Hash value of the key. */
+  size_t keylen;                   /* Key length. */
+  union
+  {
+    long double ld;
+    void *ptr;
+    char buf[1];
+  } data;                          /* User data, followed by the key. */
+};
+
+struct shtab_shard
+{
+  pthread_mutex_t mutex;
+  struct shtab_entry **tab;        /* Hash table. */
+  size_t tabsize;                  /* Its size (a power of two). */
+  DLIST_HEAD (,shtab_entry) lru;   /* LRU list of entries. */
+  size_t count;                    /* Number of entries. */
+  unsigned long evicted;           /* Number of evicted entries. */
+  unsigned long counter[SHTAB_MAX_COUNTERS];
+};
+
+struct shtab
+{
+  size_t size;                     /* Max. number of entries per shard,
+				      0 if unbounded. */
+  size_t datasize;                 /* Size of user data. */
+  uint64_t key[2];                 /* Hash key. */
+  struct shtab_shard shard[SHTAB_SHARDS];
+};
+
+/*
+ * SipHash-2-4.  Keys often come from clients (addresses, header values,
+ * URLs).  Hashing them with a secret key prevents clients from choosing
+ * keys that fall into the same shard and bucket, which would evict
+ * entries of other clients and slow down lookups.
+ */
+#define ROTL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+#define SIPROUND					\
+  do							\
+    {							\
+      v0 += v1; v1 = ROTL64 (v1, 13); v1 ^= v0;	\
+      v0 = ROTL64 (v0, 32);				\
+      v2 += v3; v3 = ROTL64 (v3, 16); v3 ^= v2;	\
+      v0 += v3; v3 = ROTL64 (v3, 21); v3 ^= v0;	\
+      v2 += v1; v1 = ROTL64 (v1, 17); v1 ^= v2;	\
+      v2 = ROTL64 (v2, 32);				\
+    }							\
+  while (0)
+
+static uint64_t
+siphash (uint64_t const key[2], void const *data, size_t len)
+{
+  unsigned char const *p = data;
+  uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+  uint64_t m;
+  size_t i;
+
+  for (; len >= 8; len -= 8, p += 8)
+    {
+      for (m = 0, i = 0; i < 8; i++)
+	m |= (uint64_t) p[i] << (8 * i);
+      v3 ^= m;
+      SIPROUND;
+      SIPROUND;
+      v0 ^= m;
+    }
+  /* Last block: remaining bytes and the input length. */
+  m = (uint64_t) (len + (p - (unsigned char const *) data)) << 56;
+  for (i = 0; i < len; i++)
+    m |= (uint64_t) p[i] << (8 * i);
+  v3 ^= m;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= m;
+
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/*
+ * Create a table for at most SIZE entries (0 meaning no limit), each
+ * carrying DATASIZE bytes of user data.
+ */
+SHTAB *
+shtab_new (size_t size, size_t datasize)
+{
+  SHTAB *tab;
+  int i;
+
+  XZALLOC (tab);
+  tab->size = (size + SHTAB_SHARDS - 1) / SHTAB_SHARDS;
+  tab->datasize = datasize;
+  if (RAND_bytes ((unsigned char *) tab->key, sizeof (tab->key)) != 1)
+    {
+      /* Should not happen: fall back to a weak source. */
+      tab->key[0] = ((uint64_t) random () << 32) ^ random ();
+      tab->key[1] = ((uint64_t) random () << 32) ^ random ();
+    }
+  for (i = 0; i < SHTAB_SHARDS; i++)
+    {
+      struct shtab_shard *sh = &tab->shard[i];
+
+      pthread_mutex_init (&sh->mutex, NULL);
+      if (tab->size)
+	for (sh->tabsize = 1; sh->tabsize < tab->size; sh->tabsize <<= 1)
+	  ;
+      else
+	sh->tabsize = SHTAB_BUCKETS;
+      sh->tab = xcalloc (sh->tabsize, sizeof (sh->tab[0]));
+      DLIST_INIT (&sh->lru);
+    }
+  return tab;
+}
+
+static inline char *
+entry_key (SHTAB *tab, struct shtab_entry *ent)
+{
+  return ent->data.buf + tab->datasize;
+}
+
+static struct shtab_entry **
+shard_locate (SHTAB *tab, struct shtab_shard *sh, unsigned long hash,
+	      void const *key, size_t len)
+{
+  struct shtab_entry **pp;
+
+  for (pp = &sh->tab[hash & (sh->tabsize - 1)]; *pp; pp = &(*pp)->hnext)
+    {
+      struct shtab_entry *ent = *pp;
+      if (ent->hash == hash && ent->keylen == len
+	  && memcmp (entry_key (tab, ent), key, len) == 0)
+	break;
+    }
+  return pp;
+}
+
+static void
+shard_remove (SHTAB *tab, struct shtab_shard *sh, struct shtab_entry *ent)
+{
+  struct shtab_entry **pp = shard_locate (tab, sh, ent->hash,
+					  entry_key (tab, ent), ent->keylen);
+  *pp = ent->hnext;
+  DLIST_REMOVE (&sh->lru, ent, lru);
+  sh->count--;
+  free (ent);
+}
+
+/* Double the number of hash buckets in SH. */
+static void
+shard_grow (struct shtab_shard *sh)
+{
+  size_t newsize = sh->tabsize * 2, i;
+  struct shtab_entry **newtab = calloc (newsize, sizeof (newtab[0]));
+
+  if (!newtab)
+    return;
+  for (i = 0; i < sh->tabsize; i++)
+    {
+      struct shtab_entry *ent, *next;
+      for (ent = sh->tab[i]; ent; ent = next)
+	{
+	  next = ent->hnext;
+	  ent->hnext = newtab[ent->hash & (newsize - 1)];
+	  newtab[ent->hash & (newsize - 1)] = ent;
+	}
+    }
+  free (sh->tab);
+  sh->tab = newtab;
+  sh->tabsize = newsize;
+}
+
+/*
+ * Look up KEY of length LEN.  Lock the shard it belongs to and fill in
+ * the cursor CUR.  If the key is found, mark its entry as the most
+ * recently used one and return a pointer to its data.  Otherwise, return
+ * NULL.
+ */
+void *
+shtab_lookup (SHTAB *tab, void const *key, size_t len,
+	      struct shtab_cursor *cur)
+{
+  unsigned long hash = siphash (tab->key, key, len);
+  /* High bits select the shard, low bits the hash bucket. */
+  struct shtab_shard *sh = &tab->shard[(hash >> 24) & (SHTAB_SHARDS - 1)];
+  struct shtab_entry *ent;
+
+  cur->shard = sh;
+  cur->hash = hash;
+  cur->key = key;
+  cur->keylen = len;
+
+  pthread_mutex_lock (&sh->mutex);
+  if ((ent = *shard_locate (tab, sh, hash, key, len)) != NULL)
+    {
+      DLIST_REMOVE (&sh->lru, ent, lru);
+      DLIST_INSERT_HEAD (&sh->lru, ent, lru);
+    }
+  cur->ent = ent;
+  return ent ? ent->data.buf : NULL;
+}
+
+/*
+ * Add an entry for the key CUR was looked up for, which must not exist.
+ * Evict the least recently used entry, if the shard is full.  Return a
+ * pointer to the (zeroed) data of the new entry, or NULL if out of memory.
+ */
+void *
+shtab_insert (SHTAB *tab, struct shtab_cursor *cur)
+{
+  struct shtab_shard *sh = cur->shard;
+  struct shtab_entry *ent;
+  size_t i;
+
+  if (tab->size && sh->count >= tab->size)
+    {
+      shard_remove (tab, sh, DLIST_LAST (&sh->lru));
+      sh->evicted++;
+    }
+  if ((ent = calloc (1, offsetof (struct shtab_entry, data)
+		     + tab->datasize + cur->keylen)) == NULL)
+    {
+      lognomem ();
+      return NULL;
+    }
+  ent->hash = cur->hash;
+  ent->keylen = cur->keylen;
+  memcpy (entry_key (tab, ent), cur->key, cur->keylen);
+  i = ent->hash & (sh->tabsize - 1);
+  ent->hnext = sh->tab[i];
+  sh->tab[i] = ent;
+  DLIST_INSERT_HEAD (&sh->lru, ent, lru);
+  if (++sh->count > sh->tabsize)
+    shard_grow (sh);
+  cur->ent = ent;
+  return ent->data.buf;
+}
+
+/* Remove the entry found or created using CUR. */
+void
+shtab_remove (SHTAB *tab, struct shtab_cursor *cur)
+{
+  if (cur->ent)
+    {
+      shard_remove (tab, cur->shard, cur->ent);
+      cur->ent = NULL;
+    }
+}
+
+/* Unlock the shard locked by shtab_lookup. */
+void
+shtab_unlock (struct shtab_cursor *cur)
+{
+  pthread_mutex_unlock (&cur->shard->mutex);
+}
+
+/* Add DELTA to the Nth user counter of the shard locked by CUR. */
+void
+shtab_count (struct shtab_cursor *cur, int n, long delta)
+{
+  cur->shard->counter[n] += delta;
+}
+
+/* Remove all entries from TAB. */
+void
+shtab_flush (SHTAB *tab)
+{
+  int i;
+
+  for (i = 0; i < SHTAB_SHARDS; i++)
+    {
+      struct shtab_shard *sh = &tab->shard[i];
+      struct shtab_entry *ent;
+
+      pthread_mutex_lock (&sh->mutex);
+      while ((ent = DLIST_FIRST (&sh->lru)) != NULL)
+	{
+	  DLIST_REMOVE (&sh->lru, ent, lru);
+	  free (ent);
+	}
+      memset (sh->tab, 0, sh->tabsize * sizeof (sh->tab[0]));
+      sh->count = 0;
+      pthread_mutex_unlock (&sh->mutex);
+    }
+}
+
+void
+shtab_get_stats (SHTAB *tab, struct shtab_stats *st)
+{
+  int i, j;
+
+  memset (st, 0, sizeof (*st));
+  st->size = tab->size * SHTAB_SHARDS;
+  for (i = 0; i < SHTAB_SHARDS; i++)
+    {
+      struct shtab_shard *sh = &tab->shard[i];
+
+      pthread_mutex_lock (&sh->mutex);
+      st->entries += sh->count;
+      st->evicted += sh->evicted;
+      for (j = 0; j < SHTAB_MAX_COUNTERS; j++)
+	st->counter[j] += sh->counter[j];
+      pthread_mutex_unlock (&sh->mutex);
+    }
+}
@@ -0,0 +1,83 @@
+/* This file is part of pound
+ * Copyright (C) 2024 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef POUND_SHTAB_H
+# define POUND_SHTAB_H
+
+#include <stddef.h>
+
+/*
+ * Sharded hash table with optional LRU eviction.
+ *
+ * Entries are identified by arbitrary byte strings (keys) and carry a
+ * fixed-size block of user data.  The table is split into shards, each
+ * protected by its own mutex.  If the table is bounded, the least
+ * recently used entry of a shard is evicted when a new one is added to
+ * a full shard.  Keys are hashed with a random key chosen for each
+ * table, so that clients can't predict which shard an entry goes to.
+ *
+ * Entries are accessed via a cursor:
+ *
+ *   struct shtab_cursor cur;
+ *   struct my_data *p;
+ *
+ *   if ((p = shtab_lookup (tab, key, len, &cur)) == NULL)
+ *     p = shtab_insert (tab, &cur);
+ *   if (p)
+ *     ... use p ...
+ *   shtab_unlock (&cur);
+ *
+ * shtab_lookup locks the shard the key belongs to; it stays locked until
+ * shtab_unlock.  The data pointer is valid only while the shard is
+ * locked.
+ *
+ * Each shard also keeps a small set of user counters, which can be
+ * modified while the shard is locked and are summed by shtab_get_stats.
+ */
+
+/* Maximum number of user counters. */
+#define SHTAB_MAX_COUNTERS 4
+
+typedef struct shtab SHTAB;
+
+struct shtab_cursor
+{
+  struct shtab_shard *shard;       /* Locked shard. */
+  struct shtab_entry *ent;         /* Entry found, or NULL. */
+  unsigned long hash;              /* Hash value of the key. */
+  void const *key;                 /* Key and its length. */
+  size_t keylen;
+};
+
+struct shtab_stats
+{
+  size_t size;                     /* Max. number of entries (0 if unbounded). */
+  size_t entries;                  /* Number of entries. */
+  unsigned long evicted;           /* Number of evicted entries. */
+  unsigned long counter[SHTAB_MAX_COUNTERS]; /* User counters. */
+};
+
+SHTAB *shtab_new (size_t size, size_t datasize);
+void *shtab_lookup (SHTAB *tab, void const *key, size_t len,
+		    struct shtab_cursor *cur);
+void *shtab_insert (SHTAB *tab, struct shtab_cursor *cur);
+void shtab_remove (SHTAB *tab, struct shtab_cursor *cur);
+void shtab_unlock (struct shtab_cursor *cur);
+void shtab_count (struct shtab_cursor *cur, int n, long delta);
+void shtab_flush (SHTAB *tab);
+void shtab_get_stats (SHTAB *tab, struct shtab_stats *st);
+
+#endif
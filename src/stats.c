@@ -0,0 +1,564 @@
+/*
+ * Pound - the reverse-proxy load-balancer
+ * Copyright (C) 2024 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Request statistics.
+ *
+ * Statistics of each service and backend are kept in a set of counter
+ * blocks, one per worker thread.  Each worker is assigned a slot number
+ * when it records its first request, and updates only the block in its
+ * slot, so that recording a request never takes a lock and threads
+ * don't contend for the same cache lines.  Blocks are allocated on
+ * first use.  If there are more threads than slots, the excess ones
+ * share slot 0.  Counters are updated using relaxed atomic operations,
+ * which makes it safe both to share a slot and to read the blocks
+ * concurrently.  Readers sum up all blocks.
+ *
+ * Response times are collected in log-linear (HDR-style) histograms:
+ * each power of two microseconds is split into STATS_HIST_SUB equal
+ * buckets, which gives the relative error of at most 1/STATS_HIST_SUB
+ * over the whole range, from 1 microsecond to 71 minutes.
+ *
+ * Times of the request processing phases (see phase_time) are kept
+ * for services only, in coarser histograms with one bucket per power of
+ * two microseconds.
+ */
+#include "pound.h"
+#include "extern.h"
+#include "json.h"
+
+struct stats
+{
+  struct stats_block **slot;       /* Per-thread counter blocks. */
+};
+
+/* Number of slots. */
+static unsigned stats_nslots;
+/* Slot usage map. */
+static unsigned char *stats_slot_used;
+static pthread_mutex_t stats_slot_mutex = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * Slot of the current thread, plus 1 (so that 0 means not yet
+ * assigned).
+ */
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+static void
+stats_slot_release (void *ptr)
+{
+  unsigned n = (uintptr_t) ptr - 1;
+
+  if (n > 0)
+    {
+      pthread_mutex_lock (&stats_slot_mutex);
+      stats_slot_used[n] = 0;
+      pthread_mutex_unlock (&stats_slot_mutex);
+    }
+}
+
+static void
+stats_key_create (void)
+{
+  pthread_key_create (&stats_key, stats_slot_release);
+}
+
+/* Return the slot number of the calling thread. */
+static unsigned
+stats_slot (void)
+{
+  uintptr_t n;
+
+  pthread_once (&stats_key_once, stats_key_create);
+  if ((n = (uintptr_t) pthread_getspecific (stats_key)) == 0)
+    {
+      pthread_mutex_lock (&stats_slot_mutex);
+      for (n = 1; n < stats_nslots; n++)
+	if (!stats_slot_used[n])
+	  {
+	    stats_slot_used[n] = 1;
+	    break;
+	  }
+      if (n == stats_nslots)
+	n = 0;
+      pthread_mutex_unlock (&stats_slot_mutex);
+      n++;
+      pthread_setspecific (stats_key, (void*) n);
+    }
+  return n - 1;
+}
+
+STATS *
+stats_new (void)
+{
+  STATS *st;
+
+  if (stats_nslots == 0)
+    {
+      /* Slot 0 is shared by threads that didn't get a slot of their own. */
+      stats_nslots = worker_max_count + 1;
+      stats_slot_used = xcalloc (stats_nslots, 1);
+    }
+  XZALLOC (st);
+  st->slot = xcalloc (stats_nslots, sizeof (st->slot[0]));
+  return st;
+}
+
+static int
+service_stats_init (SERVICE *svc, void *data)
+{
+  BACKEND *be;
+
+  svc->stats = stats_new ();
+  SLIST_FOREACH (be, &svc->backends, next)
+    be->stats = stats_new ();
+  if (svc->emergency)
+    svc->emergency->stats = stats_new ();
+  return 0;
+}
+
+/* Allocate statistics for all services and backends. */
+void
+stats_init (void)
+{
+  foreach_service (service_stats_init, NULL);
+}
+
+/* Return the counter block of ST for the calling thread. */
+static struct stats_block *
+stats_block_get (STATS *st)
+{
+  struct stats_block **slot = &st->slot[stats_slot ()];
+  struct stats_block *b, *cur = NULL;
+
+  if ((b = __atomic_load_n (slot, __ATOMIC_ACQUIRE)) == NULL)
+    {
+      if ((b = calloc (1, sizeof (*b))) == NULL)
+	{
+	  lognomem ();
+	  return NULL;
+	}
+      /* Slot 0 can be shared, so another thread may have been faster. */
+      if (!__atomic_compare_exchange_n (slot, &cur, b, 0,
+					__ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+	{
+	  free (b);
+	  b = cur;
+	}
+    }
+  return b;
+}
+
+/* Return the index of the histogram bucket for the value V. */
+static inline int
+stats_hist_index (unsigned long long v)
+{
+  int n;
+
+  if (v < STATS_HIST_SUB)
+    return v;
+  if (v > 0xffffffffULL)
+    v = 0xffffffffULL;
+  n = 31 - __builtin_clz ((unsigned) v) - STATS_HIST_SUB_BITS;
+  return ((n + 1) << STATS_HIST_SUB_BITS) + ((v >> n) & (STATS_HIST_SUB - 1));
+}
+
+/* Return the upper bound (exclusive) of the histogram bucket I. */
+unsigned long long
+stats_hist_bound (int i)
+{
+  int n;
+
+  if (i < STATS_HIST_SUB)
+    return i + 1;
+  n = (i >> STATS_HIST_SUB_BITS) - 1;
+  return ((unsigned long long) (STATS_HIST_SUB + (i & (STATS_HIST_SUB - 1)) + 1))
+	  << n;
+}
+
+/* Add the time interval TS to the histogram H. */
+void
+stats_hist_add (struct stats_hist *h, struct timespec const *ts)
+{
+  unsigned long long us;
+
+  if (ts->tv_sec < 0)
+    us = 0;
+  else
+    us = (unsigned long long) ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+  __atomic_fetch_add (&h->count[stats_hist_index (us)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&h->sum, us, __ATOMIC_RELAXED);
+}
+
+/*
+ * Record a request in ST.  STATUS is the HTTP response status (0 if
+ * no response was sent), BYTES_IN and BYTES_OUT are the numbers of
+ * request and response body bytes, and LATENCY is the time it took to
+ * process the request.
+ */
+void
+stats_record (STATS *st, int status,
+	      CONTENT_LENGTH bytes_in, CONTENT_LENGTH bytes_out,
+	      struct timespec const *latency)
+{
+  struct stats_block *b;
+  int n;
+
+  if (!st || (b = stats_block_get (st)) == NULL)
+    return;
+  n = status / 100 - 1;
+  if (n >= 0 && n < STATS_CLASSES)
+    __atomic_fetch_add (&b->responses[n], 1, __ATOMIC_RELAXED);
+  if (bytes_in > 0)
+    __atomic_fetch_add (&b->bytes_in, bytes_in, __ATOMIC_RELAXED);
+  if (bytes_out > 0)
+    __atomic_fetch_add (&b->bytes_out, bytes_out, __ATOMIC_RELAXED);
+  stats_hist_add (&b->latency, latency);
+}
+
+/*
+ * Record the times of the processing phases of the request PHTTP in
+ * ST.
+ */
+void
+stats_record_phases (STATS *st, POUND_HTTP const *phttp)
+{
+  struct stats_block *b;
+  int i;
+
+  if (!st || (b = stats_block_get (st)) == NULL)
+    return;
+  for (i = 0; i < PHASE_MAX; i++)
+    {
+      struct timespec ts;
+      unsigned long long us;
+      int k;
+
+      if (phase_time (phttp, i, &ts))
+	continue;
+      if (ts.tv_sec < 0)
+	us = 0;
+      else
+	us = (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+      if (us == 0)
+	k = 0;
+      else if (us > 0xffffffffULL)
+	k = STATS_PHASE_BUCKETS - 1;
+      else
+	k = 32 - __builtin_clz ((unsigned) us);
+      __atomic_fetch_add (&b->phase[i].count[k], 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add (&b->phase[i].sum, us, __ATOMIC_RELAXED);
+    }
+}
+
+static void
+stats_hist_sum (struct stats_hist *dst, struct stats_hist *src)
+{
+  int i;
+
+  for (i = 0; i < STATS_HIST_BUCKETS; i++)
+    dst->count[i] += __atomic_load_n (&src->count[i], __ATOMIC_RELAXED);
+  dst->sum += __atomic_load_n (&src->sum, __ATOMIC_RELAXED);
+}
+
+/* Sum up the counter blocks of ST into RES. */
+void
+stats_get (STATS *st, struct stats_block *res)
+{
+  unsigned i;
+  int j;
+
+  memset (res, 0, sizeof (*res));
+  for (i = 0; i < stats_nslots; i++)
+    {
+      struct stats_block *b = __atomic_load_n (&st->slot[i], __ATOMIC_ACQUIRE);
+      if (!b)
+	continue;
+      for (j = 0; j < STATS_CLASSES; j++)
+	res->responses[j] += __atomic_load_n (&b->responses[j],
+					      __ATOMIC_RELAXED);
+      res->bytes_in += __atomic_load_n (&b->bytes_in, __ATOMIC_RELAXED);
+      res->bytes_out += __atomic_load_n (&b->bytes_out, __ATOMIC_RELAXED);
+      stats_hist_sum (&res->latency, &b->latency);
+      for (j = 0; j < PHASE_MAX; j++)
+	{
+	  int k;
+
+	  for (k = 0; k < STATS_PHASE_BUCKETS; k++)
+	    res->phase[j].count[k] +=
+	      __atomic_load_n (&b->phase[j].count[k], __ATOMIC_RELAXED);
+	  res->phase[j].sum += __atomic_load_n (&b->phase[j].sum,
+						__ATOMIC_RELAXED);
+	}
+    }
+}
+
+/* Return the number of samples in H. */
+unsigned long
+stats_hist_count (struct stats_hist const *h)
+{
+  unsigned long n = 0;
+  int i;
+
+  for (i = 0; i < STATS_HIST_BUCKETS; i++)
+    n += h->count[i];
+  return n;
+}
+
+/*
+ * Return the number of samples in H less than 2^K microseconds
+ * (0 <= K <= 32).
+ */
+unsigned long
+stats_hist_count_below (struct stats_hist const *h, int k)
+{
+  int i, n = stats_hist_index (1ULL << k);
+  unsigned long c = 0;
+
+  if (k == 32)
+    n = STATS_HIST_BUCKETS;
+  for (i = 0; i < n; i++)
+    c += h->count[i];
+  return c;
+}
+
+/*
+ * Return the number of phase times in P less than 2^K microseconds
+ * (0 <= K <= 32).  K = 33 gives the total number of samples.
+ */
+unsigned long
+stats_phase_count_below (struct stats_phase const *p, int k)
+{
+  unsigned long c = 0;
+  int i;
+
+  for (i = 0; i <= k && i < STATS_PHASE_BUCKETS; i++)
+    c += p->count[i];
+  return c;
+}
+
+/*
+ * Return the Q-th quantile (0 < Q <= 1) of the values in H, in
+ * microseconds.  The upper bound of the bucket where it falls is
+ * returned.
+ */
+unsigned long long
+stats_hist_quantile (struct stats_hist const *h, double q)
+{
+  unsigned long total = stats_hist_count (h), n, c = 0;
+  int i;
+
+  if (total == 0)
+    return 0;
+  n = (unsigned long) (q * total + 0.5);
+  if (n == 0)
+    n = 1;
+  for (i = 0; i < STATS_HIST_BUCKETS; i++)
+    if ((c += h->count[i]) >= n)
+      break;
+  return stats_hist_bound (i);
+}
+
+static double
+nabs (double a)
+{
+  return (a < 0) ? -a : a;
+}
+
+static double
+nsqrt (double a, double prec)
+{
+  double x0, x1;
+
+  if (a < 0)
+    return 0;
+  if (a < prec)
+    return 0;
+  x1 = a / 2;
+  do
+    {
+      x0 = x1;
+      x1 = (x0 + a / x0) / 2;
+    }
+  while (nabs (x1 - x0) > prec);
+
+  return x1;
+}
+
+/*
+ * Return the standard deviation of the values in H, in microseconds,
+ * approximating each value by the midpoint of its bucket.
+ */
+double
+stats_hist_stddev (struct stats_hist const *h, unsigned long total)
+{
+  double mean = (double) h->sum / total, var = 0;
+  unsigned long long lo = 0;
+  int i;
+
+  for (i = 0; i < STATS_HIST_BUCKETS; i++)
+    {
+      unsigned long long hi = stats_hist_bound (i);
+      if (h->count[i])
+	{
+	  double d = (lo + hi - 1) / 2.0 - mean;
+	  var += h->count[i] * d * d;
+	}
+      lo = hi;
+    }
+  return nsqrt (var / total, 0.5);
+}
+
+/* Convert microseconds to nanoseconds. */
+#define US2NS(n) ((double) (n) * 1000)
+
+static struct json_value *
+stats_hist_serialize (struct stats_hist const *h)
+{
+  struct json_value *arr;
+  int k;
+
+  if ((arr = json_new_array ()) == NULL)
+    return NULL;
+  for (k = 0; k <= 32; k++)
+    {
+      struct json_value *obj = json_new_object ();
+      if (!obj
+	  || json_object_set (obj, "le",
+			      json_new_number (US2NS (1ULL << k)))
+	  || json_object_set (obj, "count",
+			      json_new_number (stats_hist_count_below (h, k)))
+	  || json_array_append (arr, obj))
+	{
+	  json_value_free (obj);
+	  json_value_free (arr);
+	  return NULL;
+	}
+    }
+  return arr;
+}
+
+static char const *stats_class_str[STATS_CLASSES] = {
+  "1xx", "2xx", "3xx", "4xx", "5xx"
+};
+
+static struct json_value *
+stats_responses_serialize (struct stats_block const *b)
+{
+  struct json_value *obj;
+  int i;
+
+  if ((obj = json_new_object ()) != NULL)
+    {
+      for (i = 0; i < STATS_CLASSES; i++)
+	if (json_object_set (obj, stats_class_str[i],
+			     json_new_number (b->responses[i])))
+	  {
+	    json_value_free (obj);
+	    return NULL;
+	  }
+    }
+  return obj;
+}
+
+/*
+ * Serialize the phase times from B as an object keyed by phase name.
+ * Phases that were never recorded are omitted.
+ */
+static struct json_value *
+stats_phases_serialize (struct stats_block const *b)
+{
+  struct json_value *obj;
+  int i;
+
+  if ((obj = json_new_object ()) == NULL)
+    return NULL;
+  for (i = 0; i < PHASE_MAX; i++)
+    {
+      unsigned long count = stats_phase_count_below (&b->phase[i],
+						     STATS_PHASE_BUCKETS - 1);
+      struct json_value *pobj;
+
+      if (count == 0)
+	continue;
+      if ((pobj = json_new_object ()) == NULL
+	  || json_object_set (pobj, "count", json_new_number (count))
+	  || json_object_set (pobj, "sum",
+			      json_new_number (US2NS (b->phase[i].sum)))
+	  || json_object_set (pobj, "avg",
+			      json_new_number (US2NS (b->phase[i].sum) / count))
+	  || json_object_set (obj, phase_name (i), pobj))
+	{
+	  json_value_free (pobj);
+	  json_value_free (obj);
+	  return NULL;
+	}
+    }
+  return obj;
+}
+
+/*
+ * Serialize statistics ST.  Times are given in nanoseconds.
+ */
+struct json_value *
+stats_serialize (STATS *st)
+{
+  struct stats_block *b;
+  struct json_value *obj;
+  unsigned long count;
+  int err = 0;
+
+  if ((b = malloc (sizeof (*b))) == NULL)
+    {
+      lognomem ();
+      return NULL;
+    }
+  stats_get (st, b);
+  count = stats_hist_count (&b->latency);
+
+  if ((obj = json_new_object ()) != NULL)
+    {
+      err = json_object_set (obj, "request_count", json_new_number (count))
+	|| json_object_set (obj, "responses", stats_responses_serialize (b))
+	|| json_object_set (obj, "bytes_in", json_new_number (b->bytes_in))
+	|| json_object_set (obj, "bytes_out", json_new_number (b->bytes_out))
+	|| json_object_set (obj, "request_time_sum",
+			    json_new_number (US2NS (b->latency.sum)))
+	|| json_object_set (obj, "request_time_histogram",
+			    stats_hist_serialize (&b->latency))
+	|| json_object_set (obj, "phase_time", stats_phases_serialize (b));
+      if (!err && count > 0)
+	err = json_object_set (obj, "request_time_avg",
+			       json_new_number (US2NS (b->latency.sum) / count))
+	  || json_object_set (obj, "request_time_stddev",
+			      json_new_number (US2NS (stats_hist_stddev (&b->latency, count))))
+	  || json_object_set (obj, "request_time_p50",
+			      json_new_number (US2NS (stats_hist_quantile (&b->latency, 0.5))))
+	  || json_object_set (obj, "request_time_p90",
+			      json_new_number (US2NS (stats_hist_quantile (&b->latency, 0.9))))
+	  || json_object_set (obj, "request_time_p99",
+			      json_new_number (US2NS (stats_hist_quantile (&b->latency, 0.99))));
+    }
+  free (b);
+  if (err)
+    {
+      json_value_free (obj);
+      obj = NULL;
+    }
+  return obj;
+}
@@ -338,41 +338,6 @@ str_be (char *buf, size_t size, BACKEND *be)
   return buf;
 }
 
-static int
-match_service (SERVICE *svc, POUND_HTTP *phttp)
-{
-  return match_cond (&svc->cond, phttp, &phttp->request);
-}
-
-/*
- * Find the right service for a request
- */
-SERVICE *
-get_service (POUND_HTTP *phttp)
-{
-  SERVICE *svc;
-
-  SLIST_FOREACH (svc, &phttp->lstn->services, next)
-    {
-      if (svc->disabled)
-	continue;
-      if (match_service (svc, phttp))
-	return svc;
-    }
-
-  /* try global services */
-  SLIST_FOREACH (svc, &services, next)
-    {
-      if (svc->disabled)
-	continue;
-      if (match_service (svc, phttp))
-	return svc;
-    }
-
-  /* nothing matched */
-  return NULL;
-}
-
 /*
  * Calculate a uniformly distributed random number less than max.
  * avoiding "modulo bias".
@@ -1540,6 +1505,24 @@ job_rearm (struct timespec *ts, void (*func) (void *), void *data)
   pthread_mutex_unlock (&job_mutex);
 }
 
+/*
+ * Job functions are called with the job queue locked.  A function that
+ * needs to perform lengthy I/O can use these to release the queue while
+ * doing so.  The calling job is already removed from the queue at that
+ * point.
+ */
+void
+job_unlock (void)
+{
+  pthread_mutex_unlock (&job_mutex);
+}
+
+void
+job_lock (void)
+{
+  pthread_mutex_lock (&job_mutex);
+}
+
 static void
 timer_cleanup (void *ptr)
 {
@@ -1728,52 +1711,19 @@ addrinfo_serialize (struct addrinfo *addr)
   return json_new_string (buf);
 }
 
-static double
-nabs (double a)
-{
-  return (a < 0) ? -a : a;
-}
-
-double
-nsqrt (double a, double prec)
-{
-  double x0, x1;
-
-  if (a < 0)
-    return 0;
-  if (a < prec)
-    return 0;
-  x1 = a / 2;
-  do
-    {
-      x0 = x1;
-      x1 = (x0 + a / x0) / 2;
-    }
-  while (nabs (x1 - x0) > prec);
-
-  return x1;
-}
-
 static struct json_value *
 backend_stats_serialize (BACKEND *be)
 {
   struct json_value *obj;
 
-  if ((obj = json_new_object ()) != NULL)
+  if ((obj = stats_serialize (be->stats)) != NULL)
     {
-      int err = 0;
-
-      pthread_mutex_lock (&be->mut);
-      err |= json_object_set (obj, "request_count", json_new_number (be->numreq))
-            || json_object_set (obj, "session_count", json_new_number (be->session_count));
-      if (be->numreq > 0)
+      if (json_object_set (obj, "session_count",
+			   json_new_number (be->session_count)))
 	{
-	  err |= json_object_set (obj, "request_time_avg",
-				  json_new_number (be->avgtime))
-	    || json_object_set (obj, "request_time_stddev",
-				json_new_number (nsqrt (be->avgsqtime - be->avgtime * be->avgtime, 0.5)));
+	  json_value_free (obj);
+	  obj = NULL;
 	}
-      pthread_mutex_unlock (&be->mut);
     }
   return obj;
 }
@@ -1835,7 +1785,7 @@ backend_serialize (BACKEND *be)
 				      be->v.error.text ? json_new_string (be->v.error.text) : json_new_null ());
 		break;
 	      }
-	  if (enable_backend_stats)
+	  if (be->stats)
 	    err |= json_object_set (obj, "stats", backend_stats_serialize (be));
 	}
     }
@@ -1892,7 +1842,15 @@ service_serialize (SERVICE *svc)
 	  || json_object_set (obj, "session_type", json_new_string (typename ? typename : "UNKNOWN"))
 	  || json_object_set (obj, "sessions", service_session_serialize (svc))
 	  || json_object_set (obj, "backends", backends_serialize (&svc->backends))
-	  || json_object_set (obj, "emergency", backend_serialize (svc->emergency)))
+	  || json_object_set (obj, "emergency", backend_serialize (svc->emergency))
+	  || (svc->rate_limit
+	      && json_object_set (obj, "rate_limit",
+				  rate_limit_serialize (svc->rate_limit)))
+	  || (svc->conc_limit
+	      && json_object_set (obj, "concurrency_limit",
+				  conc_limit_serialize (svc->conc_limit)))
+	  || (svc->stats
+	      && json_object_set (obj, "stats", stats_serialize (svc->stats))))
 	{
 	  json_value_free (obj);
 	  obj = NULL;
@@ -1903,6 +1861,38 @@ service_serialize (SERVICE *svc)
   return obj;
 }
 
+static struct json_value *
+client_timeouts_serialize (LISTENER *lstn)
+{
+  struct json_value *obj;
+  int err = 0;
+
+  obj = json_new_object ();
+  if (obj)
+    {
+      pthread_mutex_lock (&lstn->tmo_mutex);
+      err = json_object_set (obj, "header_timeout",
+			     json_new_integer (lstn->header_to))
+	|| json_object_set (obj, "body_min_rate",
+			    json_new_integer (lstn->body_min_rate))
+	|| json_object_set (obj, "keepalive_timeout",
+			    json_new_integer (lstn->keepalive_to))
+	|| json_object_set (obj, "header",
+			    json_new_number (lstn->tmo_count[CLIENT_TMO_HEADER]))
+	|| json_object_set (obj, "body_rate",
+			    json_new_number (lstn->tmo_count[CLIENT_TMO_BODY_RATE]))
+	|| json_object_set (obj, "keepalive",
+			    json_new_number (lstn->tmo_count[CLIENT_TMO_KEEPALIVE]));
+      pthread_mutex_unlock (&lstn->tmo_mutex);
+    }
+  if (err)
+    {
+      json_value_free (obj);
+      obj = NULL;
+    }
+  return obj;
+}
+
 static struct json_value *
 listener_serialize (LISTENER *lstn)
 {
@@ -1924,6 +1914,21 @@ listener_serialize (LISTENER *lstn)
       if (is_https)
 	err |= json_object_set (obj, "nohttps11", json_new_integer (lstn->noHTTPS11));
       err |= json_object_set (obj, "enabled", json_new_bool (!lstn->disabled));
+      if (lstn->route_cache)
+	err |= json_object_set (obj, "route_cache",
+				route_cache_serialize (lstn->route_cache));
+      if (lstn->rate_limit)
+	err |= json_object_set (obj, "rate_limit",
+				rate_limit_serialize (lstn->rate_limit));
+      if (lstn->conn_table)
+	err |= json_object_set (obj, "conn_limit",
+				conn_limit_serialize (lstn->conn_table));
+      if (lstn->header_to || lstn->body_min_rate || lstn->keepalive_to)
+	err |= json_object_set (obj, "client_timeouts",
+				client_timeouts_serialize (lstn));
+      if (lstn->log_file)
+	err |= json_object_set (obj, "log_file",
+				log_file_serialize (lstn->log_file));
 
       if ((p = json_new_array ()) == NULL)
 	err = 1;
@@ -1966,7 +1971,16 @@ pound_core_serialize (void)
 	|| json_object_set (obj, "pid", json_new_integer (getpid ()))
 	|| json_object_set (obj, "timestamp", timespec_serialize (&ts))
 	|| json_object_set (obj, "queue_len", json_new_integer (get_thr_qlen ()))
-	|| json_object_set (obj, "workers", workers_serialize ());
+	|| json_object_set (obj, "workers", workers_serialize ())
+	|| json_object_set (obj, "worker_queue", worker_queue_serialize ())
+	|| json_object_set (obj, "tls_handshake", tls_handshake_serialize ())
+	|| json_object_set (obj, "early_data", early_data_serialize ())
+	|| json_object_set (obj, "basic_auth_cache",
+			    basic_auth_cache_serialize ())
+	|| (log_queue_size
+	    && json_object_set (obj, "log_queue", log_queue_serialize ()))
+	|| (trace_conf.enabled
+	    && json_object_set (obj, "trace", trace_serialize ()));
       if (err)
 	{
 	  json_value_free (obj);
@@ -2416,6 +2430,7 @@ disable_handler (BIO *c, OBJECT *obj, char const *url, void *data)
 
     case OBJ_SERVICE:
       obj->svc->disabled = *dis;
+      route_cache_invalidate ();
       break;
 
     case OBJ_LISTENER:
@@ -2569,6 +2584,56 @@ control_add_session (BIO *c, char const *url)
   return HTTP_STATUS_NOT_FOUND;
 }
 
+static int
+reload_certs_handler (BIO *c, OBJECT *obj, char const *url, void *data)
+{
+  int rc;
+  struct json_value *val;
+
+  if (*url && *url != '?')
+    return HTTP_STATUS_NOT_FOUND;
+
+  if (obj->type != OBJ_LISTENER || obj->lstn == NULL
+      || SLIST_EMPTY (&obj->lstn->cert_sources))
+    return HTTP_STATUS_BAD_REQUEST;
+
+  if ((val = json_new_bool (listener_reload_certs (obj->lstn) == 0)) == NULL)
+    rc = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+  else
+    {
+      rc = send_json_reply (c, val, url);
+      json_value_free (val);
+    }
+  return rc;
+}
+
+static int
+control_reload_certs (BIO *c, char const *url)
+{
+  if (*url == '/')
+    return ctl_listener (reload_certs_handler, NULL, c, url);
+  return HTTP_STATUS_NOT_FOUND;
+}
+
+static int
+control_reopen_logs (BIO *c, char const *url)
+{
+  int rc;
+  struct json_value *val;
+
+  if (*url && *url != '?')
+    return HTTP_STATUS_NOT_FOUND;
+
+  if ((val = json_new_bool (log_file_reopen_all () == 0)) == NULL)
+    rc = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+  else
+    {
+      rc = send_json_reply (c, val, url);
+      json_value_free (val);
+    }
+  return rc;
+}
+
 struct endpoint
 {
   char *uri;
@@ -2589,6 +2654,8 @@ static struct endpoint control_endpoint[] = {
   { S("/service"), METH_PUT, control_enable_service },
   { S("/session"), METH_DELETE, control_delete_session },
   { S("/session"), METH_PUT, control_add_session },
+  { S("/certs"), METH_POST, control_reload_certs },
+  { S("/logs"), METH_POST, control_reopen_logs },
 #undef S
   { NULL }
 };
@@ -0,0 +1,968 @@
+/*
+ * Pound - the reverse-proxy load-balancer
+ * Copyright (C) 2024 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Distributed tracing.
+ *
+ * The trace context of each request is taken from its "traceparent"
+ * header (W3C Trace Context).  If there is no valid one, a new trace is
+ * started.  Incoming requests that carry a context follow the sampling
+ * decision of the caller; new traces are sampled at the configured rate,
+ * deciding on the random bits of the trace ID, so that the decision is
+ * consistent across all pounds seeing the trace.
+ *
+ * Each request gets a server span.  A request passed to a backend also
+ * gets a client span, a child of the server one, whose ID is sent to the
+ * backend as the parent ID in the "traceparent" header.  The
+ * "tracestate" header is passed unchanged.
+ *
+ * When a sampled request is finished, its data are copied to a span
+ * record, which is appended to the export queue.  No formatting or I/O
+ * is done by the worker: a dedicated exporter thread formats the
+ * records as OTLP/JSON (one ExportTraceServiceRequest per line) and
+ * writes them to a file, or sends them to a datagram socket, one
+ * request per datagram.  If the queue is full, the record is dropped.
+ */
+#include "pound.h"
+#include "extern.h"
+#include "json.h"
+#include <openssl/rand.h>
+
+TRACE_CONF trace_conf;
+
+/* OpenTelemetry span kinds. */
+enum
+  {
+    SPAN_KIND_SERVER = 2,
+    SPAN_KIND_CLIENT = 3
+  };
+
+/* OpenTelemetry status code for failed spans. */
+#define STATUS_CODE_ERROR 2
+
+/* Names of span events, by the corresponding request phase. */
+static char const *trace_event_name[PHASE_MAX] = {
+  [PHASE_ACCEPT] = "accept",
+  [PHASE_HANDSHAKE] = "handshake",
+  [PHASE_DEQUEUE] = "dequeue",
+  [PHASE_HEADERS] = "headers",
+  [PHASE_SERVICE] = "service",
+  [PHASE_CONNECT] = "connect",
+  [PHASE_SENT] = "sent",
+  [PHASE_FIRST_BYTE] = "first_byte",
+  [PHASE_LAST_BYTE] = "last_byte"
+};
+
+/* String attributes of a span record. */
+enum
+  {
+    TRACE_ATTR_METHOD,
+    TRACE_ATTR_PATH,
+    TRACE_ATTR_HOST,
+    TRACE_ATTR_CLIENT,
+    TRACE_ATTR_LISTENER,
+    TRACE_ATTR_SERVICE,
+    TRACE_ATTR_BACKEND,
+    TRACE_ATTR_TRACESTATE,
+    TRACE_ATTR_MAX
+  };
+
+/* Attribute keys (semantic conventions where applicable). */
+static char const *trace_attr_key[TRACE_ATTR_MAX] = {
+  [TRACE_ATTR_METHOD] = "http.request.method",
+  [TRACE_ATTR_PATH] = "url.path",
+  [TRACE_ATTR_HOST] = "server.address",
+  [TRACE_ATTR_CLIENT] = "client.address",
+  [TRACE_ATTR_LISTENER] = "pound.listener",
+  [TRACE_ATTR_SERVICE] = "pound.service",
+  [TRACE_ATTR_BACKEND] = "server.address",
+  [TRACE_ATTR_TRACESTATE] = NULL
+};
+
+/* Finished request, waiting for export. */
+struct trace_span
+{
+  struct trace_span *next;
+  struct trace_context ctx;
+  unsigned long long event[PHASE_MAX]; /* Unix times of events (ns), or 0 */
+  int status;                          /* Response status (0 if none) */
+  int error;                           /* Request failed */
+  char *attr[TRACE_ATTR_MAX];          /* String attributes, or NULL */
+  char buf[1];                         /* Storage for attributes */
+};
+
+/* Export queue. */
+static struct trace_span *queue_head, **queue_tail = &queue_head;
+static unsigned long queue_len;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+static int running;                    /* Exporter thread is running. */
+static int stopping;                   /* Exporter is requested to stop. */
+static pthread_t exporter_tid;
+
+static int export_fd = -1;             /* Export file or socket. */
+
+/* Statistics. */
+static unsigned long stat_sampled;     /* Sampled requests. */
+static unsigned long stat_dropped;     /* Spans dropped on queue overflow. */
+static unsigned long stat_exported;    /* Spans exported. */
+static unsigned long stat_failed;      /* Spans lost because of I/O errors. */
+
+static int
+hexval (int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+/*
+ * Decode N bytes from the lowercase hex string S into BUF.  Return 0
+ * on success, -1 if S is not a valid hex string.
+ */
+static int
+hex_decode (char const *s, unsigned char *buf, size_t n)
+{
+  while (n--)
+    {
+      int hi = hexval (s[0]), lo = hexval (s[1]);
+      if (hi < 0 || lo < 0)
+	return -1;
+      *buf++ = (hi << 4) | lo;
+      s += 2;
+    }
+  return 0;
+}
+
+static void
+hex_encode (unsigned char const *buf, size_t n, char *s)
+{
+  static char const xdig[] = "0123456789abcdef";
+
+  while (n--)
+    {
+      *s++ = xdig[*buf >> 4];
+      *s++ = xdig[*buf & 0xf];
+      buf++;
+    }
+  *s = 0;
+}
+
+static int
+id_is_zero (unsigned char const *id, size_t n)
+{
+  while (n--)
+    if (*id++)
+      return 0;
+  return 1;
+}
+
+/* Fill ID with N random bytes, avoiding the (invalid) all-zero value. */
+static void
+id_generate (unsigned char *id, size_t n)
+{
+  do
+    {
+      if (RAND_bytes (id, n) != 1)
+	{
+	  /* Should not happen: fall back to a weak source. */
+	  size_t i;
+	  for (i = 0; i < n; i++)
+	    id[i] = random ();
+	}
+    }
+  while (id_is_zero (id, n));
+}
+
+/*
+ * Parse the traceparent header value S into CTX.  Return 0 on success
+ * and -1 if the value is invalid.
+ *
+ *   traceparent = version "-" trace-id "-" parent-id "-" trace-flags
+ *
+ * Values of future versions can have more fields appended.
+ */
+static int
+traceparent_parse (char const *s, struct trace_context *ctx)
+{
+  size_t len = strlen (s);
+  unsigned char version, flags;
+
+  if (len < 55
+      || hex_decode (s, &version, 1) || version == 0xff || s[2] != '-'
+      || hex_decode (s + 3, ctx->trace_id, TRACE_ID_SIZE) || s[35] != '-'
+      || hex_decode (s + 36, ctx->parent_id, SPAN_ID_SIZE) || s[52] != '-'
+      || hex_decode (s + 53, &flags, 1)
+      || (len > 55 && (version == 0 || s[55] != '-'))
+      || id_is_zero (ctx->trace_id, TRACE_ID_SIZE)
+      || id_is_zero (ctx->parent_id, SPAN_ID_SIZE))
+    return -1;
+  ctx->sampled = flags & 1;
+  return 0;
+}
+
+/*
+ * Decide whether to sample a new trace with the given ID.  The last 7
+ * bytes of the ID are random, so that they are compared with the
+ * threshold corresponding to the sampling rate.
+ */
+static int
+trace_id_sampled (unsigned char const *id)
+{
+  unsigned long long r = 0;
+  int i;
+
+  if (trace_conf.sample_rate >= 100)
+    return 1;
+  for (i = TRACE_ID_SIZE - 7; i < TRACE_ID_SIZE; i++)
+    r = (r << 8) | id[i];
+  return r < ((1ULL << 56) / 100) * trace_conf.sample_rate;
+}
+
+/*
+ * Set up the trace context of the request PHTTP, whose headers have
+ * just been read.
+ */
+void
+trace_request_begin (POUND_HTTP *phttp)
+{
+  struct trace_context *ctx = &phttp->trace;
+  struct http_header *hdr;
+  char const *val;
+
+  memset (ctx, 0, sizeof (*ctx));
+  if (!trace_conf.enabled)
+    return;
+  if ((hdr = http_header_list_locate_name (&phttp->request.headers,
+					   "traceparent", 11)) != NULL
+      && (val = http_header_get_value (hdr)) != NULL
+      && traceparent_parse (val, ctx) == 0)
+    ctx->has_parent = 1;
+  else
+    {
+      memset (ctx, 0, sizeof (*ctx));
+      id_generate (ctx->trace_id, TRACE_ID_SIZE);
+      ctx->sampled = trace_id_sampled (ctx->trace_id);
+    }
+  id_generate (ctx->span_id, SPAN_ID_SIZE);
+}
+
+/*
+ * Start the client span of the request PHTTP, that is about to be
+ * sent to a backend, and pass its context in the traceparent header.
+ * Return 0 on success and -1 on error.
+ */
+int
+trace_inject (POUND_HTTP *phttp)
+{
+  struct trace_context *ctx = &phttp->trace;
+  char tid[2 * TRACE_ID_SIZE + 1], sid[2 * SPAN_ID_SIZE + 1];
+  struct stringbuf sb;
+  char *str;
+  int rc = 0;
+
+  if (!trace_conf.enabled)
+    return 0;
+  id_generate (ctx->client_id, SPAN_ID_SIZE);
+  ctx->has_client = 1;
+
+  hex_encode (ctx->trace_id, TRACE_ID_SIZE, tid);
+  hex_encode (ctx->client_id, SPAN_ID_SIZE, sid);
+  stringbuf_init_log (&sb);
+  stringbuf_printf (&sb, "traceparent: 00-%s-%s-%02x", tid, sid,
+		    ctx->sampled ? 1 : 0);
+  if ((str = stringbuf_finish (&sb)) == NULL
+      || http_header_list_append (&phttp->request.headers, str, H_REPLACE))
+    rc = -1;
+  stringbuf_free (&sb);
+  return rc;
+}
+
+/*
+ * Span records.
+ */
+
+static unsigned long long
+timespec_to_ns (struct timespec const *ts)
+{
+  return (unsigned long long) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/* Create the span record for the request PHTTP. */
+static struct trace_span *
+trace_span_new (POUND_HTTP *phttp, int ok)
+{
+  char const *val[TRACE_ATTR_MAX];
+  size_t size[TRACE_ATTR_MAX], total = 0;
+  char caddr[MAX_ADDR_BUFSIZE], baddr[MAX_ADDR_BUFSIZE];
+  struct http_header *hdr;
+  struct trace_span *span;
+  struct timespec rt, mt;
+  long long offset;
+  char *p;
+  int i;
+
+  memset (val, 0, sizeof (val));
+  val[TRACE_ATTR_METHOD] = method_name (phttp->request.method);
+  http_request_get_path (&phttp->request, &val[TRACE_ATTR_PATH]);
+  if ((hdr = http_header_list_locate_name (&phttp->request.headers,
+					   "host", 4)) != NULL)
+    val[TRACE_ATTR_HOST] = http_header_get_value (hdr);
+  val[TRACE_ATTR_CLIENT] = addr2str (caddr, sizeof (caddr),
+				     &phttp->from_host, 1);
+  val[TRACE_ATTR_LISTENER] = phttp->lstn->name;
+  if (phttp->svc)
+    val[TRACE_ATTR_SERVICE] = phttp->svc->name;
+  if (phttp->trace.has_client)
+    val[TRACE_ATTR_BACKEND] = str_be (baddr, sizeof (baddr), phttp->backend);
+  if ((hdr = http_header_list_locate_name (&phttp->request.headers,
+					   "tracestate", 10)) != NULL)
+    val[TRACE_ATTR_TRACESTATE] = http_header_get_value (hdr);
+
+  for (i = 0; i < TRACE_ATTR_MAX; i++)
+    {
+      size[i] = val[i] ? strlen (val[i]) + 1 : 0;
+      total += size[i];
+    }
+
+  if ((span = calloc (1, sizeof (*span) + total)) == NULL)
+    {
+      lognomem ();
+      return NULL;
+    }
+  span->ctx = phttp->trace;
+  span->status = phttp->response_code;
+  span->error = !ok || phttp->response_code >= 500;
+
+  p = span->buf;
+  for (i = 0; i < TRACE_ATTR_MAX; i++)
+    {
+      if (val[i])
+	{
+	  span->attr[i] = p;
+	  memcpy (p, val[i], size[i]);
+	  p += size[i];
+	}
+    }
+
+  /* Convert monotonic event times to Unix times. */
+  clock_gettime (CLOCK_REALTIME, &rt);
+  clock_gettime (CLOCK_MONOTONIC, &mt);
+  offset = timespec_to_ns (&rt) - timespec_to_ns (&mt);
+  for (i = 0; i < PHASE_MAX; i++)
+    if (phase_is_set (phttp, i))
+      span->event[i] = timespec_to_ns (&phttp->phase[i]) + offset;
+
+  return span;
+}
+
+/*
+ * Finish tracing the request PHTTP.  OK is 0 if no response was sent.
+ * If the request is sampled, queue its spans for export.  Subsequent
+ * calls for the same request are no-op.
+ */
+void
+trace_request_end (POUND_HTTP *phttp, int ok)
+{
+  struct trace_span *span;
+
+  if (!trace_conf.enabled || !phttp->trace.sampled)
+    return;
+  __atomic_fetch_add (&stat_sampled, 1, __ATOMIC_RELAXED);
+  span = trace_span_new (phttp, ok);
+  phttp->trace.sampled = 0;
+  if (span == NULL)
+    return;
+
+  pthread_mutex_lock (&queue_mutex);
+  if (!running || queue_len >= trace_conf.queue_size)
+    {
+      stat_dropped++;
+      free (span);
+    }
+  else
+    {
+      *queue_tail = span;
+      queue_tail = &span->next;
+      queue_len++;
+      pthread_cond_signal (&queue_cond);
+    }
+  pthread_mutex_unlock (&queue_mutex);
+}
+
+/*
+ * OTLP/JSON formatting.
+ */
+
+/* Return ID of size N as a JSON string. */
+static struct json_value *
+json_new_id (unsigned char const *id, size_t n)
+{
+  char buf[2 * TRACE_ID_SIZE + 1];
+
+  hex_encode (id, n, buf);
+  return json_new_string (buf);
+}
+
+/* Return a 64-bit integer N as a JSON string, as required by OTLP. */
+static struct json_value *
+json_new_int64 (unsigned long long n)
+{
+  char buf[80];
+
+  snprintf (buf, sizeof (buf), "%llu", n);
+  return json_new_string (buf);
+}
+
+/* Append the attribute KEY with the value VAL to the array ATTRS. */
+static int
+otlp_attr_add (struct json_value *attrs, char const *key,
+	       char const *type, struct json_value *val)
+{
+  struct json_value *attr, *anyval;
+
+  if ((anyval = json_new_object ()) == NULL)
+    {
+      json_value_free (val);
+      return -1;
+    }
+  if (json_object_set (anyval, type, val))
+    {
+      json_value_free (val);
+      json_value_free (anyval);
+      return -1;
+    }
+  if ((attr = json_new_object ()) == NULL
+      || json_object_set (attr, "key", json_new_string (key))
+      || json_object_set (attr, "value", anyval))
+    {
+      json_value_free (anyval);
+      json_value_free (attr);
+      return -1;
+    }
+  if (json_array_append (attrs, attr))
+    {
+      json_value_free (attr);
+      return -1;
+    }
+  return 0;
+}
+
+static int
+otlp_attr_string (struct json_value *attrs, char const *key, char const *str)
+{
+  if (!str)
+    return 0;
+  return otlp_attr_add (attrs, key, "stringValue", json_new_string (str));
+}
+
+static int
+otlp_attr_int (struct json_value *attrs, char const *key, long n)
+{
+  return otlp_attr_add (attrs, key, "intValue", json_new_int64 (n));
+}
+
+/* Return the array of span events for the record SPAN. */
+static struct json_value *
+otlp_events (struct trace_span const *span)
+{
+  struct json_value *arr, *ev;
+  int i;
+
+  if ((arr = json_new_array ()) == NULL)
+    return NULL;
+  for (i = 0; i < PHASE_MAX; i++)
+    {
+      if (span->event[i] == 0)
+	continue;
+      if ((ev = json_new_object ()) == NULL
+	  || json_object_set (ev, "name",
+			      json_new_string (trace_event_name[i]))
+	  || json_object_set (ev, "timeUnixNano",
+			      json_new_int64 (span->event[i]))
+	  || json_array_append (arr, ev))
+	{
+	  json_value_free (ev);
+	  json_value_free (arr);
+	  return NULL;
+	}
+    }
+  return arr;
+}
+
+/*
+ * Create the span object of the given KIND for the record SPAN.  ID and
+ * PARENT_ID (if not NULL) are the span ID and parent span ID.  The span
+ * lasts from the event START to the end of the request.
+ */
+static struct json_value *
+otlp_span (struct trace_span const *span, int kind, unsigned char const *id,
+	   unsigned char const *parent_id, int start)
+{
+  struct json_value *obj, *attrs;
+  int i;
+
+  if ((attrs = json_new_array ()) == NULL)
+    return NULL;
+  if (otlp_attr_string (attrs, trace_attr_key[TRACE_ATTR_METHOD],
+			span->attr[TRACE_ATTR_METHOD]))
+    goto err;
+  if (kind == SPAN_KIND_SERVER)
+    {
+      for (i = TRACE_ATTR_PATH; i <= TRACE_ATTR_SERVICE; i++)
+	if (otlp_attr_string (attrs, trace_attr_key[i], span->attr[i]))
+	  goto err;
+    }
+  else if (otlp_attr_string (attrs, trace_attr_key[TRACE_ATTR_BACKEND],
+			     span->attr[TRACE_ATTR_BACKEND]))
+    goto err;
+  if (span->status && otlp_attr_int (attrs, "http.response.status_code",
+				     span->status))
+    goto err;
+
+  if ((obj = json_new_object ()) == NULL)
+    goto err;
+  if (json_object_set (obj, "traceId",
+		       json_new_id (span->ctx.trace_id, TRACE_ID_SIZE))
+      || json_object_set (obj, "spanId", json_new_id (id, SPAN_ID_SIZE))
+      || (parent_id
+	  && json_object_set (obj, "parentSpanId",
+			      json_new_id (parent_id, SPAN_ID_SIZE)))
+      || (span->attr[TRACE_ATTR_TRACESTATE]
+	  && json_object_set (obj, "traceState",
+			      json_new_string (span->attr[TRACE_ATTR_TRACESTATE])))
+      || json_object_set (obj, "name",
+			  json_new_string (span->attr[TRACE_ATTR_METHOD]))
+      || json_object_set (obj, "kind", json_new_integer (kind))
+      || json_object_set (obj, "startTimeUnixNano",
+			  json_new_int64 (span->event[start]))
+      || json_object_set (obj, "endTimeUnixNano",
+			  json_new_int64 (span->event[PHASE_LAST_BYTE]))
+      || json_object_set (obj, "attributes", attrs))
+    {
+      json_value_free (obj);
+      goto err;
+    }
+  attrs = NULL;
+  if (kind == SPAN_KIND_SERVER
+      && json_object_set (obj, "events", otlp_events (span)))
+    {
+      json_value_free (obj);
+      return NULL;
+    }
+  if (span->error)
+    {
+      struct json_value *status = json_new_object ();
+      if (!status
+	  || json_object_set (status, "code",
+			      json_new_integer (STATUS_CODE_ERROR))
+	  || json_object_set (obj, "status", status))
+	{
+	  json_value_free (status);
+	  json_value_free (obj);
+	  return NULL;
+	}
+    }
+  return obj;
+
+ err:
+  json_value_free (attrs);
+  return NULL;
+}
+
+/* Return the spans of the record SPAN as a JSON array. */
+static struct json_value *
+otlp_spans (struct trace_span const *span)
+{
+  struct json_value *arr, *obj;
+  int start;
+
+  if ((arr = json_new_array ()) == NULL)
+    return NULL;
+
+  /* Server span starts when the request arrived. */
+  if (span->event[PHASE_ACCEPT])
+    start = PHASE_ACCEPT;
+  else
+    start = PHASE_DEQUEUE;
+  obj = otlp_span (span, SPAN_KIND_SERVER, span->ctx.span_id,
+		   span->ctx.has_parent ? span->ctx.parent_id : NULL, start);
+  if (!obj || json_array_append (arr, obj))
+    goto err;
+
+  /* Client span starts when the request is routed to the backend. */
+  if (span->ctx.has_client)
+    {
+      obj = otlp_span (span, SPAN_KIND_CLIENT, span->ctx.client_id,
+		       span->ctx.span_id, PHASE_SERVICE);
+      if (!obj || json_array_append (arr, obj))
+	goto err;
+    }
+  return arr;
+
+ err:
+  json_value_free (obj);
+  json_value_free (arr);
+  return NULL;
+}
+
+/*
+ * Build the ExportTraceServiceRequest object for the record SPAN:
+ *
+ *  { "resourceSpans": [ { "resource": { "attributes": [ ... ] },
+ *                         "scopeSpans": [ { "scope": { ... },
+ *                                           "spans": [ ... ] } ] } ] }
+ */
+static struct json_value *
+otlp_request (struct trace_span const *span)
+{
+  struct json_value *req = NULL, *rs = NULL, *res = NULL, *attrs = NULL,
+    *ss = NULL, *scope = NULL, *arr;
+
+  if ((attrs = json_new_array ()) == NULL
+      || otlp_attr_string (attrs, "service.name", trace_conf.service_name)
+      || (res = json_new_object ()) == NULL
+      || json_object_set (res, "attributes", attrs))
+    goto err;
+  attrs = NULL;
+
+  if ((scope = json_new_object ()) == NULL
+      || json_object_set (scope, "name", json_new_string (PACKAGE_NAME))
+      || json_object_set (scope, "version", json_new_string (PACKAGE_VERSION))
+      || (ss = json_new_object ()) == NULL
+      || json_object_set (ss, "scope", scope))
+    goto err;
+  scope = NULL;
+  if (json_object_set (ss, "spans", otlp_spans (span)))
+    goto err;
+
+  if ((rs = json_new_object ()) == NULL
+      || json_object_set (rs, "resource", res))
+    goto err;
+  res = NULL;
+  if ((arr = json_new_array ()) == NULL)
+    goto err;
+  if (json_array_append (arr, ss))
+    {
+      json_value_free (arr);
+      goto err;
+    }
+  ss = NULL;
+  if (json_object_set (rs, "scopeSpans", arr))
+    goto err;
+
+  if ((req = json_new_object ()) == NULL
+      || (arr = json_new_array ()) == NULL)
+    goto err;
+  if (json_array_append (arr, rs))
+    {
+      json_value_free (arr);
+      goto err;
+    }
+  rs = NULL;
+  if (json_object_set (req, "resourceSpans", arr))
+    goto err;
+  return req;
+
+ err:
+  json_value_free (req);
+  json_value_free (rs);
+  json_value_free (res);
+  json_value_free (attrs);
+  json_value_free (ss);
+  json_value_free (scope);
+  return NULL;
+}
+
+static void
+write_string (void *data, char const *str, size_t len)
+{
+  struct stringbuf *sb = data;
+  stringbuf_add (sb, str, len);
+}
+
+/*
+ * Format the record SPAN as a line of OTLP/JSON and add it to SB.
+ * Return 0 on success, -1 on error.
+ */
+static int
+trace_span_format (struct trace_span const *span, struct stringbuf *sb)
+{
+  struct json_format format = {
+    .indent = 0,
+    .precision = 0,
+    .write = write_string,
+    .data = sb
+  };
+  struct json_value *req;
+  int rc;
+
+  if ((req = otlp_request (span)) == NULL)
+    return -1;
+  rc = json_value_format (req, &format, 0);
+  json_value_free (req);
+  if (rc == 0)
+    rc = stringbuf_add_char (sb, '\n');
+  return rc;
+}
+
+/*
+ * Exporter thread.
+ */
+
+/* Write LEN bytes from BUF to the export file. */
+static int
+export_write (char const *buf, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t n = write (export_fd, buf, len);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      buf += n;
+      len -= n;
+    }
+  return 0;
+}
+
+/*
+ * Export the list of records LIST and free it.  Records are written to
+ * the file in a single batch, or sent to the socket one per datagram.
+ */
+static void
+trace_export (struct trace_span *list)
+{
+  struct stringbuf sb;
+  struct trace_span *span;
+  unsigned long count = 0, failed = 0;
+
+  stringbuf_init_log (&sb);
+  while ((span = list) != NULL)
+    {
+      size_t mark = stringbuf_len (&sb);
+
+      list = span->next;
+      if (trace_span_format (span, &sb))
+	{
+	  stringbuf_truncate (&sb, mark);
+	  failed++;
+	}
+      else if (trace_conf.file)
+	count++;
+      else
+	{
+	  if (send (export_fd, stringbuf_value (&sb), stringbuf_len (&sb) - 1,
+		    MSG_DONTWAIT) < 0)
+	    failed++;
+	  else
+	    count++;
+	  stringbuf_reset (&sb);
+	}
+      free (span);
+    }
+  if (trace_conf.file && count > 0)
+    {
+      if (export_write (stringbuf_value (&sb), stringbuf_len (&sb)))
+	{
+	  logmsg (LOG_ERR, "error writing spans to %s: %s",
+		  trace_conf.file, strerror (errno));
+	  failed += count;
+	  count = 0;
+	}
+    }
+  stringbuf_free (&sb);
+  __atomic_fetch_add (&stat_exported, count, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&stat_failed, failed, __ATOMIC_RELAXED);
+}
+
+static void *
+thr_trace_exporter (void *arg)
+{
+  for (;;)
+    {
+      struct trace_span *list;
+
+      pthread_mutex_lock (&queue_mutex);
+      while (queue_head == NULL && !stopping)
+	pthread_cond_wait (&queue_cond, &queue_mutex);
+      list = queue_head;
+      queue_head = NULL;
+      queue_tail = &queue_head;
+      queue_len = 0;
+      pthread_mutex_unlock (&queue_mutex);
+
+      if (list)
+	trace_export (list);
+      else
+	break;
+    }
+  return NULL;
+}
+
+/* Open the export file or socket.  Return the descriptor, or -1. */
+static int
+export_open (void)
+{
+  int fd, family;
+
+  if (trace_conf.file)
+    return open (trace_conf.file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+
+  switch (trace_conf.addr.ai_family)
+    {
+    case AF_UNIX:
+      family = PF_UNIX;
+      break;
+
+    case AF_INET6:
+      family = PF_INET6;
+      break;
+
+    default:
+      family = PF_INET;
+    }
+  if ((fd = socket (family, SOCK_DGRAM, 0)) == -1)
+    return -1;
+  if (connect (fd, trace_conf.addr.ai_addr, trace_conf.addr.ai_addrlen))
+    {
+      int ec = errno;
+      close (fd);
+      errno = ec;
+      return -1;
+    }
+  return fd;
+}
+
+/*
+ * Open the export file or socket.  This is done before dropping
+ * privileges and changing root.
+ */
+void
+trace_export_open (void)
+{
+  if (!trace_conf.enabled)
+    return;
+  if ((export_fd = export_open ()) == -1)
+    {
+      if (trace_conf.file)
+	abend ("can't open trace export file %s: %s", trace_conf.file,
+	       strerror (errno));
+      else
+	abend ("can't open trace export socket: %s", strerror (errno));
+    }
+}
+
+/*
+ * Reopen the export file (e.g. after it has been rotated).  The new file
+ * replaces the old one atomically, so that no spans are lost.
+ */
+void
+trace_export_reopen (void)
+{
+  int fd;
+
+  if (!trace_conf.enabled || !trace_conf.file)
+    return;
+  if ((fd = export_open ()) == -1)
+    {
+      logmsg (LOG_ERR, "can't reopen %s: %s", trace_conf.file,
+	      strerror (errno));
+      return;
+    }
+  if (dup2 (fd, export_fd) == -1)
+    logmsg (LOG_ERR, "can't reopen %s: %s", trace_conf.file,
+	    strerror (errno));
+  close (fd);
+}
+
+/* Start the exporter thread, if tracing is enabled. */
+void
+trace_start (void)
+{
+  int rc;
+
+  if (!trace_conf.enabled)
+    return;
+  if ((rc = pthread_create (&exporter_tid, NULL, thr_trace_exporter,
+			    NULL)) != 0)
+    abend ("can't create trace exporter thread: %s", strerror (rc));
+  pthread_mutex_lock (&queue_mutex);
+  running = 1;
+  pthread_mutex_unlock (&queue_mutex);
+}
+
+/* Export all pending spans and stop the exporter thread. */
+void
+trace_stop (void)
+{
+  pthread_mutex_lock (&queue_mutex);
+  if (!running)
+    {
+      pthread_mutex_unlock (&queue_mutex);
+      return;
+    }
+  running = 0;
+  stopping = 1;
+  pthread_cond_signal (&queue_cond);
+  pthread_mutex_unlock (&queue_mutex);
+  pthread_join (exporter_tid, NULL);
+}
+
+struct json_value *
+trace_serialize (void)
+{
+  struct json_value *obj;
+  unsigned long queued, dropped;
+  int err = 0;
+
+  pthread_mutex_lock (&queue_mutex);
+  queued = queue_len;
+  dropped = stat_dropped;
+  pthread_mutex_unlock (&queue_mutex);
+
+  obj = json_new_object ();
+  if (obj)
+    {
+      err = json_object_set (obj, "sample_rate",
+			     json_new_integer (trace_conf.sample_rate))
+	|| json_object_set (obj, "sampled",
+			    json_new_number (__atomic_load_n (&stat_sampled,
+							      __ATOMIC_RELAXED)))
+	|| json_object_set (obj, "queued", json_new_number (queued))
+	|| json_object_set (obj, "exported",
+			    json_new_number (__atomic_load_n (&stat_exported,
+							      __ATOMIC_RELAXED)))
+	|| json_object_set (obj, "dropped", json_new_number (dropped))
+	|| json_object_set (obj, "failed",
+			    json_new_number (__atomic_load_n (&stat_failed,
+							      __ATOMIC_RELAXED)));
+    }
+  if (err)
+    {
+      json_value_free (obj);
+      obj = NULL;
+    }
+  return obj;
+}
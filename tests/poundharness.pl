@@ -746,7 +746,7 @@ sub parse_runcom {
     my $collect;
 
     $self->{RUNCOM} = {
-	command => $command,
+	command => $self->expandvars($command),
 	BEG => $self->{line}
     };
     while (<$fh>) {
@@ -1636,7 +1636,8 @@ exit code, standard output and error streams.  It is inlcuded mainly for
 testing the B<poundctl> command.
 
 The stanza begins with the keyword B<run> followed by the command
-and its argument.  It can be followed by one or more of expect statements:
+and its argument.  Variables (see above) are expanded in the command
+line.  It can be followed by one or more of expect statements:
 
 =over 4
 
@@ -0,0 +1,234 @@
+/* This file is part of pound testsuite.
+ * Copyright (C) 2024 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Micro-benchmark of regular expression backends.
+ *
+ * Usage: rebench [-n COUNT]
+ *
+ * Matches a set of patterns typical for pound configurations against
+ * sample subjects, COUNT times each, and reports the average time per
+ * match for each backend:
+ *
+ *   posix       - the libc regex functions;
+ *   pcre2posix  - PCRE2 used the way the pcre2posix wrapper does: no JIT,
+ *                 match data allocated on each call;
+ *   pcre2       - native PCRE2, as used by pound: JIT-compiled patterns,
+ *                 match data allocated once.
+ *
+ * This program is not built by default.  Use "make rebench" to build it.
+ */
+#include "config.h"
+/* Make sure the libc functions are used, see am/pcreposix.m4. */
+#undef regcomp
+#undef regexec
+#undef regerror
+#undef regfree
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <regex.h>
+#if HAVE_LIBPCRE2
+# define PCRE2_CODE_UNIT_WIDTH 8
+# include <pcre2.h>
+#endif
+
+static struct pattern
+{
+  char const *expr;
+  int icase;
+} patterns[] = {
+  { "^([a-z0-9!#$%&'*+.^_`|~-]+):[ \t]*(.*)[ \t]*$", 1 },
+  { "(http|https)://([^/]+)(.*)", 1 },
+  { "^/static/.*", 0 },
+  { "\\.(jpg|png|gif|css|js)$", 1 },
+  { "^Host:[[:space:]]*www\\.example\\.org$", 1 },
+  { "^/api/v[0-9]+/users/([0-9]+)$", 0 },
+  { NULL }
+};
+
+static char const *subjects[] = {
+  "Host: www.example.org",
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101",
+  "https://www.example.org/some/long/path/to/a/resource?with=query",
+  "/static/css/site.css",
+  "/api/v2/users/12345",
+  "/index.html",
+  NULL
+};
+
+#define MAX_MATCH 10
+
+struct backend
+{
+  char const *name;
+  void *(*compile) (struct pattern const *);
+  int (*match) (void *, char const *);
+};
+
+static void *
+posix_compile (struct pattern const *pat)
+{
+  regex_t *re = malloc (sizeof (*re));
+  if (regcomp (re, pat->expr, REG_EXTENDED | (pat->icase ? REG_ICASE : 0)))
+    {
+      fprintf (stderr, "posix: can't compile %s\n", pat->expr);
+      exit (1);
+    }
+  return re;
+}
+
+static int
+posix_match (void *data, char const *subj)
+{
+  regmatch_t mv[MAX_MATCH];
+  return regexec (data, subj, MAX_MATCH, mv, 0) == 0;
+}
+
+#if HAVE_LIBPCRE2
+static pcre2_match_data *match_data;
+
+static pcre2_code *
+pcre2_compile_pattern (struct pattern const *pat)
+{
+  int errcode;
+  PCRE2_SIZE erroffset;
+  pcre2_code *code;
+
+  code = pcre2_compile ((PCRE2_SPTR) pat->expr, PCRE2_ZERO_TERMINATED,
+			pat->icase ? PCRE2_CASELESS : 0,
+			&errcode, &erroffset, NULL);
+  if (code == NULL)
+    {
+      fprintf (stderr, "pcre2: can't compile %s\n", pat->expr);
+      exit (1);
+    }
+  return code;
+}
+
+static void *
+pcre2posix_compile (struct pattern const *pat)
+{
+  return pcre2_compile_pattern (pat);
+}
+
+static int
+pcre2posix_match (void *data, char const *subj)
+{
+  pcre2_match_data *md = pcre2_match_data_create (MAX_MATCH, NULL);
+  int rc = pcre2_match (data, (PCRE2_SPTR) subj, PCRE2_ZERO_TERMINATED,
+			0, 0, md, NULL);
+  pcre2_match_data_free (md);
+  return rc >= 0;
+}
+
+static void *
+pcre2_native_compile (struct pattern const *pat)
+{
+  pcre2_code *code = pcre2_compile_pattern (pat);
+  pcre2_jit_compile (code, PCRE2_JIT_COMPLETE);
+  return code;
+}
+
+static int
+pcre2_native_match (void *data, char const *subj)
+{
+  if (match_data == NULL)
+    match_data = pcre2_match_data_create (MAX_MATCH, NULL);
+  return pcre2_match (data, (PCRE2_SPTR) subj, PCRE2_ZERO_TERMINATED,
+		      0, 0, match_data, NULL) >= 0;
+}
+#endif
+
+static struct backend backends[] = {
+  { "posix", posix_compile, posix_match },
+#if HAVE_LIBPCRE2
+  { "pcre2posix", pcre2posix_compile, pcre2posix_match },
+  { "pcre2", pcre2_native_compile, pcre2_native_match },
+#endif
+  { NULL }
+};
+
+static double
+elapsed (struct timespec const *start)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
+
+int
+main (int argc, char **argv)
+{
+  long count = 100000;
+  int c;
+  struct backend *be;
+  size_t npat = sizeof (patterns) / sizeof (patterns[0]) - 1;
+  size_t nsubj = sizeof (subjects) / sizeof (subjects[0]) - 1;
+  void **compiled;
+
+  while ((c = getopt (argc, argv, "n:")) != EOF)
+    {
+      switch (c)
+	{
+	case 'n':
+	  count = strtol (optarg, NULL, 10);
+	  if (count <= 0)
+	    {
+	      fprintf (stderr, "bad count\n");
+	      return 1;
+	    }
+	  break;
+
+	default:
+	  fprintf (stderr, "usage: %s [-n COUNT]\n", argv[0]);
+	  return 1;
+	}
+    }
+
+#if HAVE_LIBPCRE2
+  {
+    uint32_t jit = 0;
+    pcre2_config (PCRE2_CONFIG_JIT, &jit);
+    printf ("PCRE2 JIT support: %s\n", jit ? "yes" : "no");
+  }
+#endif
+  compiled = calloc (npat, sizeof (compiled[0]));
+  printf ("%-12s %10s %10s\n", "backend", "ns/match", "matches");
+  for (be = backends; be->name; be++)
+    {
+      struct timespec start;
+      size_t i, j;
+      long n, matches = 0;
+
+      for (i = 0; i < npat; i++)
+	compiled[i] = be->compile (&patterns[i]);
+
+      clock_gettime (CLOCK_MONOTONIC, &start);
+      for (n = 0; n < count; n++)
+	for (i = 0; i < npat; i++)
+	  for (j = 0; j < nsubj; j++)
+	    matches += be->match (compiled[i], subjects[j]);
+
+      printf ("%-12s %10.1f %10ld\n", be->name,
+	      elapsed (&start) / ((double) count * npat * nsubj),
+	      matches / count);
+    }
+  return 0;
+}